@@ -103,55 +103,92 @@
                     Fixed postfix increment operator
     Version 0.32 :  Fixed Math.randInt on 32 bit PCs, where it was broken
     Version 0.33 :  Fixed Memory leak + brokenness on === comparison
+    Version 0.34 :  Added TINYJS_EXECUTE_SYNTAX_TREE mode, which parses function bodies once
+                      and walks the CScriptSyntaxTree rather than re-lexing on every call
+                    Moved shift operators into mathsOp
+    Version 0.35 :  Added TINYJS_EXECUTE_BYTECODE mode, which compiles syntax trees to
+                      CScriptBytecode for a register-based VM
+    Version 0.36 :  Objects with few properties keep them in the order of a shared CScriptShape,
+                      and every '.name' has a CScriptPropertyCache of where to find it
+    Version 0.37 :  Arrays keep their elements in a vector and track their length,
+                      and 'new Array(5)' makes an array of that length
+    Version 0.38 :  Bytecode registers hold numbers, undefined and null as CScriptValues
+                      rather than allocating a CScriptVar and link for each result
+    Version 0.39 :  undefined, null, small ints and one character strings are shared
+                      CScriptConstants, copied before anything changes them in place
+    Version 0.40 :  CScriptVar and CScriptVarLink are allocated from CScriptPool free lists
+    Version 0.41 :  Added CScriptCycleCollector, which frees loops of variables between calls to execute()
+    Version 0.42 :  Added TINYJS_TRACING_GC, to build with a tracing collector (CScriptTracingCollector)
+                      instead of reference counting
+    Version 0.43 :  Strings made by '+' go into a CScriptStringBuffer that later '+'s append to,
+                      so building a string up in a loop isn't quadratic
+    Version 0.44 :  Numbers are written by TinyJS_NumberFormat (doubles as the shortest string that
+                      reads back the same, as JavaScript does), and keep their string until they change
+    Version 0.45 :  Maths on numbers and comparisons of strings are done by CScriptMaths's kernels without
+                      allocating, and +=, ++ and -- change an unshared number in place
+    Version 0.46 :  Added CScriptSyntaxTree::optimize, which folds constants, drops int identities, prunes
+                      branches on literals and code after a return (see CTinyJS::setOptimizations)
+    Version 0.47 :  Tokens know their matching bracket, so code that isn't executed is jumped over rather
+                      than parsed, and function bodies are only scanned into tokens on their first call
+    Version 0.48 :  The call stack (TINYJS_CALL_STACK) keeps CScriptCallFrames, whose line and column are
+                      only worked out (from the token list's line starts) when an error is reported
+    Version 0.49 :  Calls reuse the scopes and frames of calls that have returned, keep their return value
+                      and 'this' in the first slots, and don't copy arguments that nothing else can see
+    Version 0.50 :  Added CScriptMachineCode, which compiles hot functions' bytecode straight into x86-64
+                      machine code in memory, with gcc as a later tier (see CTinyJS::setCompilers)
+    Version 0.51 :  gcc runs on background threads (CScriptCompiler), hottest function first, while
+                      the script carries on; what it builds is installed at the start of a call
+    Version 0.52 :  gcc's libraries can be kept in a cache directory, named by a hash of what went into
+                      them, so later runs load them rather than build them again (see CTinyJS::setCompileCache)
+    Version 0.53 :  gcc builds in a private temporary directory, and functions that get hot together can
+                      be built into one library with a single run of gcc (see CTinyJS::setCompileBatching)
+    Version 0.54 :  Functions that fail to compile are only tried again after backing off, and are blacklisted
+                      after TINYJS_COMPILE_ATTEMPTS; see CTinyJS::getCompileState and getCompileFailures
+    Version 0.55 :  gcc writes numeric functions out on plain ints and doubles, specialized to the types the
+                      interpreter saw while they warmed up (CScriptTypeFeedback), with guards that hand the
+                      call back to the interpreter if they fail (see CTinyJS::deoptimize)
 
      NOTE:
-           Constructing an array with an initial length 'Array(5)' doesn't work
-           Recursive loops of data such as a.foo = a; fail to be garbage collected
+           Array can't be called as a function, so 'Array(5)' must be written 'new Array(5)'
+           Recursive loops of data such as a.foo = a; are only freed by the CScriptCycleCollector,
+             which runs between calls to execute() (or by the CScriptTracingCollector, if it's used)
            length variable cannot be set
            The postfix increment operator returns the current value, not the previous as it should.
            There is no prefix increment operator
      TODO:
            Utility va-args style function in TinyJS for executing a function directly
            Merge the parsing of expressions/statements so eval("statement") works like we'd expect.
-           Move 'shift' implementation into mathsOp
 
   */
 
 #include "TinyJS.h"
 #include "TinyJS_SyntaxTree.h"
+#include "TinyJS_Bytecode.h"
+#include "TinyJS_MachineCode.h"
+#include "TinyJS_Compiler.h"
+#include "TinyJS_NumberFormat.h"
 #include <assert.h>
 
 #define ASSERT(X) assert(X)
-  /* Frees the given link IF it isn't owned by anything else */
-#define CLEAN(x) { CScriptVarLink *__v = x; if (__v && !__v->owned) { delete __v; } }
-/* Create a LINK to point to VAR and free the old link.
- * BUT this is more clever - it tries to keep the old link if it's not owned to save allocations */
-#define CREATE_LINK(LINK, VAR) { if (!LINK || LINK->owned) LINK = new CScriptVarLink(VAR); else LINK->replaceWith(VAR); }
 
 #include <string>
 #include <string.h>
 #include <sstream>
+#include <algorithm>
 #include <cstdlib>
 #include <stdio.h>
 #include <fstream>
+#include <ctime>
+#include <chrono>
 
-// support both windows and linux
+// support both windows and linux (building libraries is in CScriptCompiler)
 #ifdef _MSC_VER
 #include <windows.h>
 
-#define GETLIB(a,b) LoadLibrary(a)
-#define GETSYMBOL(a,b) GetProcAddress(a, b)
-#define LIBNAME ".\\jit.dll"
-#define GETBUILDERROR "Load failed with 0x%x\n", GetLastError() 
 #define FREELIB(a) FreeLibrary(a)
-#define RTLD_NOW 0
 #else
 #include <dlfcn.h>   
 
-#define GETLIB(a,b) dlopen(a, b)
-#define GETSYMBOL(a,b) dlsym(a, b)
-#define LIBNAME "./jit.so"
-#define GETBUILDERROR "%s\n", dlerror()
 #define FREELIB(a) dlclose(a)
 #endif
 
@@ -224,7 +261,7 @@ void show_allocated()
     }
     for(size_t i = 0; i < allocatedLinks.size(); i++)
     {
-        printf("ALLOCATED LINK %s, allocated[%d] to \n", allocatedLinks[i]->name.c_str(), allocatedLinks[i]->var->getRefs());
+        printf("ALLOCATED LINK %s, allocated[%d] to \n", allocatedLinks[i]->getName().c_str(), allocatedLinks[i]->var->getRefs());
         allocatedLinks[i]->var->trace("  ");
     }
     allocatedVars.clear();
@@ -337,6 +374,356 @@ bool isAlphaNum(const std::string &str)
 CScriptException::CScriptException(const string &exceptionText)
 {
     text = exceptionText;
+    source = 0;
+    position = 0;
+}
+
+// ----------------------------------------------------------------------------------- CSCRIPTATOMS
+
+mutex CScriptAtoms::lock;
+unordered_map<string, int> CScriptAtoms::atoms;
+atomic<CScriptAtoms::Entry*> CScriptAtoms::chunks[MAX_CHUNKS];
+atomic<atomic<int>*> CScriptAtoms::indexChunks[INDEX_CACHE_SIZE >> CHUNK_BITS];
+bool CScriptAtoms::fixedAtoms = CScriptAtoms::addFixedAtoms();
+
+// The array index that a name refers to, if it's written the way an index is turned into a string
+static int arrayIndexOf(const string &str)
+{
+    if(str.empty() || str.size() > 9 || (str[0] == '0' && str.size() > 1))
+        return -1; // 9 digits always fits in an int
+    int index = 0;
+    for(char ch : str)
+    {
+        if(!isNumeric(ch))
+            return -1;
+        index = index*10 + (ch - '0');
+    }
+    return index;
+}
+
+bool CScriptAtoms::addFixedAtoms()
+{
+    // in the order of TINYJS_ATOMS
+    const char *fixed[] = { TINYJS_TEMP_NAME, TINYJS_RETURN_VAR, TINYJS_PROTOTYPE_CLASS, "length", "this" };
+    for(const char *str : fixed)
+        add(str);
+    return true;
+}
+
+int CScriptAtoms::add(const string &str)
+{
+    const int mask = (1 << CHUNK_BITS) - 1;
+    int atom = (int)atoms.size();
+    if(atom >= (MAX_CHUNKS << CHUNK_BITS))
+        throw new CScriptException("Too many different names");
+    Entry *chunk = chunks[atom >> CHUNK_BITS].load(memory_order_relaxed);
+    if(!chunk)
+    {
+        chunk = new Entry[1 << CHUNK_BITS];
+        chunks[atom >> CHUNK_BITS].store(chunk, memory_order_release);
+    }
+    Entry &entry = chunk[atom & mask];
+    entry.str = str;
+    entry.index = arrayIndexOf(str);
+    atoms.insert(make_pair(str, atom));
+    // the cache has every index atom below INDEX_CACHE_SIZE, however it was added
+    if(entry.index >= 0 && entry.index < INDEX_CACHE_SIZE)
+    {
+        atomic<int> *indexChunk = indexChunks[entry.index >> CHUNK_BITS].load(memory_order_relaxed);
+        if(!indexChunk)
+        {
+            indexChunk = new atomic<int>[1 << CHUNK_BITS];
+            for(int i = 0; i <= mask; i++)
+                indexChunk[i].store(-1, memory_order_relaxed);
+            indexChunks[entry.index >> CHUNK_BITS].store(indexChunk, memory_order_release);
+        }
+        indexChunk[entry.index & mask].store(atom, memory_order_release);
+    }
+    return atom;
+}
+
+int CScriptAtoms::get(const string &str)
+{
+    lock_guard<mutex> guard(lock);
+    auto atom = atoms.find(str);
+    if(atom != atoms.end())
+        return atom->second;
+    return add(str);
+}
+
+int CScriptAtoms::find(const string &str)
+{
+    lock_guard<mutex> guard(lock);
+    auto atom = atoms.find(str);
+    return atom != atoms.end() ? atom->second : -1;
+}
+
+int CScriptAtoms::findIndexAtom(int index)
+{
+    if(index >= 0 && index < INDEX_CACHE_SIZE)
+    {
+        atomic<int> *indexChunk = indexChunks[index >> CHUNK_BITS].load(memory_order_acquire);
+        return indexChunk ? indexChunk[index & ((1 << CHUNK_BITS) - 1)].load(memory_order_acquire) : -1;
+    }
+    char sIdx[TINYJS_NUMBER_BUFFER_SIZE];
+    formatInt(index, sIdx);
+    return find(sIdx);
+}
+
+int CScriptAtoms::getIndexAtom(int index)
+{
+    int atom = findIndexAtom(index);
+    if(atom >= 0)
+        return atom;
+    char sIdx[TINYJS_NUMBER_BUFFER_SIZE];
+    formatInt(index, sIdx);
+    return get(sIdx);
+}
+
+// ----------------------------------------------------------------------------------- CSCRIPTSHAPE
+
+CScriptShape CScriptShape::emptyShape;
+mutex CScriptShape::lock;
+int CScriptShape::shapes = 1;
+
+CScriptShape::~CScriptShape()
+{
+    for(auto& transition : transitions)
+        delete transition.second;
+}
+
+CScriptShape *CScriptShape::withProperty(int atom)
+{
+    lock_guard<mutex> guard(lock);
+    auto transition = transitions.find(atom);
+    if(transition != transitions.end())
+        return transition->second;
+    if((int)transitions.size() >= MAX_TRANSITIONS || shapes >= MAX_SHAPES)
+        return 0; // objects are being used as dictionaries, so they're better off as one
+    shapes++;
+    CScriptShape *shape = new CScriptShape();
+    shape->names = names;
+    shape->names.push_back(atom);
+    transitions[atom] = shape;
+    return shape;
+}
+
+CScriptShape *CScriptShape::withoutProperty(int atom)
+{
+    // go back to the empty shape and add the other properties again, so that objects
+    // which end up with the same properties still end up with the same shape
+    CScriptShape *shape = empty();
+    for(int name : names)
+        if(name != atom && shape)
+            shape = shape->withProperty(name);
+    return shape;
+}
+
+int CScriptShape::find(int atom)
+{
+    for(size_t i = 0; i < names.size(); i++)
+        if(names[i] == atom)
+            return (int)i;
+    return -1;
+}
+
+// ----------------------------------------------------------------------------------- CSCRIPTPOOL
+
+/* The pools themselves have nothing to destroy, so that getting at them is as quick as any
+   thread_local can be. This notes which ones a thread has used, to leave their blocks when it finishes. */
+struct CScriptPoolThread
+{
+    vector<CScriptPool*> pools;
+    ~CScriptPoolThread()
+    {
+        for(CScriptPool *pool : pools)
+            pool->leave();
+    }
+};
+
+void CScriptPool::grow()
+{
+    if(!capacity)
+    {
+        static thread_local CScriptPoolThread thread;
+        thread.pools.push_back(this);
+    }
+    {
+        lock_guard<mutex> guard(orphans.lock);
+        if(orphans.freeList)
+        {
+            freeList = orphans.freeList;
+            capacity += orphans.blocks;
+            orphans.freeList = 0;
+            orphans.blocks = 0;
+            return;
+        }
+    }
+    // each chunk starts with a link to the one before, and the blocks come after it
+    const size_t header = sizeof(max_align_t);
+    char *chunk = (char*)::operator new(header + blockSize * BLOCKS_PER_CHUNK);
+    {
+        lock_guard<mutex> guard(orphans.lock);
+        ((Block*)chunk)->next = orphans.chunks;
+        orphans.chunks = (Block*)chunk;
+    }
+    for(int i = BLOCKS_PER_CHUNK - 1; i >= 0; i--)
+    {
+        Block *block = (Block*)(chunk + header + i * blockSize);
+        block->next = freeList;
+        freeList = block;
+    }
+    capacity += BLOCKS_PER_CHUNK;
+    chunks++;
+}
+
+void CScriptPool::leave()
+{
+    if(!freeList)
+        return;
+    // the blocks still in use might be released on any thread, so only the free ones can go
+    Block *last = freeList;
+    while(last->next)
+        last = last->next;
+    lock_guard<mutex> guard(orphans.lock);
+    last->next = orphans.freeList;
+    orphans.freeList = freeList;
+    orphans.blocks += getFree();
+    freeList = 0;
+    capacity = inUse;
+}
+
+// ----------------------------------------------------------------------------------- CSCRIPTTRACINGCOLLECTOR
+
+#ifdef TINYJS_TRACING_GC
+// these come before anything that makes variables, so that they're constructed first
+std::vector<CScriptVar*> CScriptTracingCollector::vars;
+std::vector<CScriptVarLink*> CScriptTracingCollector::links;
+size_t CScriptTracingCollector::threshold = CScriptTracingCollector::DEFAULT_THRESHOLD;
+size_t CScriptTracingCollector::nextCollection = CScriptTracingCollector::DEFAULT_THRESHOLD;
+int CScriptTracingCollector::nativeCalls = 0;
+size_t CScriptTracingCollector::collections = 0;
+size_t CScriptTracingCollector::freedVars = 0;
+double CScriptTracingCollector::lastPause = 0;
+double CScriptTracingCollector::maxPause = 0;
+double CScriptTracingCollector::totalPause = 0;
+size_t CScriptTracingCollector::pauses[CScriptTracingCollector::PAUSE_BUCKETS];
+
+void CScriptTracingCollector::remove(CScriptVar *var)
+{
+    if(var->heapIndex < 0)
+        return; // collect() has already taken it out
+    CScriptVar *last = vars.back();
+    vars[var->heapIndex] = last;
+    last->heapIndex = var->heapIndex;
+    vars.pop_back();
+}
+
+void CScriptTracingCollector::remove(CScriptVarLink *link)
+{
+    if(link->heapIndex < 0)
+        return;
+    CScriptVarLink *last = links.back();
+    links[link->heapIndex] = last;
+    last->heapIndex = link->heapIndex;
+    links.pop_back();
+}
+
+void CScriptTracingCollector::mark(CScriptVar *var, std::vector<CScriptVar*> &stack)
+{
+    if(var && !var->marked)
+    {
+        var->marked = true;
+        stack.push_back(var);
+    }
+}
+
+size_t CScriptTracingCollector::collect()
+{
+    clock_t start = clock();
+    std::vector<CScriptVar*> stack;
+    for(CScriptVar *var : vars)
+        if(var->refs > 0)
+            mark(var, stack);
+    for(CScriptVarLink *link : links)
+        if(!link->owned)
+            mark(link->var, stack);
+    while(!stack.empty())
+    {
+        CScriptVar *var = stack.back();
+        stack.pop_back();
+        for(CScriptVarLink *link = var->firstChild; link; link = link->nextSibling)
+            mark(link->var, stack);
+    }
+
+    // take the garbage out of the heap all at once, rather than one at a time as it's deleted
+    std::vector<CScriptVar*> garbage;
+    size_t live = 0;
+    for(CScriptVar *var : vars)
+    {
+        if(var->marked)
+        {
+            var->marked = false;
+            var->heapIndex = (int)live;
+            vars[live++] = var;
+        }
+        else
+        {
+            var->heapIndex = -1;
+            garbage.push_back(var);
+            for(CScriptVarLink *link = var->firstChild; link; link = link->nextSibling)
+                link->heapIndex = -1;
+        }
+    }
+    vars.resize(live);
+    live = 0;
+    for(CScriptVarLink *link : links)
+        if(link->heapIndex >= 0)
+        {
+            link->heapIndex = (int)live;
+            links[live++] = link;
+        }
+    links.resize(live);
+    // links don't touch their variables, so these can go in any order
+    for(CScriptVar *var : garbage)
+        delete var;
+
+    nextCollection = std::max(threshold, vars.size() * 2);
+    collections++;
+    freedVars += garbage.size();
+    lastPause = (clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+    maxPause = std::max(maxPause, lastPause);
+    totalPause += lastPause;
+    int bucket = 0;
+    for(double limit = 1; bucket < PAUSE_BUCKETS - 1 && lastPause >= limit; limit *= 2)
+        bucket++;
+    pauses[bucket]++;
+    return garbage.size();
+}
+#endif
+
+// ----------------------------------------------------------------------------------- CSCRIPTPROPERTYCACHE
+
+CScriptPropertyCache::CScriptPropertyCache(int atom)
+{
+    this->atom = atom;
+    for(int i = 0; i < ENTRIES; i++)
+    {
+        shapes[i] = 0;
+        indices[i] = 0;
+    }
+    next = 0;
+}
+
+CScriptVarLink *CScriptPropertyCache::findSlow(CScriptVar *object)
+{
+    int index = object->shape ? object->shape->find(atom) : -1;
+    if(index < 0)
+        return object->findChild(atom); // in a map, or not there at all (but could be an array's length)
+    shapes[next] = object->shape;
+    indices[next] = index;
+    next = (next + 1) % ENTRIES;
+    return object->slots[index];
 }
 
 // ----------------------------------------------------------------------------------- CSCRIPTLEX
@@ -347,15 +734,34 @@ CScriptLex::CScriptLex(const string &input)
     dataOwned = true;
     dataStart = 0;
     dataEnd = strlen(data);
+    tokenList = new CScriptTokenList();
+    tokenListOwned = true;
+    scanTokens();
+    tokenFirst = 0;
+    tokenLast = (int)tokenList->tokens.size();
     reset();
 }
 
+static bool tokenStartsBefore(const CScriptToken &token, int pos)
+{
+    return token.start < pos;
+}
+
 CScriptLex::CScriptLex(CScriptLex *owner, int startChar, int endChar)
 {
     data = owner->data;
     dataOwned = false;
     dataStart = startChar;
     dataEnd = endChar;
+    tokenList = owner->tokenList;
+    tokenListOwned = false;
+    // find our range of the owner's tokens
+    vector<CScriptToken>::iterator first = tokenList->tokens.begin() + owner->tokenFirst;
+    vector<CScriptToken>::iterator last = tokenList->tokens.begin() + owner->tokenLast;
+    first = lower_bound(first, last, startChar, tokenStartsBefore);
+    last = lower_bound(first, last, endChar, tokenStartsBefore);
+    tokenFirst = (int)(first - tokenList->tokens.begin());
+    tokenLast = (int)(last - tokenList->tokens.begin());
     reset();
 }
 
@@ -363,18 +769,19 @@ CScriptLex::~CScriptLex(void)
 {
     if(dataOwned)
         free((void*)data);
+    if(tokenListOwned)
+        delete tokenList;
 }
 
 void CScriptLex::reset()
 {
-    dataPos = dataStart;
+    tokenPos = tokenFirst;
     tokenStart = 0;
     tokenEnd = 0;
     tokenLastEnd = 0;
     tk = 0;
     tkStr = "";
-    getNextCh();
-    getNextCh();
+    tkAtom = TINYJS_ATOM_TEMP_NAME;
     getNextToken();
 }
 
@@ -466,6 +873,117 @@ void CScriptLex::getNextCh()
 }
 
 void CScriptLex::getNextToken()
+{
+    tokenLastEnd = tokenEnd;
+    if(tokenPos < tokenLast)
+    {
+        const CScriptToken &token = tokenList->tokens[tokenPos++];
+        tk = token.tk;
+        tokenStart = token.start;
+        tokenEnd = token.end;
+        tkStr = tokenList->strings[token.str];
+        tkAtom = token.atom;
+    }
+    else
+    {
+        // where the scanner would have put the end of the data
+        tk = LEX_EOF;
+        tkStr.clear();
+        tkAtom = TINYJS_ATOM_TEMP_NAME;
+        tokenStart = dataEnd;
+        tokenEnd = dataEnd - 1;
+    }
+}
+
+CScriptPropertyCache *CScriptLex::getPropertyCache()
+{
+    if(tk == LEX_EOF)
+        return 0;
+    int cache = tokenList->tokens[tokenPos - 1].cache;
+    return cache < 0 ? 0 : &tokenList->caches[cache];
+}
+
+int CScriptLex::getMatchingBracket()
+{
+    if(tk != '{' && tk != '(' && tk != '[')
+        return -1;
+    int pair = tokenList->tokens[tokenPos - 1].pair;
+    return pair < tokenLast ? pair : -1;
+}
+
+void CScriptLex::seekToken(int index)
+{
+    tokenPos = index;
+    getNextToken();
+}
+
+bool CScriptLex::skipBrackets()
+{
+    int close = getMatchingBracket();
+    if(close < 0)
+        return false;
+    seekToken(close);
+    getNextToken();
+    return true;
+}
+
+void CScriptLex::scanTokens()
+{
+    unordered_map<string, int> strings;
+    vector<int> brackets; // the open brackets we're inside
+    dataPos = dataStart;
+    tokenEnd = 0;
+    getNextCh();
+    getNextCh();
+    for(;;)
+    {
+        scanToken();
+        if(tk == LEX_EOF)
+            break;
+        CScriptToken token;
+        token.tk = tk;
+        token.start = tokenStart;
+        token.end = tokenEnd;
+        auto str = strings.find(tkStr);
+        if(str == strings.end())
+        {
+            str = strings.insert(make_pair(tkStr, (int)tokenList->strings.size())).first;
+            tokenList->strings.push_back(tkStr);
+        }
+        token.str = str->second;
+        // intern names now, so nothing has to hash them while running
+        token.atom = (tk == LEX_ID || tk == LEX_R_RESERVED) ? CScriptAtoms::get(tkStr) : TINYJS_ATOM_TEMP_NAME;
+        token.cache = -1;
+        if(tk == LEX_ID && !tokenList->tokens.empty() && tokenList->tokens.back().tk == '.')
+        {
+            token.cache = (int)tokenList->caches.size();
+            tokenList->caches.push_back(CScriptPropertyCache(token.atom));
+        }
+        token.pair = -1;
+        int index = (int)tokenList->tokens.size();
+        if(tk == '{' || tk == '(' || tk == '[')
+            brackets.push_back(index);
+        else if(tk == '}' || tk == ')' || tk == ']')
+        {
+            // a close that doesn't match is left unpaired, and the parser will complain about it
+            int open = brackets.empty() ? -1 : brackets.back();
+            if(open >= 0 && tokenList->tokens[open].tk == (tk == '}' ? '{' : tk == ')' ? '(' : '['))
+            {
+                brackets.pop_back();
+                tokenList->tokens[open].pair = index;
+                token.pair = open;
+            }
+        }
+        tokenList->tokens.push_back(token);
+    }
+    // note where the lines start, so that positions can be found without going through all the data
+    tokenList->lines.push_back(0);
+    for(int i = 0; i < dataEnd; i++)
+        if(data[i] == '\n')
+            tokenList->lines.push_back(i + 1);
+}
+
+void CScriptLex::scanToken()
 {
     tk = LEX_EOF;
     tkStr.clear();
@@ -475,7 +993,7 @@ void CScriptLex::getNextToken()
     {
         while(currCh && currCh != '\n') getNextCh();
         getNextCh();
-        getNextToken();
+        scanToken();
         return;
     }
     // block comments
@@ -484,7 +1002,7 @@ void CScriptLex::getNextToken()
         while(currCh && (currCh != '*' || nextCh != '/')) getNextCh();
         getNextCh();
         getNextCh();
-        getNextToken();
+        scanToken();
         return;
     }
     // record beginning of this token
@@ -770,38 +1288,63 @@ CScriptLex *CScriptLex::getSubLex(int lastPosition)
 string CScriptLex::getPosition(int pos)
 {
     if(pos < 0) pos = tokenLastEnd;
-    int line = 1, col = 1;
-    for(int i = 0; i < pos; i++)
-    {
-        char ch;
-        if(i < dataEnd)
-            ch = data[i];
-        else
-            ch = 0;
-        col++;
-        if(ch == '\n')
-        {
-            line++;
-            col = 0;
-        }
-    }
+    return tokenList->getPosition(pos);
+}
+
+// ----------------------------------------------------------------------------------- CSCRIPTTOKENLIST
+
+string CScriptTokenList::getPosition(int pos)
+{
+    // the line is the last one that starts at or before pos
+    int line = (int)(upper_bound(lines.begin(), lines.end(), pos) - lines.begin());
+    if(line < 1) line = 1;
+    // columns on the first line count from 1, and on the others from 0
+    int col = pos - lines[line - 1] + (line == 1 ? 1 : 0);
     char buf[256];
     sprintf_s(buf, 256, "(line: %d, col: %d)", line, col);
     return buf;
 }
 
+// ----------------------------------------------------------------------------------- CSCRIPTCALLFRAME
+
+string CScriptCallFrame::getDescription()
+{
+    return CScriptAtoms::getString(function) + " from " + source->getPosition(position);
+}
+
 // ----------------------------------------------------------------------------------- CSCRIPTVARLINK
 
+CScriptPool::Orphans CScriptVarLink::poolOrphans;
+thread_local CScriptPool CScriptVarLink::pool(sizeof(CScriptVarLink), CScriptVarLink::poolOrphans);
+
 CScriptVarLink::CScriptVarLink()
 {
 #if DEBUG_MEMORY
     mark_allocated(this);
 #endif 	   
+#ifdef TINYJS_TRACING_GC
+    CScriptTracingCollector::add(this);
+#endif
     this->nextSibling = 0;
     this->prevSibling = 0;
     this->var = 0;
     this->owned = false;
-    this->name = "";
+    this->nameAtom = TINYJS_ATOM_TEMP_NAME;
+}
+
+CScriptVarLink::CScriptVarLink(CScriptVar *var, int nameAtom)
+{
+#if DEBUG_MEMORY
+    mark_allocated(this);
+#endif
+#ifdef TINYJS_TRACING_GC
+    CScriptTracingCollector::add(this);
+#endif
+    this->nameAtom = nameAtom;
+    this->nextSibling = 0;
+    this->prevSibling = 0;
+    this->var = ref(var);
+    this->owned = false;
 }
 
 CScriptVarLink::CScriptVarLink(CScriptVar *var, const std::string &name)
@@ -809,10 +1352,13 @@ CScriptVarLink::CScriptVarLink(CScriptVar *var, const std::string &name)
 #if DEBUG_MEMORY
     mark_allocated(this);
 #endif
-    this->name = name;
+#ifdef TINYJS_TRACING_GC
+    CScriptTracingCollector::add(this);
+#endif
+    this->nameAtom = CScriptAtoms::get(name);
     this->nextSibling = 0;
     this->prevSibling = 0;
-    this->var = var->ref();
+    this->var = ref(var);
     this->owned = false;
 }
 
@@ -822,10 +1368,13 @@ CScriptVarLink::CScriptVarLink(const CScriptVarLink &link)
 #if DEBUG_MEMORY
     mark_allocated(this);
 #endif
-    this->name = link.name;
+#ifdef TINYJS_TRACING_GC
+    CScriptTracingCollector::add(this);
+#endif
+    this->nameAtom = link.nameAtom;
     this->nextSibling = 0;
     this->prevSibling = 0;
-    this->var = link.var->ref();
+    this->var = ref(link.var);
     this->owned = false;
 }
 
@@ -833,6 +1382,9 @@ CScriptVarLink::~CScriptVarLink()
 {
 #if DEBUG_MEMORY
     mark_deallocated(this);
+#endif
+#ifdef TINYJS_TRACING_GC
+    CScriptTracingCollector::remove(this);
 #endif
 	if(var)
 		unref(var);
@@ -842,7 +1394,7 @@ CScriptVarLink* CScriptVarLink::replaceWith(CScriptVar *newVar)
 {
     CScriptVar *oldVar = var;
 	ASSERT(newVar->getRefs() >= 0);
-    var = newVar->ref();
+    var = ref(newVar);
 	if(oldVar)
 		unref(oldVar);
     return this;
@@ -853,31 +1405,55 @@ CScriptVarLink* CScriptVarLink::replaceWith(CScriptVarLink *newVar)
     if(newVar)
         replaceWith(newVar->var);
     else
-        replaceWith(new CScriptVar());
+        replaceWith(CScriptConstants::getUndefined());
     return this;
 }
 
+CScriptVar *CScriptVarLink::getWritableVar()
+{
+    if(var->isConstant())
+    {
+        CScriptVar *copy = new CScriptVar();
+        copy->copyValue(var);
+        replaceWith(copy);
+    }
+    return var;
+}
+
 int CScriptVarLink::getIntName()
 {
-    return atoi(name.c_str());
+    return atoi(getName().c_str());
 }
 void CScriptVarLink::setIntName(int n)
 {
-    char sIdx[64];
-    sprintf_s(sIdx, sizeof(sIdx), "%d", n);
-    name = sIdx;
+    char sIdx[TINYJS_NUMBER_BUFFER_SIZE];
+    formatInt(n, sIdx);
+    setName(sIdx);
+}
+
+CScriptVar *CScriptVarLink::ref(CScriptVar* newVar)
+{
+#ifndef TINYJS_TRACING_GC
+    newVar->ref();
+#endif
+    return newVar;
 }
 
 void CScriptVarLink::unref(CScriptVar* oldVar)
 {
+#ifndef TINYJS_TRACING_GC
 	if(oldVar->getRefs() <= 0)
-		TRACE("WARNING: Too many unrefs in variable \'%s\'. Stack may be corrupted.\n", name.c_str());
+		TRACE("WARNING: Too many unrefs in variable \'%s\'. Stack may be corrupted.\n", getName().c_str());
 	else
 		oldVar->unref();
+#endif
 }
 
 // ----------------------------------------------------------------------------------- CSCRIPTVAR
 
+CScriptPool::Orphans CScriptVar::poolOrphans;
+thread_local CScriptPool CScriptVar::pool(sizeof(CScriptVar), CScriptVar::poolOrphans);
+
 CScriptVar::CScriptVar()
 {
     refs = 0;
@@ -886,15 +1462,29 @@ CScriptVar::CScriptVar()
 #endif		
     lastChild = 0;
     firstChild = 0;
+    shape = CScriptShape::empty();
+    sparseElements = 0;
+    arrayLength = 0;
     flags = 0;
     jsCallback = 0;
     jsCallbackUserData = 0;
     data = TINYJS_BLANK_DATA;
+    stringBuffer = 0;
+    stringLength = 0;
     intData = 0;
     doubleData = 0;
     executions = 0;
     nativeHandle = 0;
+    parsedBody = 0;
+    bytecode = 0;
     flags = SCRIPTVAR_UNDEFINED;
+    cycleColor = 0;
+    candidateIndex = -1;
+    collector = 0;
+#ifdef TINYJS_TRACING_GC
+    marked = false;
+    CScriptTracingCollector::add(this);
+#endif
 }
 
 CScriptVar::CScriptVar(const string &str) : CScriptVar()
@@ -935,18 +1525,24 @@ CScriptVar::~CScriptVar(void)
     mark_deallocated(this);
 #endif
     removeAllChildren();
+    releaseStringBuffer();
     if(nativeHandle)
         FREELIB(nativeHandle);
+    if(candidateIndex >= 0)
+        CScriptCycleCollector::removeCandidate(this);
+#ifdef TINYJS_TRACING_GC
+    CScriptTracingCollector::remove(this);
+#endif
 }
 
 CScriptVar *CScriptVar::getReturnVar()
 {
-    return getParameter(TINYJS_RETURN_VAR);
+    return findChildOrCreate(TINYJS_ATOM_RETURN_VAR)->getWritableVar();
 }
 
 void CScriptVar::setReturnVar(CScriptVar *var)
 {
-    findChildOrCreate(TINYJS_RETURN_VAR)->replaceWith(var);
+    findChildOrCreate(TINYJS_ATOM_RETURN_VAR)->replaceWith(var);
 }
 
 
@@ -969,22 +1565,50 @@ int CScriptVar::getExecutions()
 
 CScriptVarLink *CScriptVar::findChild(const string &childName)
 {
-    auto v = children.find(childName);
-    if(v != children.end())
-        return v->second;
-    if(childName == "length" && isArray())
-        return new CScriptVarLink(new CScriptVar(getArrayLength()));
-    if(childName == "length" && isString())
-        return new CScriptVarLink(new CScriptVar((int)getString().size()));
+    int childAtom = CScriptAtoms::find(childName);
+    return childAtom >= 0 ? findChild(childAtom) : 0;
+}
+
+CScriptVarLink *CScriptVar::findChild(int childAtom)
+{
+    if(shape)
+    {
+        int index = shape->find(childAtom);
+        if(index >= 0)
+            return slots[index];
+    }
+    else
+    {
+        if(isArray())
+        {
+            int index = CScriptAtoms::getIndex(childAtom);
+            if(index >= 0 && index < (int)elements.size())
+                return elements[index];
+            if(index >= 0 && !sparseElements)
+                return 0;
+        }
+        auto v = children.find(childAtom);
+        if(v != children.end())
+            return v->second;
+    }
+    if(childAtom == TINYJS_ATOM_LENGTH && isArray())
+        return new CScriptVarLink(CScriptConstants::newInt(getArrayLength()));
+    if(childAtom == TINYJS_ATOM_LENGTH && isString())
+        return new CScriptVarLink(CScriptConstants::newInt((int)getStringLength()));
     return 0;
 }
 
 CScriptVarLink *CScriptVar::findChildOrCreate(const string &childName, int varFlags)
 {
-    CScriptVarLink *l = findChild(childName);
+    return findChildOrCreate(CScriptAtoms::get(childName), varFlags);
+}
+
+CScriptVarLink *CScriptVar::findChildOrCreate(int childAtom, int varFlags)
+{
+    CScriptVarLink *l = findChild(childAtom);
     if(l) return l;
 
-    return addChild(childName, new CScriptVar(TINYJS_BLANK_DATA, varFlags));
+    return addChild(childAtom, new CScriptVar(TINYJS_BLANK_DATA, varFlags));
 }
 
 CScriptVarLink *CScriptVar::findChildOrCreateByPath(const std::string &path)
@@ -999,6 +1623,12 @@ CScriptVarLink *CScriptVar::findChildOrCreateByPath(const std::string &path)
 
 CScriptVarLink *CScriptVar::addChild(const std::string &childName, CScriptVar *child)
 {
+    return addChild(CScriptAtoms::get(childName), child);
+}
+
+CScriptVarLink *CScriptVar::addChild(int childAtom, CScriptVar *child)
+{
+    ASSERT(!isConstant());
     if(isUndefined())
     {
         flags = SCRIPTVAR_OBJECT;
@@ -1007,42 +1637,71 @@ CScriptVarLink *CScriptVar::addChild(const std::string &childName, CScriptVar *c
     if(!child)
         child = new CScriptVar();
 
-    CScriptVarLink *link = new CScriptVarLink(child, childName);
+    CScriptVarLink *link = new CScriptVarLink(child, childAtom);
     link->owned = true;
-    if(!children.empty())
+    if(firstChild)
     {
         // can't use a raw replace because that would lead to dropping
         // the pointer on the floor
-        CScriptVarLink* oldChild = findChild(childName);
+        CScriptVarLink* oldChild = findChild(childAtom);
         if(oldChild)
         {
             oldChild->replaceWith(link);
             delete link;
             return oldChild;
         }
+        lastChild->nextSibling = link;
+        link->prevSibling = lastChild;
+        lastChild = link;
+    }
+    else
+        lastChild = firstChild = link;
+
+    if(shape && (isArray() || shape->getCount() >= CScriptShape::MAX_PROPERTIES))
+        removeShape();
+    CScriptShape *nextShape = shape ? shape->withProperty(childAtom) : 0;
+    if(shape && !nextShape)
+        removeShape();
+    int index = isArray() ? CScriptAtoms::getIndex(childAtom) : -1;
+    if(shape)
+    {
+        shape = nextShape;
+        slots.push_back(link);
+    }
+    else if(index >= 0)
+    {
+        // grow the elements for anything that won't leave them mostly holes
+        int size = (int)elements.size();
+        if(index >= size && !sparseElements && index < size*2 + TINYJS_ARRAY_SLACK)
+            elements.resize(index + 1, 0);
+        if(index < (int)elements.size())
+            elements[index] = link;
         else
         {
-            lastChild->nextSibling = link;
-            link->prevSibling = lastChild;
-            lastChild = link;
-            return children[childName] = link;
+            children[childAtom] = link;
+            sparseElements++;
         }
+        if(index >= arrayLength)
+            arrayLength = index + 1;
     }
     else
-    {
-        lastChild = firstChild = link;
-        return children[childName] = link;
-    }
+        children[childAtom] = link;
+    return link;
 }
 
 CScriptVarLink *CScriptVar::addChildNoDup(const std::string &childName, CScriptVar *child)
+{
+    return addChildNoDup(CScriptAtoms::get(childName), child);
+}
+
+CScriptVarLink *CScriptVar::addChildNoDup(int childAtom, CScriptVar *child)
 {
     // if no child supplied, create one
     if(!child)
         child = new CScriptVar();
 
     // no duplication is the default behavior of addChild now that it uses a map
-    return addChild(childName, child);
+    return addChild(childAtom, child);
 }
 
 void CScriptVar::removeChild(const std::string &childName, CScriptVar *child, bool throwIfMissing)
@@ -1057,8 +1716,30 @@ void CScriptVar::removeChild(const std::string &childName, CScriptVar *child, bo
 void CScriptVar::removeLink(CScriptVarLink *link)
 {
     if(!link) return;
-    if(!children.erase(link->name)) // erase() returns 1 if it actually erased something
-        throw new CScriptException("Not this variable's link!"); // don't remove a link that's not ours
+    if(shape)
+    {
+        int index = shape->find(link->nameAtom);
+        if(index < 0 || slots[index] != link)
+            throw new CScriptException("Not this variable's link!"); // don't remove a link that's not ours
+        CScriptShape *nextShape = shape->withoutProperty(link->nameAtom);
+        slots.erase(slots.begin() + index);
+        if(nextShape)
+            shape = nextShape;
+        else
+            removeShape();
+    }
+    else
+    {
+        int index = isArray() ? CScriptAtoms::getIndex(link->nameAtom) : -1;
+        if(index >= 0 && index < (int)elements.size() && elements[index] == link)
+            elements[index] = 0;
+        else if(!children.erase(link->nameAtom)) // erase() returns 1 if it actually erased something
+            throw new CScriptException("Not this variable's link!"); // don't remove a link that's not ours
+        else if(index >= 0)
+            sparseElements--;
+        if(index >= 0 && index == arrayLength - 1)
+            updateArrayLength();
+    }
     if(link->nextSibling)
         link->nextSibling->prevSibling = link->prevSibling;
     if(link->prevSibling)
@@ -1079,23 +1760,56 @@ void CScriptVar::removeAllChildren()
         it = children.erase(it);
         delete temp;
     }
+    for(CScriptVarLink* link : slots)
+        delete link;
+    slots.clear();
+    shape = CScriptShape::empty();
+    for(CScriptVarLink* link : elements)
+        delete link;
+    elements.clear();
+    sparseElements = 0;
+    arrayLength = 0;
+    firstChild = 0;
     lastChild = 0;
 }
 
+void CScriptVar::removeShape()
+{
+    for(CScriptVarLink* link : slots)
+        children[link->nameAtom] = link;
+    slots.clear();
+    shape = 0;
+}
+
+CScriptVarLink *CScriptVar::findArrayElement(int idx)
+{
+    if(isArray() && idx >= 0 && idx < (int)elements.size())
+        return elements[idx];
+    if(isArray() && idx >= 0 && !sparseElements)
+        return 0;
+    int atom = CScriptAtoms::findIndexAtom(idx);
+    return atom >= 0 ? findChild(atom) : 0;
+}
+
+CScriptVarLink *CScriptVar::findIndexOrCreate(CScriptVar *index)
+{
+    if(!index->isInt())
+        return findChildOrCreate(index->getString());
+    CScriptVarLink *link = findArrayElement(index->getInt());
+    if(link) return link;
+    return addChild(CScriptAtoms::getIndexAtom(index->getInt()));
+}
+
 CScriptVar *CScriptVar::getArrayIndex(int idx)
 {
-    char sIdx[64];
-    sprintf_s(sIdx, sizeof(sIdx), "%d", idx);
-    CScriptVarLink *link = findChild(sIdx);
+    CScriptVarLink *link = findArrayElement(idx);
     if(link) return link->var;
-    else return new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_NULL); // undefined
+    else return CScriptConstants::getNull(); // undefined
 }
 
 void CScriptVar::setArrayIndex(int idx, CScriptVar *value)
 {
-    char sIdx[64];
-    sprintf_s(sIdx, sizeof(sIdx), "%d", idx);
-    CScriptVarLink *link = findChild(sIdx);
+    CScriptVarLink *link = findArrayElement(idx);
 
     if(link)
     {
@@ -1107,31 +1821,43 @@ void CScriptVar::setArrayIndex(int idx, CScriptVar *value)
     else
     {
         if(!value->isUndefined())
-            addChild(sIdx, value);
+            addChild(CScriptAtoms::getIndexAtom(idx), value);
     }
 }
 
-int CScriptVar::getArrayLength()
+void CScriptVar::setArrayLength(int length)
 {
-    int highest = -1;
-    if(!isArray()) return 0;
+    if(!isArray() || length <= arrayLength)
+        return;
+    arrayLength = length;
+    // make room for the elements now, unless that's silly
+    if(!sparseElements && length < (1 << 20))
+        elements.resize(length, 0);
+}
 
-    // not the biggest fan of this implementation
-    for(auto& child : children)
-    {
-        CScriptVarLink* link = child.second;
-        if(isNumber(link->name))
+void CScriptVar::updateArrayLength()
+{
+    // trailing holes aren't worth keeping
+    while(!elements.empty() && !elements.back())
+        elements.pop_back();
+    arrayLength = (int)elements.size();
+    if(sparseElements)
+        for(auto& child : children)
         {
-            int val = atoi(link->name.c_str());
-            if(val > highest) highest = val;
+            int index = CScriptAtoms::getIndex(child.first);
+            if(index >= arrayLength)
+                arrayLength = index + 1;
         }
-    }
-    return highest + 1;
 }
 
 int CScriptVar::getChildren()
 {
-    return children.size();
+    if(shape)
+        return slots.size();
+    int count = children.size();
+    for(CScriptVarLink* link : elements)
+        if(link) count++;
+    return count;
 }
 
 int CScriptVar::getInt()
@@ -1159,82 +1885,146 @@ const string &CScriptVar::getString()
      * I should really just use char* :) */
     static string s_null = "null";
     static string s_undefined = "undefined";
+    // numbers keep their string in 'data' once it's been worked out, until they're set to something else
     if(isInt())
     {
-        char buffer[32];
-        sprintf_s(buffer, sizeof(buffer), "%ld", intData);
-        data = buffer;
+        if(data.empty())
+        {
+            char buffer[TINYJS_NUMBER_BUFFER_SIZE];
+            data.assign(buffer, formatInt(intData, buffer));
+        }
         return data;
     }
     if(isDouble())
     {
-        char buffer[32];
-        sprintf_s(buffer, sizeof(buffer), "%f", doubleData);
-        data = buffer;
+        if(data.empty())
+        {
+            char buffer[TINYJS_NUMBER_BUFFER_SIZE];
+            data.assign(buffer, formatDouble(doubleData, buffer));
+        }
         return data;
     }
     if(isNull()) return s_null;
     if(isUndefined()) return s_undefined;
-    // are we just a string here?
+    if(stringBuffer)
+    {
+        // if we're the whole buffer, the caller can have it - but it can't be added to in place after that
+        if(stringLength == stringBuffer->chars.size())
+        {
+            stringBuffer->sealed = true;
+            return stringBuffer->chars;
+        }
+        data.assign(stringBuffer->chars, 0, stringLength);
+        releaseStringBuffer();
+    }
+    // are we just a string here?
     return data;
 }
 
+size_t CScriptVar::getStringLength()
+{
+    return stringBuffer ? stringLength : getString().size();
+}
+
+void CScriptVar::appendString(std::string &str)
+{
+    if(stringBuffer)
+        str.append(stringBuffer->chars, 0, stringLength);
+    else
+        str.append(getString());
+}
+
+void CScriptVar::releaseStringBuffer()
+{
+    if(stringBuffer && --stringBuffer->refs == 0)
+        delete stringBuffer;
+    stringBuffer = 0;
+    stringLength = 0;
+}
+
 void CScriptVar::setInt(int val)
 {
+    ASSERT(!isConstant());
     flags = (flags&~SCRIPTVAR_VARTYPEMASK) | SCRIPTVAR_INTEGER;
     intData = val;
     doubleData = 0;
     data = TINYJS_BLANK_DATA;
+    releaseStringBuffer();
+    parsedBody = 0;
+    bytecode = 0;
 }
 
 void CScriptVar::setDouble(double val)
 {
+    ASSERT(!isConstant());
     flags = (flags&~SCRIPTVAR_VARTYPEMASK) | SCRIPTVAR_DOUBLE;
     doubleData = val;
     intData = 0;
     data = TINYJS_BLANK_DATA;
+    releaseStringBuffer();
+    parsedBody = 0;
+    bytecode = 0;
 }
 
 void CScriptVar::setString(const string &str)
 {
+    ASSERT(!isConstant());
     // name sure it's not still a number or integer
     flags = (flags&~SCRIPTVAR_VARTYPEMASK) | SCRIPTVAR_STRING;
     data = str;
+    releaseStringBuffer();
     intData = 0;
     doubleData = 0;
+    parsedBody = 0;
+    bytecode = 0;
 }
 
 void CScriptVar::setUndefined()
 {
+    ASSERT(!isConstant());
     // name sure it's not still a number or integer
     flags = (flags&~SCRIPTVAR_VARTYPEMASK) | SCRIPTVAR_UNDEFINED;
     data = TINYJS_BLANK_DATA;
+    releaseStringBuffer();
     intData = 0;
     doubleData = 0;
     removeAllChildren();
+    parsedBody = 0;
+    bytecode = 0;
 }
 
 void CScriptVar::setArray()
 {
+    ASSERT(!isConstant());
     // name sure it's not still a number or integer
     flags = (flags&~SCRIPTVAR_VARTYPEMASK) | SCRIPTVAR_ARRAY;
     data = TINYJS_BLANK_DATA;
+    releaseStringBuffer();
     intData = 0;
     doubleData = 0;
     removeAllChildren();
+    parsedBody = 0;
+    bytecode = 0;
 }
 
 bool CScriptVar::equals(CScriptVar *v)
 {
+    CScriptValue value;
+    if(CScriptMaths::evaluate(this, v, LEX_EQUAL, value))
+        return value.intData != 0;
     CScriptVar *resV = mathsOp(v, LEX_EQUAL);
     bool res = resV->getBool();
-    delete resV;
+    if(!resV->refs) delete resV;
     return res;
 }
 
 CScriptVar *CScriptVar::mathsOp(CScriptVar *b, int op)
 {
     CScriptVar *a = this;
+    // numbers, and comparisons of strings
+    CScriptValue value;
+    if(CScriptMaths::evaluate(a, b, op, value))
+        return CScriptMaths::newVar(value);
     // Type equality check
     if(op == LEX_TYPEEQUAL || op == LEX_NTYPEEQUAL)
     {
@@ -1249,72 +2039,32 @@ CScriptVar *CScriptVar::mathsOp(CScriptVar *b, int op)
         }
         ;
         if(op == LEX_TYPEEQUAL)
-            return new CScriptVar(eql);
+            return CScriptConstants::newInt(eql);
         else
-            return new CScriptVar(!eql);
+            return CScriptConstants::newInt(!eql);
     }
-    // do maths...
-    if(a->isUndefined() && b->isUndefined())
+    // shifts always work on ints, whatever they're given
+    if(op == LEX_LSHIFT || op == LEX_RSHIFT || op == LEX_RSHIFTUNSIGNED)
     {
-        if(op == LEX_EQUAL) return new CScriptVar(true);
-        else if(op == LEX_NEQUAL) return new CScriptVar(false);
-        else return new CScriptVar(); // undefined
+        int da = a->getInt();
+        int db = b->getInt();
+        if(op == LEX_LSHIFT) return CScriptConstants::newInt(da << db);
+        if(op == LEX_RSHIFT) return CScriptConstants::newInt(da >> db);
+        return CScriptConstants::newInt((int)(((unsigned int)da) >> db));
     }
-    else if((a->isNumeric() || a->isUndefined()) &&
+    if((a->isNumeric() || a->isUndefined()) &&
         (b->isNumeric() || b->isUndefined()))
     {
-        if(!a->isDouble() && !b->isDouble())
-        {
-            // use ints
-            int da = a->getInt();
-            int db = b->getInt();
-            switch(op)
-            {
-            case '+': return new CScriptVar(da + db);
-            case '-': return new CScriptVar(da - db);
-            case '*': return new CScriptVar(da*db);
-            case '/': return new CScriptVar(da / db);
-            case '&': return new CScriptVar(da&db);
-            case '|': return new CScriptVar(da | db);
-            case '^': return new CScriptVar(da^db);
-            case '%': return new CScriptVar(da%db);
-            case LEX_EQUAL:     return new CScriptVar(da == db);
-            case LEX_NEQUAL:    return new CScriptVar(da != db);
-            case '<':     return new CScriptVar(da < db);
-            case LEX_LEQUAL:    return new CScriptVar(da <= db);
-            case '>':     return new CScriptVar(da > db);
-            case LEX_GEQUAL:    return new CScriptVar(da >= db);
-            default: throw new CScriptException("Operation " + CScriptLex::getTokenStr(op) + " not supported on the Int datatype");
-            }
-        }
-        else
-        {
-            // use doubles
-            double da = a->getDouble();
-            double db = b->getDouble();
-            switch(op)
-            {
-            case '+': return new CScriptVar(da + db);
-            case '-': return new CScriptVar(da - db);
-            case '*': return new CScriptVar(da*db);
-            case '/': return new CScriptVar(da / db);
-            case LEX_EQUAL:     return new CScriptVar(da == db);
-            case LEX_NEQUAL:    return new CScriptVar(da != db);
-            case '<':     return new CScriptVar(da < db);
-            case LEX_LEQUAL:    return new CScriptVar(da <= db);
-            case '>':     return new CScriptVar(da > db);
-            case LEX_GEQUAL:    return new CScriptVar(da >= db);
-            default: throw new CScriptException("Operation " + CScriptLex::getTokenStr(op) + " not supported on the Double datatype");
-            }
-        }
+        // CScriptMaths does everything that can be done with numbers
+        throw new CScriptException("Operation " + CScriptLex::getTokenStr(op) + " not supported on the " + (a->isDouble() || b->isDouble() ? "Double" : "Int") + " datatype");
     }
     else if(a->isArray())
     {
         /* Just check pointers */
         switch(op)
         {
-        case LEX_EQUAL: return new CScriptVar(a == b);
-        case LEX_NEQUAL: return new CScriptVar(a != b);
+        case LEX_EQUAL: return CScriptConstants::newInt(a == b);
+        case LEX_NEQUAL: return CScriptConstants::newInt(a != b);
         default: throw new CScriptException("Operation " + CScriptLex::getTokenStr(op) + " not supported on the Array datatype");
         }
     }
@@ -1323,25 +2073,26 @@ CScriptVar *CScriptVar::mathsOp(CScriptVar *b, int op)
         /* Just check pointers */
         switch(op)
         {
-        case LEX_EQUAL: return new CScriptVar(a == b);
-        case LEX_NEQUAL: return new CScriptVar(a != b);
+        case LEX_EQUAL: return CScriptConstants::newInt(a == b);
+        case LEX_NEQUAL: return CScriptConstants::newInt(a != b);
         default: throw new CScriptException("Operation " + CScriptLex::getTokenStr(op) + " not supported on the Object datatype");
         }
     }
+    else if(op == '+')
+        return a->concat(b);
     else
     {
-        string da = a->getString();
-        string db = b->getString();
+        const string &da = a->getString();
+        const string &db = b->getString();
         // use strings
         switch(op)
         {
-        case '+':           return new CScriptVar(da + db, SCRIPTVAR_STRING);
-        case LEX_EQUAL:     return new CScriptVar(da == db);
-        case LEX_NEQUAL:    return new CScriptVar(da != db);
-        case '<':     return new CScriptVar(da < db);
-        case LEX_LEQUAL:    return new CScriptVar(da <= db);
-        case '>':     return new CScriptVar(da > db);
-        case LEX_GEQUAL:    return new CScriptVar(da >= db);
+        case LEX_EQUAL:     return CScriptConstants::newInt(da == db);
+        case LEX_NEQUAL:    return CScriptConstants::newInt(da != db);
+        case '<':     return CScriptConstants::newInt(da < db);
+        case LEX_LEQUAL:    return CScriptConstants::newInt(da <= db);
+        case '>':     return CScriptConstants::newInt(da > db);
+        case LEX_GEQUAL:    return CScriptConstants::newInt(da >= db);
         default: throw new CScriptException("Operation " + CScriptLex::getTokenStr(op) + " not supported on the string datatype");
         }
     }
@@ -1349,11 +2100,47 @@ CScriptVar *CScriptVar::mathsOp(CScriptVar *b, int op)
     return 0;
 }
 
+CScriptVar *CScriptVar::concat(CScriptVar *b)
+{
+    CScriptVar *result = new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_STRING);
+    CScriptStringBuffer *buffer = stringBuffer;
+    if(buffer && !buffer->sealed && stringLength == buffer->chars.size())
+        buffer->refs++; // we're the end of our buffer, so b can go straight on to it
+    else
+    {
+        size_t length = getStringLength() + b->getStringLength();
+        if(length < TINYJS_STRING_BUFFER_MIN)
+        {
+            result->data.reserve(length);
+            appendString(result->data);
+            b->appendString(result->data);
+            return result;
+        }
+        buffer = new CScriptStringBuffer();
+        buffer->chars.reserve(length * 2);
+        appendString(buffer->chars);
+    }
+    if(b->stringBuffer == buffer)
+        buffer->chars.append(std::string(buffer->chars, 0, b->stringLength)); // adding a string on to itself
+    else
+        b->appendString(buffer->chars);
+    result->stringBuffer = buffer;
+    result->stringLength = buffer->chars.size();
+    return result;
+}
+
 void CScriptVar::copySimpleData(CScriptVar *val)
 {
     data = val->data;
+    releaseStringBuffer();
+    stringBuffer = val->stringBuffer;
+    stringLength = val->stringLength;
+    if(stringBuffer)
+        stringBuffer->refs++;
     intData = val->intData;
     doubleData = val->doubleData;
+    parsedBody = val->parsedBody;
+    bytecode = val->bytecode;
     flags = (flags & ~SCRIPTVAR_VARTYPEMASK) | (val->flags & SCRIPTVAR_VARTYPEMASK);
 }
 
@@ -1364,19 +2151,19 @@ void CScriptVar::copyValue(CScriptVar *val)
         copySimpleData(val);
         // remove all current children
         removeAllChildren();
-        // copy children of 'val'
-        for(auto& i : val->children)
+        // copy children of 'val', in order
+        for(CScriptVarLink *child = val->firstChild; child; child = child->nextSibling)
         {
-            CScriptVarLink *child = i.second;
             CScriptVar *copied;
             // don't copy the 'parent' object...
-            if(i.first != TINYJS_PROTOTYPE_CLASS)
+            if(child->nameAtom != TINYJS_ATOM_PROTOTYPE_CLASS)
                 copied = child->var->deepCopy();
             else
                 copied = child->var;
 
-            addChild(i.first, copied);
+            addChild(child->nameAtom, copied);
         }
+        setArrayLength(val->arrayLength);
     }
     else
     {
@@ -1388,19 +2175,19 @@ CScriptVar *CScriptVar::deepCopy()
 {
     CScriptVar *newVar = new CScriptVar();
     newVar->copySimpleData(this);
-    // copy children
-    for(auto& i : children)
+    // copy children, in order (a function's arguments depend on it)
+    for(CScriptVarLink *child = firstChild; child; child = child->nextSibling)
     {
-        CScriptVarLink *child = i.second;
         CScriptVar *copied;
         // don't copy the 'parent' object...
-        if(child->name != TINYJS_PROTOTYPE_CLASS)
+        if(child->nameAtom != TINYJS_ATOM_PROTOTYPE_CLASS)
             copied = child->var->deepCopy();
         else
             copied = child->var;
 
-        newVar->addChild(child->name, copied);
+        newVar->addChild(child->nameAtom, copied);
     }
+    newVar->setArrayLength(arrayLength);
     return newVar;
 }
 
@@ -1412,11 +2199,8 @@ void CScriptVar::trace(string indentStr, const string &name)
         getString().c_str(),
         getFlagsAsString().c_str());
     string indent = indentStr + " ";
-    for(auto& i : children)
-    {
-        CScriptVarLink *link = i.second;
-        link->var->trace(indent, link->name);
-    }
+    for(CScriptVarLink *link = firstChild; link; link = link->nextSibling)
+        link->var->trace(indent, link->getName());
 }
 
 string CScriptVar::getFlagsAsString()
@@ -1445,7 +2229,7 @@ string CScriptVar::getParsableString()
         CScriptVarLink *link = firstChild;
         while(link)
         {
-            funcStr << link->name;
+            funcStr << link->getName();
             if(link = link->nextSibling) funcStr << ",";
         }
         // add function body
@@ -1471,7 +2255,7 @@ void CScriptVar::getJSON(ostringstream &destination, const string linePrefix)
         while(link)
         {
             destination << indentedLinePrefix;
-            destination << getJSString(link->name);
+            destination << getJSString(link->getName());
             destination << " : ";
             link->var->getJSON(destination, indentedLinePrefix);
             if(link = link->nextSibling)
@@ -1488,11 +2272,20 @@ void CScriptVar::getJSON(ostringstream &destination, const string linePrefix)
         int len = getArrayLength();
         if(len > 10000) len = 10000; // we don't want to get stuck here!
 
-        for(int i = 0; i < len; i++)
+        // write the elements that are there, and null for the holes between them
+        int i = 0;
+        for(CScriptVarLink *element : arrayElements())
         {
-            getArrayIndex(i)->getJSON(destination, indentedLinePrefix);
-            if(i < len - 1) destination << ",\n";
+            int index = CScriptAtoms::getIndex(element->nameAtom);
+            for(; i < index && i < len; i++)
+                destination << "null" << (i < len - 1 ? ",\n" : "");
+            if(i >= len)
+                break;
+            element->var->getJSON(destination, indentedLinePrefix);
+            if(++i < len) destination << ",\n";
         }
+        for(; i < len; i++)
+            destination << "null" << (i < len - 1 ? ",\n" : "");
 
         destination << "\n" << linePrefix << "]";
     }
@@ -1522,14 +2315,40 @@ std::vector<CScriptVarLink*> CScriptVar::orderedChildren()
     return output;
 }
 
+std::vector<CScriptVarLink*> CScriptVar::arrayElements()
+{
+    std::vector<CScriptVarLink*> output;
+    if(!isArray())
+        return output;
+    for(CScriptVarLink* link : elements)
+        if(link)
+            output.push_back(link);
+    if(sparseElements)
+    {
+        // only look at the indices that are there - a sparse array's length can be anything
+        size_t dense = output.size();
+        for(auto& child : children)
+            if(CScriptAtoms::getIndex(child.first) >= 0)
+                output.push_back(child.second);
+        std::sort(output.begin() + dense, output.end(), [](CScriptVarLink *a, CScriptVarLink *b) {
+            return CScriptAtoms::getIndex(a->nameAtom) < CScriptAtoms::getIndex(b->nameAtom);
+        });
+    }
+    return output;
+}
+
 CScriptVar *CScriptVar::ref()
 {
-    refs++;
+    // constants are shared by every engine, so they're never written to - not even their counts
+    if(!isConstant())
+        refs++;
     return this;
 }
 
 void CScriptVar::unref()
 {
+	if(isConstant())
+		return;
 	if(refs <= 0)
 	{
 		std::ostringstream ss;
@@ -1537,10 +2356,20 @@ void CScriptVar::unref()
 		getJSON(ss);
 		TRACE("WARNING: Too many unrefs in variable with contents:\n%s\nStack may be corrupted.\n", ss.str().c_str());
 	}
+#ifdef TINYJS_TRACING_GC
+    else
+        refs--; // links to it may not have been counted, so only the collector can free it
+#else
     else if((--refs) == 0)
     {
         delete this;
     }
+    else if(firstChild && !isConstant())
+    {
+        // this might have been the last way into a loop of variables
+        CScriptCycleCollector::addCandidate(this);
+    }
+#endif
 }
 
 int CScriptVar::getRefs()
@@ -1548,12 +2377,581 @@ int CScriptVar::getRefs()
     return refs;
 }
 
+bool CScriptVar::isUnshared()
+{
+#ifdef TINYJS_TRACING_GC
+    return false; // links aren't counted, so there's no knowing
+#else
+    return refs == 1 && !isConstant();
+#endif
+}
+
+// ----------------------------------------------------------------------------------- CSCRIPTCONSTANTS
+
+CScriptVar *CScriptConstants::undefinedVar = CScriptConstants::pin(new CScriptVar());
+CScriptVar *CScriptConstants::nullVar = CScriptConstants::pin(new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_NULL));
+std::vector<CScriptVar*> CScriptConstants::ints = CScriptConstants::makeInts();
+std::vector<CScriptVar*> CScriptConstants::chars = CScriptConstants::makeChars();
+
+CScriptVar *CScriptConstants::newString(const std::string &str)
+{
+    if(str.size() == 1)
+        return chars[(unsigned char)str[0]];
+    return new CScriptVar(str);
+}
+
+CScriptVar *CScriptConstants::pin(CScriptVar *var)
+{
+    var->ref(); // this reference is never given up, and once it's a constant nothing else is counted
+    var->getString(); // numbers keep their string once it's worked out, so do it now rather than on some thread later
+    var->flags |= SCRIPTVAR_CONSTANT;
+    return var;
+}
+
+std::vector<CScriptVar*> CScriptConstants::makeInts()
+{
+    std::vector<CScriptVar*> values;
+    for(int i = MIN_INT; i <= MAX_INT; i++)
+        values.push_back(pin(new CScriptVar(i)));
+    return values;
+}
+
+std::vector<CScriptVar*> CScriptConstants::makeChars()
+{
+    std::vector<CScriptVar*> values;
+    for(int ch = 0; ch < 256; ch++)
+        values.push_back(pin(new CScriptVar(std::string(1, (char)ch))));
+    return values;
+}
+
+// ----------------------------------------------------------------------------------- CSCRIPTMATHS
+
+static inline bool intResult(CScriptValue &result, int value)
+{
+    result.type = CScriptValue::INT;
+    result.intData = value;
+    return true;
+}
+
+static inline bool doubleResult(CScriptValue &result, double value)
+{
+    result.type = CScriptValue::DOUBLE;
+    result.doubleData = value;
+    return true;
+}
+
+/* The kernel for operands of types A and B. A and B are constants, so each instance only keeps
+ * the branches for its own pair of types. This follows CScriptVar::mathsOp exactly, and returns
+ * false where that would make a new string, throw, or look at objects. */
+template<int A, int B>
+bool CScriptMaths::kernel(const Operand &a, const Operand &b, int op, CScriptValue &result)
+{
+    if(A == OTHER || B == OTHER)
+        return false;
+    if(op == LEX_TYPEEQUAL || op == LEX_NTYPEEQUAL)
+    {
+        bool eql = A == B;
+        if(eql && A == INT) eql = a.intValue == b.intValue;
+        if(eql && A == DOUBLE) eql = a.doubleValue == b.doubleValue;
+        if(eql && A == STRING) eql = *a.stringValue == *b.stringValue;
+        return intResult(result, op == LEX_TYPEEQUAL ? eql : !eql);
+    }
+    // shifts always work on ints, whatever they're given (a string's int is 0)
+    switch(op)
+    {
+    case LEX_LSHIFT: return intResult(result, a.intValue << b.intValue);
+    case LEX_RSHIFT: return intResult(result, a.intValue >> b.intValue);
+    case LEX_RSHIFTUNSIGNED: return intResult(result, (int)(((unsigned int)a.intValue) >> b.intValue));
+    }
+    if(A == STRING || B == STRING)
+    {
+        // a string and a number are compared as strings, and '+' makes a new string
+        if(A != STRING || B != STRING)
+            return false;
+        const std::string &da = *a.stringValue;
+        const std::string &db = *b.stringValue;
+        switch(op)
+        {
+        case LEX_EQUAL: return intResult(result, da == db);
+        case LEX_NEQUAL: return intResult(result, da != db);
+        case '<': return intResult(result, da < db);
+        case LEX_LEQUAL: return intResult(result, da <= db);
+        case '>': return intResult(result, da > db);
+        case LEX_GEQUAL: return intResult(result, da >= db);
+        default: return false;
+        }
+    }
+    if(A == UNDEFINED && B == UNDEFINED)
+    {
+        if(op == LEX_EQUAL) return intResult(result, true);
+        if(op == LEX_NEQUAL) return intResult(result, false);
+        result.type = CScriptValue::UNDEFINED;
+        return true;
+    }
+    if(A != DOUBLE && B != DOUBLE)
+    {
+        // use ints (undefined and null are 0)
+        int da = a.intValue;
+        int db = b.intValue;
+        switch(op)
+        {
+        case '+': return intResult(result, da + db);
+        case '-': return intResult(result, da - db);
+        case '*': return intResult(result, da*db);
+        case '/': return intResult(result, da / db);
+        case '&': return intResult(result, da&db);
+        case '|': return intResult(result, da | db);
+        case '^': return intResult(result, da^db);
+        case '%': return intResult(result, da%db);
+        case LEX_EQUAL: return intResult(result, da == db);
+        case LEX_NEQUAL: return intResult(result, da != db);
+        case '<': return intResult(result, da < db);
+        case LEX_LEQUAL: return intResult(result, da <= db);
+        case '>': return intResult(result, da > db);
+        case LEX_GEQUAL: return intResult(result, da >= db);
+        default: return false;
+        }
+    }
+    else
+    {
+        // use doubles
+        double da = a.doubleValue;
+        double db = b.doubleValue;
+        switch(op)
+        {
+        case '+': return doubleResult(result, da + db);
+        case '-': return doubleResult(result, da - db);
+        case '*': return doubleResult(result, da*db);
+        case '/': return doubleResult(result, da / db);
+        case LEX_EQUAL: return intResult(result, da == db);
+        case LEX_NEQUAL: return intResult(result, da != db);
+        case '<': return intResult(result, da < db);
+        case LEX_LEQUAL: return intResult(result, da <= db);
+        case '>': return intResult(result, da > db);
+        case LEX_GEQUAL: return intResult(result, da >= db);
+        default: return false;
+        }
+    }
+}
+
+#define TINYJS_MATHS_KERNELS(A) \
+    { &kernel<A, INT>, &kernel<A, DOUBLE>, &kernel<A, UNDEFINED>, &kernel<A, NULL_VALUE>, &kernel<A, STRING>, &kernel<A, OTHER> }
+const CScriptMaths::Kernel CScriptMaths::kernels[TYPE_COUNT][TYPE_COUNT] =
+{
+    TINYJS_MATHS_KERNELS(INT),
+    TINYJS_MATHS_KERNELS(DOUBLE),
+    TINYJS_MATHS_KERNELS(UNDEFINED),
+    TINYJS_MATHS_KERNELS(NULL_VALUE),
+    TINYJS_MATHS_KERNELS(STRING),
+    TINYJS_MATHS_KERNELS(OTHER),
+};
+#undef TINYJS_MATHS_KERNELS
+
+void CScriptMaths::getOperand(CScriptVar *var, Operand &operand)
+{
+    operand.intValue = 0;
+    operand.doubleValue = 0;
+    operand.stringValue = 0;
+    switch(var->flags & SCRIPTVAR_VARTYPEMASK)
+    {
+    case SCRIPTVAR_INTEGER:
+        operand.type = INT;
+        operand.intValue = var->intData;
+        operand.doubleValue = var->intData;
+        break;
+    case SCRIPTVAR_DOUBLE:
+        operand.type = DOUBLE;
+        operand.intValue = (int)var->doubleData;
+        operand.doubleValue = var->doubleData;
+        break;
+    case SCRIPTVAR_UNDEFINED: operand.type = UNDEFINED; break;
+    case SCRIPTVAR_NULL: operand.type = NULL_VALUE; break;
+    case SCRIPTVAR_STRING:
+        operand.type = STRING;
+        operand.stringValue = &var->getString();
+        break;
+    default: operand.type = OTHER;
+    }
+}
+
+void CScriptMaths::getOperand(const CScriptValue &value, Operand &operand)
+{
+    switch(value.type)
+    {
+    case CScriptValue::INT:
+        operand.type = INT;
+        operand.intValue = value.intData;
+        operand.doubleValue = value.intData;
+        break;
+    case CScriptValue::DOUBLE:
+        operand.type = DOUBLE;
+        operand.intValue = (int)value.doubleData;
+        operand.doubleValue = value.doubleData;
+        break;
+    case CScriptValue::UNDEFINED:
+    case CScriptValue::NULL_VALUE:
+        operand.type = value.type == CScriptValue::NULL_VALUE ? NULL_VALUE : UNDEFINED;
+        operand.intValue = 0;
+        operand.doubleValue = 0;
+        break;
+    default:
+        getOperand(value.link->var, operand);
+        return;
+    }
+    operand.stringValue = 0;
+}
+
+bool CScriptMaths::evaluate(CScriptVar *a, CScriptVar *b, int op, CScriptValue &result)
+{
+    Operand da, db;
+    getOperand(a, da);
+    getOperand(b, db);
+    return kernels[da.type][db.type](da, db, op, result);
+}
+
+bool CScriptMaths::evaluate(const CScriptValue &a, const CScriptValue &b, int op, CScriptValue &result)
+{
+    Operand da, db;
+    getOperand(a, da);
+    getOperand(b, db);
+    return kernels[da.type][db.type](da, db, op, result);
+}
+
+CScriptVar *CScriptMaths::newVar(const CScriptValue &value)
+{
+    switch(value.type)
+    {
+    case CScriptValue::INT: return CScriptConstants::newInt(value.intData);
+    case CScriptValue::DOUBLE: return new CScriptVar(value.doubleData);
+    case CScriptValue::NULL_VALUE: return CScriptConstants::getNull();
+    default: return CScriptConstants::getUndefined();
+    }
+}
+
+bool CScriptMaths::isWritable(CScriptVar *var)
+{
+    return var->isUnshared() && !var->isConstant() && var->isBasic() && (var->isNumeric() || var->isUndefined());
+}
+
+bool CScriptMaths::assignInPlace(CScriptVar *var, const CScriptValue &value)
+{
+    if((value.type != CScriptValue::INT && value.type != CScriptValue::DOUBLE) || !isWritable(var))
+        return false;
+    if(value.type == CScriptValue::INT)
+        var->setInt(value.intData);
+    else
+        var->setDouble(value.doubleData);
+    return true;
+}
+
+void CScriptMaths::apply(CScriptVarLink *&a, CScriptVar *b, int op)
+{
+    CScriptValue value;
+    CScriptVar *res;
+    if(evaluate(a->var, b, op, value))
+    {
+        // a temporary's variable can only be seen through it, so it can take the result itself
+        if(!a->owned && assignInPlace(a->var, value))
+            return;
+        res = newVar(value);
+    }
+    else
+        res = a->var->mathsOp(b, op);
+    CREATE_LINK(a, res);
+}
+
+void CScriptMaths::assign(CScriptVarLink *lhs, CScriptVar *b, int op)
+{
+    CScriptValue value;
+    if(evaluate(lhs->var, b, op, value))
+    {
+        if(!assignInPlace(lhs->var, value))
+            lhs->replaceWith(newVar(value));
+    }
+    else
+        lhs->replaceWith(lhs->var->mathsOp(b, op));
+}
+
+CScriptVarLink *CScriptMaths::postfix(CScriptVarLink *lhs, int op)
+{
+    CScriptVar *var = lhs->var;
+    Operand a, one;
+    getOperand(var, a);
+    one.type = INT;
+    one.intValue = 1;
+    one.doubleValue = 1;
+    one.stringValue = 0;
+    CScriptValue value;
+    if((a.type == INT || a.type == DOUBLE) && isWritable(var) && kernels[a.type][INT](a, one, op, value))
+    {
+        // the variable is about to change, so the old value needs one of its own
+        CScriptVarLink *oldValue = new CScriptVarLink(a.type == INT ? CScriptConstants::newInt(a.intValue) : new CScriptVar(a.doubleValue));
+        assignInPlace(var, value);
+        return oldValue;
+    }
+    CScriptVarLink *oldValue = new CScriptVarLink(var);
+    assign(lhs, CScriptConstants::newInt(1), op);
+    return oldValue;
+}
+
+
+// ----------------------------------------------------------------------------------- CSCRIPTCYCLECOLLECTOR
+
+thread_local CScriptCycleCollector *CScriptCycleCollector::current = 0;
+
+CScriptCycleCollector::CScriptCycleCollector()
+{
+    threshold = DEFAULT_THRESHOLD;
+    budget = 0;
+    collections = 0;
+    freedVars = 0;
+    freedBytes = 0;
+    abandoned = 0;
+    lastPause = 0;
+    maxPause = 0;
+    totalPause = 0;
+}
+
+CScriptCycleCollector::~CScriptCycleCollector()
+{
+    // anything still here is being kept by someone, who can unref it into another collector
+    for(CScriptVar *var : candidates)
+    {
+        var->candidateIndex = -1;
+        var->collector = 0;
+    }
+    if(current == this)
+        current = 0;
+}
+
+void CScriptCycleCollector::add(CScriptVar *var)
+{
+    var->cycleColor = PURPLE;
+    if(var->candidateIndex < 0)
+    {
+        var->candidateIndex = (int)candidates.size();
+        var->collector = this;
+        candidates.push_back(var);
+    }
+}
+
+void CScriptCycleCollector::addCandidate(CScriptVar *var)
+{
+    CScriptCycleCollector *collector = var->collector ? var->collector : current;
+    if(collector)
+        collector->add(var);
+}
+
+void CScriptCycleCollector::removeCandidate(CScriptVar *var)
+{
+    std::vector<CScriptVar*> &candidates = var->collector->candidates;
+    CScriptVar *last = candidates.back();
+    candidates[var->candidateIndex] = last;
+    last->candidateIndex = var->candidateIndex;
+    candidates.pop_back();
+    var->candidateIndex = -1;
+    var->collector = 0;
+}
+
+size_t CScriptCycleCollector::collect(double maxMilliseconds)
+{
+    using namespace std::chrono;
+    steady_clock::time_point start = steady_clock::now();
+    // scanning what's been marked takes about as long again, so marking only gets half the time
+    bool limited = maxMilliseconds > 0;
+    deadline = start + duration_cast<steady_clock::duration>(duration<double, std::milli>(maxMilliseconds / 2));
+    std::vector<CScriptVar*> roots;
+    std::vector<CScriptVar*> garbage;
+    size_t bytes = 0;
+    bool first = true;
+    bool outOfTime = false;
+    sinceCheck = 0;
+    while(!candidates.empty() && !outOfTime)
+    {
+        // take the candidates a batch at a time, so that we can stop in between if we're out of time
+        roots.clear();
+        while(!candidates.empty() && roots.size() < BATCH_SIZE)
+        {
+            CScriptVar *var = candidates.back();
+            removeCandidate(var);
+            // if it isn't purple, it's been looked at (and found alive) since it was added
+            if(var->cycleColor == PURPLE)
+                roots.push_back(var);
+        }
+        size_t marked = 0;
+        for(; marked < roots.size(); marked++)
+            if(roots[marked]->cycleColor == PURPLE)
+            {
+                // the first candidate is always finished, so that every collection gets somewhere
+                if(!markGray(roots[marked], !limited || first))
+                {
+                    outOfTime = true;
+                    break;
+                }
+                first = false;
+            }
+        if(outOfTime)
+        {
+            // give back the one markGray gave up on, and the ones it didn't get to
+            for(size_t i = marked; i < roots.size(); i++)
+                if(roots[i]->cycleColor == PURPLE)
+                    add(roots[i]);
+            abandoned++;
+            roots.resize(marked);
+        }
+        for(CScriptVar *var : roots)
+            scan(var);
+        size_t firstGarbage = garbage.size();
+        for(CScriptVar *var : roots)
+            collectWhite(var, garbage);
+        for(size_t i = firstGarbage; i < garbage.size(); i++)
+        {
+            // markGray already took away the references that these links hold
+            CScriptVar *var = garbage[i];
+            for(CScriptVarLink *link = var->firstChild; link; link = link->nextSibling)
+            {
+                link->var = 0;
+                bytes += sizeof(CScriptVarLink);
+            }
+            bytes += sizeof(CScriptVar) + var->data.capacity();
+        }
+        if(limited && steady_clock::now() >= deadline)
+            break;
+    }
+    for(CScriptVar *var : garbage)
+        delete var;
+
+    collections++;
+    freedVars += garbage.size();
+    freedBytes += bytes;
+    lastPause = duration<double, std::milli>(steady_clock::now() - start).count();
+    maxPause = std::max(maxPause, lastPause);
+    totalPause += lastPause;
+    return garbage.size();
+}
+
+bool CScriptCycleCollector::markGray(CScriptVar *var, bool finish)
+{
+    std::vector<CScriptVar*> stack(1, var);
+    recolored.clear();
+    expanded.clear();
+    if(!finish)
+        recolored.push_back(std::make_pair(var, var->cycleColor));
+    var->cycleColor = GRAY;
+    while(!stack.empty())
+    {
+        if(!finish && ++sinceCheck >= CHECK_INTERVAL)
+        {
+            sinceCheck = 0;
+            if(std::chrono::steady_clock::now() >= deadline)
+            {
+                // out of time - put back the references we've taken and the colors we've changed
+                for(CScriptVar *v : expanded)
+                    for(CScriptVarLink *link = v->firstChild; link; link = link->nextSibling)
+                        if(!link->var->isConstant())
+                            link->var->refs++;
+                for(auto& v : recolored)
+                    v.first->cycleColor = v.second;
+                return false;
+            }
+        }
+        CScriptVar *v = stack.back();
+        stack.pop_back();
+        if(!finish)
+            expanded.push_back(v);
+        for(CScriptVarLink *link = v->firstChild; link; link = link->nextSibling)
+        {
+            CScriptVar *child = link->var;
+            if(child->isConstant())
+                continue; // their references aren't counted, and they can't be in a cycle
+            child->refs--;
+            if(child->cycleColor != GRAY)
+            {
+                if(!finish)
+                    recolored.push_back(std::make_pair(child, child->cycleColor));
+                child->cycleColor = GRAY;
+                stack.push_back(child);
+            }
+        }
+    }
+    return true;
+}
+
+void CScriptCycleCollector::scan(CScriptVar *var)
+{
+    std::vector<CScriptVar*> stack(1, var);
+    while(!stack.empty())
+    {
+        CScriptVar *v = stack.back();
+        stack.pop_back();
+        if(v->cycleColor != GRAY)
+            continue;
+        if(v->refs > 0)
+            scanBlack(v);
+        else
+        {
+            v->cycleColor = WHITE;
+            for(CScriptVarLink *link = v->firstChild; link; link = link->nextSibling)
+                if(link->var->cycleColor == GRAY)
+                    stack.push_back(link->var);
+        }
+    }
+}
+
+void CScriptCycleCollector::scanBlack(CScriptVar *var)
+{
+    std::vector<CScriptVar*> stack(1, var);
+    var->cycleColor = BLACK;
+    while(!stack.empty())
+    {
+        CScriptVar *v = stack.back();
+        stack.pop_back();
+        for(CScriptVarLink *link = v->firstChild; link; link = link->nextSibling)
+        {
+            CScriptVar *child = link->var;
+            if(child->isConstant())
+                continue;
+            child->refs++;
+            if(child->cycleColor != BLACK)
+            {
+                child->cycleColor = BLACK;
+                stack.push_back(child);
+            }
+        }
+    }
+}
+
+void CScriptCycleCollector::collectWhite(CScriptVar *var, std::vector<CScriptVar*> &garbage)
+{
+    if(var->cycleColor != WHITE)
+        return;
+    var->cycleColor = BLACK;
+    size_t next = garbage.size();
+    garbage.push_back(var);
+    for(; next < garbage.size(); next++)
+        for(CScriptVarLink *link = garbage[next]->firstChild; link; link = link->nextSibling)
+            if(link->var->cycleColor == WHITE)
+            {
+                link->var->cycleColor = BLACK;
+                garbage.push_back(link->var);
+            }
+}
 
 // ----------------------------------------------------------------------------------- CSCRIPT
 
 CTinyJS::CTinyJS(int executions_before_compile)
 {
+    cycleCollector.makeCurrent();
     executions_to_compile = executions_before_compile;
+    executionMode = TINYJS_EXECUTE_SOURCE;
+    optimizations = TINYJS_OPTIMIZE_ALL;
+    compilers = TINYJS_COMPILE_GCC;
+    compileThreads = 1;
+    compileBatchWindow = 0;
+    compiler = 0;
+    compileCacheSize = 0;
+    nativeFunction = 0;
+    frame = 0;
     l = 0;
     root = (new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_OBJECT))->ref();
     // Add built-in classes
@@ -1571,11 +2969,34 @@ CTinyJS::CTinyJS(int executions_before_compile)
 CTinyJS::~CTinyJS()
 {
     ASSERT(!l);
+    delete compiler; // before anything it's holding on to goes
     scopes.clear();
     stringClass->unref();
     arrayClass->unref();
     objectClass->unref();
     root->unref();
+    for(auto& compiled : machineCode)
+        delete compiled.second;
+    for(auto& compiled : bytecodes)
+        delete compiled.second;
+    for(auto& parsed : parsedFunctions)
+        delete parsed.second;
+    for(auto& lexed : lexedFunctions)
+        delete lexed.second;
+    for(CScriptVar *scope : freeScopes)
+    {
+#ifdef TINYJS_TRACING_GC
+        scope->unref();
+#endif
+        delete scope;
+    }
+    for(vector<CScriptVarLink*> *oldFrame : freeFrames)
+        delete oldFrame;
+#ifdef TINYJS_TRACING_GC
+    CScriptTracingCollector::collect();
+#else
+    cycleCollector.collect();
+#endif
 
 #if DEBUG_MEMORY
     show_allocated();
@@ -1587,11 +3008,59 @@ void CTinyJS::trace()
     root->trace();
 }
 
+void CTinyJS::setExecutionMode(int mode)
+{
+    executionMode = mode;
+}
+
+void CTinyJS::setOptimizations(int passes)
+{
+    optimizations = passes;
+}
+
+void CTinyJS::setCompilers(int compilers)
+{
+    this->compilers = compilers;
+}
+
+void CTinyJS::setCompileThreads(int threads)
+{
+    finishCompiles();
+    delete compiler;
+    compiler = 0;
+    compileThreads = threads;
+}
+
+void CTinyJS::setCompileBatching(int milliseconds)
+{
+    finishCompiles();
+    delete compiler;
+    compiler = 0;
+    compileBatchWindow = milliseconds;
+}
+
+void CTinyJS::setCompileCache(const string &directory, size_t maxBytes)
+{
+    compileCache = directory;
+    compileCacheSize = maxBytes;
+}
+
+void CTinyJS::finishCompiles()
+{
+    if(!compiler)
+        return;
+    compiler->wait();
+    installCompiled();
+}
+
 void CTinyJS::execute(const string &code)
 {
+    cycleCollector.makeCurrent(); // in case another engine has run on this thread since
     CScriptLex *oldLex = l;
     vector<CScriptVar*> oldScopes = scopes;
-    l = new CScriptLex(code);
+    vector<CScriptVarLink*> *oldFrame = frame;
+    CScriptLex *lex = new CScriptLex(code);
+    l = lex;
 #ifdef TINYJS_CALL_STACK
     call_stack.clear();
 #endif
@@ -1600,7 +3069,27 @@ void CTinyJS::execute(const string &code)
     try
     {
         bool execute = true;
-        while(l->tk) statement(execute);
+        if(executionMode == TINYJS_EXECUTE_SYNTAX_TREE)
+        {
+            // parse everything up front, then walk the tree
+            CScriptSyntaxTree tree(l);
+            tree.parse();
+            tree.optimize(optimizations);
+            vector<CScriptVarLink*> slots(tree.getSlotCount());
+            frame = &slots;
+            CLEAN(tree.evaluate(this, execute));
+            frame = oldFrame;
+        }
+        else if(executionMode == TINYJS_EXECUTE_BYTECODE)
+        {
+            CScriptSyntaxTree tree(l);
+            tree.parse();
+            tree.optimize(optimizations);
+            CScriptBytecode code(&tree);
+            code.execute(this, execute);
+        }
+        else
+            while(l->tk) statement(execute);
     }
     catch(CScriptException *e)
     {
@@ -1608,25 +3097,44 @@ void CTinyJS::execute(const string &code)
         msg << "Error " << e->text;
 #ifdef TINYJS_CALL_STACK
         for(int i = (int)call_stack.size() - 1; i >= 0; i--)
-            msg << "\n" << i << ": " << call_stack.at(i);
+            msg << "\n" << i << ": " << call_stack[i].getDescription();
+        call_stack.clear(); // they're in the message now, and their source is about to go
 #endif
-        msg << " at " << l->getPosition();
-        delete l;
+        // a tree or bytecode has been parsed to the end before it's run, so it says where it went wrong itself
+        msg << " at " << (e->source ? e->source->getPosition(e->position) : l->getPosition());
+        delete lex; // 'l' may be a loop's lexer that the error left us in
+        delete e;
         l = oldLex;
+        frame = oldFrame;
 
         throw new CScriptException(msg.str());
     }
     delete l;
     l = oldLex;
     scopes = oldScopes;
+    collectGarbage();
+}
+
+void CTinyJS::collectGarbage()
+{
+#ifdef TINYJS_TRACING_GC
+    if(CScriptTracingCollector::isSafe() && CScriptTracingCollector::isDue())
+        CScriptTracingCollector::collect();
+#else
+    // nothing can be holding on to variables without refs if we're not running anything
+    if(!l && cycleCollector.getCandidates() > cycleCollector.getThreshold())
+        cycleCollector.collect(cycleCollector.getBudget());
+#endif
 }
 
 CScriptVarLink CTinyJS::evaluateComplex(const string &code)
 {
+    cycleCollector.makeCurrent();
     CScriptLex *oldLex = l;
     vector<CScriptVar*> oldScopes = scopes;
 
-    l = new CScriptLex(code);
+    CScriptLex *lex = new CScriptLex(code);
+    l = lex;
 #ifdef TINYJS_CALL_STACK
     call_stack.clear();
 #endif
@@ -1649,10 +3157,11 @@ CScriptVarLink CTinyJS::evaluateComplex(const string &code)
         msg << "Error " << e->text;
 #ifdef TINYJS_CALL_STACK
         for(int i = (int)call_stack.size() - 1; i >= 0; i--)
-            msg << "\n" << i << ": " << call_stack.at(i);
+            msg << "\n" << i << ": " << call_stack[i].getDescription();
+        call_stack.clear(); // they're in the message now, and their source is about to go
 #endif
         msg << " at " << l->getPosition();
-        delete l;
+        delete lex;
         delete e;
         l = oldLex;
 
@@ -1661,6 +3170,7 @@ CScriptVarLink CTinyJS::evaluateComplex(const string &code)
     delete l;
     l = oldLex;
     scopes = oldScopes;
+    collectGarbage();
 
     if(v)
     {
@@ -1714,163 +3224,445 @@ void CTinyJS::addNative(const string &funcDesc, JSCallback ptr, void *userdata)
         l->match(LEX_ID);
     }
 
-    CScriptVar *funcVar = new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_FUNCTION | SCRIPTVAR_NATIVE);
-    funcVar->setCallback(ptr, userdata);
-    parseFunctionArguments(funcVar);
-    delete l;
-    l = oldLex;
+    CScriptVar *funcVar = new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_FUNCTION | SCRIPTVAR_NATIVE);
+    funcVar->setCallback(ptr, userdata);
+    parseFunctionArguments(funcVar);
+    delete l;
+    l = oldLex;
+
+    base->addChild(funcName, funcVar);
+}
+
+CScriptVarLink *CTinyJS::parseFunctionDefinition()
+{
+    // actually parse a function...
+    l->match(LEX_R_FUNCTION);
+    string funcName = TINYJS_TEMP_NAME;
+    /* we can have functions without names */
+    if(l->tk == LEX_ID)
+    {
+        funcName = l->tkStr;
+        l->match(LEX_ID);
+    }
+    CScriptVarLink *funcVar = new CScriptVarLink(new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_FUNCTION), funcName);
+    parseFunctionArguments(funcVar->var);
+    int funcBegin = l->tokenStart;
+    bool noexecute = false;
+    block(noexecute);
+    funcVar->var->data = l->getSubString(funcBegin);
+    return funcVar;
+}
+
+/** Handle a function call (assumes we've parsed the function name and we're
+ * on the start bracket). 'parent' is the object that contains this method,
+ * if there was one (otherwise it's just a normnal function).
+ */
+CScriptVarLink *CTinyJS::functionCall(bool &execute, CScriptVarLink *function, CScriptVar *parent)
+{
+    if(execute)
+    {
+        prepareCall(function);
+        l->match('(');
+        // create a new symbol table entry for execution of this function
+        CScriptVar *functionRoot = newScope(parent);
+        // grab in all parameters	  
+        CScriptVarLink* v = function->var->firstChild;
+        while(v)
+        {
+            CScriptVarLink *value = base(execute);
+            if(execute)
+                functionRoot->addChild(v->nameAtom, getArgument(value));
+            CLEAN(value);
+            if(l->tk != ')') l->match(',');
+            v = v->nextSibling;
+        }
+        l->match(')');
+        return executeFunction(execute, function, functionRoot);
+    }
+    else
+    {
+        // function, but not executing - just skip the args and be done
+        if(!l->skipBrackets())
+        {
+            l->match('(');
+            while(l->tk != ')')
+            {
+                CScriptVarLink *value = base(execute);
+                CLEAN(value);
+                if(l->tk != ')') l->match(',');
+            }
+            l->match(')');
+        }
+        if(l->tk == '{')
+        {
+            // TODO: why is this here?
+            block(execute);
+        }
+        /* function will be a blank scriptvarlink if we're not executing,
+         * so just return it rather than an alloc/free */
+        return function;
+    }
+}
+
+CScriptVarLink *CTinyJS::callFunction(bool &execute, CScriptVarLink *function, CScriptVar *parent, const vector<CScriptVarLink*> &arguments,
+                                      CScriptTokenList *source, int position)
+{
+    prepareCall(function);
+    CScriptVar *functionRoot = newScope(parent);
+    size_t argIdx = 0;
+    for(CScriptVarLink *v = function->var->firstChild; v; v = v->nextSibling, argIdx++)
+    {
+        if(argIdx >= arguments.size())
+            functionRoot->addChild(v->nameAtom); // not passed, so undefined
+        else
+            functionRoot->addChild(v->nameAtom, getArgument(arguments[argIdx]));
+    }
+    try
+    {
+        return executeFunction(execute, function, functionRoot, source, position);
+    }
+    catch(CScriptException *e)
+    {
+        // to the code making it, it's the call that went wrong
+        if(source)
+        {
+            e->source = source;
+            e->position = position;
+        }
+        throw e;
+    }
+}
+
+CScriptVar *CTinyJS::newScope(CScriptVar *parent)
+{
+    CScriptVar *scope;
+    if(freeScopes.empty())
+    {
+        scope = new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_FUNCTION);
+#ifdef TINYJS_TRACING_GC
+        scope->ref(); // nothing links to a scope, so this keeps it for as long as we do
+#endif
+    }
+    else
+    {
+        scope = freeScopes.back();
+        freeScopes.pop_back();
+    }
+    // the return value always comes first, so that finding it is quick
+    scope->addChild(TINYJS_ATOM_RETURN_VAR, CScriptConstants::getUndefined());
+    if(parent)
+        scope->addChild(TINYJS_ATOM_THIS, parent);
+    return scope;
+}
+
+void CTinyJS::freeScope(CScriptVar *scope)
+{
+    // the children go, but the scope keeps the room it had for them
+    scope->removeAllChildren();
+    freeScopes.push_back(scope);
+}
+
+CScriptVar *CTinyJS::getArgument(CScriptVarLink *value)
+{
+    CScriptVar *var = value->var;
+    // objects are passed by reference, and constants are copied before anything changes them
+    if(!var->isBasic() || var->isConstant())
+        return var;
+    // a temporary that's about to be freed needn't be copied either
+    if(!value->owned && var->isUnshared())
+        return var;
+    return var->deepCopy(); // pass by value
+}
+
+vector<CScriptVarLink*> *CTinyJS::newFrame(int slots)
+{
+    vector<CScriptVarLink*> *newFrame;
+    if(freeFrames.empty())
+        newFrame = new vector<CScriptVarLink*>();
+    else
+    {
+        newFrame = freeFrames.back();
+        freeFrames.pop_back();
+    }
+    newFrame->assign(slots, 0);
+    return newFrame;
+}
+
+void CTinyJS::freeFrame(vector<CScriptVarLink*> *oldFrame)
+{
+    freeFrames.push_back(oldFrame);
+}
 
-    base->addChild(funcName, funcVar);
+void CTinyJS::prepareCall(CScriptVarLink *function)
+{
+    if(!function->var->isFunction())
+    {
+        string errorMsg = "Expecting '";
+        errorMsg = errorMsg + function->getName() + "' to be a function";
+        throw new CScriptException(errorMsg.c_str());
+    }
+    // switch functions over to what the background compiler has built. Between calls is a safe
+    // point for that, as a call that's already running carries on with the code it started with.
+    if(compiler && compiler->hasFinished())
+        installCompiled();
+    int executions = function->var->getExecutions();
+    if(executions_to_compile && !function->var->isNative() && executions >= executions_to_compile)
+    {
+        // we've executed this function enough to justify compiling it
+        if(!(function->var->flags & (SCRIPTVAR_COMPILING | SCRIPTVAR_COMPILE_FAILED)))
+            compile(function);
+        // ...and if that's been tried, it's only looked at again each time its executions double
+        else if(!(executions & (executions - 1)))
+            recompile(function);
+    }
+    else if(executions_to_compile && (compilers & TINYJS_COMPILE_GCC) &&
+        function->var->jsCallback == &CScriptMachineCode::call && executions >= executions_to_compile * 10 &&
+        (executions == executions_to_compile * 10 || !(executions & (executions - 1))))
+    {
+        // and this one enough to be worth gcc as well
+        if(executions == executions_to_compile * 10 && !(function->var->flags & SCRIPTVAR_COMPILING))
+            compile(function);
+        else
+            recompile(function);
+    }
 }
 
-CScriptVarLink *CTinyJS::parseFunctionDefinition()
+void CTinyJS::recompile(CScriptVarLink *function)
 {
-    // actually parse a function...
-    l->match(LEX_R_FUNCTION);
-    string funcName = TINYJS_TEMP_NAME;
-    /* we can have functions without names */
-    if(l->tk == LEX_ID)
+    if(function->var->flags & SCRIPTVAR_COMPILING)
     {
-        funcName = l->tkStr;
-        l->match(LEX_ID);
+        // it's waiting for the background compiler, so tell that it's hotter
+        // (so it can get back in the queue, if hotter functions pushed it out)
+        if(!compiler || !compiler->raise(function->var, function->var->getExecutions()))
+            compile(function);
+    }
+    else if(isCompileRetryDue(function->var))
+    {
+        // it failed, but it's run enough since to be worth another go
+        compile(function);
     }
-    CScriptVarLink *funcVar = new CScriptVarLink(new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_FUNCTION), funcName);
-    parseFunctionArguments(funcVar->var);
-    int funcBegin = l->tokenStart;
-    bool noexecute = false;
-    block(noexecute);
-    funcVar->var->data = l->getSubString(funcBegin);
-    return funcVar;
 }
 
-/** Handle a function call (assumes we've parsed the function name and we're
- * on the start bracket). 'parent' is the object that contains this method,
- * if there was one (otherwise it's just a normnal function).
- */
-CScriptVarLink *CTinyJS::functionCall(bool &execute, CScriptVarLink *function, CScriptVar *parent)
+CScriptVarLink *CTinyJS::executeFunction(bool &execute, CScriptVarLink *function, CScriptVar *functionRoot,
+                                         CScriptTokenList *source, int position)
 {
-    if(execute)
+    // setup a return variable
+    CScriptVarLink *returnVar = NULL;
+    // execute function!
+    // add the function's execute space to the symbol table so we can recurse
+    CScriptVarLink *returnVarLink = functionRoot->findChild(TINYJS_ATOM_RETURN_VAR);
+    scopes.push_back(functionRoot);
+#ifdef TINYJS_CALL_STACK
+    CScriptCallFrame caller = { function->nameAtom, source ? source : l->getSource(), source ? position : l->tokenLastEnd };
+    call_stack.push_back(caller);
+#endif
+
+    if(function->var->isNative())
     {
-        if(!function->var->isFunction())
-        {
-            string errorMsg = "Expecting '";
-            errorMsg = errorMsg + function->name + "' to be a function";
-            throw new CScriptException(errorMsg.c_str());
-        }
-        if(executions_to_compile && !function->var->isNative() &&
-            function->var->getExecutions() >= executions_to_compile)
+        ASSERT(function->var->jsCallback);
+        CScriptVar *oldNative = nativeFunction;
+        nativeFunction = function->var;
+#ifdef TINYJS_TRACING_GC
+        // natives can hold variables without links, so nothing can be collected until they're done
+        CScriptTracingCollector::enterNative();
+#endif
+        try
         {
-            // we've executed this function enough to justify compiling it
-            compile(function);
+            function->var->jsCallback(functionRoot, function->var->jsCallbackUserData);
         }
-        l->match('(');
-        // create a new symbol table entry for execution of this function
-        CScriptVar *functionRoot = new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_FUNCTION);
-        if(parent)
-            functionRoot->addChildNoDup("this", parent);
-        // grab in all parameters	  
-        CScriptVarLink* v = function->var->firstChild;
-        while(v)
+        catch(CScriptException *e)
         {
-            CScriptVarLink *value = base(execute);
-            if(execute)
-            {
-                if(value->var->isBasic())
-                {
-                    // pass by value
-                    functionRoot->addChild(v->name, value->var->deepCopy());
-                }
-                else
-                {
-                    // pass by reference
-                    functionRoot->addChild(v->name, value->var);
-                }
-            }
-            CLEAN(value);
-            if(l->tk != ')') l->match(',');
-            v = v->nextSibling;
+#ifdef TINYJS_TRACING_GC
+            CScriptTracingCollector::leaveNative();
+#endif
+            nativeFunction = oldNative;
+            throw e;
         }
-        l->match(')');
-        // setup a return variable
-        CScriptVarLink *returnVar = NULL;
-        // execute function!
-        // add the function's execute space to the symbol table so we can recurse
-        CScriptVarLink *returnVarLink = functionRoot->addChild(TINYJS_RETURN_VAR);
-        scopes.push_back(functionRoot);
+#ifdef TINYJS_TRACING_GC
+        CScriptTracingCollector::leaveNative();
+#endif
+        nativeFunction = oldNative;
+        function->var->addExecution(); // might as well keep track, might be useful
+    }
+    else
+    {
+        interpretBody(execute, function->var);
+        // on a successful execution of the body, add one to the execution count
+        function->var->addExecution();
+    }
+    // while it warms up, note what its variables hold for gcc to specialize its code to
+    if(executions_to_compile && (compilers & TINYJS_COMPILE_GCC) && !function->var->nativeHandle &&
+        (!function->var->isNative() || function->var->jsCallback == &CScriptMachineCode::call))
+    {
+        int executions = function->var->getExecutions();
+        if(executions >= executions_to_compile / 2 && executions <= executions_to_compile * 10)
+            recordTypes(function->var, functionRoot);
+    }
 #ifdef TINYJS_CALL_STACK
-        call_stack.push_back(function->name + " from " + l->getPosition());
+    if(!call_stack.empty()) call_stack.pop_back();
 #endif
+    scopes.pop_back();
+    /* get the real return var before we empty our function's scope */
+    returnVar = new CScriptVarLink(returnVarLink->var);
+    freeScope(functionRoot);
+    if(returnVar)
+        return returnVar;
+    else
+        return new CScriptVarLink(new CScriptVar());
+}
 
-        if(function->var->isNative())
+void CTinyJS::interpretBody(bool &execute, CScriptVar *function)
+{
+    if(executionMode == TINYJS_EXECUTE_SYNTAX_TREE)
+    {
+        // walk the (cached) syntax tree of the body rather than lexing it again
+        CScriptSyntaxTree *body = getParsedBody(function);
+        vector<CScriptVarLink*> *oldFrame = frame;
+        frame = newFrame(body->getSlotCount());
+        try
         {
-            ASSERT(function->var->jsCallback);
-            function->var->jsCallback(functionRoot, function->var->jsCallbackUserData);
-            function->var->addExecution(); // might as well keep track, might be useful
+            CLEAN(body->evaluate(this, execute));
         }
-        else
+        catch(CScriptException *e)
         {
-            /* we just want to execute the block, but something could
-             * have messed up and left us with the wrong ScriptLex, so
-             * we want to be careful here... */
-            CScriptException *exception = 0;
-            CScriptLex *oldLex = l;
-            CScriptLex *newLex = new CScriptLex(function->var->getString());
-            l = newLex;
-            try
-            {
-                block(execute);
-                // because return will probably have called this, and set execute to false
-                execute = true;
-                // on a successful execution of the body, add one to the execution count
-                function->var->addExecution();
-            }
-            catch(CScriptException *e)
-            {
-                exception = e;
-            }
-            delete newLex;
-            l = oldLex;
-
-            if(exception)
-                throw exception;
+            freeFrame(frame);
+            frame = oldFrame;
+            throw e;
         }
-#ifdef TINYJS_CALL_STACK
-        if(!call_stack.empty()) call_stack.pop_back();
-#endif
-        scopes.pop_back();
-        /* get the real return var before we remove it from our function */
-        returnVar = new CScriptVarLink(returnVarLink->var);
-        functionRoot->removeLink(returnVarLink);
-        delete functionRoot;
-        if(returnVar)
-            return returnVar;
-        else
-            return new CScriptVarLink(new CScriptVar());
+        freeFrame(frame);
+        frame = oldFrame;
+        execute = true;
+    }
+    else if(executionMode == TINYJS_EXECUTE_BYTECODE)
+    {
+        getBytecode(function)->execute(this, execute);
+        execute = true;
     }
     else
     {
-        // function, but not executing - just parse args and be done
-        l->match('(');
-        while(l->tk != ')')
+        /* we just want to execute the block, but something could
+         * have messed up and left us with the wrong ScriptLex, so
+         * we want to be careful here... */
+        CScriptException *exception = 0;
+        CScriptLex *oldLex = l;
+        CScriptLex *newLex = getLexedBody(function);
+        l = newLex;
+        try
         {
-            CScriptVarLink *value = base(execute);
-            CLEAN(value);
-            if(l->tk != ')') l->match(',');
+            block(execute);
+            // because return will probably have called this, and set execute to false
+            execute = true;
         }
-        l->match(')');
-        if(l->tk == '{')
+        catch(CScriptException *e)
         {
-            // TODO: why is this here?
-            block(execute);
+            exception = e;
         }
-        /* function will be a blank scriptvarlink if we're not executing,
-         * so just return it rather than an alloc/free */
-        return function;
+        delete newLex;
+        l = oldLex;
+
+        if(exception)
+            throw exception;
+    }
+}
+
+string CTinyJS::getFeedbackKey(CScriptVar *function)
+{
+    string key = "(";
+    for(CScriptVarLink *link = function->firstChild; link; link = link->nextSibling)
+        key += link->getName() + (link->nextSibling ? "," : "");
+    return key + ") " + function->getString();
+}
+
+void CTinyJS::recordTypes(CScriptVar *function, CScriptVar *functionRoot)
+{
+    CScriptTypeFeedback &feedback = typeFeedback[getFeedbackKey(function)];
+    for(CScriptVarLink *link = functionRoot->firstChild; link; link = link->nextSibling)
+    {
+        int type = link->var->flags & SCRIPTVAR_VARTYPEMASK;
+        feedback.types[link->getName()] |= type ? type : CScriptTypeFeedback::UNDEFINED;
+    }
+}
+
+void CTinyJS::deoptimize(CScriptVar *root)
+{
+    CScriptVar *function = nativeFunction;
+    ASSERT(function && !scopes.empty() && scopes.back() == root);
+    CScriptTypeFeedback &feedback = typeFeedback[getFeedbackKey(function)];
+    if(++feedback.deoptimizations >= TINYJS_DEOPTIMIZE_LIMIT && feedback.deoptimizations * 8 >= function->getExecutions() &&
+        !feedback.generic)
+    {
+        // its guards fail too often to be worth it, so it's interpreted until gcc has built it again without
+        // them. The library stays loaded (we're running in it) until installCompiled replaces it.
+        feedback.generic = true;
+        function->flags &= ~SCRIPTVAR_NATIVE;
+        function->setCallback(0, 0);
+    }
+    bool execute = true;
+    interpretBody(execute, function);
+}
+
+CScriptLex *CTinyJS::getLexedBody(CScriptVar *function)
+{
+    const string &body = function->getString();
+    auto lexed = lexedFunctions.find(body);
+    if(lexed == lexedFunctions.end())
+        lexed = lexedFunctions.insert(make_pair(body, new CScriptLex(body))).first;
+    // a sub-lexer of the whole body, so that recursive calls each have their own position
+    return new CScriptLex(lexed->second, 0, (int)body.length());
+}
+
+CScriptSyntaxTree *CTinyJS::getParsedBody(CScriptVar *function)
+{
+    if(function->parsedBody)
+        return function->parsedBody;
+    // functions created from the same source (eg. in a loop) share one tree
+    const string &body = function->getString();
+    auto parsed = parsedFunctions.find(body);
+    if(parsed == parsedFunctions.end())
+    {
+        CScriptSyntaxTree *tree = new CScriptSyntaxTree(body);
+        try
+        {
+            tree->parse();
+            tree->optimize(optimizations);
+        }
+        catch(CScriptException *e)
+        {
+            delete tree;
+            throw e;
+        }
+        parsed = parsedFunctions.insert(make_pair(body, tree)).first;
     }
+    function->parsedBody = parsed->second;
+    return function->parsedBody;
+}
+
+CScriptBytecode *CTinyJS::getBytecode(CScriptVar *function)
+{
+    if(function->bytecode)
+        return function->bytecode;
+    CScriptSyntaxTree *body = getParsedBody(function);
+    auto compiled = bytecodes.find(body);
+    if(compiled == bytecodes.end())
+        compiled = bytecodes.insert(make_pair(body, new CScriptBytecode(body))).first;
+    function->bytecode = compiled->second;
+    return function->bytecode;
+}
+
+bool CTinyJS::disassemble(const string &path, ostream &out)
+{
+    CScriptVarLink *function = root->findChild(path);
+    if(!function || !function->var->isFunction() || function->var->isNative())
+        return false;
+    getBytecode(function->var)->disassemble(out);
+    return true;
 }
 
 CScriptVarLink *CTinyJS::factor(bool &execute)
 {
+    // brackets that aren't being executed can't make a value that matters
+    if(!execute && l->skipBrackets())
+        return new CScriptVarLink(CScriptConstants::getUndefined());
     if(l->tk == '(')
     {
         l->match('(');
@@ -1881,26 +3673,26 @@ CScriptVarLink *CTinyJS::factor(bool &execute)
     if(l->tk == LEX_R_TRUE)
     {
         l->match(LEX_R_TRUE);
-        return new CScriptVarLink(new CScriptVar(1));
+        return new CScriptVarLink(CScriptConstants::newInt(1));
     }
     if(l->tk == LEX_R_FALSE)
     {
         l->match(LEX_R_FALSE);
-        return new CScriptVarLink(new CScriptVar(0));
+        return new CScriptVarLink(CScriptConstants::newInt(0));
     }
     if(l->tk == LEX_R_NULL)
     {
         l->match(LEX_R_NULL);
-        return new CScriptVarLink(new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_NULL));
+        return new CScriptVarLink(CScriptConstants::getNull());
     }
     if(l->tk == LEX_R_UNDEFINED)
     {
         l->match(LEX_R_UNDEFINED);
-        return new CScriptVarLink(new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_UNDEFINED));
+        return new CScriptVarLink(CScriptConstants::getUndefined());
     }
     if(l->tk == LEX_ID || l->tk == LEX_R_RESERVED)
     {
-        CScriptVarLink *a = execute ? findInScopes(l->tkStr) : new CScriptVarLink(new CScriptVar());
+        CScriptVarLink *a = execute ? findInScopes(l->tkAtom) : new CScriptVarLink(CScriptConstants::getUndefined());
         //printf("0x%08X for %s at %s\n", (unsigned int)a, l->tkStr.c_str(), l->getPosition().c_str());
         /* The parent if we're executing a method call */
         CScriptVar *parent = 0;
@@ -1909,7 +3701,7 @@ CScriptVarLink *CTinyJS::factor(bool &execute)
         {
             /* Variable doesn't exist! JavaScript says we should create it
              * (we won't add it here. This is done in the assignment operator) */
-            a = new CScriptVarLink(new CScriptVar(), l->tkStr);
+            a = new CScriptVarLink(new CScriptVar(), l->tkAtom);
         }
 		bool reserved = false;
 		int tkst = l->tokenStart;
@@ -1940,12 +3732,13 @@ CScriptVarLink *CTinyJS::factor(bool &execute)
                 l->match('.');
                 if(execute)
                 {
-                    const string &name = l->tkStr;
-                    CScriptVarLink *child = a->var->findChild(name);
+                    int name = l->tkAtom;
+                    CScriptPropertyCache *cache = l->getPropertyCache();
+                    CScriptVarLink *child = cache ? cache->find(a->var) : a->var->findChild(name);
                     if(!child)
                         child = findInParentClasses(a->var, name);
                     if(!child)
-                        child = a->var->addChild(name);
+                        child = a->getWritableVar()->addChild(name);
                     parent = a->var;
                     a = child;
                 }
@@ -1961,12 +3754,14 @@ CScriptVarLink *CTinyJS::factor(bool &execute)
 						<< " at " << tkst;
 					throw new CScriptException(errorString.str());
 				}
+                if(!execute && l->skipBrackets())
+                    continue; // nothing to look up
                 l->match('[');
                 CScriptVarLink *index = base(execute);
                 l->match(']');
                 if(execute)
                 {
-                    CScriptVarLink *child = a->var->findChildOrCreate(index->var->getString());
+                    CScriptVarLink *child = a->getWritableVar()->findIndexOrCreate(index->var);
                     parent = a->var;
                     a = child;
                 }
@@ -2000,7 +3795,7 @@ CScriptVarLink *CTinyJS::factor(bool &execute)
     if(l->tk == LEX_R_FUNCTION)
     {
         CScriptVarLink *funcVar = parseFunctionDefinition();
-        if(funcVar->name != TINYJS_TEMP_NAME)
+        if(funcVar->nameAtom != TINYJS_ATOM_TEMP_NAME)
             TRACE("Functions not defined at statement-level are not meant to have a name");
         return funcVar;
     }
@@ -2066,11 +3861,8 @@ CScriptVar* CTinyJS::createArray(bool& execute, CScriptLex* lexer)
     {
         if(execute)
         {
-            char idx_str[16]; // big enough for 2^32
-            sprintf_s(idx_str, sizeof(idx_str), "%d", idx);
-
             CScriptVarLink *a = base(execute);
-            contents->addChild(idx_str, a->var);
+            contents->addChild(CScriptAtoms::getIndexAtom(idx), a->var);
             CLEAN(a);
         }
         // no need to clean here, as it will definitely be used
@@ -2116,12 +3908,21 @@ CScriptVar* CTinyJS::keywordNew(bool& execute, CScriptLex* lexer)
         }
         else
         {
-            obj->addChild(TINYJS_PROTOTYPE_CLASS, objClassOrFunc->var);
+            vector<CScriptVarLink*> arguments;
             if(l->tk == '(')
             {
                 l->match('(');
+                while(l->tk != ')')
+                {
+                    arguments.push_back(base(execute));
+                    if(l->tk != ')') l->match(',');
+                }
                 l->match(')');
             }
+            if(!constructBuiltin(obj, objClassOrFunc->var, arguments))
+                obj->addChild(TINYJS_ATOM_PROTOTYPE_CLASS, objClassOrFunc->var);
+            for(CScriptVarLink *arg : arguments)
+                CLEAN(arg);
         }
     }
     else
@@ -2130,6 +3931,11 @@ CScriptVar* CTinyJS::keywordNew(bool& execute, CScriptLex* lexer)
         if(lexer->tk == '(')
         {
             lexer->match('(');
+            while(lexer->tk != ')')
+            {
+                CLEAN(base(execute));
+                if(lexer->tk != ')') lexer->match(',');
+            }
             lexer->match(')');
         }
     }
@@ -2143,6 +3949,20 @@ CScriptVar* CTinyJS::keywordNew(bool& execute, CScriptLex* lexer)
     return obj;
 }
 
+bool CTinyJS::constructBuiltin(CScriptVar *obj, CScriptVar *objClass, const vector<CScriptVarLink*> &arguments)
+{
+    if(objClass != arrayClass)
+        return false;
+    obj->setArray();
+    // like JavaScript, a single number is the length rather than the only element
+    if(arguments.size() == 1 && arguments[0]->var->isInt())
+        obj->setArrayLength(arguments[0]->var->getInt());
+    else
+        for(size_t i = 0; i < arguments.size(); i++)
+            obj->addChild(CScriptAtoms::getIndexAtom((int)i), arguments[i]->var);
+    return true;
+}
+
 void CTinyJS::keywordNewNative(CScriptVar* root, void* userData)
 {
     CScriptLex* lexer = new CScriptLex(root->findChild("argString")->var->getString());
@@ -2156,65 +3976,166 @@ void CTinyJS::keywordNewNative(CScriptVar* root, void* userData)
 void CTinyJS::compile(CScriptVarLink* function)
 {
     ASSERT(function->var->isFunction());
+    // machine code first, as it's so much quicker to get
+    if((compilers & TINYJS_COMPILE_MACHINE_CODE) && !function->var->isNative() && compileMachineCode(function))
+        return;
+    if(!isCompileRetryDue(function->var))
+    {
+        // there's nothing (else) to try for now, so don't look again until it's backed off
+        if(!function->var->isNative())
+            function->var->flags |= SCRIPTVAR_COMPILE_FAILED;
+        return;
+    }
+    function->var->flags &= ~SCRIPTVAR_COMPILE_FAILED; // even if machine code just failed, gcc has a go
+
+    if(compileThreads)
+    {
+        // leave gcc to the background compiler, and carry on as we are until it's done
+        function->var->flags |= SCRIPTVAR_COMPILING;
+        if(!compiler)
+            compiler = new CScriptCompiler(compileThreads, compileBatchWindow);
+        compiler->submit(function->var, function->getName(), getCompileSource(function), compileCache, compileCacheSize,
+                         function->var->getExecutions());
+        return;
+    }
+    CScriptCompiler::Job job;
+    job.function = function->var;
+    job.name = function->getName();
+    job.source = getCompileSource(function);
+    job.cache = compileCache;
+    job.cacheSize = compileCacheSize;
+    CScriptCompiler::build(std::vector<CScriptCompiler::Job*>(1, &job));
+    if(job.callback)
+        installCompiled(function->var, job.handle, job.callback);
+    else
+        compileFailed(function->var, job.name, TINYJS_COMPILE_GCC, job.error);
+}
 
+string CTinyJS::getCompileSource(CScriptVarLink* function)
+{
     // first, build the syntax tree
     ostringstream json;
-    json << "function " << function->name << "(";
+    json << "function " << function->getName() << "(";
     // get list of parameters	
     CScriptVarLink *link = function->var->firstChild;
     while(link)
     {
-        json << link->name;
+        json << link->getName();
         if(link = link->nextSibling) json << ",";
     }
     // add function body
     json << ") " << function->var->getString();
-    CScriptSyntaxTree* stree = new CScriptSyntaxTree(json.str());
-    stree->parse();
-
-    ofstream outfile;
-    outfile.open("jit.cpp", ios::trunc);
-    stree->compile(outfile);
-    outfile.close();
-    // yes, yes, it's a system() call, blah blah blah
-#ifdef _MSC_VER
-    // ship off the actual compilation to cl.exe
-    // this line is a hell of a doozy. it's made longer by the fact that
-    // the development environment has to be activated with this bat script.
-    // Note that the version hard-coded here uses a D drive and VS Community 2015 RC; tweak to fit
-    // your build environment. 
-    // Also, without the redirection at the end, two lines of output will be displayed
-    // by cl during compile and there appears to be no way to make it compile quietly.
-    // Additionally, it doesn't output to err, only stdout, so even if there are errors
-    // it doesn't help at all.
-    // Once again, it goes without saying that TinyJS.h must be in the same (working) directory
-    // as the executable, and Debug\tiny-js.lib must also exist. 
-    system((std::string("%comspec% /c \"\"d:\\Program Files (x86)\\Microsoft Visual Studio 14.0\\VC\\vcvarsall.bat\" x86 && cl.exe /nologo /D_USRDLL /D_WINDLL /EHsc /Zi /FI TinyJS.h jit.cpp Debug\\tiny-js.lib /MDd /LDd /link /DLL /OUT:jit.dll /EXPORT:\"") + function->name + "\"\" > nul").c_str());
-#else
-    // ship off the actual compilation to gcc for now
-    // it goes without saying that this only works if the executable
-    // has libtinyjs.so and TinyJS.h in its working directory and gcc
-    // on PATH.
-    system("gcc -g -Wall -D_DEBUG -std=c++11 -fPIC -include TinyJS.h -L./libtinyjs -shared -o jit.so jit.cpp");
-#endif
-    // open the newly built library
-    LIBHANDLE handle = GETLIB(LIBNAME, RTLD_NOW);
-    if(!handle)
+    CScriptSyntaxTree stree(json.str());
+    stree.parse();
+    stree.optimize(optimizations);
+
+    // specialized to the types it's been seen with, unless that's been given up on
+    auto feedback = typeFeedback.find(getFeedbackKey(function->var));
+    ostringstream source;
+    stree.compile(source, feedback != typeFeedback.end() && !feedback->second.generic ? &feedback->second : 0);
+    return source.str();
+}
+
+void CTinyJS::installCompiled(CScriptVar* function, LIBHANDLE handle, JSCallback callback)
+{
+    // only type-specialized builds get replaced, and as they make no calls, none can still be running
+    if(function->nativeHandle)
+        FREELIB(function->nativeHandle);
+    function->setCallback(callback, this);
+    function->flags |= SCRIPTVAR_NATIVE;
+    function->nativeHandle = handle;
+}
+
+void CTinyJS::installCompiled()
+{
+    for(CScriptCompiler::Job *job : compiler->takeFinished())
     {
-        TRACE(GETBUILDERROR);
-        return;
+        job->function->flags &= ~SCRIPTVAR_COMPILING;
+        if(job->callback)
+            installCompiled(job->function, job->handle, job->callback);
+        else
+            compileFailed(job->function, job->name, TINYJS_COMPILE_GCC, job->error);
+        job->function->unref();
+        delete job;
     }
-    JSCallback callback = (JSCallback)GETSYMBOL(handle, function->name.c_str());
-
-	if(!callback)
-	{
-		TRACE("Unable to get symbol from DLL. It's possible compilation of the JIT-code failed.\n");
-		return;
-	}
+}
 
-    function->var->setCallback(callback, this);
+bool CTinyJS::compileMachineCode(CScriptVarLink* function)
+{
+    if(!CScriptMachineCode::isSupported())
+        return false;
+    CScriptBytecode *bytecode = getBytecode(function->var);
+    auto compiled = machineCode.find(bytecode);
+    if(compiled == machineCode.end())
+    {
+        CScriptMachineCode *code = 0;
+        try
+        {
+            code = new CScriptMachineCode(this, bytecode);
+        }
+        catch(CScriptException *e)
+        {
+            TRACE("Unable to compile '%s' to machine code: %s\n", function->getName().c_str(), e->text.c_str());
+            compileFailed(function->var, function->getName(), TINYJS_COMPILE_MACHINE_CODE, e->text);
+            delete e;
+        }
+        compiled = machineCode.insert(make_pair(bytecode, code)).first;
+    }
+    if(!compiled->second)
+        return false;
+    function->var->setCallback(&CScriptMachineCode::call, compiled->second);
     function->var->flags |= SCRIPTVAR_NATIVE;
-    function->var->nativeHandle = handle;
+    return true;
+}
+
+void CTinyJS::compileFailed(CScriptVar* function, const string &name, int compiler, const string &reason)
+{
+    // failures are kept by body, as every closure made from it would fail the same way
+    CScriptCompileFailure &failure = compileFailures[make_pair(function->getString(), compiler)];
+    failure.name = name;
+    failure.compiler = compiler;
+    failure.reason = reason;
+    failure.attempts++;
+    failure.retryAt = function->getExecutions() * TINYJS_COMPILE_BACKOFF;
+    failure.blacklisted = compiler == TINYJS_COMPILE_MACHINE_CODE || failure.attempts >= TINYJS_COMPILE_ATTEMPTS;
+    if(!function->isNative())
+        function->flags |= SCRIPTVAR_COMPILE_FAILED;
+}
+
+bool CTinyJS::isCompileRetryDue(CScriptVar* function)
+{
+    if(!(compilers & TINYJS_COMPILE_GCC))
+        return false;
+    auto failure = compileFailures.find(make_pair(function->getString(), (int)TINYJS_COMPILE_GCC));
+    return failure == compileFailures.end() ||
+        (!failure->second.blacklisted && function->getExecutions() >= failure->second.retryAt);
+}
+
+int CTinyJS::getCompileState(const string &path)
+{
+    CScriptVar *function = getScriptVariable(path);
+    if(!function || !function->isFunction())
+        return -1;
+    if(function->isNative())
+        return function->nativeHandle || function->jsCallback == &CScriptMachineCode::call ? TINYJS_COMPILE_COMPILED : -1;
+    if(function->flags & SCRIPTVAR_COMPILING)
+        return TINYJS_COMPILE_QUEUED;
+    auto gcc = compileFailures.find(make_pair(function->getString(), (int)TINYJS_COMPILE_GCC));
+    if(gcc == compileFailures.end() &&
+       !compileFailures.count(make_pair(function->getString(), (int)TINYJS_COMPILE_MACHINE_CODE)))
+        return TINYJS_COMPILE_COLD;
+    // it's only blacklisted once there's nothing left that could be tried
+    if((compilers & TINYJS_COMPILE_GCC) && (gcc == compileFailures.end() || !gcc->second.blacklisted))
+        return TINYJS_COMPILE_FAILED;
+    return TINYJS_COMPILE_BLACKLISTED;
+}
+
+vector<CScriptCompileFailure> CTinyJS::getCompileFailures()
+{
+    vector<CScriptCompileFailure> failures;
+    for(auto &failure : compileFailures)
+        failures.push_back(failure.second);
+    return failures;
 }
 
 CScriptVarLink *CTinyJS::unary(bool &execute)
@@ -2226,9 +4147,7 @@ CScriptVarLink *CTinyJS::unary(bool &execute)
         a = factor(execute);
         if(execute)
         {
-            CScriptVar zero(0);
-            CScriptVar *res = a->var->mathsOp(&zero, LEX_EQUAL);
-            CREATE_LINK(a, res);
+            CScriptMaths::apply(a, CScriptConstants::newInt(0), LEX_EQUAL);
         }
     }
     else
@@ -2245,10 +4164,7 @@ CScriptVarLink *CTinyJS::term(bool &execute)
         l->match(l->tk);
         CScriptVarLink *b = unary(execute);
         if(execute)
-        {
-            CScriptVar *res = a->var->mathsOp(b->var, op);
-            CREATE_LINK(a, res);
-        }
+            CScriptMaths::apply(a, b->var, op);
         CLEAN(b);
     }
     return a;
@@ -2279,11 +4195,7 @@ CScriptVarLink *CTinyJS::expression(bool &execute)
         {
             if(execute)
             {
-                CScriptVar one(1);
-                CScriptVar *res = a->var->mathsOp(&one, op == LEX_PLUSPLUS ? '+' : '-');
-                CScriptVarLink *oldValue = new CScriptVarLink(a->var);
-                // in-place add/subtract
-                a->replaceWith(res);
+                CScriptVarLink *oldValue = CScriptMaths::postfix(a, op == LEX_PLUSPLUS ? '+' : '-');
                 CLEAN(a);
                 a = oldValue;
             }
@@ -2292,11 +4204,7 @@ CScriptVarLink *CTinyJS::expression(bool &execute)
         {
             CScriptVarLink *b = term(execute);
             if(execute)
-            {
-                // not in-place, so just replace
-                CScriptVar *res = a->var->mathsOp(b->var, op);
-                CREATE_LINK(a, res);
-            }
+                CScriptMaths::apply(a, b->var, op);
             CLEAN(b);
         }
     }
@@ -2311,14 +4219,9 @@ CScriptVarLink *CTinyJS::shift(bool &execute)
         int op = l->tk;
         l->match(op);
         CScriptVarLink *b = base(execute);
-        int shift = execute ? b->var->getInt() : 0;
-        CLEAN(b);
         if(execute)
-        {
-            if(op == LEX_LSHIFT) a->var->setInt(a->var->getInt() << shift);
-            if(op == LEX_RSHIFT) a->var->setInt(a->var->getInt() >> shift);
-            if(op == LEX_RSHIFTUNSIGNED) a->var->setInt(((unsigned int)a->var->getInt()) >> shift);
-        }
+            CScriptMaths::apply(a, b->var, op);
+        CLEAN(b);
     }
     return a;
 }
@@ -2336,10 +4239,7 @@ CScriptVarLink *CTinyJS::condition(bool &execute)
         l->match(l->tk);
         b = shift(execute);
         if(execute)
-        {
-            CScriptVar *res = a->var->mathsOp(b->var, op);
-            CREATE_LINK(a, res);
-        }
+            CScriptMaths::apply(a, b->var, op);
         CLEAN(b);
     }
     return a;
@@ -2376,13 +4276,12 @@ CScriptVarLink *CTinyJS::logic(bool &execute)
         {
             if(boolean)
             {
-                CScriptVar *newa = new CScriptVar(a->var->getBool());
-                CScriptVar *newb = new CScriptVar(b->var->getBool());
+                CScriptVar *newa = CScriptConstants::newInt(a->var->getBool());
+                CScriptVar *newb = CScriptConstants::newInt(b->var->getBool());
                 CREATE_LINK(a, newa);
                 CREATE_LINK(b, newb);
             }
-            CScriptVar *res = a->var->mathsOp(b->var, op);
-            CREATE_LINK(a, res);
+            CScriptMaths::apply(a, b->var, op);
         }
         CLEAN(b);
     }
@@ -2434,9 +4333,9 @@ CScriptVarLink *CTinyJS::base(bool &execute)
          * add it to the symbol table root as per JavaScript. */
         if(execute && !lhs->owned)
         {
-            if(lhs->name.length() > 0)
+            if(lhs->nameAtom != TINYJS_ATOM_TEMP_NAME)
             {
-                CScriptVarLink *realLhs = root->addChildNoDup(lhs->name, lhs->var);
+                CScriptVarLink *realLhs = root->addChildNoDup(lhs->nameAtom, lhs->var);
                 CLEAN(lhs);
                 lhs = realLhs;
             }
@@ -2454,15 +4353,9 @@ CScriptVarLink *CTinyJS::base(bool &execute)
                 lhs->replaceWith(rhs);
             }
             else if(op == LEX_PLUSEQUAL)
-            {
-                CScriptVar *res = lhs->var->mathsOp(rhs->var, '+');
-                lhs->replaceWith(res);
-            }
+                CScriptMaths::assign(lhs, rhs->var, '+');
             else if(op == LEX_MINUSEQUAL)
-            {
-                CScriptVar *res = lhs->var->mathsOp(rhs->var, '-');
-                lhs->replaceWith(res);
-            }
+                CScriptMaths::assign(lhs, rhs->var, '-');
             else ASSERT(0);
         }
         CLEAN(rhs);
@@ -2472,16 +4365,26 @@ CScriptVarLink *CTinyJS::base(bool &execute)
 
 void CTinyJS::block(bool &execute)
 {
-    l->match('{');
     if(execute)
     {
+        int close = l->getMatchingBracket();
+        l->match('{');
         while(l->tk && l->tk != '}')
+        {
             statement(execute);
+            // after a return, there's nothing left in the block to run
+            if(!execute && close >= 0)
+                l->seekToken(close);
+        }
         l->match('}');
     }
-    else
+    else if(l->tk == '{' && l->skipBrackets())
     {
         // fast skip of blocks
+    }
+    else
+    {
+        l->match('{');
         int brackets = 1;
         while(l->tk && brackets)
         {
@@ -2502,7 +4405,10 @@ void CTinyJS::statement(bool &execute)
         l->tk == '-')
     {
         /* Execute a simple statement that only contains basic arithmetic... */
-        CLEAN(base(execute));
+        if(!execute)
+            skipExpressions();
+        else
+            CLEAN(base(execute));
         l->match(';');
     }
     else if(l->tk == '{')
@@ -2521,11 +4427,13 @@ void CTinyJS::statement(bool &execute)
          * hand side. Maybe just have a flag called can_create_var that we
          * set and then we parse as if we're doing a normal equals.*/
         l->match(LEX_R_VAR);
+        if(!execute)
+            skipExpressions();
         while(l->tk != ';')
         {
             CScriptVarLink *a = 0;
             if(execute)
-                a = scopes.back()->findChildOrCreate(l->tkStr);
+                a = scopes.back()->findChildOrCreate(l->tkAtom);
             l->match(LEX_ID);
             // now do stuff defined with dots
             while(l->tk == '.')
@@ -2534,7 +4442,7 @@ void CTinyJS::statement(bool &execute)
                 if(execute)
                 {
                     CScriptVarLink *lastA = a;
-                    a = lastA->var->findChildOrCreate(l->tkStr);
+                    a = lastA->getWritableVar()->findChildOrCreate(l->tkAtom);
                 }
                 l->match(LEX_ID);
             }
@@ -2555,11 +4463,19 @@ void CTinyJS::statement(bool &execute)
     else if(l->tk == LEX_R_IF)
     {
         l->match(LEX_R_IF);
-        l->match('(');
-        CScriptVarLink *var = base(execute);
-        l->match(')');
-        bool cond = execute && var->var->getBool();
-        CLEAN(var);
+        bool cond = false;
+        if(!execute && l->skipBrackets())
+        {
+            // not executing, so the condition doesn't matter
+        }
+        else
+        {
+            l->match('(');
+            CScriptVarLink *var = base(execute);
+            l->match(')');
+            cond = execute && var->var->getBool();
+            CLEAN(var);
+        }
         bool noexecute = false; // because we need to be abl;e to write to it
         statement(cond ? execute : noexecute);
         if(l->tk == LEX_R_ELSE)
@@ -2573,6 +4489,12 @@ void CTinyJS::statement(bool &execute)
         // We do repetition by pulling out the string representing our statement
         // there's definitely some opportunity for optimisation here
         l->match(LEX_R_WHILE);
+        if(!execute && l->skipBrackets())
+        {
+            // a loop that isn't being executed only has a body to step over
+            statement(execute);
+            return;
+        }
         l->match('(');
         int whileCondStart = l->tokenStart;
         bool noexecute = false;
@@ -2606,6 +4528,11 @@ void CTinyJS::statement(bool &execute)
     else if(l->tk == LEX_R_FOR)
     {
         l->match(LEX_R_FOR);
+        if(!execute && l->skipBrackets())
+        {
+            statement(execute);
+            return;
+        }
         l->match('(');
         statement(execute); // initialisation
         //l->match(';');
@@ -2659,11 +4586,13 @@ void CTinyJS::statement(bool &execute)
     {
         l->match(LEX_R_RETURN);
         CScriptVarLink *result = 0;
-        if(l->tk != ';')
+        if(!execute)
+            skipExpressions();
+        else if(l->tk != ';')
             result = base(execute);
         if(execute)
         {
-            CScriptVarLink *resultVar = scopes.back()->findChild(TINYJS_RETURN_VAR);
+            CScriptVarLink *resultVar = scopes.back()->findChild(TINYJS_ATOM_RETURN_VAR);
             if(resultVar)
                 resultVar->replaceWith(result);
             else
@@ -2678,10 +4607,10 @@ void CTinyJS::statement(bool &execute)
         CScriptVarLink *funcVar = parseFunctionDefinition();
         if(execute)
         {
-            if(funcVar->name == TINYJS_TEMP_NAME)
+            if(funcVar->nameAtom == TINYJS_ATOM_TEMP_NAME)
                 TRACE("Functions defined at statement-level are meant to have a name\n");
             else
-                scopes.back()->addChildNoDup(funcVar->name, funcVar->var);
+                scopes.back()->addChildNoDup(funcVar->nameAtom, funcVar->var);
         }
         CLEAN(funcVar);
     }
@@ -2699,6 +4628,15 @@ void CTinyJS::statement(bool &execute)
     else l->match(LEX_EOF);
 }
 
+void CTinyJS::skipExpressions()
+{
+    while(l->tk && l->tk != ';' && l->tk != ')' && l->tk != ']' && l->tk != '}')
+    {
+        if(!l->skipBrackets())
+            l->match(l->tk);
+    }
+}
+
 /// Get the given variable specified by a path (var1.var2.etc), or return 0
 CScriptVar *CTinyJS::getScriptVariable(const string &path)
 {
@@ -2751,26 +4689,49 @@ bool CTinyJS::setVariable(const std::string &path, const std::string &varData)
 
 /// Finds a child, looking recursively up the scopes
 CScriptVarLink *CTinyJS::findInScopes(const std::string &childName)
+{
+    int childAtom = CScriptAtoms::find(childName);
+    return childAtom >= 0 ? findInScopes(childAtom) : 0;
+}
+
+CScriptVarLink *CTinyJS::findInScopes(int childAtom)
 {
     for(int s = scopes.size() - 1; s >= 0; s--)
     {
-        CScriptVarLink *v = scopes[s]->findChild(childName);
+        CScriptVarLink *v = scopes[s]->findChild(childAtom);
         if(v) return v;
     }
     return NULL;
 
 }
 
+CScriptVarLink *CTinyJS::findInFrame(int slot, int atom)
+{
+    /* A link stays put for as long as the scope it's in, and all the scopes we
+       can see outlive the frame, so once a variable is found it can be kept. Only
+       a new definition in the current scope can hide it, and that updates the frame. */
+    CScriptVarLink *&link = (*frame)[slot];
+    if(!link)
+        link = findInScopes(atom);
+    return link;
+}
+
 /// Look up in any parent classes of the given object
 CScriptVarLink *CTinyJS::findInParentClasses(CScriptVar *object, const std::string &name)
+{
+    int atom = CScriptAtoms::find(name);
+    return atom >= 0 ? findInParentClasses(object, atom) : 0;
+}
+
+CScriptVarLink *CTinyJS::findInParentClasses(CScriptVar *object, int name)
 {
     // Look for links to actual parent classes
-    CScriptVarLink *parentClass = object->findChild(TINYJS_PROTOTYPE_CLASS);
+    CScriptVarLink *parentClass = object->findChild(TINYJS_ATOM_PROTOTYPE_CLASS);
     while(parentClass)
     {
         CScriptVarLink *implementation = parentClass->var->findChild(name);
         if(implementation) return implementation;
-        parentClass = parentClass->var->findChild(TINYJS_PROTOTYPE_CLASS);
+        parentClass = parentClass->var->findChild(TINYJS_ATOM_PROTOTYPE_CLASS);
     }
     // else fake it for strings and finally objects
     if(object->isString())
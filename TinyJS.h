@@ -31,6 +31,9 @@
 
  // If defined, this keeps a note of all calls and where from in memory. This is slower, but good for debugging
 #define TINYJS_CALL_STACK
+ // If defined, variables are freed by tracing from the roots (see CScriptTracingCollector) rather than by
+ // counting the links to them. This has to be set here rather than on the command line, as jit code uses it too
+//#define TINYJS_TRACING_GC
 
 #ifdef _WIN32
 #ifdef _DEBUG
@@ -41,7 +44,11 @@
 #endif
 #include <string>
 #include <vector>
+#include <map>
 #include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <chrono>
 
 #ifdef _MSC_VER
 #include <windows.h>
@@ -54,6 +61,12 @@
 #define TRACE printf
 #endif // TRACE
 
+/* Frees the given link IF it isn't owned by anything else */
+#define CLEAN(x) { CScriptVarLink *__v = x; if (__v && !__v->owned) { delete __v; } }
+/* Create a LINK to point to VAR and free the old link.
+ * BUT this is more clever - it tries to keep the old link if it's not owned to save allocations */
+#define CREATE_LINK(LINK, VAR) { if (!LINK || LINK->owned) LINK = new CScriptVarLink(VAR); else LINK->replaceWith(VAR); }
+
 enum LEX_TYPES
 {
     LEX_EOF = 0,
@@ -116,6 +129,9 @@ enum SCRIPTVAR_FLAGS
     SCRIPTVAR_NULL = 64, // it seems null is its own data type
 
     SCRIPTVAR_NATIVE = 128, // to specify this is a native function
+    SCRIPTVAR_CONSTANT = 256, // shared by everything with this value, so it can't be changed (see CScriptConstants)
+    SCRIPTVAR_COMPILING = 512, // a function that's been given to the background compiler (see CScriptCompiler)
+    SCRIPTVAR_COMPILE_FAILED = 1024, // a function that couldn't be compiled, which isn't tried again until it's backed off
     SCRIPTVAR_NUMERICMASK = SCRIPTVAR_NULL |
     SCRIPTVAR_DOUBLE |
     SCRIPTVAR_INTEGER,
@@ -136,17 +152,297 @@ enum SCRIPTVAR_FLAGS
 #define TINYJS_NEW_FUNCTION_NAME "__new_"
 #define TINYJS_ARRAY_FUNCTION_NAME "__array_"
 #define TINYJS_OBJECT_FUNCTION_NAME "__object_"
+/// How far past the end of an array's elements an index can be and still be stored with them
+#define TINYJS_ARRAY_SLACK 64
+// Strings made by '+' that are at least this long go into a CScriptStringBuffer, so that adding more on is cheap
+#define TINYJS_STRING_BUFFER_MIN 32
+// Bump this when a change here would break libraries gcc has already built from functions (see CTinyJS::setCompileCache)
+#define TINYJS_JIT_ABI_VERSION 2
+
+/// How CTinyJS runs script code (see CTinyJS::setExecutionMode)
+enum TINYJS_EXECUTION_MODES
+{
+    TINYJS_EXECUTE_SOURCE, ///< Interpret straight from the source, re-lexing function bodies on every call
+    TINYJS_EXECUTE_SYNTAX_TREE, ///< Parse scripts and function bodies once into a CScriptSyntaxTree and walk that
+    TINYJS_EXECUTE_BYTECODE, ///< Parse as for TINYJS_EXECUTE_SYNTAX_TREE, then compile the tree to CScriptBytecode and run that
+};
+
+/// What CScriptSyntaxTree::optimize does to a parsed tree, as flags (see CTinyJS::setOptimizations)
+enum TINYJS_OPTIMIZATIONS
+{
+    TINYJS_OPTIMIZE_NONE = 0,
+    TINYJS_OPTIMIZE_CONSTANTS = 1, ///< Work out operators on literals up front, so 'x * (60 * 60)' becomes 'x * 3600'
+    TINYJS_OPTIMIZE_ALGEBRA = 2, ///< Drop operations that can't change an int, like 'n + 0' or '!!(a < b)'
+    TINYJS_OPTIMIZE_BRANCHES = 4, ///< Drop what an if, loop, '?', '&&' or '||' with a literal condition never runs
+    TINYJS_OPTIMIZE_UNREACHABLE = 8, ///< Drop statements that follow a return
+    TINYJS_OPTIMIZE_ALL = 15,
+};
+
+/// How CTinyJS compiles functions that have run often enough, as flags (see CTinyJS::setCompilers)
+enum TINYJS_COMPILERS
+{
+    TINYJS_COMPILE_NONE = 0,
+    TINYJS_COMPILE_GCC = 1, ///< Write the function out as C++ and build it with gcc into a library to load
+    TINYJS_COMPILE_MACHINE_CODE = 2, ///< Compile the function's bytecode in memory into x86-64 machine code (see CScriptMachineCode)
+};
+
+/// Where a function is in being compiled (see CTinyJS::getCompileState)
+enum TINYJS_COMPILE_STATES
+{
+    TINYJS_COMPILE_COLD, ///< Not compiled, and not tried yet
+    TINYJS_COMPILE_QUEUED, ///< Waiting for the background compiler (even if hotter functions have pushed it out of the queue), or being built by it
+    TINYJS_COMPILE_COMPILED, ///< Running as machine code or a library gcc built
+    TINYJS_COMPILE_FAILED, ///< Couldn't be compiled, and will be tried again once it has run more
+    TINYJS_COMPILE_BLACKLISTED, ///< Couldn't be compiled, and won't be tried again
+};
+
+// How many times gcc gets to try a function before it's blacklisted
+#define TINYJS_COMPILE_ATTEMPTS 3
+// How many times as often a function has to have run after failing before it's tried again
+#define TINYJS_COMPILE_BACKOFF 4
+
+/// Why a function couldn't be compiled (see CTinyJS::getCompileFailures)
+struct CScriptCompileFailure
+{
+    std::string name; ///< The function's name when it last failed
+    int compiler; ///< The TINYJS_COMPILERS flag for what failed
+    std::string reason;
+    int attempts;
+    int retryAt; ///< How many times the function has to have run before it's tried again
+    bool blacklisted; ///< Whether it won't be tried again (machine code is never retried, as it'd fail the same way)
+};
+
+// How many times gcc's type-specialized code for a function can bail out to the interpreter, once it's
+// been at least an eighth of the function's calls, before it's built again without specializing
+#define TINYJS_DEOPTIMIZE_LIMIT 16
+
+/// What the interpreter saw a function's arguments and locals hold while it warmed up, for gcc to
+/// write code on plain ints and doubles for (see CScriptSyntaxTree::compile)
+struct CScriptTypeFeedback
+{
+    static const int UNDEFINED = 1 << 16; ///< Seen without a value, which has no SCRIPTVAR_FLAGS bit of its own
+    std::unordered_map<std::string, int> types; ///< By name, the SCRIPTVAR_VARTYPEMASK bits (or UNDEFINED) seen
+    int deoptimizations; ///< How many times the specialized code has handed a call back to the interpreter
+    bool generic; ///< Whether it's to be built without specializing, as its guards failed too often
+
+    CScriptTypeFeedback() : deoptimizations(0), generic(false) { }
+};
 
 /// convert the given string into a quoted string suitable for javascript
 std::string getJSString(const std::string &str);
 
+struct CScriptTokenList;
+
 class CScriptException
 {
 public:
     std::string text;
+    /* Where it went wrong, for code run from a syntax tree or bytecode, where the lexer has
+       already read to the end: the outermost call it came out of, or else its statement. */
+    CScriptTokenList *source;
+    int position;
     CScriptException(const std::string &exceptionText);
 };
 
+/// Atoms that are always in the table, so they can be used without looking them up
+enum TINYJS_ATOMS
+{
+    TINYJS_ATOM_TEMP_NAME, ///< TINYJS_TEMP_NAME
+    TINYJS_ATOM_RETURN_VAR, ///< TINYJS_RETURN_VAR
+    TINYJS_ATOM_PROTOTYPE_CLASS, ///< TINYJS_PROTOTYPE_CLASS
+    TINYJS_ATOM_LENGTH, ///< "length"
+    TINYJS_ATOM_THIS, ///< "this"
+};
+
+/** The engine-wide table of names. Every variable and property name is stored here once,
+    and is known everywhere else by its index - its atom - so that names can be compared and
+    hashed as ints. Atoms are never removed, so they stay valid for as long as the program runs.
+    Lookups that only want to know about a name (find, findIndexAtom) never add it, so only names
+    that are actually stored somewhere end up in the table. Adding is locked, and the strings are
+    kept in chunks that never move, so engines on other threads can read atoms without locking. */
+class CScriptAtoms
+{
+public:
+    static int get(const std::string &str); ///< Get the atom for a string, adding it to the table if it's new
+    static int find(const std::string &str); ///< Get the atom for a string, or -1 if it isn't in the table
+    static const std::string &getString(int atom) { return entry(atom).str; } ///< Get the string for an atom
+    static int getIndex(int atom) { return entry(atom).index; } ///< If the atom's string is an array index, get the index (otherwise -1)
+    static int getIndexAtom(int index); ///< Get the atom for an array index, only formatting it the first time
+    static int findIndexAtom(int index); ///< Get the atom for an array index, or -1 if it isn't in the table
+private:
+    struct Entry
+    {
+        std::string str;
+        int index; ///< The array index of the string, or -1
+    };
+    static const int CHUNK_BITS = 12; ///< Entries are allocated 4096 at a time
+    static const int MAX_CHUNKS = 1 << 12; ///< Which allows for 16M names
+    static const int INDEX_CACHE_SIZE = 1 << 20; ///< Array indices below this have their atoms cached
+
+    static std::mutex lock; ///< Held while adding to the table
+    static std::unordered_map<std::string, int> atoms;
+    static std::atomic<Entry*> chunks[MAX_CHUNKS]; ///< The entries, indexed by atom
+    static std::atomic<std::atomic<int>*> indexChunks[INDEX_CACHE_SIZE >> CHUNK_BITS]; ///< The atoms of array indices by index, or -1 if not added yet
+    static bool fixedAtoms;
+
+    static Entry &entry(int atom) { return chunks[atom >> CHUNK_BITS].load(std::memory_order_acquire)[atom & ((1 << CHUNK_BITS) - 1)]; }
+    static int add(const std::string &str); ///< Add a string that isn't in the table yet (with the lock held)
+    static bool addFixedAtoms(); ///< Add the TINYJS_ATOMS
+};
+
+/** The layout shared by every object that had the same properties added in the same order.
+    A shaped object keeps its property links in a vector in that order (CScriptVar::slots), so
+    finding a property is a search of the short list of names here, and a CScriptPropertyCache
+    that has seen the shape before doesn't have to search at all. Shapes form a tree of
+    transitions from the empty shape, and like atoms they last for as long as the program runs.
+    Arrays and objects with lots of properties are left in a map instead (CScriptVar::children),
+    and so are objects that would take a shape that has already branched MAX_TRANSITIONS ways, or
+    that would need a new shape once there are MAX_SHAPES - so objects used as dictionaries with
+    made-up keys can't grow the tree without bound. Adding shapes is locked, as the tree is shared
+    by every engine; a shape never changes once it's made, so finding names in it isn't. */
+class CScriptShape
+{
+public:
+    static const int MAX_PROPERTIES = 16; ///< Objects that grow beyond this go into a map
+    static const int MAX_TRANSITIONS = 64; ///< How many different properties can be added to one shape
+    static const int MAX_SHAPES = 1 << 16; ///< How many shapes there can be in all
+
+    ~CScriptShape();
+
+    static CScriptShape *empty() { return &emptyShape; } ///< The shape of an object with no properties
+    CScriptShape *withProperty(int atom); ///< The shape after adding a property (this is cached, so it's the same every time), or 0 if there are too many shapes
+    CScriptShape *withoutProperty(int atom); ///< The shape after removing a property, or 0 as for withProperty
+    int find(int atom); ///< The index of the property with the given name, or -1
+    int getCount() { return (int)names.size(); }
+
+private:
+    std::vector<int> names; ///< The atoms of the properties, in the order they were added
+    std::unordered_map<int, CScriptShape*> transitions; ///< The shapes made by adding each property to this one
+    static CScriptShape emptyShape;
+    static std::mutex lock; ///< Held while looking at or adding to transitions
+    static int shapes; ///< How many shapes have been made
+};
+
+/** A free list of blocks of one size, for the objects that are made and thrown away all the
+    time (CScriptVar and CScriptVarLink allocate from one each). Memory comes from the system in
+    chunks of many blocks, and released blocks are kept for reuse rather than given back. Every
+    thread has its own pools, so engines running on different threads never share a free list.
+    A block released on a different thread from the one that allocated it just joins the pool of
+    the thread that released it, and when a thread finishes, its free blocks are left as Orphans
+    for the next pool that needs more. The pools are filled in before any constructors run, so
+    they work for objects made at any time. */
+class CScriptPool
+{
+    struct Block { Block *next; };
+public:
+    static const int BLOCKS_PER_CHUNK = 512;
+
+    /// The blocks that finished threads left free, shared by every thread's pool for one kind of object
+    struct Orphans
+    {
+        constexpr Orphans() : freeList(0), blocks(0), chunks(0) {}
+        std::mutex lock;
+        Block *freeList;
+        size_t blocks;
+        Block *chunks; ///< Every chunk any thread has taken from the system, as they're never given back
+    };
+
+    constexpr CScriptPool(size_t blockSize, Orphans &orphans) :
+        blockSize(blockSize), orphans(orphans), freeList(0), inUse(0), capacity(0), allocations(0), chunks(0) {}
+
+    void *allocate()
+    {
+        if(!freeList)
+            grow();
+        Block *block = freeList;
+        freeList = block->next;
+        inUse++;
+        allocations++;
+        return block;
+    }
+    void release(void *ptr)
+    {
+        Block *block = (Block*)ptr;
+        block->next = freeList;
+        freeList = block;
+        if(inUse)
+            inUse--;
+        else
+            capacity++; // it came from another thread's pool, so now it's ours
+    }
+
+    size_t getBlockSize() const { return blockSize; }
+    size_t getInUse() const { return inUse; } ///< Blocks that have been allocated and not released yet
+    size_t getCapacity() const { return capacity; } ///< Blocks this pool has, in use or free
+    size_t getFree() const { return capacity - inUse; } ///< Blocks waiting to be allocated again
+    size_t getAllocations() const { return allocations; } ///< The number of times allocate has been called
+    size_t getChunks() const { return chunks; } ///< The number of chunks taken from the system
+    double getFragmentation() const { return capacity ? (double)getFree() / capacity : 0; } ///< How much of the pool's memory is sitting free, from 0 to 1
+
+private:
+    size_t blockSize;
+    Orphans &orphans;
+    Block *freeList;
+    size_t inUse;
+    size_t capacity;
+    size_t allocations;
+    size_t chunks;
+
+    void grow(); ///< Add orphaned blocks, or else a new chunk's worth, to the free list
+    void leave(); ///< Give the free list to the orphans, as this thread is finishing
+    friend struct CScriptPoolThread;
+};
+
+class CScriptVar;
+class CScriptVarLink;
+class CScriptCycleCollector;
+
+/** An inline cache for one '.name' in the source. It remembers where the property was in the
+    last few shapes of object it was used on, so that finding it again is a pointer compare and
+    an index into the object's slots. */
+struct CScriptPropertyCache
+{
+    static const int ENTRIES = 4; ///< Shapes remembered before the oldest is replaced
+
+    CScriptPropertyCache(int atom = 0);
+
+    /// Find the property in the object itself (not its parent classes), or return 0 if it's not there
+    CScriptVarLink *find(CScriptVar *object);
+
+    int atom; ///< The name of the property
+private:
+    CScriptShape *shapes[ENTRIES];
+    int indices[ENTRIES]; ///< Where the property is in objects of each shape in 'shapes'
+    int next; ///< The entry to replace on the next miss
+
+    CScriptVarLink *findSlow(CScriptVar *object);
+};
+
+/// A token as scanned by CScriptLex
+struct CScriptToken
+{
+    int tk; ///< The type of the token
+    int start; ///< Position in the data of the first character of the token
+    int end; ///< Position in the data of the last character of the token
+    int str; ///< Index of the token's data in CScriptTokenList::strings
+    int atom; ///< If the token is an ID, the atom for its name (see CScriptAtoms)
+    int cache; ///< If the token is the name after a '.', its index in CScriptTokenList::caches (otherwise -1)
+    int pair; ///< If the token is a bracket, the index of the one that matches it (otherwise -1)
+};
+
+/** All the tokens in a piece of source, scanned once up front. A lexer and all the
+    sub-lexers it hands out share one of these, so that loops can go around again by
+    replaying tokens rather than by scanning characters. */
+struct CScriptTokenList
+{
+    std::vector<CScriptToken> tokens;
+    std::vector<std::string> strings; ///< The data of the tokens. Each distinct string is only stored once.
+    std::vector<CScriptPropertyCache> caches; ///< One for each '.name', kept for as long as the tokens are
+    std::vector<int> lines; ///< Position in the data of the start of each line
+
+    std::string getPosition(int pos); ///< Return a string representing the position in lines and columns of the character pos given
+};
+
 class CScriptLex
 {
 public:
@@ -160,6 +456,7 @@ public:
     int tokenEnd; ///< Position in the data at the last character of the token we have here
     int tokenLastEnd; ///< Position in the data at the last character of the last token
     std::string tkStr; ///< Data contained in the token we have here
+    int tkAtom; ///< If the token we have here is an ID, the atom for tkStr
 
     void match(int expected_tk); ///< Lexical match wotsit
     static std::string getTokenStr(int token, bool raw_tokens = false); ///< Get the string representation of the given token
@@ -169,6 +466,14 @@ public:
     CScriptLex *getSubLex(int lastPosition); ///< Return a sub-lexer from the given position up until right now
 
     std::string getPosition(int pos = -1); ///< Return a string representing the position in lines and columns of the character pos given
+    CScriptTokenList *getSource() { return tokenList; } ///< The tokens this lexer shares with its owner and sub-lexers
+    CScriptPropertyCache *getPropertyCache(); ///< The cache for the token we have here, if it's the name after a '.'
+
+    /* Code that isn't being executed only has to be stepped over, so rather than parsing it
+       we can jump straight to the bracket that closes it. */
+    int getMatchingBracket(); ///< If we're on '{', '(' or '[', the index of the token that closes it in this lexer (otherwise -1)
+    void seekToken(int index); ///< Make the token at 'index' (from getMatchingBracket) the one we have
+    bool skipBrackets(); ///< If we're on '{', '(' or '[' and it's closed, go to the token after the close and return true
 
 protected:
     /* When we go into a loop, we use getSubLex to get a lexer for just the sub-part of the
@@ -180,11 +485,35 @@ protected:
 
     int dataPos; ///< Position in data (we CAN go past the end of the string here)
 
+    /* Sub-lexers share their owner's token list too, and just have a different range of it. */
+    CScriptTokenList *tokenList; ///< The tokens of the data string
+    bool tokenListOwned; ///< Do we own the token list?
+    int tokenFirst, tokenLast; ///< Range of tokenList->tokens that this lexer returns
+    int tokenPos; ///< Index in tokenList->tokens of the next token
+
     void getNextCh();
-    void getNextToken(); ///< Get the text token from our text string
+    void scanToken(); ///< Scan the next token from our text string
+    void scanTokens(); ///< Scan the whole of our text string into tokenList
+    void getNextToken(); ///< Get the next token from the token list
+};
+
+/** A function call that's running, kept so that errors can say how we got there. It only
+    records where the call was made: that's turned into a line and column if an error needs it. */
+struct CScriptCallFrame
+{
+    int function; ///< The atom of the name the function was called by
+    CScriptTokenList *source; ///< The source the call was made from...
+    int position; ///< ...and the position of the call in it
+
+    std::string getDescription(); ///< Return a string like "name from (line: 1, col: 2)"
 };
 
 class CScriptVar;
+class CSyntaxNode;
+class CScriptSyntaxTree;
+class CScriptBytecode;
+class CScriptMachineCode;
+class CScriptCompiler;
 
 typedef void(*JSCallback)(CScriptVar *var, void *userdata);
 typedef CScriptVar* (*NativeImpl)(bool& execute, CScriptLex* lexer);
@@ -192,26 +521,56 @@ typedef CScriptVar* (*NativeImpl)(bool& execute, CScriptLex* lexer);
 class CScriptVarLink
 {
 public:
-    std::string name;
+    int nameAtom; ///< The atom for this link's name (see CScriptAtoms)
     CScriptVarLink *nextSibling;
     CScriptVarLink *prevSibling;
     CScriptVar *var;
     bool owned;
 
     CScriptVarLink(); // for use as an immediate (only used in jit code)
-    CScriptVarLink(CScriptVar *var, const std::string &name = TINYJS_TEMP_NAME);
+    CScriptVarLink(CScriptVar *var, int nameAtom = TINYJS_ATOM_TEMP_NAME);
+    CScriptVarLink(CScriptVar *var, const std::string &name);
     CScriptVarLink(const CScriptVarLink &link); ///< Copy constructor
     ~CScriptVarLink();
 
+    const std::string &getName() { return CScriptAtoms::getString(nameAtom); }
+    void setName(const std::string &name) { nameAtom = CScriptAtoms::get(name); }
+
     // both versions of "replaceWith" return "this". This seems like a sort of
     // intuitive thing to do, and it helps for emitting interesting JIT code.
     CScriptVarLink* replaceWith(CScriptVar *newVar); ///< Replace the Variable pointed to
     CScriptVarLink* replaceWith(CScriptVarLink *newVar); ///< Replace the Variable pointed to (just dereferences)
+    CScriptVar *getWritableVar(); ///< The variable, replacing it with a copy first if it's one of the shared constants
     int getIntName(); ///< Get the name as an integer (for arrays)
     void setIntName(int n); ///< Set the name as an integer (for arrays)
-	
+
+    static void *operator new(size_t) { return pool.allocate(); }
+    static void operator delete(void *ptr) { pool.release(ptr); }
+    static const CScriptPool &getPool() { return pool; } ///< For counting links (on this thread)
+
 private:
+    static thread_local CScriptPool pool;
+    static CScriptPool::Orphans poolOrphans;
+	static CScriptVar *ref(CScriptVar* newVar); ///< Count this link as a reference to 'newVar' (unless they're being traced), and return it
 	void unref(CScriptVar* oldVar);
+#ifdef TINYJS_TRACING_GC
+    int heapIndex; ///< Where this is in CScriptTracingCollector's links
+    friend class CScriptTracingCollector;
+#endif
+};
+
+/** The characters of a string that was made with '+'. Adding to the end of one of these just
+    appends to it, and the result shares the buffer, so building a string up a piece at a time
+    takes time in proportion to its length rather than its length squared. Each variable that
+    shares a buffer knows how much of the start of it is its own string, and only the variable
+    whose string is the whole buffer can add to it. */
+struct CScriptStringBuffer
+{
+    int refs; ///< The number of variables sharing this
+    bool sealed; ///< Set once something outside might be holding on to 'chars', so it mustn't change any more
+    std::string chars;
+
+    CScriptStringBuffer() : refs(1), sealed(false) {}
 };
 
 /// Variable class (containing a doubly-linked list of children)
@@ -232,22 +591,30 @@ public:
     int getExecutions(); ///< If this is a function, get the number of times it's been executed
 
     CScriptVarLink *findChild(const std::string &childName); ///< Tries to find a child with the given name, may return 0
+    CScriptVarLink *findChild(int childAtom); ///< As above, for a name that's already an atom
     CScriptVarLink *findChildOrCreate(const std::string &childName, int varFlags = SCRIPTVAR_UNDEFINED); ///< Tries to find a child with the given name, or will create it with the given flags
+    CScriptVarLink *findChildOrCreate(int childAtom, int varFlags = SCRIPTVAR_UNDEFINED);
     CScriptVarLink *findChildOrCreateByPath(const std::string &path); ///< Tries to find a child with the given path (separated by dots)
     CScriptVarLink *addChild(const std::string &childName, CScriptVar *child = NULL);
+    CScriptVarLink *addChild(int childAtom, CScriptVar *child = NULL);
     CScriptVarLink *addChildNoDup(const std::string &childName, CScriptVar *child = NULL); ///< add a child overwriting any with the same name
+    CScriptVarLink *addChildNoDup(int childAtom, CScriptVar *child = NULL);
     void removeChild(const std::string &childName, CScriptVar *child, bool throwIfMissing = false);
     void removeLink(CScriptVarLink *link); ///< Remove a specific link (this is faster than finding via a child)
     void removeAllChildren();
+    CScriptVarLink *findArrayElement(int idx); ///< Tries to find the child for an array index, may return 0
+    CScriptVarLink *findIndexOrCreate(CScriptVar *index); ///< As findChildOrCreate for 'this[index]', without turning ints into strings
     CScriptVar *getArrayIndex(int idx); ///< The the value at an array index
     void setArrayIndex(int idx, CScriptVar *value); ///< Set the value at an array index
-    int getArrayLength(); ///< If this is an array, return the number of items in it (else 0)
+    int getArrayLength() { return isArray() ? arrayLength : 0; } ///< If this is an array, return the number of items in it (else 0)
+    void setArrayLength(int length); ///< If this is an array, make it at least this long (as for 'new Array(length)')
     int getChildren(); ///< Get the number of children
 
     int getInt();
     bool getBool() { return getInt() != 0; }
     double getDouble();
     const std::string &getString();
+    size_t getStringLength(); ///< getString().size(), but without copying a string out of its CScriptStringBuffer
     std::string getParsableString(); ///< get Data as a parsable javascript string
     void setInt(int num);
     void setDouble(double val);
@@ -266,9 +633,12 @@ public:
     bool isNative() { return (flags&SCRIPTVAR_NATIVE) != 0; }
     bool isUndefined() { return (flags & SCRIPTVAR_VARTYPEMASK) == SCRIPTVAR_UNDEFINED; }
     bool isNull() { return (flags & SCRIPTVAR_NULL) != 0; }
-    bool isBasic() { return children.empty(); } ///< Is this *not* an array/object/etc
+    bool isBasic() { return !firstChild; } ///< Is this *not* an array/object/etc
+    bool isConstant() { return (flags & SCRIPTVAR_CONSTANT) != 0; } ///< Is this shared, so that it mustn't be changed?
+    bool isUnshared(); ///< Is the one link we have to this the only way to see it, so that it can be changed in place?
 
     CScriptVar *mathsOp(CScriptVar *b, int op); ///< do a maths op with another script variable
+    CScriptVar *concat(CScriptVar *b); ///< A new string of this followed by b (as mathsOp '+' for strings)
     void copyValue(CScriptVar *val); ///< copy the value from the value given
     CScriptVar *deepCopy(); ///< deep copy this node and return the result
 
@@ -277,35 +647,312 @@ public:
     void getJSON(std::ostringstream &destination, const std::string linePrefix = ""); ///< Write out all the JS code needed to recreate this script variable to the stream (as JSON)
     void setCallback(JSCallback callback, void *userdata); ///< Set the callback for native functions
 
-    std::unordered_map<std::string, CScriptVarLink*> children;
+    std::unordered_map<int, CScriptVarLink*> children; ///< Children by the atom of their name, if this has no shape
     std::vector<CScriptVarLink*> orderedChildren();	///< Returns a vector of the children of this variable ordered by most recently added last
+    std::vector<CScriptVarLink*> arrayElements(); ///< If this is an array, returns the links of the elements it has in index order (holes aren't in it)
 
     /// For memory management/garbage collection
-    CScriptVar *ref(); ///< Add reference to this variable
+    CScriptVar *ref(); ///< Add reference to this variable (with TINYJS_TRACING_GC, links don't, so this just keeps it alive)
     void unref(); ///< Remove a reference, and delete this variable if required
     int getRefs(); ///< Get the number of references to this script variable
+
+    static void *operator new(size_t) { return pool.allocate(); }
+    static void operator delete(void *ptr) { pool.release(ptr); }
+    static const CScriptPool &getPool() { return pool; } ///< For counting variables (on this thread)
 protected:
+    static thread_local CScriptPool pool;
+    static CScriptPool::Orphans poolOrphans;
+
     int refs; ///< The number of references held to this - used for garbage collection
     int executions; ///< The number of times this function has been executed (if this is a function)
     LIBHANDLE nativeHandle; ///< The handle to a jit-code compiled library
 
-    std::string data; ///< The contents of this variable if it is a string
+    std::string data; ///< The contents of this variable if it is a string (and it isn't in stringBuffer)
+    CScriptStringBuffer *stringBuffer; ///< If this is a string made by concat, its characters (or 0)
+    size_t stringLength; ///< How much of stringBuffer this string is
     long intData; ///< The contents of this variable if it is an int
     double doubleData; ///< The contents of this variable if it is a double
     int flags; ///< the flags determine the type of the variable - int/double/string/etc
     JSCallback jsCallback; ///< Callback for native functions
     void *jsCallbackUserData; ///< user data passed as second argument to native functions
+    CScriptSyntaxTree *parsedBody; ///< If this is a function, its body as parsed by CTinyJS (owned by that CTinyJS)
+    CScriptBytecode *bytecode; ///< If this is a function, its body as compiled to bytecode by CTinyJS (owned by that CTinyJS)
 
     /** Copy the basic data and flags from the variable given, with no
       * children. Should be used internally only - by copyValue and deepCopy */
     void copySimpleData(CScriptVar *val);
+    void appendString(std::string &str); ///< Add our string on to the end of 'str'
+    void releaseStringBuffer(); ///< Stop using stringBuffer, freeing it if nothing else is
 
     CScriptVarLink* firstChild; ///< used for ordered iteration through children (function defs, etc)
     CScriptVarLink* lastChild; ///< only used to maintain script link linked list
 
+    CScriptShape *shape; ///< The names of the children, or 0 if they're in 'children' instead
+    std::vector<CScriptVarLink*> slots; ///< Children in the order of 'shape', if this has one
+    void removeShape(); ///< Move the children into 'children' (arrays and big objects live there)
+
+    /* Arrays keep the children for their indices in a vector, apart from any that are so far
+       past the end that it'd be mostly holes. Those go into 'children' with everything else. */
+    std::vector<CScriptVarLink*> elements; ///< If this is an array, the children for indices below elements.size() (0 for holes)
+    int sparseElements; ///< If this is an array, the number of children for indices that are in 'children'
+    int arrayLength; ///< If this is an array, one more than its highest index
+    void updateArrayLength(); ///< Work out arrayLength again after removing a child
+
+    /* For the cycle collector (see CScriptCycleCollector) */
+    int cycleColor; ///< What the collector has found out about this variable so far
+    int candidateIndex; ///< Where this is in the collector's candidates, or -1
+    CScriptCycleCollector *collector; ///< The collector this is a candidate of, if it is one
+#ifdef TINYJS_TRACING_GC
+    int heapIndex; ///< Where this is in CScriptTracingCollector's variables
+    bool marked; ///< Whether the collection that's running has found this yet
+    friend class CScriptTracingCollector;
+#endif
+
     friend class CTinyJS;
+    friend struct CScriptPropertyCache;
+    friend class CScriptConstants;
+    friend class CScriptCycleCollector;
+    friend class CScriptMaths;
+    friend class CScriptMachineCode; // which reads ints straight out of variables
 };
 
+/** Values that are needed so often that everything with the value shares one variable, rather
+    than allocating its own: undefined, null, small integers (which include true and false) and
+    strings of one character. Like atoms they last for as long as the program runs, and they
+    must never be changed - anything that would change one in place has to copy it first (see
+    CScriptVarLink::getWritableVar). That goes for their reference counts too: ref() and unref()
+    leave constants alone, so engines running on different threads can share them safely. */
+class CScriptConstants
+{
+public:
+    static const int MIN_INT = -128;
+    static const int MAX_INT = 1023;
+
+    static CScriptVar *getUndefined() { return undefinedVar; }
+    static CScriptVar *getNull() { return nullVar; }
+    static CScriptVar *getChar(unsigned char ch) { return chars[ch]; } ///< A string of just 'ch'
+    /// The shared variable for an integer if it's small enough, or else a new one
+    static CScriptVar *newInt(int value) { return value >= MIN_INT && value <= MAX_INT ? ints[value - MIN_INT] : new CScriptVar(value); }
+    static CScriptVar *newString(const std::string &str); ///< As newInt, for strings of one character
+private:
+    static CScriptVar *undefinedVar;
+    static CScriptVar *nullVar;
+    static std::vector<CScriptVar*> ints; ///< MIN_INT to MAX_INT
+    static std::vector<CScriptVar*> chars;
+    static CScriptVar *pin(CScriptVar *var); ///< Mark a variable as a constant, and keep it alive
+    static std::vector<CScriptVar*> makeInts();
+    static std::vector<CScriptVar*> makeChars();
+};
+
+/** A value that doesn't need a CScriptVar of its own. Numbers, undefined and null are held right
+  * here, so that maths on them doesn't have to allocate anything: a CScriptVar is only made for
+  * one when it has to go somewhere that needs a link, like a variable, an argument or a return
+  * value. Anything else is a link. The bytecode's registers are these, and an empty register is
+  * a null link.
+  */
+struct CScriptValue
+{
+    enum TYPES { LINK, UNDEFINED, NULL_VALUE, INT, DOUBLE };
+
+    int type;
+    union
+    {
+        CScriptVarLink* link;
+        int intData;
+        double doubleData;
+    };
+
+    CScriptValue() : type(LINK), link(0) {}
+};
+
+/** The operators that can be done without making a CScriptVar for the result: maths on numbers
+    (and undefined and null), and comparing one string with another. There's a kernel for each pair of
+    operand types, all made from one template, and a table indexed by the pair of types picks
+    which to run. Anything the kernels can't do is left to CScriptVar::mathsOp. */
+class CScriptMaths
+{
+public:
+    /** Do what CScriptVar::mathsOp does, putting the value in 'result' instead of a new variable.
+      * This returns false (leaving 'result' alone) for anything it can't do that way, including
+      * the operations mathsOp throws about. */
+    static bool evaluate(CScriptVar *a, CScriptVar *b, int op, CScriptValue &result);
+    static bool evaluate(const CScriptValue &a, const CScriptValue &b, int op, CScriptValue &result); ///< As above, for values that might not be in variables
+    static CScriptVar *newVar(const CScriptValue &value); ///< A variable holding a value that isn't a link (a shared one if it can be)
+    /// Write a number straight into 'var' if nothing else can see it, which is the same as replacing it but without the allocation. Returns false if it couldn't be.
+    static bool assignInPlace(CScriptVar *var, const CScriptValue &value);
+
+    /// a = a <op> b, as CREATE_LINK(a, a->var->mathsOp(b, op)) but reusing a temporary's variable for a number if it can
+    static void apply(CScriptVarLink *&a, CScriptVar *b, int op);
+    /// lhs = lhs <op> b, as lhs->replaceWith(lhs->var->mathsOp(b, op)) but in place for a number if it can be
+    static void assign(CScriptVarLink *lhs, CScriptVar *b, int op);
+    /// The postfix ++ (op '+') and -- (op '-'), in place if they can be. Returns a new temporary with the old value.
+    static CScriptVarLink *postfix(CScriptVarLink *lhs, int op);
+
+private:
+    enum TYPES { INT, DOUBLE, UNDEFINED, NULL_VALUE, STRING, OTHER, TYPE_COUNT };
+    /// What a kernel sees of an operand
+    struct Operand
+    {
+        int type;
+        int intValue;
+        double doubleValue;
+        const std::string *stringValue;
+    };
+    typedef bool (*Kernel)(const Operand &a, const Operand &b, int op, CScriptValue &result);
+    static const Kernel kernels[TYPE_COUNT][TYPE_COUNT];
+
+    template<int A, int B> static bool kernel(const Operand &a, const Operand &b, int op, CScriptValue &result);
+    static void getOperand(CScriptVar *var, Operand &operand);
+    static void getOperand(const CScriptValue &value, Operand &operand);
+    static bool isWritable(CScriptVar *var); ///< Whether a number can be written straight into 'var' (see assignInPlace)
+};
+
+/** Frees loops of variables that only keep each other alive (like a.foo = a), which reference
+    counting alone never can. When a variable with children is unreffed and doesn't go to zero it
+    might have been the last way into such a loop, so it's kept as a candidate. collect() then does
+    a trial deletion from the candidates (Bacon and Rajan's synchronous cycle collection): it takes
+    away the references that everything reachable from them gives to each other, and whatever is
+    left with none is garbage. Anything that holds a variable without a link or a ref would fool it,
+    so CTinyJS only collects when it gets back out to the top level of execute() or evaluate(), once
+    there are more than getThreshold() candidates.
+    Each CTinyJS has its own collector, and whichever engine last ran on a thread gets the candidates
+    that turn up there (see makeCurrent). A collection with a time limit looks at the clock as it
+    marks, and if it runs out part way through a candidate it puts back what it took and leaves that
+    candidate for next time - so a pause only goes over the limit when the first candidate it looks
+    at reaches that much of the heap on its own. */
+class CScriptCycleCollector
+{
+public:
+    static const int DEFAULT_THRESHOLD = 10000;
+
+    CScriptCycleCollector();
+    ~CScriptCycleCollector();
+
+    /** Look for garbage from the candidates and free it. If 'maxMilliseconds' is given, stop once
+      * that much time has gone, leaving the rest of the candidates for next time. Returns the
+      * number of variables freed. */
+    size_t collect(double maxMilliseconds = 0);
+    void setThreshold(size_t candidates) { threshold = candidates; } ///< How many candidates there are before CTinyJS collects
+    size_t getThreshold() { return threshold; }
+    void setBudget(double maxMilliseconds) { budget = maxMilliseconds; } ///< The time CTinyJS gives to each collection (0 for no limit)
+    double getBudget() { return budget; }
+    size_t getCandidates() { return candidates.size(); }
+    void makeCurrent() { current = this; } ///< Have the variables unreffed on this thread become candidates here
+
+    // statistics
+    size_t getCollections() { return collections; }
+    size_t getFreedVars() { return freedVars; }
+    size_t getFreedBytes() { return freedBytes; } ///< Roughly - variables, their links and their strings
+    size_t getAbandoned() { return abandoned; } ///< Candidates given back part way through marking, as time ran out
+    double getLastPause() { return lastPause; } ///< In milliseconds
+    double getMaxPause() { return maxPause; }
+    double getTotalPause() { return totalPause; }
+
+private:
+    enum COLORS { BLACK, GRAY, WHITE, PURPLE }; ///< Alive (or not looked at), being tried, garbage, candidate
+    static const int BATCH_SIZE = 1024; ///< Candidates to mark before scanning them
+    static const int CHECK_INTERVAL = 256; ///< Variables to mark between looking at the clock
+
+    std::vector<CScriptVar*> candidates;
+    size_t threshold;
+    double budget;
+    size_t collections;
+    size_t freedVars;
+    size_t freedBytes;
+    size_t abandoned;
+    double lastPause;
+    double maxPause;
+    double totalPause;
+    std::chrono::steady_clock::time_point deadline; ///< When marking has to stop, if it's limited
+    int sinceCheck; ///< Variables marked since looking at the clock
+    std::vector<std::pair<CScriptVar*, int> > recolored; ///< What the candidate being marked has made gray, and its color before
+    std::vector<CScriptVar*> expanded; ///< What it's taken the children's references away from
+    static thread_local CScriptCycleCollector *current;
+
+    void add(CScriptVar *var);
+    static void addCandidate(CScriptVar *var); ///< To the collector it's already a candidate of, or else the current one
+    static void removeCandidate(CScriptVar *var);
+    /// Take away the references from everything reachable from 'var'. Unless 'finish' is set, this gives up if it's past the deadline, puts everything back as it was and returns false
+    bool markGray(CScriptVar *var, bool finish);
+    static void scan(CScriptVar *var); ///< Find what's still referenced from outside and put its references back
+    static void scanBlack(CScriptVar *var);
+    static void collectWhite(CScriptVar *var, std::vector<CScriptVar*> &garbage);
+
+    friend class CScriptVar;
+};
+
+#ifdef TINYJS_TRACING_GC
+/** Frees variables by finding everything that can still be reached, and deleting the rest, in
+    place of counting references, when TinyJS is built with TINYJS_TRACING_GC. Links then don't touch the
+    variables they point to at all, which saves the ref/unref on every temporary, and loops of
+    variables need nothing special. What's reached from is:
+      - variables with a ref(), which now just means 'keep this' (the root, the built in classes,
+        the constants, bytecode constants, and the scopes of functions that are running)
+      - variables with a link that isn't owned by another variable (temporaries, function
+        arguments, bytecode registers and anything the host program holds a CScriptVarLink for)
+    A variable held by nothing but a C++ pointer would be missed, so CTinyJS only collects where
+    there can't be one: between calls to execute() or evaluate(), and on the backward jumps of
+    bytecode loops, as long as no native function (or jit code) is running. It collects once the
+    heap has grown by getThreshold() variables, or has doubled since the last collection. */
+class CScriptTracingCollector
+{
+public:
+    static const int DEFAULT_THRESHOLD = 100000;
+    static const int PAUSE_BUCKETS = 8; ///< Pauses under 1ms, under 2ms, under 4ms... and the rest
+
+    static size_t collect(); ///< Free everything that can't be reached. Returns the number of variables freed
+    static bool isDue() { return vars.size() >= nextCollection; } ///< Whether the heap has grown enough to collect
+    static void setThreshold(size_t vars) { threshold = vars; nextCollection = vars; } ///< Variables allocated before the first collection, and the least between collections
+    static size_t getThreshold() { return threshold; }
+    static void enterNative() { nativeCalls++; } ///< A native function is starting, so it isn't safe to collect until...
+    static void leaveNative() { nativeCalls--; } ///< ...it's finished
+    static bool isSafe() { return nativeCalls == 0; }
+
+    // statistics
+    static size_t getHeapVars() { return vars.size(); } ///< Variables that haven't been freed yet (reachable or not)
+    static size_t getHeapLinks() { return links.size(); }
+    static size_t getHeapBytes() { return vars.size() * sizeof(CScriptVar) + links.size() * sizeof(CScriptVarLink); } ///< Roughly, not counting strings
+    static size_t getCollections() { return collections; }
+    static size_t getFreedVars() { return freedVars; }
+    static double getLastPause() { return lastPause; } ///< In milliseconds
+    static double getMaxPause() { return maxPause; }
+    static double getTotalPause() { return totalPause; }
+    static size_t getPauses(int bucket) { return pauses[bucket]; } ///< The number of collections with a pause in the given bucket
+
+private:
+    static std::vector<CScriptVar*> vars;
+    static std::vector<CScriptVarLink*> links;
+    static size_t threshold;
+    static size_t nextCollection;
+    static int nativeCalls;
+    static size_t collections;
+    static size_t freedVars;
+    static double lastPause;
+    static double maxPause;
+    static double totalPause;
+    static size_t pauses[PAUSE_BUCKETS];
+
+    static void add(CScriptVar *var) { var->heapIndex = (int)vars.size(); vars.push_back(var); }
+    static void remove(CScriptVar *var);
+    static void add(CScriptVarLink *link) { link->heapIndex = (int)links.size(); links.push_back(link); }
+    static void remove(CScriptVarLink *link);
+    static void mark(CScriptVar *var, std::vector<CScriptVar*> &stack);
+
+    friend class CScriptVar;
+    friend class CScriptVarLink;
+};
+#endif
+
+inline CScriptVarLink *CScriptPropertyCache::find(CScriptVar *object)
+{
+    CScriptShape *shape = object->shape;
+    if(shape)
+        for(int i = 0; i < ENTRIES; i++)
+            if(shapes[i] == shape)
+                return object->slots[indices[i]];
+    return findSlow(object);
+}
+
 class CTinyJS
 {
 public:
@@ -349,13 +996,72 @@ public:
     /// Send all variables to stdout
     void trace();
 
+    /// Choose how code is run - one of TINYJS_EXECUTION_MODES. TINYJS_EXECUTE_SOURCE is the default.
+    void setExecutionMode(int mode);
+    int getExecutionMode() { return executionMode; }
+    /// Choose which TINYJS_OPTIMIZATIONS are made to syntax trees parsed from now on. TINYJS_OPTIMIZE_ALL is the default.
+    void setOptimizations(int passes);
+    int getOptimizations() { return optimizations; }
+    /** Choose which TINYJS_COMPILERS hot functions are compiled with. TINYJS_COMPILE_GCC is the default.
+        With both, a function gets machine code first, and then goes to gcc once it has run ten times
+        as often again. */
+    void setCompilers(int compilers);
+    int getCompilers() { return compilers; }
+    /** Choose how many threads run gcc, so a script carries on (without the function being compiled)
+        while it does. 1 is the default, and 0 runs gcc there and then, stopping the script until it's done. */
+    void setCompileThreads(int threads);
+    int getCompileThreads() { return compileThreads; }
+    /** Have each background thread wait up to 'milliseconds' for more functions to get hot once it finds one,
+        and build them all into one library with a single run of gcc. 0 (the default) builds each on its own. */
+    void setCompileBatching(int milliseconds);
+    int getCompileBatching() { return compileBatchWindow; }
+    /// Wait for everything given to the background compiler to be built (even what hotter functions pushed out of its queue), and start using it
+    void finishCompiles();
+    /** Keep what gcc builds in 'directory', named by a hash of everything that went into it, so that
+        later runs (and other CTinyJS's) load it rather than run gcc again. The least recently used are
+        deleted when there's more than 'maxBytes' of them (0 for no limit). It's off ("") by default. */
+    void setCompileCache(const std::string &directory, size_t maxBytes = 0);
+    /// Get the TINYJS_COMPILE_STATES of the function at the given path, or -1 if there's no such script function
+    int getCompileState(const std::string &path);
+    /// Every function that a compiler has failed on (by function body), and why
+    std::vector<CScriptCompileFailure> getCompileFailures();
+    /// Write the bytecode for the function at the given path to 'out'. Returns false if there's no such function.
+    bool disassemble(const std::string &path, std::ostream &out);
+    /** For gcc's type-specialized code, when one of its guards fails: run the call whose scope is 'root'
+        in the interpreter instead. The code has changed nothing anything else can see by then, so the
+        interpreter runs the whole of the body. */
+    void deoptimize(CScriptVar *root);
+    /// The collector that frees loops of this engine's variables, for its threshold, budget and statistics
+    CScriptCycleCollector &getCycleCollector() { return cycleCollector; }
+
     CScriptVar *root;   /// root of symbol table
 private:
     int executions_to_compile;
+    int executionMode;
+    int optimizations;
+    int compilers;
+    int compileThreads;
+    int compileBatchWindow;
+    CScriptCompiler *compiler; /// Builds with gcc in the background (made when it's first needed)
+    CScriptCycleCollector cycleCollector;
+    std::string compileCache; /// Where gcc's libraries are kept between runs (see setCompileCache)
+    size_t compileCacheSize;
+    std::unordered_map<std::string, CScriptSyntaxTree*> parsedFunctions; /// Function bodies we have parsed, by source
+    std::unordered_map<std::string, CScriptLex*> lexedFunctions; /// Function bodies we have scanned into tokens, by source
+    std::unordered_map<CScriptSyntaxTree*, CScriptBytecode*> bytecodes; /// Function bodies we have compiled to bytecode, by syntax tree
+    std::unordered_map<CScriptBytecode*, CScriptMachineCode*> machineCode; /// Bytecode we have compiled to machine code (0 if it couldn't be)
+    std::map<std::pair<std::string, int>, CScriptCompileFailure> compileFailures; /// By function body and compiler
+    std::unordered_map<std::string, CScriptTypeFeedback> typeFeedback; /// By function parameters and body
+    CScriptVar *nativeFunction; /// The native function being called, if one is (for deoptimize)
+    std::vector<CScriptVarLink*> *frame; /// Where the variables of the syntax tree or bytecode being run were found, by slot
+    /* Calls take their scope and frame from these, and give them back when they return,
+       so a call only has to allocate them when it goes deeper than any call before it. */
+    std::vector<CScriptVar*> freeScopes;
+    std::vector<std::vector<CScriptVarLink*>*> freeFrames;
     CScriptLex *l;             /// current lexer
     std::vector<CScriptVar*> scopes; /// stack of scopes when parsing
 #ifdef TINYJS_CALL_STACK
-    std::vector<std::string> call_stack; /// Names of places called so we can show when erroring
+    std::vector<CScriptCallFrame> call_stack; /// Places called from so we can show when erroring
 #endif
 
     CScriptVar *stringClass; /// Built in string class
@@ -364,6 +1070,10 @@ private:
 
     // parsing - in order of precedence
     CScriptVarLink *functionCall(bool &execute, CScriptVarLink *function, CScriptVar *parent);
+    /** Call a function with arguments that have already been evaluated (used when walking a syntax tree).
+        The call stack has it made from 'position' in 'source', or from where the lexer is if there's no source. */
+    CScriptVarLink *callFunction(bool &execute, CScriptVarLink *function, CScriptVar *parent, const std::vector<CScriptVarLink*> &arguments,
+                                 CScriptTokenList *source = 0, int position = 0);
     CScriptVarLink *factor(bool &execute);
     CScriptVarLink *unary(bool &execute);
     CScriptVarLink *term(bool &execute);
@@ -375,18 +1085,42 @@ private:
     CScriptVarLink *base(bool &execute);
     void block(bool &execute);
     void statement(bool &execute);
+    void skipExpressions(); ///< Step over code that isn't being executed, up to the ';' or close bracket that ends it
     // parsing utility functions
     CScriptVarLink *parseFunctionDefinition();
     void parseFunctionArguments(CScriptVar *funcVar);
+    // function call utility functions
+    void prepareCall(CScriptVarLink *function); ///< Check 'function' can be called, and compile it if it's time to
+    /// Run the function with its arguments already in functionRoot, called from 'position' in 'source' (or where the lexer is)
+    CScriptVarLink *executeFunction(bool &execute, CScriptVarLink *function, CScriptVar *functionRoot, CScriptTokenList *source = 0, int position = 0);
+    void interpretBody(bool &execute, CScriptVar *function); ///< Run a function's body in the execution mode, in the scope already pushed
+    void recordTypes(CScriptVar *function, CScriptVar *functionRoot); ///< Note the types of a call's variables for gcc (see CScriptTypeFeedback)
+    std::string getFeedbackKey(CScriptVar *function); ///< What a function's type feedback is kept under: its parameters and body, as types are by name
+    CScriptVar *newScope(CScriptVar *parent); ///< A scope for a call, holding just its return value and then 'this' (if there's a parent)
+    void freeScope(CScriptVar *scope); ///< Empty a scope, and keep it for another call
+    CScriptVar *getArgument(CScriptVarLink *value); ///< The variable to pass for an argument: basic values are copied unless nothing else can see them
+    std::vector<CScriptVarLink*> *newFrame(int slots); ///< A frame with the given number of empty slots
+    void freeFrame(std::vector<CScriptVarLink*> *frame); ///< Keep a frame for another call
+    CScriptLex *getLexedBody(CScriptVar *function); ///< Get a new lexer for a function's body, sharing the tokens (and brackets) scanned the first time
+    CScriptSyntaxTree *getParsedBody(CScriptVar *function); ///< Get the syntax tree for a function's body, parsing it if we haven't already
+    CScriptBytecode *getBytecode(CScriptVar *function); ///< Get the bytecode for a function's body, compiling it if we haven't already
+    void collectGarbage(); ///< Run the collector if it's safe to here and there's enough to do
 
     CScriptVarLink *findInScopes(const std::string &childName); ///< Finds a child, looking recursively up the scopes
+    CScriptVarLink *findInScopes(int childAtom);
+    /// Find a variable that has a slot in the current frame, looking in the scopes the first time
+    CScriptVarLink *findInFrame(int slot, int atom);
+    void setInFrame(int slot, CScriptVarLink *link) { (*frame)[slot] = link; } ///< A variable has been defined in the current scope
     /// Look up in any parent classes of the given object
     CScriptVarLink *findInParentClasses(CScriptVar *object, const std::string &name);
+    CScriptVarLink *findInParentClasses(CScriptVar *object, int atom);
 
     /* Used for new keyword and object/array definitions in JIT compiling */
     CScriptVar* createObject(bool& execute, CScriptLex* lexer);
     CScriptVar* createArray(bool& execute, CScriptLex* lexer);
     CScriptVar* keywordNew(bool& execute, CScriptLex* lexer);
+    /// For 'new' of a built in class whose instances aren't plain objects (only Array so far), make 'obj' one and return true
+    bool constructBuiltin(CScriptVar *obj, CScriptVar *objClass, const std::vector<CScriptVarLink*> &arguments);
     /* These are the functions actually registered with addNative to implement
        new, [], and {} in the JIT-compiled code. The second parameter is the instance of
        CTinyJS, since these functions must be declared static to match the signature
@@ -397,6 +1131,18 @@ private:
 
     /* Compiles a function into native code. */
     void compile(CScriptVarLink* function);
+    std::string getCompileSource(CScriptVarLink* function); ///< The C++ for gcc to compile a function from
+    void installCompiled(CScriptVar* function, LIBHANDLE handle, JSCallback callback); ///< Make a function call what gcc built
+    void installCompiled(); ///< Install everything the background compiler has finished
+    /// Compile a function into machine code, returning false if it can't be
+    bool compileMachineCode(CScriptVarLink* function);
+    /// Note that 'compiler' failed on a function, and when it can be tried again
+    void compileFailed(CScriptVar* function, const std::string &name, int compiler, const std::string &reason);
+    bool isCompileRetryDue(CScriptVar* function); ///< Has a function that failed backed off enough for gcc to try again?
+    void recompile(CScriptVarLink* function); ///< Look again at a function that's waiting for the background compiler, or failed
+
+    friend class CSyntaxNode; // so the syntax tree can be evaluated against our scopes
+    friend class CScriptBytecode; // ...and so can bytecode
 };
 
 #endif
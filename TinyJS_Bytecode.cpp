@@ -0,0 +1,1128 @@
+#include "TinyJS_Bytecode.h"
+#include "TinyJS_SyntaxTree.h"
+#include <assert.h>
+#include <iomanip>
+#include <sstream>
+
+#define ASSERT(X) assert(X)
+
+// computed gotos are a GNU extension; everyone else gets a switch
+#ifdef __GNUC__
+#define TINYJS_COMPUTED_GOTO
+#endif
+
+static const char* opNames[] =
+{
+#define TINYJS_BYTECODE_NAME(name) #name,
+#define TINYJS_BYTECODE_MATHS_NAME(name, token) #name,
+    TINYJS_BYTECODE_OPS(TINYJS_BYTECODE_NAME)
+    TINYJS_BYTECODE_MATHS(TINYJS_BYTECODE_MATHS_NAME)
+#undef TINYJS_BYTECODE_NAME
+#undef TINYJS_BYTECODE_MATHS_NAME
+};
+
+/// The opcode that does the maths operation for the given token
+static int mathsOpcode(int token)
+{
+    switch(token)
+    {
+#define TINYJS_BYTECODE_MATHS_CASE(name, token) case token: return OP_##name;
+        TINYJS_BYTECODE_MATHS(TINYJS_BYTECODE_MATHS_CASE)
+#undef TINYJS_BYTECODE_MATHS_CASE
+    }
+    throw new CScriptException("Operation " + CScriptLex::getTokenStr(token) + " has no bytecode");
+}
+
+CScriptBytecode::CScriptBytecode(CScriptSyntaxTree* tree)
+{
+    registers = 0;
+    maxRegisters = 0;
+    frameSize = tree->getSlotCount();
+    source = tree->getSource();
+    assembleStatement(*this, tree->getRoot());
+    emit(OP_END);
+    ASSERT(registers == 0);
+}
+
+CScriptBytecode::~CScriptBytecode()
+{
+    for(CScriptVar* constant : constants)
+        constant->unref();
+}
+
+int CScriptBytecode::emit(int op, int a, int b, int c)
+{
+    checkOperand(a);
+    checkOperand(b);
+    checkOperand(c);
+    CScriptInstruction instruction;
+    instruction.op = (unsigned short)op;
+    instruction.a = (unsigned short)a;
+    instruction.b = (unsigned short)b;
+    instruction.c = (unsigned short)c;
+    code.push_back(instruction);
+    positions.push_back(0);
+    checkOperand(here());
+    return here() - 1;
+}
+
+void CScriptBytecode::setPositions(int from, int position)
+{
+    // the statements inside this one have been through here already, and calls have their own
+    for(int instruction = from; instruction < here(); instruction++)
+        if(!positions[instruction])
+            positions[instruction] = position;
+}
+
+int CScriptBytecode::addConstant(CScriptVar* value)
+{
+    constants.push_back(value->ref());
+    return (int)constants.size() - 1;
+}
+
+int CScriptBytecode::addName(const std::string& name)
+{
+    return addName(CScriptAtoms::get(name));
+}
+
+int CScriptBytecode::addName(int atom)
+{
+    for(size_t i = 0; i < names.size(); i++)
+        if(names[i] == atom)
+            return (int)i;
+    names.push_back(atom);
+    return (int)names.size() - 1;
+}
+
+int CScriptBytecode::addCache(int atom)
+{
+    caches.push_back(CScriptPropertyCache(atom));
+    checkOperand((int)caches.size() - 1);
+    return (int)caches.size() - 1;
+}
+
+int CScriptBytecode::allocRegister()
+{
+    int reg = registers++;
+    if(registers > maxRegisters)
+        maxRegisters = registers;
+    checkOperand(reg);
+    return reg;
+}
+
+void CScriptBytecode::freeRegister(int reg)
+{
+    ASSERT(reg == registers - 1);
+    registers--;
+}
+
+void CScriptBytecode::checkOperand(int value)
+{
+    if(value < 0 || value > NO_REGISTER)
+        throw new CScriptException("Function too large to compile to bytecode");
+}
+
+void assembleStatement(CScriptBytecode& code, CSyntaxNode* stmt)
+{
+    int from = code.here();
+    if(dynamic_cast<CSyntaxExpression*>(stmt))
+    {
+        int reg = code.allocRegister();
+        stmt->assemble(code, reg);
+        code.emit(OP_CLEAR, reg);
+        code.freeRegister(reg);
+    }
+    else
+        stmt->assemble(code, CScriptBytecode::NO_REGISTER);
+    code.setPositions(from, stmt->getPosition());
+}
+
+// ----------------------------------------------------------------------------------- EXECUTION
+
+/// Empty a register, freeing what was there if it was a temporary
+static inline void clearRegister(CScriptValue& reg)
+{
+    if(reg.type == CScriptValue::LINK)
+        CLEAN(reg.link);
+    reg.type = CScriptValue::LINK;
+    reg.link = 0;
+}
+
+/// Put a new link in a register, freeing what was there if it was a temporary
+static inline void setRegister(CScriptValue& reg, CScriptVarLink* value)
+{
+    if(reg.type != CScriptValue::LINK || reg.link != value)
+        clearRegister(reg);
+    reg.type = CScriptValue::LINK;
+    reg.link = value;
+}
+
+/// Get the link in a register, turning a value held there into a temporary link first
+static inline CScriptVarLink* link(CScriptValue& reg)
+{
+    if(reg.type != CScriptValue::LINK)
+    {
+        CScriptVarLink* value = new CScriptVarLink(CScriptMaths::newVar(reg));
+        reg.type = CScriptValue::LINK;
+        reg.link = value;
+    }
+    return reg.link;
+}
+
+static inline bool setInt(CScriptValue& result, int value)
+{
+    result.type = CScriptValue::INT;
+    result.intData = value;
+    return true;
+}
+
+static inline bool setDouble(CScriptValue& result, double value)
+{
+    result.type = CScriptValue::DOUBLE;
+    result.doubleData = value;
+    return true;
+}
+
+/// rA = rA <op> rB, freeing rB
+static inline void mathsOp(CScriptValue& a, CScriptValue& b, int op)
+{
+    CScriptValue result;
+    if(CScriptMaths::evaluate(a, b, op, result))
+    {
+        clearRegister(a);
+        a = result;
+    }
+    else
+    {
+        CScriptVar* res = link(a)->var->mathsOp(link(b)->var, op);
+        CREATE_LINK(a.link, res);
+    }
+    clearRegister(b);
+}
+
+/// Store a value in a variable, writing a number straight into it if nothing else can see it
+static void assign(CScriptVarLink* lhs, CScriptValue& value)
+{
+    if(!CScriptMaths::assignInPlace(lhs->var, value))
+        lhs->replaceWith(link(value));
+    clearRegister(value);
+}
+
+static inline bool getBool(const CScriptValue& reg)
+{
+    switch(reg.type)
+    {
+    case CScriptValue::LINK: return reg.link->var->getBool();
+    case CScriptValue::INT: return reg.intData != 0;
+    case CScriptValue::DOUBLE: return (int)reg.doubleData != 0; // as CScriptVar::getBool does
+    default: return false;
+    }
+}
+
+/// Get 'count' registers from 'first' as links, for a call
+static std::vector<CScriptVarLink*> arguments(CScriptValue* regs, int first, int count)
+{
+    std::vector<CScriptVarLink*> links;
+    links.reserve(count);
+    for(int i = first; i < first + count; i++)
+        links.push_back(link(regs[i]));
+    return links;
+}
+
+void CScriptBytecode::begin(State& state, CTinyJS* js, bool& execute)
+{
+    state.js = js;
+    state.execute = &execute;
+    state.registers.resize(maxRegisters);
+    state.regs = state.registers.empty() ? 0 : &state.registers[0];
+    state.start = &code[0];
+    state.constants = constants.empty() ? 0 : &constants[0];
+    state.names = names.empty() ? 0 : &names[0];
+    state.caches = caches.empty() ? 0 : &caches[0];
+    state.source = source;
+    state.positions = &positions[0];
+    state.oldFrame = js->frame;
+    js->frame = js->newFrame(frameSize);
+}
+
+void CScriptBytecode::end(State& state)
+{
+    for(CScriptValue& reg : state.registers)
+        clearRegister(reg);
+    state.js->freeFrame(state.js->frame);
+    state.js->frame = state.oldFrame;
+}
+
+/* The instructions. Each returns STEP_NEXT, STEP_JUMP to go to instruction B, or STEP_STOP
+   once the code is done. They're shared by the interpreter below and by CScriptMachineCode. */
+#define R(x) s.regs[x]
+#define L(x) link(s.regs[x])
+#define TINYJS_STEP(name) inline int CScriptBytecode::step##name(State& s, const CScriptInstruction* pc)
+#ifdef TINYJS_TRACING_GC
+// every loop jumps backwards, so this is often enough to collect at, and everything is in a register or a scope
+#define STEP_JUMP_TO(target) { if(s.start + (target) <= pc) s.js->collectGarbage(); return STEP_JUMP; }
+#else
+#define STEP_JUMP_TO(target) return STEP_JUMP
+#endif
+
+TINYJS_STEP(NOP)
+{
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(CONST)
+{
+    CScriptVar* constant = s.constants[pc->b];
+    clearRegister(R(pc->a));
+    if(constant->isInt())
+        setInt(R(pc->a), constant->getInt());
+    else if(constant->isDouble())
+        setDouble(R(pc->a), constant->getDouble());
+    else
+        R(pc->a).link = new CScriptVarLink(constant->deepCopy());
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(UNDEFINED)
+{
+    clearRegister(R(pc->a));
+    R(pc->a).type = CScriptValue::UNDEFINED;
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(NULL)
+{
+    clearRegister(R(pc->a));
+    R(pc->a).type = CScriptValue::NULL_VALUE;
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(NAME)
+{
+    CScriptVarLink* a = s.js->findInScopes(s.names[pc->b]);
+    if(!a)
+    {
+        /* Variable doesn't exist! JavaScript says we should create it
+         * (we won't add it here. This is done by LVALUE) */
+        a = new CScriptVarLink(new CScriptVar(), s.names[pc->b]);
+    }
+    setRegister(R(pc->a), a);
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(LOCAL)
+{
+    CScriptVarLink* a = s.js->findInFrame(pc->b, s.names[pc->c]);
+    if(!a)
+        a = new CScriptVarLink(new CScriptVar(), s.names[pc->c]);
+    setRegister(R(pc->a), a);
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(MEMBER)
+{
+    CScriptVar* object = L(pc->b)->var;
+    CScriptPropertyCache& cache = s.caches[pc->c];
+    int name = cache.atom;
+    CScriptVarLink* child = cache.find(object);
+    if(!child)
+        child = s.js->findInParentClasses(object, name);
+    if(!child)
+        child = L(pc->b)->getWritableVar()->addChild(name);
+    setRegister(R(pc->a), child);
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(INDEX)
+{
+    CScriptVarLink* child;
+    if(R(pc->c).type == CScriptValue::INT)
+    {
+        CScriptVar index(R(pc->c).intData);
+        child = L(pc->b)->getWritableVar()->findIndexOrCreate(&index);
+    }
+    else
+        child = L(pc->b)->getWritableVar()->findIndexOrCreate(L(pc->c)->var);
+    clearRegister(R(pc->c));
+    setRegister(R(pc->a), child);
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(RELEASE)
+{
+    CScriptVarLink* child = L(pc->b);
+    R(pc->b).link = 0;
+    R(pc->a).link = releaseParent(child, L(pc->a));
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(MOVE)
+{
+    if(pc->a != pc->b)
+    {
+        clearRegister(R(pc->a));
+        R(pc->a) = R(pc->b);
+        R(pc->b) = CScriptValue();
+    }
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(CLEAR)
+{
+    clearRegister(R(pc->a));
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(NOT)
+{
+    CScriptValue zero;
+    zero.type = CScriptValue::INT;
+    zero.intData = 0;
+    mathsOp(R(pc->a), zero, LEX_EQUAL);
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(BOOL)
+{
+    bool value = getBool(R(pc->b));
+    clearRegister(R(pc->b));
+    clearRegister(R(pc->a));
+    setInt(R(pc->a), value);
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(POSTINC)
+{
+    CScriptVarLink* a = L(pc->b);
+    R(pc->b).link = 0;
+    CScriptVar* var = a->var;
+    int delta = pc->op == OP_POSTINC ? 1 : -1;
+    if(var->isInt() && var->isBasic())
+    {
+        int oldValue = var->getInt();
+        if(var->isUnshared())
+            var->setInt(oldValue + delta); // in-place add/subtract
+        else
+            a->replaceWith(CScriptConstants::newInt(oldValue + delta));
+        CLEAN(a);
+        clearRegister(R(pc->a));
+        setInt(R(pc->a), oldValue);
+    }
+    else
+    {
+        CScriptVarLink* oldValue = CScriptMaths::postfix(a, pc->op == OP_POSTINC ? '+' : '-');
+        CLEAN(a);
+        setRegister(R(pc->a), oldValue);
+    }
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(POSTDEC)
+{
+    return stepPOSTINC(s, pc);
+}
+
+TINYJS_STEP(LVALUE)
+{
+    /* If we're assigning to this and we don't have a parent,
+     * add it to the symbol table root as per JavaScript. */
+    CScriptVarLink* lhs = L(pc->a);
+    if(!lhs->owned)
+    {
+        if(lhs->nameAtom != TINYJS_ATOM_TEMP_NAME)
+        {
+            R(pc->a).link = s.js->root->addChildNoDup(lhs->nameAtom, lhs->var);
+            CLEAN(lhs);
+        }
+        else
+            TRACE("Trying to assign to an un-named type\n");
+    }
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(ASSIGN)
+{
+    assign(L(pc->a), R(pc->b));
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(ASSIGNADD)
+{
+    CScriptValue result;
+    int op = pc->op == OP_ASSIGNADD ? '+' : '-';
+    if(CScriptMaths::evaluate(R(pc->a), R(pc->b), op, result))
+        assign(L(pc->a), result);
+    else
+        L(pc->a)->replaceWith(L(pc->a)->var->mathsOp(L(pc->b)->var, op));
+    clearRegister(R(pc->b));
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(ASSIGNSUB)
+{
+    return stepASSIGNADD(s, pc);
+}
+
+TINYJS_STEP(DEFVAR)
+{
+    setRegister(R(pc->a), s.js->scopes.back()->findChildOrCreate(s.names[pc->b]));
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(DEFLOCAL)
+{
+    setRegister(R(pc->a), s.js->scopes.back()->findChildOrCreate(s.names[pc->c]));
+    s.js->setInFrame(pc->b, R(pc->a).link);
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(DEFMEMBER)
+{
+    setRegister(R(pc->a), L(pc->a)->getWritableVar()->findChildOrCreate(s.names[pc->b]));
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(JMP)
+{
+    STEP_JUMP_TO(pc->b);
+}
+
+TINYJS_STEP(JMPF)
+{
+    bool value = getBool(R(pc->a));
+    if(pc->c)
+        clearRegister(R(pc->a));
+    if(value == (pc->op == OP_JMPT))
+        STEP_JUMP_TO(pc->b);
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(JMPT)
+{
+    return stepJMPF(s, pc);
+}
+
+TINYJS_STEP(FUNC)
+{
+    setRegister(R(pc->a), new CScriptVarLink(s.constants[pc->b]->deepCopy(), s.names[pc->c]));
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(DEFFUNC)
+{
+    CScriptVarLink* function = s.js->scopes.back()->addChildNoDup(s.names[pc->c], s.constants[pc->b]->deepCopy());
+    if(pc->a != NO_SLOT)
+        s.js->setInFrame(pc->a, function);
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(OBJECT)
+{
+    setRegister(R(pc->a), new CScriptVarLink(new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_OBJECT)));
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(ARRAY)
+{
+    setRegister(R(pc->a), new CScriptVarLink(new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_ARRAY)));
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(SETCHILD)
+{
+    L(pc->a)->var->addChild(s.names[pc->b], L(pc->c)->var);
+    clearRegister(R(pc->c));
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(CALL)
+{
+    int base = pc->a;
+    std::vector<CScriptVarLink*> args = arguments(s.regs, base + 2, pc->b);
+    CScriptVarLink* parent = R(base).type == CScriptValue::LINK && !R(base).link ? 0 : L(base);
+    CScriptVarLink* returnVar = s.js->callFunction(*s.execute, L(base + 1), parent ? parent->var : 0, args,
+                                                   s.source, s.positions[pc - s.start]);
+    for(int i = base + 2 + pc->b - 1; i >= base + 2; i--)
+        clearRegister(R(i));
+    // the function may belong to the parent, so it has to go first
+    clearRegister(R(base + 1));
+    setRegister(R(base), returnVar);
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(NEW)
+{
+    int base = pc->a;
+    int className = s.names[pc->c];
+    CScriptVarLink* objLink;
+    CScriptVarLink* objClassOrFunc = s.js->findInScopes(className);
+    if(!objClassOrFunc)
+    {
+        TRACE("%s is not a valid class name", CScriptAtoms::getString(className).c_str());
+        objLink = new CScriptVarLink(new CScriptVar());
+    }
+    else
+    {
+        // keep a link to our object so it doesn't get cleaned up during the constructor
+        objLink = new CScriptVarLink(new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_OBJECT));
+        std::vector<CScriptVarLink*> args = arguments(s.regs, base + 1, pc->b);
+        if(objClassOrFunc->var->isFunction())
+            CLEAN(s.js->callFunction(*s.execute, objClassOrFunc, objLink->var, args, s.source, s.positions[pc - s.start]))
+        else if(!s.js->constructBuiltin(objLink->var, objClassOrFunc->var, args))
+            objLink->var->addChild(TINYJS_ATOM_PROTOTYPE_CLASS, objClassOrFunc->var);
+    }
+    for(int i = base + pc->b; i > base; i--)
+        clearRegister(R(i));
+    setRegister(R(base), objLink);
+    return STEP_NEXT;
+}
+
+TINYJS_STEP(RETURN)
+{
+    CScriptVarLink* resultVar = s.js->scopes.back()->findChild(TINYJS_ATOM_RETURN_VAR);
+    if(resultVar && pc->a == NO_REGISTER)
+        resultVar->replaceWith((CScriptVarLink*)0);
+    else if(resultVar)
+        assign(resultVar, R(pc->a));
+    else
+        TRACE("RETURN statement, but not in a function.\n");
+    *s.execute = false;
+    return STEP_STOP;
+}
+
+TINYJS_STEP(END)
+{
+    return STEP_STOP;
+}
+
+#define TINYJS_BYTECODE_MATHS_STEP(name, token) \
+TINYJS_STEP(name) \
+{ \
+    mathsOp(R(pc->a), R(pc->b), token); \
+    return STEP_NEXT; \
+}
+TINYJS_BYTECODE_MATHS(TINYJS_BYTECODE_MATHS_STEP)
+#undef TINYJS_BYTECODE_MATHS_STEP
+
+#undef STEP_JUMP_TO
+#undef TINYJS_STEP
+#undef R
+#undef L
+
+/// Say an error was at the instruction that threw it, unless somewhere more exact already has (see CScriptException)
+static void placeError(CScriptException* e, const CScriptBytecode::State& s, const CScriptInstruction* pc)
+{
+    int position = s.positions[pc - s.start];
+    if(!e->source && position)
+    {
+        e->source = s.source;
+        e->position = position;
+    }
+}
+
+/// A step that catches anything thrown, for code that can't be unwound through
+template<int (*STEP)(CScriptBytecode::State&, const CScriptInstruction*)>
+static int catchingStep(CScriptBytecode::State* s, const CScriptInstruction* pc)
+{
+    try
+    {
+        return STEP(*s, pc);
+    }
+    catch(CScriptException* e)
+    {
+        placeError(e, *s, pc);
+        s->exception = std::current_exception();
+        return CScriptBytecode::STEP_STOP;
+    }
+    catch(...)
+    {
+        s->exception = std::current_exception();
+        return CScriptBytecode::STEP_STOP;
+    }
+}
+
+CScriptBytecode::StepFunction CScriptBytecode::getStep(int op)
+{
+    static const StepFunction steps[] =
+    {
+#define TINYJS_BYTECODE_STEP(name) &catchingStep<&CScriptBytecode::step##name>,
+#define TINYJS_BYTECODE_MATHS_STEP(name, token) &catchingStep<&CScriptBytecode::step##name>,
+        TINYJS_BYTECODE_OPS(TINYJS_BYTECODE_STEP)
+        TINYJS_BYTECODE_MATHS(TINYJS_BYTECODE_MATHS_STEP)
+#undef TINYJS_BYTECODE_STEP
+#undef TINYJS_BYTECODE_MATHS_STEP
+    };
+    return steps[op];
+}
+
+#ifdef TINYJS_COMPUTED_GOTO
+#define VM_CASE(name) label_##name:
+#define VM_DISPATCH() goto *dispatch[pc->op]
+#else
+#define VM_CASE(name) case name:
+#define VM_DISPATCH() continue
+#endif
+#define VM_NEXT() { pc++; VM_DISPATCH(); }
+#define VM_JUMP(target) { pc = start + (target); VM_DISPATCH(); }
+#define VM_STEP(name) \
+        VM_CASE(OP_##name) \
+            switch(step##name(state, pc)) \
+            { \
+            case STEP_NEXT: VM_NEXT(); \
+            case STEP_JUMP: VM_JUMP(pc->b); \
+            default: goto done; \
+            }
+#define VM_MATHS_STEP(name, token) VM_STEP(name)
+
+void CScriptBytecode::execute(CTinyJS* js, bool& execute)
+{
+#ifdef TINYJS_COMPUTED_GOTO
+    static void* dispatch[] =
+    {
+#define TINYJS_BYTECODE_LABEL(name) &&label_OP_##name,
+#define TINYJS_BYTECODE_MATHS_LABEL(name, token) &&label_OP_##name,
+        TINYJS_BYTECODE_OPS(TINYJS_BYTECODE_LABEL)
+        TINYJS_BYTECODE_MATHS(TINYJS_BYTECODE_MATHS_LABEL)
+#undef TINYJS_BYTECODE_LABEL
+#undef TINYJS_BYTECODE_MATHS_LABEL
+    };
+#endif
+    State state;
+    begin(state, js, execute);
+    const CScriptInstruction* start = state.start;
+    const CScriptInstruction* pc = start;
+    try
+    {
+#ifdef TINYJS_COMPUTED_GOTO
+        VM_DISPATCH();
+#else
+        for(;;) switch(pc->op) {
+#endif
+        TINYJS_BYTECODE_OPS(VM_STEP)
+        TINYJS_BYTECODE_MATHS(VM_MATHS_STEP)
+#ifndef TINYJS_COMPUTED_GOTO
+        default:
+            ASSERT(0);
+            goto done;
+        }
+#endif
+    }
+    catch(CScriptException* e)
+    {
+        placeError(e, state, pc);
+        end(state);
+        throw e;
+    }
+done:
+    end(state);
+}
+
+#undef VM_CASE
+#undef VM_DISPATCH
+#undef VM_NEXT
+#undef VM_JUMP
+#undef VM_STEP
+#undef VM_MATHS_STEP
+
+// ----------------------------------------------------------------------------------- DISASSEMBLY
+
+void CScriptBytecode::disassemble(std::ostream& out)
+{
+    out << "; " << code.size() << " instructions, " << maxRegisters << " registers, "
+        << frameSize << " slots, " << constants.size() << " constants\n";
+    for(size_t i = 0; i < code.size(); i++)
+    {
+        const CScriptInstruction& ins = code[i];
+        std::ostringstream operands;
+        switch(ins.op)
+        {
+        case OP_NOP:
+        case OP_END:
+            break;
+        case OP_UNDEFINED:
+        case OP_NULL:
+        case OP_CLEAR:
+        case OP_NOT:
+        case OP_LVALUE:
+        case OP_OBJECT:
+        case OP_ARRAY:
+            operands << "r" << ins.a;
+            break;
+        case OP_CONST:
+        {
+            std::ostringstream value;
+            constants[ins.b]->getJSON(value);
+            operands << "r" << ins.a << ", k" << ins.b << "\t; " << value.str();
+            break;
+        }
+        case OP_NAME:
+        case OP_DEFVAR:
+        case OP_DEFMEMBER:
+            operands << "r" << ins.a << ", " << getJSString(CScriptAtoms::getString(names[ins.b]));
+            break;
+        case OP_LOCAL:
+        case OP_DEFLOCAL:
+            operands << "r" << ins.a << ", s" << ins.b << ", " << getJSString(CScriptAtoms::getString(names[ins.c]));
+            break;
+        case OP_MEMBER:
+            operands << "r" << ins.a << ", r" << ins.b << ", " << getJSString(CScriptAtoms::getString(caches[ins.c].atom));
+            break;
+        case OP_INDEX:
+            operands << "r" << ins.a << ", r" << ins.b << ", r" << ins.c;
+            break;
+        case OP_JMP:
+            operands << "-> " << ins.b;
+            break;
+        case OP_JMPF:
+        case OP_JMPT:
+            operands << "r" << ins.a << ", -> " << ins.b << (ins.c ? ", free" : "");
+            break;
+        case OP_FUNC:
+            operands << "r" << ins.a << ", k" << ins.b << ", " << getJSString(CScriptAtoms::getString(names[ins.c]));
+            break;
+        case OP_DEFFUNC:
+            operands << "k" << ins.b << ", " << getJSString(CScriptAtoms::getString(names[ins.c]));
+            if(ins.a != NO_SLOT)
+                operands << ", s" << ins.a;
+            break;
+        case OP_SETCHILD:
+            operands << "r" << ins.a << ", " << getJSString(CScriptAtoms::getString(names[ins.b])) << ", r" << ins.c;
+            break;
+        case OP_CALL:
+            operands << "r" << ins.a << ", " << ins.b << " args";
+            break;
+        case OP_NEW:
+            operands << "r" << ins.a << ", " << getJSString(CScriptAtoms::getString(names[ins.c])) << ", " << ins.b << " args";
+            break;
+        case OP_RETURN:
+            if(ins.a != NO_REGISTER)
+                operands << "r" << ins.a;
+            break;
+        default:
+            // everything else works on two registers
+            operands << "r" << ins.a << ", r" << ins.b;
+            break;
+        }
+        out << std::setw(5) << i << "  " << std::left << std::setw(10) << opNames[ins.op] << std::right
+            << operands.str() << "\n";
+    }
+}
+
+// ----------------------------------------------------------------------------------- ASSEMBLY
+
+void CSyntaxSequence::assemble(CScriptBytecode& code, int dest)
+{
+    if(statements.empty())
+        statements = normalize(false);
+    for(CSyntaxNode* stmt : statements)
+        assembleStatement(code, stmt);
+}
+
+void CSyntaxIf::assemble(CScriptBytecode& code, int dest)
+{
+    int cond = code.allocRegister();
+    expr->assemble(code, cond);
+    int jumpToElse = code.emit(OP_JMPF, cond, 0, 1);
+    code.freeRegister(cond);
+    assembleStatement(code, node);
+    if(else_)
+    {
+        int jumpToEnd = code.emit(OP_JMP);
+        code.patch(jumpToElse, code.here());
+        assembleStatement(code, else_);
+        code.patch(jumpToEnd, code.here());
+    }
+    else
+        code.patch(jumpToElse, code.here());
+}
+
+void CSyntaxWhile::assemble(CScriptBytecode& code, int dest)
+{
+    int loop = code.here();
+    int cond = code.allocRegister();
+    expr->assemble(code, cond);
+    int jumpToEnd = code.emit(OP_JMPF, cond, 0, 1);
+    code.freeRegister(cond);
+    assembleStatement(code, node);
+    code.emit(OP_JMP, 0, loop);
+    code.patch(jumpToEnd, code.here());
+}
+
+void CSyntaxFor::assemble(CScriptBytecode& code, int dest)
+{
+    if(init)
+        assembleStatement(code, init);
+    int loop = code.here();
+    int jumpToEnd = -1;
+    if(cond)
+    {
+        int condReg = code.allocRegister();
+        cond->assemble(code, condReg);
+        jumpToEnd = code.emit(OP_JMPF, condReg, 0, 1);
+        code.freeRegister(condReg);
+    }
+    assembleStatement(code, node);
+    if(update)
+        assembleStatement(code, update);
+    code.emit(OP_JMP, 0, loop);
+    if(jumpToEnd >= 0)
+        code.patch(jumpToEnd, code.here());
+}
+
+void CSyntaxFactor::assemble(CScriptBytecode& code, int dest)
+{
+    switch(factorType)
+    {
+    case F_TYPE_INT:
+        code.emit(OP_CONST, dest, code.addConstant(new CScriptVar(value, SCRIPTVAR_INTEGER)));
+        break;
+    case F_TYPE_DOUBLE:
+        code.emit(OP_CONST, dest, code.addConstant(new CScriptVar(value, SCRIPTVAR_DOUBLE)));
+        break;
+    case F_TYPE_STRING:
+        code.emit(OP_CONST, dest, code.addConstant(new CScriptVar(value, SCRIPTVAR_STRING)));
+        break;
+    case F_TYPE_NULL:
+        code.emit(OP_NULL, dest);
+        break;
+    default:
+        code.emit(OP_UNDEFINED, dest);
+        break;
+    }
+}
+
+void CSyntaxID::assemble(CScriptBytecode& code, int dest)
+{
+    if(slot >= 0)
+        code.emit(OP_LOCAL, dest, slot, code.addName(atom));
+    else
+        code.emit(OP_NAME, dest, code.addName(atom));
+}
+
+void CSyntaxFunction::assemble(CScriptBytecode& code, int dest)
+{
+    // as with evaluate(), only the source goes into the function
+    CScriptVar* funcVar = new CScriptVar(source, SCRIPTVAR_FUNCTION);
+    for(CSyntaxID* arg : arguments)
+        funcVar->addChildNoDup(arg->getAtom());
+    int constant = code.addConstant(funcVar);
+    if(statement)
+    {
+        if(!name)
+            TRACE("Functions defined at statement-level are meant to have a name\n");
+        else
+            code.emit(OP_DEFFUNC, name->getSlot() >= 0 ? name->getSlot() : CScriptBytecode::NO_SLOT,
+                constant, code.addName(name->getAtom()));
+    }
+    else
+        code.emit(OP_FUNC, dest, constant, code.addName(name ? name->getAtom() : (int)TINYJS_ATOM_TEMP_NAME));
+}
+
+void CSyntaxFunctionCall::assemble(CScriptBytecode& code, int dest)
+{
+    // the call needs 'this', the function and then the arguments in consecutive registers
+    int base = dest == code.topRegister() ? dest : code.allocRegister();
+    int function = code.allocRegister();
+    if(member)
+        member->assembleMember(code, base, function);
+    else
+        node->assemble(code, function);
+    std::vector<int> args;
+    for(CSyntaxExpression* actual : actuals)
+    {
+        args.push_back(code.allocRegister());
+        actual->assemble(code, args.back());
+    }
+    code.setPosition(code.emit(OP_CALL, base, (int)actuals.size()), position);
+    for(auto arg = args.rbegin(); arg != args.rend(); ++arg)
+        code.freeRegister(*arg);
+    code.freeRegister(function);
+    if(base != dest)
+    {
+        code.emit(OP_MOVE, dest, base);
+        code.freeRegister(base);
+    }
+}
+
+void CSyntaxObjectLiteral::assemble(CScriptBytecode& code, int dest)
+{
+    code.emit(OP_OBJECT, dest);
+    for(size_t i = 0; i < values.size(); i++)
+    {
+        int value = code.allocRegister();
+        values[i]->assemble(code, value);
+        code.emit(OP_SETCHILD, dest, code.addName(names[i]), value);
+        code.freeRegister(value);
+    }
+}
+
+void CSyntaxArrayLiteral::assemble(CScriptBytecode& code, int dest)
+{
+    code.emit(OP_ARRAY, dest);
+    for(size_t i = 0; i < values.size(); i++)
+    {
+        int value = code.allocRegister();
+        values[i]->assemble(code, value);
+        code.emit(OP_SETCHILD, dest, code.addName(std::to_string(i)), value);
+        code.freeRegister(value);
+    }
+}
+
+void CSyntaxNew::assemble(CScriptBytecode& code, int dest)
+{
+    int base = dest == code.topRegister() ? dest : code.allocRegister();
+    std::vector<int> args;
+    for(CSyntaxExpression* arg : arguments)
+    {
+        args.push_back(code.allocRegister());
+        arg->assemble(code, args.back());
+    }
+    code.setPosition(code.emit(OP_NEW, base, (int)arguments.size(), code.addName(((CSyntaxID*)node)->getAtom())), position);
+    for(auto arg = args.rbegin(); arg != args.rend(); ++arg)
+        code.freeRegister(*arg);
+    if(base != dest)
+    {
+        code.emit(OP_MOVE, dest, base);
+        code.freeRegister(base);
+    }
+}
+
+void CSyntaxReturn::assemble(CScriptBytecode& code, int dest)
+{
+    if(!node)
+    {
+        code.emit(OP_RETURN, CScriptBytecode::NO_REGISTER);
+        return;
+    }
+    int result = code.allocRegister();
+    node->assemble(code, result);
+    code.emit(OP_RETURN, result);
+    code.freeRegister(result);
+}
+
+void CSyntaxAssign::assemble(CScriptBytecode& code, int dest)
+{
+    int assignOp = op == '=' ? OP_ASSIGN : (op == LEX_PLUSEQUAL ? OP_ASSIGNADD : OP_ASSIGNSUB);
+    CSyntaxBinaryOperator* member = dynamic_cast<CSyntaxBinaryOperator*>(lval);
+    if(member && member->canBeLval())
+    {
+        // keep the object in 'dest' until we're done with its member
+        int child = code.allocRegister();
+        member->assembleMember(code, dest, child);
+        code.emit(OP_LVALUE, child);
+        int rhs = code.allocRegister();
+        node->assemble(code, rhs);
+        code.emit(assignOp, child, rhs);
+        code.freeRegister(rhs);
+        code.emit(OP_RELEASE, dest, child);
+        code.freeRegister(child);
+    }
+    else
+    {
+        lval->assemble(code, dest);
+        code.emit(OP_LVALUE, dest);
+        int rhs = code.allocRegister();
+        node->assemble(code, rhs);
+        code.emit(assignOp, dest, rhs);
+        code.freeRegister(rhs);
+    }
+}
+
+void CSyntaxDefinition::assemble(CScriptBytecode& code, int dest)
+{
+    int var = code.allocRegister();
+    assembleDefine(code, lval, var);
+    if(node)
+    {
+        int value = code.allocRegister();
+        node->assemble(code, value);
+        code.emit(OP_ASSIGN, var, value);
+        code.freeRegister(value);
+    }
+    code.emit(OP_CLEAR, var);
+    code.freeRegister(var);
+}
+
+void CSyntaxDefinition::assembleDefine(CScriptBytecode& code, CSyntaxExpression* path, int dest)
+{
+    CSyntaxBinaryOperator* member = dynamic_cast<CSyntaxBinaryOperator*>(path);
+    if(!member)
+    {
+        CSyntaxID* id = (CSyntaxID*)path;
+        if(id->getSlot() >= 0)
+            code.emit(OP_DEFLOCAL, dest, id->getSlot(), code.addName(id->getAtom()));
+        else
+            code.emit(OP_DEFVAR, dest, code.addName(id->getAtom()));
+        return;
+    }
+    ASSERT(member->getOp() == '.');
+    assembleDefine(code, member->getLeft(), dest);
+    code.emit(OP_DEFMEMBER, dest, code.addName(((CSyntaxID*)member->getRight())->getAtom()));
+}
+
+void CSyntaxTernaryOperator::assemble(CScriptBytecode& code, int dest)
+{
+    node->assemble(code, dest);
+    int jumpToSecond = code.emit(OP_JMPF, dest, 0, 1);
+    b1->assemble(code, dest);
+    int jumpToEnd = code.emit(OP_JMP);
+    code.patch(jumpToSecond, code.here());
+    b2->assemble(code, dest);
+    code.patch(jumpToEnd, code.here());
+}
+
+void CSyntaxBinaryOperator::assemble(CScriptBytecode& code, int dest)
+{
+    if(op == '.' || op == '[')
+    {
+        int child = code.allocRegister();
+        assembleMember(code, dest, child);
+        code.emit(OP_RELEASE, dest, child);
+        code.freeRegister(child);
+        return;
+    }
+    node->assemble(code, dest);
+    int rhs = code.allocRegister();
+    right->assemble(code, rhs);
+    code.emit(mathsOpcode(op), dest, rhs);
+    code.freeRegister(rhs);
+}
+
+void CSyntaxBinaryOperator::assembleMember(CScriptBytecode& code, int object, int child)
+{
+    ASSERT(canBeLval());
+    node->assemble(code, object);
+    if(op == '.')
+        code.emit(OP_MEMBER, child, object, code.addCache(((CSyntaxID*)right)->getAtom()));
+    else
+    {
+        right->assemble(code, child);
+        code.emit(OP_INDEX, child, object, child);
+    }
+}
+
+void CSyntaxCondition::assemble(CScriptBytecode& code, int dest)
+{
+    node->assemble(code, dest);
+    // if we know the outcome we don't bother to evaluate the other side
+    int jumpToEnd = code.emit(op == LEX_ANDAND ? OP_JMPF : OP_JMPT, dest, 0, 0);
+    int rhs = code.allocRegister();
+    right->assemble(code, rhs);
+    code.emit(OP_BOOL, dest, rhs);
+    code.freeRegister(rhs);
+    code.patch(jumpToEnd, code.here());
+}
+
+void CSyntaxUnaryOperator::assemble(CScriptBytecode& code, int dest)
+{
+    node->assemble(code, dest);
+    code.emit(OP_NOT, dest);
+}
+
+void CSyntaxPostfixOperator::assemble(CScriptBytecode& code, int dest)
+{
+    int lhs = code.allocRegister();
+    node->assemble(code, lhs);
+    code.emit(op == LEX_PLUSPLUS ? OP_POSTINC : OP_POSTDEC, dest, lhs);
+    code.freeRegister(lhs);
+}
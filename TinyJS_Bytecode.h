@@ -0,0 +1,168 @@
+#include "TinyJS.h"
+#include <string>
+#include <vector>
+#include <ostream>
+#include <exception>
+
+#pragma once
+
+class CSyntaxNode;
+class CScriptSyntaxTree;
+
+// The instruction set. Registers hold CScriptValues: numbers, or CScriptVarLink*s with the same
+// ownership rules as the rest of TinyJS (an unowned link is a temporary that belongs to the register).
+// In the comments, rA/rB are registers, nB/nC are entries in the name table, kB is a constant
+// and cC is a property cache.
+#define TINYJS_BYTECODE_OPS(X) \
+    X(NOP)          /* do nothing */ \
+    X(CONST)        /* rA = copy of kB */ \
+    X(UNDEFINED)    /* rA = undefined */ \
+    X(NULL)         /* rA = null */ \
+    X(NAME)         /* rA = variable nB, or a new named temporary if it doesn't exist */ \
+    X(LOCAL)        /* rA = variable nC, which has frame slot B (otherwise as NAME) */ \
+    X(MEMBER)       /* rA = member cC of object rB (rB must be kept until rA is done with) */ \
+    X(INDEX)        /* rA = member [rC] of object rB (rC is freed) */ \
+    X(RELEASE)      /* rA = rB, freeing the object rA that rB was a member of */ \
+    X(MOVE)         /* rA = rB, rB = empty */ \
+    X(CLEAR)        /* free rA */ \
+    X(NOT)          /* rA = !rA */ \
+    X(BOOL)         /* rA = rB converted to a bool (rB is freed) */ \
+    X(POSTINC)      /* rA = rB, then rB++ (rB is freed) */ \
+    X(POSTDEC)      /* rA = rB, then rB-- (rB is freed) */ \
+    X(LVALUE)       /* if rA isn't in a scope yet, add it to the root as JavaScript does */ \
+    X(ASSIGN)       /* rA = rB (rB is freed) */ \
+    X(ASSIGNADD)    /* rA = rA + rB (rB is freed) */ \
+    X(ASSIGNSUB)    /* rA = rA - rB (rB is freed) */ \
+    X(DEFVAR)       /* rA = variable nB in the current scope, creating it if needed */ \
+    X(DEFLOCAL)     /* as DEFVAR for variable nC, which has frame slot B */ \
+    X(DEFMEMBER)    /* rA = member nB of rA, creating it if needed */ \
+    X(JMP)          /* jump to B */ \
+    X(JMPF)         /* jump to B if rA is false; free rA if C */ \
+    X(JMPT)         /* jump to B if rA is true; free rA if C */ \
+    X(FUNC)         /* rA = new function from kB, named nC */ \
+    X(DEFFUNC)      /* add a new function from kB to the current scope as nC, in frame slot A if it has one */ \
+    X(OBJECT)       /* rA = new object */ \
+    X(ARRAY)        /* rA = new array */ \
+    X(SETCHILD)     /* add rC to rA as nB (rC is freed) */ \
+    X(CALL)         /* rA = call rA+1 with 'this' rA and B arguments from rA+2 */ \
+    X(NEW)          /* rA = new nC with B arguments from rA+1 */ \
+    X(RETURN)       /* set the return value to rA (or undefined if A is NO_REGISTER) and stop */ \
+    X(END)          /* stop */
+
+// maths on two registers: rA = rA <op> rB (rB is freed)
+#define TINYJS_BYTECODE_MATHS(X) \
+    X(ADD, '+') X(SUB, '-') X(MUL, '*') X(DIV, '/') X(MOD, '%') \
+    X(AND, '&') X(OR, '|') X(XOR, '^') \
+    X(SHL, LEX_LSHIFT) X(SHR, LEX_RSHIFT) X(USHR, LEX_RSHIFTUNSIGNED) \
+    X(EQ, LEX_EQUAL) X(NE, LEX_NEQUAL) X(TEQ, LEX_TYPEEQUAL) X(NTEQ, LEX_NTYPEEQUAL) \
+    X(LT, '<') X(LE, LEX_LEQUAL) X(GT, '>') X(GE, LEX_GEQUAL)
+
+#define TINYJS_BYTECODE_ENUM(name) OP_##name,
+#define TINYJS_BYTECODE_MATHS_ENUM(name, token) OP_##name,
+enum BYTECODE_OPS
+{
+    TINYJS_BYTECODE_OPS(TINYJS_BYTECODE_ENUM)
+    TINYJS_BYTECODE_MATHS(TINYJS_BYTECODE_MATHS_ENUM)
+    OP_COUNT
+};
+#undef TINYJS_BYTECODE_ENUM
+#undef TINYJS_BYTECODE_MATHS_ENUM
+
+/// One instruction. Operands are 16 bit, which is plenty for a single function.
+struct CScriptInstruction
+{
+    unsigned short op;
+    unsigned short a;
+    unsigned short b;
+    unsigned short c;
+};
+
+/** A function body (or a whole script) compiled from its syntax tree into bytecode for
+  * a register machine. This sits between walking the syntax tree and compiling with gcc:
+  * it's cheap to build, and doesn't need any of the recursion or virtual calls of the tree.
+  * The nodes of the tree assemble themselves using the methods below (see CSyntaxNode::assemble).
+  */
+class CScriptBytecode
+{
+public:
+    static const int NO_REGISTER = 0xFFFF;
+    static const int NO_SLOT = 0xFFFF;
+
+    /// What each instruction's step returns: go on to the next instruction, jump to instruction B, or stop
+    enum STEP_RESULTS { STEP_NEXT, STEP_JUMP, STEP_STOP };
+
+    /// Everything code needs while it runs, whether it's being interpreted or was compiled to machine code
+    struct State
+    {
+        CTinyJS* js;
+        bool* execute;
+        CScriptValue* regs; ///< The registers (the data of 'registers')
+        std::vector<CScriptValue> registers;
+        const CScriptInstruction* start; ///< The first instruction, which jumps are relative to
+        CScriptVar* const* constants;
+        const int* names;
+        CScriptPropertyCache* caches;
+        CScriptTokenList* source; ///< Where the code came from, and...
+        const int* positions; ///< ...the place in it of each instruction (see CScriptBytecode::positions)
+        std::vector<CScriptVarLink*>* oldFrame; ///< The frame to go back to at the end
+        std::exception_ptr exception; ///< What a step from getStep threw, if it returned STEP_STOP because of it
+    };
+    /// Run one instruction
+    typedef int (*StepFunction)(State* state, const CScriptInstruction* instruction);
+
+    CScriptBytecode(CScriptSyntaxTree* tree);
+    ~CScriptBytecode();
+
+    /// Run the code against the interpreter's current scopes. As with the syntax tree,
+    /// 'execute' is set to false if a return was hit.
+    void execute(CTinyJS* js, bool& execute);
+    /// Write a readable listing of the code
+    void disassemble(std::ostream& out);
+
+    /* For running the code some other way (see CScriptMachineCode): begin sets up a State to run
+       it with, the steps are run in the order of the jumps, and then end cleans up. */
+    void begin(State& state, CTinyJS* js, bool& execute);
+    void end(State& state);
+    static StepFunction getStep(int op); ///< The step for an op. It catches anything thrown into State::exception, and stops.
+    const std::vector<CScriptInstruction>& getCode() { return code; }
+    CScriptVar* getConstant(int index) { return constants[index]; }
+
+    // assembling
+    int emit(int op, int a = 0, int b = 0, int c = 0); ///< Add an instruction, and return its address
+    int here() { return (int)code.size(); } ///< The address of the next instruction
+    void patch(int instruction, int target) { code[instruction].b = (unsigned short)target; } ///< Set a jump target
+    void setPosition(int instruction, int position) { positions[instruction] = position; } ///< Where a call came from in the source
+    void setPositions(int from, int position); ///< Where the statement is whose code starts at 'from', for what hasn't a place yet
+    int addConstant(CScriptVar* value); ///< The constant takes ownership of 'value'
+    int addName(const std::string& name);
+    int addName(int atom);
+    int addCache(int atom); ///< Add a property cache for one '.' access
+    int allocRegister(); ///< Registers are allocated like a stack...
+    void freeRegister(int reg); ///< ...so they must be freed in the opposite order
+    int topRegister() { return registers - 1; } ///< The most recently allocated register
+
+private:
+    std::vector<CScriptInstruction> code;
+    /// For each instruction, where it is in the source: a call's own place (for the call stack), or else its statement's (for errors)
+    std::vector<int> positions;
+    CScriptTokenList* source;
+    std::vector<CScriptVar*> constants;
+    std::vector<int> names; ///< atoms (see CScriptAtoms)
+    std::vector<CScriptPropertyCache> caches;
+    int registers; ///< registers in use while assembling
+    int maxRegisters; ///< registers needed to execute
+    int frameSize; ///< slots needed for variables (see CScriptSyntaxTree::getSlotCount)
+
+    void checkOperand(int value);
+
+    // the steps for each op
+#define TINYJS_BYTECODE_STEP(name) static int step##name(State& s, const CScriptInstruction* pc);
+#define TINYJS_BYTECODE_MATHS_STEP(name, token) TINYJS_BYTECODE_STEP(name)
+    TINYJS_BYTECODE_OPS(TINYJS_BYTECODE_STEP)
+    TINYJS_BYTECODE_MATHS(TINYJS_BYTECODE_MATHS_STEP)
+#undef TINYJS_BYTECODE_STEP
+#undef TINYJS_BYTECODE_MATHS_STEP
+};
+
+/// Assemble an expression or a statement, cleaning up an expression's value afterwards
+void assembleStatement(CScriptBytecode& code, CSyntaxNode* stmt);
@@ -0,0 +1,577 @@
+#include "TinyJS_Compiler.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <errno.h>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <stdint.h>
+#include <stdio.h>
+
+// support both windows and linux
+#ifdef _MSC_VER
+#define GETLIB(a,b) LoadLibrary(a)
+#define GETSYMBOL(a,b) GetProcAddress(a, b)
+#define LIBPATH(file) (file + ".dll")
+#define GETLOADERROR() ("load failed with error " + std::to_string(GetLastError()))
+#define FREELIB(a) FreeLibrary(a)
+#define RTLD_NOW 0
+#else
+#include <dirent.h>
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <utime.h>
+
+#define GETLIB(a,b) dlopen(a, b)
+#define GETSYMBOL(a,b) dlsym(a, b)
+#define LIBPATH(file) (file + ".so")
+#define GETLOADERROR() std::string(dlerror())
+#define FREELIB(a) dlclose(a)
+#endif
+
+std::atomic<int> CScriptCompiler::builds(0);
+
+CScriptCompiler::CScriptCompiler(int threads, int batchWindow) : finished(0)
+{
+    threadCount = threads;
+    this->batchWindow = batchWindow;
+    stopping = false;
+}
+
+CScriptCompiler::~CScriptCompiler()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    work.notify_all();
+    for(std::thread &thread : threads)
+        thread.join();
+    for(Job *job : jobs)
+        release(job);
+    for(Job *job : done)
+        release(job);
+    for(Job *job : dropped)
+        release(job);
+}
+
+// the command that builds a library (with the output and input files to go on the end)
+#ifdef _MSC_VER
+// this line is a hell of a doozy. it's made longer by the fact that
+// the development environment has to be activated with this bat script.
+// Note that the version hard-coded here uses a D drive and VS Community 2015 RC; tweak to fit
+// your build environment.
+// Also, without the redirection at the end, two lines of output will be displayed
+// by cl during compile and there appears to be no way to make it compile quietly.
+// Additionally, it doesn't output to err, only stdout, so even if there are errors
+// it doesn't help at all.
+// Once again, it goes without saying that TinyJS.h must be in the same (working) directory
+// as the executable, and Debug\tiny-js.lib must also exist.
+#define TINYJS_BUILD_COMMAND "%comspec% /c \"\"d:\\Program Files (x86)\\Microsoft Visual Studio 14.0\\VC\\vcvarsall.bat\" x86 && cl.exe /nologo /D_USRDLL /D_WINDLL /EHsc /Zi /FI TinyJS.h Debug\\tiny-js.lib /MDd /LDd"
+#else
+// it goes without saying that this only works if the executable
+// has libtinyjs.so and TinyJS.h in its working directory and gcc
+// on PATH.
+#define TINYJS_BUILD_COMMAND "gcc -g -Wall -D_DEBUG -std=c++11 -fPIC -include TinyJS.h -L./libtinyjs -shared"
+#endif
+
+#ifndef _MSC_VER
+/// Run a program with these arguments and wait for it, giving its status as system() would
+static int runCommand(const std::vector<std::string> &args)
+{
+    // everything the child needs is made before forking, as other threads may hold the heap's locks
+    std::vector<char*> argv;
+    for(const std::string &arg : args)
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(0);
+    pid_t pid = fork();
+    if(pid < 0)
+        return -1;
+    if(pid == 0)
+    {
+        execvp(argv[0], &argv[0]);
+        _exit(127); // as the shell does for a command it can't find
+    }
+    int status;
+    while(waitpid(pid, &status, 0) < 0)
+        if(errno != EINTR)
+            return -1;
+    return status;
+}
+
+/// Whether the files of a failed build should be left in the build directory for looking at
+static bool keepBuilds()
+{
+    static const bool keep = getenv("TINYJS_KEEP_BUILDS") != 0;
+    return keep;
+}
+#endif
+
+/// 64 bit FNV-1a, carried on from 'hash'
+static uint64_t hashString(uint64_t hash, const std::string &text)
+{
+    for(unsigned char c : text)
+    {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    // keep "ab"+"c" apart from "a"+"bc"
+    hash ^= text.size();
+    hash *= 1099511628211ULL;
+    return hash;
+}
+
+/// What's in the TinyJS.h that builds include, read once as it's the same for every build
+static const std::string &getHeader()
+{
+    static const std::string header = []() {
+        std::ifstream file("TinyJS.h", std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }();
+    return header;
+}
+
+const std::string &CScriptCompiler::getDirectory()
+{
+    /* Builds are made in a directory of our own, so they can't trip over another process's (or
+       anything else in the working directory). A failed build is only left there to be looked at
+       if TINYJS_KEEP_BUILDS is set in the environment; it's removed at exit if there's nothing left in it. */
+    struct Directory
+    {
+        std::string path;
+        Directory()
+        {
+#ifdef _MSC_VER
+            path = ".\\";
+#else
+            const char *tmp = getenv("TMPDIR");
+            std::string pattern = std::string(tmp && *tmp ? tmp : "/tmp") + "/tinyjs-XXXXXX";
+            std::vector<char> name(pattern.begin(), pattern.end());
+            name.push_back(0);
+            if(mkdtemp(&name[0]))
+                path = std::string(&name[0]) + "/";
+            else
+            {
+                TRACE("Unable to make a directory to build in, so using the working directory\n");
+                path = "./";
+            }
+#endif
+        }
+        ~Directory()
+        {
+#ifndef _MSC_VER
+            if(path != "./")
+                rmdir(path.c_str());
+#endif
+        }
+    };
+    static Directory directory;
+    return directory.path;
+}
+
+std::string CScriptCompiler::getCachePath(const Job *job)
+{
+    /* A library is named after everything that went into it, so a function that's changed (or a
+       different TinyJS.h or build command) just won't find one. */
+    uint64_t hash = 14695981039346656037ULL;
+    hash = hashString(hash, std::to_string(TINYJS_JIT_ABI_VERSION) + "/" + std::to_string(sizeof(CScriptVar)) + "/" +
+                            std::to_string(sizeof(CScriptVarLink)));
+    hash = hashString(hash, TINYJS_BUILD_COMMAND);
+    hash = hashString(hash, getHeader());
+    hash = hashString(hash, job->name);
+    hash = hashString(hash, job->source);
+    char key[17];
+    snprintf(key, sizeof(key), "%016llx", (unsigned long long)hash);
+    return job->cache + "/" + key + ".so";
+}
+
+void CScriptCompiler::build(const std::vector<Job*> &batch)
+{
+    std::vector<Job*> building;
+    for(Job *job : batch)
+    {
+        job->handle = 0;
+        job->callback = 0;
+        job->error.clear();
+#ifndef _MSC_VER
+        if(!job->cache.empty())
+        {
+            // it's loaded by this name, so other CTinyJS's in this process that load it get the code that's already loaded
+            std::string cached = getCachePath(job);
+            if(access(cached.c_str(), R_OK) == 0)
+            {
+                if(load(cached, job))
+                {
+                    utime(cached.c_str(), 0); // it's been used, so it's the last to be evicted
+                    continue;
+                }
+                unlink(cached.c_str());
+            }
+        }
+#endif
+        building.push_back(job);
+    }
+    if(building.empty())
+        return;
+
+    // every library gets its own file, as loading a file that's already loaded just gets the old one back
+    int id = ++builds; // other threads may be building too, so this build's names all come from here
+    std::string file = getDirectory() + "jit" + std::to_string(id);
+    std::string library = LIBPATH(file);
+    std::string cache = building[0]->cache;
+#ifndef _MSC_VER
+    if(!cache.empty())
+    {
+        // build straight into the cache, so the functions' names for it can be linked to it there
+        mkdir(cache.c_str(), 0755);
+        library = cache + "/jit." + std::to_string(getpid()) + "." + std::to_string(id) + ".tmp";
+    }
+#endif
+    if(!compileLibrary(building, file, library))
+    {
+#ifndef _MSC_VER
+        if(!cache.empty())
+            unlink(library.c_str());
+        if(!keepBuilds())
+            unlink((file + ".cpp").c_str());
+        else
+            TRACE("Left the build in '%s.cpp'\n", file.c_str());
+#endif
+        // one function that doesn't build shouldn't stop the rest of the batch
+        if(building.size() > 1)
+            for(Job *job : building)
+                build(std::vector<Job*>(1, job));
+        return;
+    }
+
+    bool loaded = true;
+#ifndef _MSC_VER
+    if(!cache.empty())
+    {
+        // each function's name for the library appears in one go, so nothing sees half of it
+        for(Job *job : building)
+        {
+            std::string cached = getCachePath(job);
+            std::string linked = cached + "." + std::to_string(getpid()) + "." + std::to_string(id) + ".tmp";
+            if(link(library.c_str(), linked.c_str()) != 0 || rename(linked.c_str(), cached.c_str()) != 0)
+            {
+                job->error = "unable to cache '" + cached + "'";
+                TRACE("Unable to cache '%s'\n", cached.c_str());
+                unlink(linked.c_str());
+                loaded = false;
+            }
+            else if(!load(cached, job))
+                loaded = false;
+        }
+        unlink(library.c_str());
+        evict(cache, building[0]->cacheSize, building);
+    }
+    else
+#endif
+    {
+        for(Job *job : building)
+            if(!load(library, job))
+                loaded = false;
+    }
+#ifndef _MSC_VER
+    // it's loaded now, so the files can go (but they're left for looking at if anything went wrong and that's wanted)
+    if(loaded || !keepBuilds())
+    {
+        unlink((file + ".cpp").c_str());
+        unlink(library.c_str());
+    }
+    else
+        TRACE("Left the build in '%s.cpp'\n", file.c_str());
+#endif
+}
+
+bool CScriptCompiler::compileLibrary(const std::vector<Job*> &batch, const std::string &file, const std::string &library)
+{
+    std::ofstream out((file + ".cpp").c_str(), std::ios::trunc);
+    for(Job *job : batch)
+        out << job->source;
+    out.close();
+    std::string error;
+    if(!out)
+        error = "unable to write '" + file + ".cpp'";
+    else
+    {
+#ifdef _MSC_VER
+        // ship off the actual compilation to cl.exe
+        // yes, yes, it's a system() call, blah blah blah
+        std::string exports;
+        for(Job *job : batch)
+            exports += " /EXPORT:\"" + job->name + "\"";
+        int status = system((TINYJS_BUILD_COMMAND " \"" + file + ".cpp\" /link /DLL /OUT:\"" + library + "\"" + exports + "\" > nul").c_str());
+#else
+        // ship off the actual compilation to gcc for now, with the paths as they are (no shell to quote them for)
+        std::vector<std::string> args;
+        std::istringstream command(TINYJS_BUILD_COMMAND);
+        std::copy(std::istream_iterator<std::string>(command), std::istream_iterator<std::string>(), std::back_inserter(args));
+        args.push_back("-o");
+        args.push_back(library);
+        args.push_back(file + ".cpp");
+        int status = runCommand(args);
+#endif
+#ifndef _MSC_VER
+        if(status != 0 && WIFEXITED(status))
+            error = "the build command exited with " + std::to_string(WEXITSTATUS(status));
+        else
+#endif
+        if(status != 0)
+            error = "the build command failed with status " + std::to_string(status);
+    }
+    if(error.empty())
+        return true;
+    TRACE("Unable to build '%s.cpp': %s\n", file.c_str(), error.c_str());
+    for(Job *job : batch)
+        job->error = error;
+    return false;
+}
+
+bool CScriptCompiler::load(const std::string &library, Job *job)
+{
+    job->handle = GETLIB(library.c_str(), RTLD_NOW);
+    if(!job->handle)
+    {
+        job->error = GETLOADERROR();
+        TRACE("%s\n", job->error.c_str());
+        return false;
+    }
+    job->callback = (JSCallback)GETSYMBOL(job->handle, job->name.c_str());
+    if(!job->callback)
+    {
+        job->error = "no symbol '" + job->name + "' in '" + library + "'";
+        TRACE("Unable to get symbol from DLL. It's possible compilation of the JIT-code failed.\n");
+        FREELIB(job->handle);
+        job->handle = 0;
+        return false;
+    }
+    return true;
+}
+
+void CScriptCompiler::evict(const std::string &cache, size_t cacheSize, const std::vector<Job*> &keep)
+{
+#ifndef _MSC_VER
+    if(!cacheSize)
+        return;
+    struct Entry
+    {
+        std::string path;
+        size_t size;
+        long long used; ///< In nanoseconds, as many libraries may be built or used in one second
+    };
+    std::vector<Entry> entries;
+    size_t total = 0;
+    DIR *dir = opendir(cache.c_str());
+    if(!dir)
+        return;
+    std::vector<std::string> kept;
+    for(Job *job : keep)
+        kept.push_back(getCachePath(job));
+    while(struct dirent *item = readdir(dir))
+    {
+        std::string path = cache + "/" + item->d_name;
+        struct stat info;
+        if(path.size() < 3 || path.compare(path.size() - 3, 3, ".so") || stat(path.c_str(), &info) != 0)
+            continue;
+#ifdef __APPLE__
+        const struct timespec &used = info.st_mtimespec;
+#else
+        const struct timespec &used = info.st_mtim;
+#endif
+        Entry entry = { path, (size_t)info.st_size, (long long)used.tv_sec * 1000000000 + used.tv_nsec };
+        entries.push_back(entry);
+        total += entry.size;
+    }
+    closedir(dir);
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.used < b.used; });
+    for(const Entry &entry : entries)
+    {
+        if(total <= cacheSize)
+            break;
+        /* Anything loaded from here stays loaded, so it's always safe to delete. A batch's functions
+           are links to one library, which are counted as copies, so the cache errs towards too small. */
+        if(std::find(kept.begin(), kept.end(), entry.path) == kept.end() && unlink(entry.path.c_str()) == 0)
+            total -= entry.size;
+    }
+#endif
+}
+
+void CScriptCompiler::submit(CScriptVar *function, const std::string &name, const std::string &source,
+                             const std::string &cache, size_t cacheSize, int hotness)
+{
+    Job *job = new Job();
+    job->function = function->ref();
+    job->name = name;
+    job->source = source;
+    job->cache = cache;
+    job->cacheSize = cacheSize;
+    job->hotness = hotness;
+    job->building = false;
+    job->handle = 0;
+    job->callback = 0;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if(!enqueue(job))
+            return;
+        if(threads.empty())
+            for(int i = 0; i < threadCount; i++)
+                threads.push_back(std::thread(&CScriptCompiler::run, this));
+    }
+    work.notify_one();
+}
+
+bool CScriptCompiler::raise(CScriptVar *function, int hotness)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    for(Job *job : jobs)
+        if(job->function == function)
+        {
+            job->hotness = hotness;
+            return true;
+        }
+    for(Job *job : done)
+        if(job->function == function)
+            return true;
+    for(Job *job : dropped)
+        if(job->function == function)
+        {
+            // it may be hot enough now to get back in the queue
+            job->hotness = hotness;
+            dropped.erase(std::find(dropped.begin(), dropped.end(), job));
+            if(enqueue(job))
+                work.notify_one();
+            return true;
+        }
+    return false;
+}
+
+bool CScriptCompiler::enqueue(Job *job)
+{
+    if(countQueued() >= TINYJS_COMPILE_QUEUE_SIZE)
+    {
+        Job *coldest = 0;
+        for(Job *other : jobs)
+            if(!other->building && (!coldest || other->hotness < coldest->hotness))
+                coldest = other;
+        if(coldest->hotness >= job->hotness)
+        {
+            dropped.push_back(job);
+            return false;
+        }
+        jobs.erase(std::find(jobs.begin(), jobs.end(), coldest));
+        dropped.push_back(coldest);
+    }
+    jobs.push_back(job);
+    return true;
+}
+
+std::vector<CScriptCompiler::Job*> CScriptCompiler::takeFinished()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<Job*> taken;
+    taken.swap(done);
+    finished.store(0, std::memory_order_release);
+    return taken;
+}
+
+void CScriptCompiler::wait()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while(true)
+    {
+        idle.wait(guard, [this] { return jobs.empty(); });
+        if(dropped.empty())
+            return;
+        // the queue's empty, so what was pushed out of it gets its turn, hottest first
+        std::stable_sort(dropped.begin(), dropped.end(), [](const Job *a, const Job *b) { return a->hotness > b->hotness; });
+        size_t count = std::min(dropped.size(), (size_t)TINYJS_COMPILE_QUEUE_SIZE);
+        jobs.insert(jobs.end(), dropped.begin(), dropped.begin() + count);
+        dropped.erase(dropped.begin(), dropped.begin() + count);
+        work.notify_all();
+    }
+}
+
+void CScriptCompiler::run()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while(true)
+    {
+        if(stopping)
+            return;
+        int queued = countQueued();
+        if(!queued)
+        {
+            work.wait(guard);
+            continue;
+        }
+        if(batchWindow && queued < TINYJS_COMPILE_BATCH_SIZE)
+        {
+            // give the functions getting hot along with these a moment to turn up, so one run of gcc builds them all
+            if(work.wait_for(guard, std::chrono::milliseconds(batchWindow),
+                             [this] { return stopping || countQueued() >= TINYJS_COMPILE_BATCH_SIZE; }))
+                continue;
+            if(!countQueued())
+                continue; // another thread took them
+        }
+        std::vector<Job*> batch = takeBatch();
+        guard.unlock();
+        build(batch);
+        guard.lock();
+        for(Job *job : batch)
+        {
+            jobs.erase(std::find(jobs.begin(), jobs.end(), job));
+            done.push_back(job);
+        }
+        finished.store((int)done.size(), std::memory_order_release);
+        idle.notify_all();
+    }
+}
+
+std::vector<CScriptCompiler::Job*> CScriptCompiler::takeBatch()
+{
+    std::vector<Job*> queued;
+    for(Job *job : jobs)
+        if(!job->building)
+            queued.push_back(job);
+    std::stable_sort(queued.begin(), queued.end(), [](const Job *a, const Job *b) { return a->hotness > b->hotness; });
+    // the hottest job, and then (if we're batching) the next hottest that can go in a library with it
+    std::vector<Job*> batch;
+    for(Job *job : queued)
+    {
+        if(!batch.empty())
+        {
+            if(!batchWindow || batch.size() >= TINYJS_COMPILE_BATCH_SIZE)
+                break;
+            bool clashes = job->cache != batch[0]->cache;
+            for(Job *other : batch)
+                clashes = clashes || other->name == job->name;
+            if(clashes)
+                continue;
+        }
+        job->building = true;
+        batch.push_back(job);
+    }
+    return batch;
+}
+
+int CScriptCompiler::countQueued()
+{
+    int queued = 0;
+    for(Job *job : jobs)
+        if(!job->building)
+            queued++;
+    return queued;
+}
+
+void CScriptCompiler::release(Job *job)
+{
+    if(job->handle)
+        FREELIB(job->handle);
+    job->function->unref();
+    delete job;
+}
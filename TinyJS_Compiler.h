@@ -0,0 +1,88 @@
+#include "TinyJS.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#pragma once
+
+// The most builds that can wait for a thread at once. When it's full, a hotter function takes the place of the coldest.
+#define TINYJS_COMPILE_QUEUE_SIZE 16
+// The most functions that go into one library when builds are batched (see CTinyJS::setCompileBatching)
+#define TINYJS_COMPILE_BATCH_SIZE 16
+
+/** Builds the C++ that CScriptSyntaxTree::compile writes for a function into a library with gcc
+  * (or cl), and loads it. Builds can run on a pool of background threads so a script doesn't stop
+  * while gcc does: jobs wait in a bounded queue, hottest first (those pushed out of it wait to get
+  * hotter, or for the queue to be drained), and CTinyJS installs what they made
+  * at the start of a call (see CTinyJS::setCompileThreads). The threads can also gather the jobs
+  * that turn up within a short window and build them all with one run of gcc.
+  * Only build() and the threads run outside the interpreter's thread, and they don't touch any
+  * CScriptVars, so everything else here is called from the interpreter's thread.
+  */
+class CScriptCompiler
+{
+public:
+    struct Job
+    {
+        CScriptVar *function; ///< The function to install the build in (ref'd until the job is done with)
+        std::string name; ///< The function's name in the library
+        std::string source; ///< The C++
+        std::string cache; ///< The directory to keep the library in (see CTinyJS::setCompileCache)
+        size_t cacheSize;
+        int hotness; ///< How many times the function had run, the last we heard
+        bool building; ///< Whether a thread has taken it
+        LIBHANDLE handle; ///< What the build made (0 if it failed)
+        JSCallback callback;
+        std::string error; ///< Why there's no callback, if there isn't
+    };
+
+    /// 'batchWindow' is how many milliseconds a thread waits for more jobs to build along with the first it finds (0 for none)
+    CScriptCompiler(int threads, int batchWindow);
+    ~CScriptCompiler(); ///< Wait for the builds that have started, and drop the rest
+
+    /** Build the jobs (which must have different names and the same cache) into one library on this thread,
+      * and load each job's function from it. Jobs found in the cache are just loaded. A job that couldn't be
+      * built or loaded is left without a callback, and with the reason in its error. */
+    static void build(const std::vector<Job*> &batch);
+
+    /** Queue a job. If the queue's full, the coldest job (which may be this one) is pushed out of it,
+      * and waits to be built until the queue is drained by wait(), or it's raised above another. */
+    void submit(CScriptVar *function, const std::string &name, const std::string &source,
+                const std::string &cache, size_t cacheSize, int hotness);
+    /// Tell the queue a function has got hotter. Returns false if it has no job.
+    bool raise(CScriptVar *function, int hotness);
+    static const std::string &getDirectory(); ///< This process's own directory for building in
+    static int getBuildCount() { return builds.load(); } ///< How many libraries have been built, each with one run of gcc
+
+    bool hasFinished() { return finished.load(std::memory_order_acquire) > 0; } ///< Are there jobs for takeFinished?
+    std::vector<Job*> takeFinished(); ///< The jobs the threads are done with, which are now the caller's to delete
+    void wait(); ///< Wait until every job has been built, including those pushed out of the queue
+
+private:
+    int threadCount;
+    int batchWindow;
+    std::vector<std::thread> threads; ///< Started when the first job is queued
+    std::mutex lock; ///< Guards everything below
+    std::condition_variable work; ///< Signalled when a job is queued, or the threads should stop
+    std::condition_variable idle; ///< Signalled when a job has been built
+    std::vector<Job*> jobs; ///< Queued and building
+    std::vector<Job*> done;
+    std::vector<Job*> dropped; ///< Pushed out of the queue by hotter jobs
+    std::atomic<int> finished; ///< done.size(), for hasFinished
+    bool stopping;
+    static std::atomic<int> builds; ///< For getBuildCount, and to give each library its own name
+
+    void run(); ///< What each thread does
+    std::vector<Job*> takeBatch(); ///< The hottest queued jobs that can be built together (with the lock held)
+    int countQueued(); ///< With the lock held
+    bool enqueue(Job *job); ///< Put a job in the queue, or in 'dropped' if it's the coldest and there's no room (with the lock held)
+    void release(Job *job); ///< Give up a job that won't be installed
+
+    /// Write the jobs' sources to 'file'.cpp, and build them into 'library' (giving each job the error if it can't)
+    static bool compileLibrary(const std::vector<Job*> &batch, const std::string &file, const std::string &library);
+    static bool load(const std::string &library, Job *job); ///< Load the job's function from 'library'
+    static std::string getCachePath(const Job *job); ///< The name the job's library has in its cache
+    /// Delete the least recently used libraries over 'cacheSize', other than those the jobs in 'keep' just made
+    static void evict(const std::string &cache, size_t cacheSize, const std::vector<Job*> &keep);
+};
@@ -102,7 +102,7 @@ void scStringCharAt(CScriptVar *c, void *)
     string str = c->getParameter("this")->getString();
     int p = c->getParameter("pos")->getInt();
     if(p >= 0 && p < (int)str.length())
-        c->getReturnVar()->setString(str.substr(p, 1));
+        c->setReturnVar(CScriptConstants::getChar(str[p]));
     else
         c->getReturnVar()->setString("");
 }
@@ -139,10 +139,11 @@ void scStringSplit(CScriptVar *c, void *)
 
 void scStringFromCharCode(CScriptVar *c, void *)
 {
-    char str[2];
-    str[0] = c->getParameter("char")->getInt();
-    str[1] = 0;
-    c->getReturnVar()->setString(str);
+    char ch = c->getParameter("char")->getInt();
+    if(ch)
+        c->setReturnVar(CScriptConstants::getChar(ch));
+    else
+        c->getReturnVar()->setString(""); // as it was when this made a C string
 }
 
 void scIntegerParseInt(CScriptVar *c, void *)
@@ -186,80 +187,50 @@ void scEval(CScriptVar *c, void *data)
 void scArrayContains(CScriptVar *c, void *data)
 {
     CScriptVar *obj = c->getParameter("obj");
+    CScriptVar *arr = c->getParameter("this");
 
     bool contains = false;
-    for(auto& it : c->getParameter("this")->children)
-    {
-        CScriptVarLink* v = it.second;
+    for(CScriptVarLink *v : arr->arrayElements())
         if(v->var->equals(obj))
         {
             contains = true;
             break;
         }
-    }
 
     c->getReturnVar()->setInt(contains);
 }
 
 void scArrayRemove(CScriptVar *c, void *data)
 {
-    // The implementation for this function is straight garbage.
-    // There has to be a better way to keep the linked list and map
-    // synced up, as well as keep link names and keys consistent, but 
-    // I was unable to come up with one. This may be in part because 
-    // the linked-list based algorithm only worked because of implementation
-    // details and left extra children in the array, and this algorithm
-    // is more or less based on that one.
     CScriptVar *obj = c->getParameter("obj");
-    vector<int> removedIndices;
-    vector<CScriptVarLink*> children;
-    // remove
-    CScriptVar* var = c->getParameter("this");
-    children = var->orderedChildren();
-    for(auto& child : children)
+    CScriptVar *arr = c->getParameter("this");
+    // take out the elements we're keeping, each moved down by the number removed before it (holes stay as holes)
+    vector<CScriptVarLink*> elements = arr->arrayElements();
+    vector<pair<int, CScriptVar*> > kept;
+    int removed = 0;
+    for(CScriptVarLink *v : elements)
     {
-        if(child->var->equals(obj))
+        if(v->var->equals(obj))
         {
-            removedIndices.push_back(child->getIntName());
-            var->removeLink(child); // this also deletes the link
+            removed++;
+            continue;
         }
+        kept.push_back(make_pair(CScriptAtoms::getIndex(v->nameAtom) - removed, v->var->ref()));
     }
-    if(removedIndices.empty())
+    if(!removed)
+    {
+        for(auto& v : kept)
+            v.second->unref();
         return;
-
-    // refetch the list of children since some have been deleted
-    children = var->orderedChildren();
-    // renumber
-    for(auto& child : children)
+    }
+    // and put them back without the gaps
+    for(auto v = elements.rbegin(); v != elements.rend(); ++v)
+        arr->removeLink(*v);
+    for(auto& v : kept)
     {
-        int n = child->getIntName();
-        int newn = n;
-        for(size_t i = 0; i < removedIndices.size(); i++)
-            if(n >= removedIndices[i])
-                newn--;
-        if(newn != n)
-        {
-            child->setIntName(newn);
-            // fix up keys in the map
-            CScriptVarLink* link = var->addChildNoDup(child->name, child->var);
-            link->name = child->name;
-        }
+        arr->addChild(CScriptAtoms::getIndexAtom(v.first), v.second);
+        v.second->unref();
     }
-    // we need to eliminate children that are stale
-    // (ie children whose name does not match their key)
-    // however we cannot do that while iterating over the map
-    children.clear(); // reuse children
-    for(auto& pair : var->children)
-        if(pair.first != pair.second->name)
-        {
-            // it is impossible to delete an element using the
-            // given methods if the link's name does not match
-            // the key's name.
-            pair.second->name = pair.first;
-            children.push_back(pair.second);
-        }
-    for(auto& child : children)
-        var->removeLink(child);
 }
 
 void scArrayJoin(CScriptVar *c, void *data)
@@ -272,7 +243,8 @@ void scArrayJoin(CScriptVar *c, void *data)
     for(int i = 0; i < l; i++)
     {
         if(i > 0) sstr << sep;
-        sstr << arr->getArrayIndex(i)->getString();
+        CScriptVarLink *v = arr->findArrayElement(i);
+        sstr << (v ? v->var->getString() : "null");
     }
 
     c->getReturnVar()->setString(sstr.str());
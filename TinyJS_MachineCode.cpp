@@ -0,0 +1,397 @@
+#include "TinyJS_MachineCode.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#include <sys/mman.h>
+#include <unistd.h>
+#define TINYJS_MACHINE_CODE
+#endif
+
+/* The code is made of calls to the steps, with these kept safe across the calls by the ABI:
+       rbx = the State, r12 = State::regs
+   Each step's result comes back in eax: STEP_NEXT, STEP_JUMP or STEP_STOP. Anything a step
+   throws is caught in the step, so exceptions never unwind through the machine code.
+   The fast paths in between use eax and ecx for ints, and rdx and esi to look at links and
+   variables. Anything they aren't sure of jumps to the step instead. */
+
+/// Writes x86-64 instructions into a buffer, with jumps to labels that are filled in by finish()
+class CScriptAssembler
+{
+public:
+    enum REGISTERS { EAX = 0, ECX = 1, EDX = 2, ESI = 6 };
+    // condition codes, for jcc and setcc
+    enum CONDITIONS { CC_E = 0x4, CC_NE = 0x5, CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF };
+    // ALU ops of the form 'op eax, ecx'
+    enum ALU_OPS { ALU_ADD = 0x01, ALU_OR = 0x09, ALU_AND = 0x21, ALU_SUB = 0x29, ALU_XOR = 0x31, ALU_CMP = 0x39 };
+
+    std::vector<unsigned char> bytes;
+
+    int newLabel()
+    {
+        labels.push_back(-1);
+        return (int)labels.size() - 1;
+    }
+    void bind(int label) { labels[label] = (int)bytes.size(); }
+
+    void prologue()
+    {
+        byte(0x53); // push rbx
+        byte(0x41); byte(0x54); // push r12
+        byte(0x41); byte(0x55); // push r13, to keep the stack 16 byte aligned for the calls
+        byte(0x48); byte(0x89); byte(0xFB); // mov rbx, rdi
+        byte(0x49); byte(0x89); byte(0xF4); // mov r12, rsi
+    }
+    void epilogue()
+    {
+        byte(0x41); byte(0x5D); // pop r13
+        byte(0x41); byte(0x5C); // pop r12
+        byte(0x5B); // pop rbx
+        byte(0xC3); // ret
+    }
+    /// eax = step(state, instruction)
+    void callStep(CScriptBytecode::StepFunction step, const CScriptInstruction* instruction)
+    {
+        byte(0x48); byte(0x89); byte(0xDF); // mov rdi, rbx
+        byte(0x48); byte(0xBE); quad((uint64_t)(uintptr_t)instruction); // mov rsi, imm64
+        byte(0x48); byte(0xB8); quad((uint64_t)(uintptr_t)step); // mov rax, imm64
+        byte(0xFF); byte(0xD0); // call rax
+    }
+    void jump(int label)
+    {
+        byte(0xE9); // jmp rel32
+        target(label);
+    }
+    void jumpIf(int condition, int label)
+    {
+        byte(0x0F); byte(0x80 | condition); // jcc rel32
+        target(label);
+    }
+
+    // ints in eax and ecx
+    void testEax() { byte(0x85); byte(0xC0); } ///< test eax, eax
+    void testEcx() { byte(0x85); byte(0xC9); } ///< test ecx, ecx
+    void cmpEax(int value) { byte(0x3D); dword(value); } ///< cmp eax, imm32
+    void alu(int op) { byte(op); byte(0xC8); } ///< op eax, ecx
+    void imul() { byte(0x0F); byte(0xAF); byte(0xC1); } ///< imul eax, ecx
+    /// eax = eax / ecx, edx = the remainder
+    void idiv()
+    {
+        byte(0x99); // cdq
+        byte(0xF7); byte(0xF9); // idiv ecx
+    }
+    void moveEdxToEax() { byte(0x89); byte(0xD0); } ///< mov eax, edx
+    /// eax = condition ? 1 : 0
+    void setEax(int condition)
+    {
+        byte(0x0F); byte(0x90 | condition); byte(0xC0); // setcc al
+        byte(0x0F); byte(0xB6); byte(0xC0); // movzx eax, al
+    }
+
+    // the registers of the State, at [r12+disp]
+    void load(int reg, int disp) { byte(0x41); byte(0x8B); r12(disp, reg); } ///< mov reg32, [r12+disp]
+    void store(int disp, int reg) { byte(0x41); byte(0x89); r12(disp, reg); } ///< mov [r12+disp], reg32
+    void loadRdx(int disp) { byte(0x49); byte(0x8B); r12(disp, EDX); } ///< mov rdx, [r12+disp]
+    void cmpDword(int disp, int value) { byte(0x41); byte(0x81); r12(disp, 7); dword(value); } ///< cmp dword [r12+disp], imm32
+    void storeDword(int disp, int value) { byte(0x41); byte(0xC7); r12(disp, 0); dword(value); } ///< mov dword [r12+disp], imm32
+    void storeQword(int disp, int value) { byte(0x49); byte(0xC7); r12(disp, 0); dword(value); } ///< mov qword [r12+disp], imm32
+
+    // links and variables, at [rdx+disp]
+    void testRdx() { byte(0x48); byte(0x85); byte(0xD2); } ///< test rdx, rdx
+    void cmpByteAtRdx(int disp, int value) { byte(0x80); rdx(disp, 7); byte(value); } ///< cmp byte [rdx+disp], imm8
+    void loadRdxFromRdx(int disp) { byte(0x48); byte(0x8B); rdx(disp, EDX); } ///< mov rdx, [rdx+disp]
+    void loadFromRdx(int reg, int disp) { byte(0x8B); rdx(disp, reg); } ///< mov reg32, [rdx+disp]
+    void andEsi(int value) { byte(0x81); byte(0xE6); dword(value); } ///< and esi, imm32
+    void cmpEsi(int value) { byte(0x81); byte(0xFE); dword(value); } ///< cmp esi, imm32
+
+    /// Fill in the jumps
+    void finish()
+    {
+        for(const Jump& jump : jumps)
+        {
+            int32_t rel = labels[jump.label] - (jump.at + 4);
+            memcpy(&bytes[jump.at], &rel, 4);
+        }
+    }
+
+private:
+    struct Jump { int at; int label; };
+    std::vector<int> labels; ///< Where each label is bound
+    std::vector<Jump> jumps;
+
+    void byte(int b) { bytes.push_back((unsigned char)b); }
+    void dword(int32_t value) { bytes.insert(bytes.end(), (unsigned char*)&value, (unsigned char*)&value + 4); }
+    void quad(uint64_t value) { bytes.insert(bytes.end(), (unsigned char*)&value, (unsigned char*)&value + 8); }
+    /// ModRM and SIB for [r12+disp32], with 'reg' as the register (or extended opcode)
+    void r12(int disp, int reg)
+    {
+        byte(0x84 | (reg << 3));
+        byte(0x24);
+        dword(disp);
+    }
+    /// ModRM for [rdx+disp32]
+    void rdx(int disp, int reg)
+    {
+        byte(0x82 | (reg << 3));
+        dword(disp);
+    }
+    void target(int label)
+    {
+        Jump jump = { (int)bytes.size(), label };
+        jumps.push_back(jump);
+        dword(0);
+    }
+};
+
+CScriptMachineCode::Fields CScriptMachineCode::getFields()
+{
+    // CScriptVar isn't standard layout, so look at a real one rather than use offsetof
+    CScriptVarLink* link = new CScriptVarLink(new CScriptVar());
+    CScriptVar* var = link->var;
+    Fields fields;
+    fields.linkVar = (int)((char*)&link->var - (char*)link);
+    fields.linkOwned = (int)((char*)&link->owned - (char*)link);
+    fields.varFlags = (int)((char*)&var->flags - (char*)var);
+    fields.varInt = (int)((char*)&var->intData - (char*)var);
+    delete link;
+    return fields;
+}
+
+/// Where the parts of a register are, relative to r12
+static int typeOf(int reg) { return reg * (int)sizeof(CScriptValue) + (int)offsetof(CScriptValue, type); }
+static int intOf(int reg) { return reg * (int)sizeof(CScriptValue) + (int)offsetof(CScriptValue, intData); }
+static int linkOf(int reg) { return reg * (int)sizeof(CScriptValue) + (int)offsetof(CScriptValue, link); }
+
+/// Get rA as an int into 'dest' if it holds one, or is a variable's link to one, otherwise jump to 'slow'
+static void fetchInt(CScriptAssembler& as, const CScriptMachineCode::Fields& fields, int reg, int dest, int slow)
+{
+    int isLink = as.newLabel(), done = as.newLabel();
+    as.cmpDword(typeOf(reg), CScriptValue::INT);
+    as.jumpIf(CScriptAssembler::CC_NE, isLink);
+    as.load(dest, intOf(reg));
+    as.jump(done);
+    as.bind(isLink);
+    as.cmpDword(typeOf(reg), CScriptValue::LINK);
+    as.jumpIf(CScriptAssembler::CC_NE, slow);
+    as.loadRdx(linkOf(reg));
+    // a temporary link would have to be freed, so leave that to the step
+    as.cmpByteAtRdx(fields.linkOwned, 0);
+    as.jumpIf(CScriptAssembler::CC_E, slow);
+    as.loadRdxFromRdx(fields.linkVar);
+    as.loadFromRdx(CScriptAssembler::ESI, fields.varFlags);
+    as.andEsi(SCRIPTVAR_VARTYPEMASK);
+    as.cmpEsi(SCRIPTVAR_INTEGER);
+    as.jumpIf(CScriptAssembler::CC_NE, slow);
+    as.loadFromRdx(dest, fields.varInt);
+    as.bind(done);
+}
+
+/// Set a register that fetchInt has been through to empty
+static void emptyRegister(CScriptAssembler& as, int reg)
+{
+    as.storeDword(typeOf(reg), CScriptValue::LINK);
+    as.storeQword(linkOf(reg), 0);
+}
+
+/// Free rA as clearRegister does, if it's a number or a variable's link, otherwise jump to 'slow'
+static void clearRegister(CScriptAssembler& as, const CScriptMachineCode::Fields& fields, int reg, int slow)
+{
+    int empty = as.newLabel(), done = as.newLabel();
+    as.cmpDword(typeOf(reg), CScriptValue::LINK);
+    as.jumpIf(CScriptAssembler::CC_NE, empty);
+    as.loadRdx(linkOf(reg));
+    as.testRdx();
+    as.jumpIf(CScriptAssembler::CC_E, done);
+    as.cmpByteAtRdx(fields.linkOwned, 0);
+    as.jumpIf(CScriptAssembler::CC_E, slow);
+    as.bind(empty);
+    emptyRegister(as, reg);
+    as.bind(done);
+}
+
+/// If rA and rB are both ints, do 'op' on them right here, otherwise jump to 'slow'
+static bool intMaths(CScriptAssembler& as, const CScriptMachineCode::Fields& fields, const CScriptInstruction& in, int slow)
+{
+    int condition = -1;
+    switch(in.op)
+    {
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD: case OP_AND: case OP_OR: case OP_XOR: break;
+    case OP_EQ: case OP_TEQ: condition = CScriptAssembler::CC_E; break;
+    case OP_NE: case OP_NTEQ: condition = CScriptAssembler::CC_NE; break;
+    case OP_LT: condition = CScriptAssembler::CC_L; break;
+    case OP_LE: condition = CScriptAssembler::CC_LE; break;
+    case OP_GT: condition = CScriptAssembler::CC_G; break;
+    case OP_GE: condition = CScriptAssembler::CC_GE; break;
+    default: return false;
+    }
+    fetchInt(as, fields, in.a, CScriptAssembler::EAX, slow);
+    fetchInt(as, fields, in.b, CScriptAssembler::ECX, slow);
+    switch(in.op)
+    {
+    case OP_ADD: as.alu(CScriptAssembler::ALU_ADD); break;
+    case OP_SUB: as.alu(CScriptAssembler::ALU_SUB); break;
+    case OP_MUL: as.imul(); break;
+    case OP_DIV:
+    case OP_MOD:
+        // only dividing by a positive number can't trap
+        as.testEcx();
+        as.jumpIf(CScriptAssembler::CC_LE, slow);
+        as.idiv();
+        if(in.op == OP_MOD)
+            as.moveEdxToEax();
+        break;
+    case OP_AND: as.alu(CScriptAssembler::ALU_AND); break;
+    case OP_OR: as.alu(CScriptAssembler::ALU_OR); break;
+    case OP_XOR: as.alu(CScriptAssembler::ALU_XOR); break;
+    default:
+        as.alu(CScriptAssembler::ALU_CMP);
+        as.setEax(condition);
+    }
+    emptyRegister(as, in.b);
+    as.storeDword(typeOf(in.a), CScriptValue::INT);
+    as.store(intOf(in.a), CScriptAssembler::EAX);
+    return true;
+}
+
+bool CScriptMachineCode::isSupported()
+{
+#ifdef TINYJS_MACHINE_CODE
+    return true;
+#else
+    return false;
+#endif
+}
+
+CScriptMachineCode::CScriptMachineCode(CTinyJS* js, CScriptBytecode* bytecode)
+{
+    this->js = js;
+    this->bytecode = bytecode;
+    code = 0;
+    size = mappedSize = 0;
+#ifdef TINYJS_MACHINE_CODE
+    static const Fields fields = getFields();
+    const std::vector<CScriptInstruction>& instructions = bytecode->getCode();
+    CScriptAssembler as;
+    std::vector<int> labels;
+    for(size_t i = 0; i < instructions.size(); i++)
+        labels.push_back(as.newLabel());
+    int exit = as.newLabel();
+
+    as.prologue();
+    for(size_t i = 0; i < instructions.size(); i++)
+    {
+        const CScriptInstruction& in = instructions[i];
+        int slow = as.newLabel(), next = as.newLabel();
+        bool fast = false;
+        as.bind(labels[i]);
+        switch(in.op)
+        {
+        case OP_NOP:
+            break;
+        case OP_END:
+            as.jump(exit);
+            break;
+        case OP_RETURN:
+            as.callStep(CScriptBytecode::getStep(in.op), &in);
+            as.jump(exit);
+            break;
+        case OP_JMP:
+#ifdef TINYJS_TRACING_GC
+            // the step is a safe point for the collector
+            as.callStep(CScriptBytecode::getStep(in.op), &in);
+            as.cmpEax(CScriptBytecode::STEP_JUMP);
+            as.jumpIf(CScriptAssembler::CC_NE, exit);
+#endif
+            as.jump(labels[in.b]);
+            break;
+        case OP_JMPF:
+        case OP_JMPT:
+#ifndef TINYJS_TRACING_GC
+            fetchInt(as, fields, in.a, CScriptAssembler::EAX, slow);
+            if(in.c)
+                emptyRegister(as, in.a);
+            as.testEax();
+            as.jumpIf(in.op == OP_JMPT ? CScriptAssembler::CC_NE : CScriptAssembler::CC_E, labels[in.b]);
+            as.jump(next);
+            as.bind(slow);
+#endif
+            as.callStep(CScriptBytecode::getStep(in.op), &in);
+            as.cmpEax(CScriptBytecode::STEP_JUMP);
+            as.jumpIf(CScriptAssembler::CC_E, labels[in.b]);
+            as.testEax();
+            as.jumpIf(CScriptAssembler::CC_NE, exit);
+            as.bind(next);
+            break;
+        default:
+            if(in.op == OP_CLEAR)
+            {
+                clearRegister(as, fields, in.a, slow);
+                fast = true;
+            }
+            else if(in.op == OP_CONST && bytecode->getConstant(in.b)->isInt())
+            {
+                clearRegister(as, fields, in.a, slow);
+                as.storeDword(typeOf(in.a), CScriptValue::INT);
+                as.storeDword(intOf(in.a), bytecode->getConstant(in.b)->getInt());
+                fast = true;
+            }
+            else
+                fast = intMaths(as, fields, in, slow);
+            if(fast)
+            {
+                as.jump(next);
+                as.bind(slow);
+            }
+            as.callStep(CScriptBytecode::getStep(in.op), &in);
+            as.testEax();
+            as.jumpIf(CScriptAssembler::CC_NE, exit);
+            as.bind(next);
+        }
+    }
+    as.bind(exit);
+    as.epilogue();
+    as.finish();
+
+    // write the code, then make it executable (and no longer writable)
+    size = as.bytes.size();
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    mappedSize = (size + page - 1) / page * page;
+    void* memory = mmap(0, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(memory == MAP_FAILED)
+        throw new CScriptException("Unable to get memory for machine code");
+    memcpy(memory, &as.bytes[0], size);
+    if(mprotect(memory, mappedSize, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(memory, mappedSize);
+        throw new CScriptException("Unable to make machine code executable");
+    }
+    code = (unsigned char*)memory;
+#else
+    throw new CScriptException("Machine code isn't supported on this platform");
+#endif
+}
+
+CScriptMachineCode::~CScriptMachineCode()
+{
+#ifdef TINYJS_MACHINE_CODE
+    if(code)
+        munmap(code, mappedSize);
+#endif
+}
+
+void CScriptMachineCode::execute(bool& execute)
+{
+    CScriptBytecode::State state;
+    bytecode->begin(state, js, execute);
+    ((Entry)code)(&state, state.regs);
+    bytecode->end(state);
+    if(state.exception)
+        std::rethrow_exception(state.exception);
+}
+
+void CScriptMachineCode::call(CScriptVar* root, void* userdata)
+{
+    bool execute = true;
+    ((CScriptMachineCode*)userdata)->execute(execute);
+}
@@ -0,0 +1,38 @@
+#include "TinyJS_Bytecode.h"
+
+#pragma once
+
+/** A function's bytecode compiled in memory into x86-64 machine code. This is much quicker to
+  * get than writing the function out as C++ for gcc, and needs nothing installed. It's a baseline
+  * compiler: each instruction becomes a call to its step (see CScriptBytecode::getStep), jumps
+  * become real jumps, and maths and comparisons on two ints are done right there in the machine
+  * code. The function runs as a native (see CTinyJS::setCompilers), in the scope of its call.
+  */
+class CScriptMachineCode
+{
+public:
+    static bool isSupported(); ///< Can machine code be made and run here?
+
+    /// Compile 'bytecode', which must outlive this. Throws a CScriptException if it can't be done.
+    CScriptMachineCode(CTinyJS* js, CScriptBytecode* bytecode);
+    ~CScriptMachineCode();
+
+    /// Run the code against the interpreter's current scopes, as CScriptBytecode::execute does
+    void execute(bool& execute);
+    /// The JSCallback for a function compiled to machine code ('userdata' is the CScriptMachineCode)
+    static void call(CScriptVar* root, void* userdata);
+    size_t getSize() { return size; } ///< The number of bytes of machine code
+
+    /// Where the fast paths find things in links and variables
+    struct Fields { int linkVar, linkOwned, varFlags, varInt; };
+    static Fields getFields();
+
+private:
+    typedef void (*Entry)(CScriptBytecode::State* state, CScriptValue* regs);
+
+    CTinyJS* js;
+    CScriptBytecode* bytecode;
+    unsigned char* code; ///< Executable memory, which starts with an Entry
+    size_t size;
+    size_t mappedSize; ///< 'size' rounded up to whole pages
+};
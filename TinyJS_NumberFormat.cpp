@@ -0,0 +1,310 @@
+#include "TinyJS_NumberFormat.h"
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+static const char digitPairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+int formatInt(long value, char* buffer)
+{
+    char digits[TINYJS_NUMBER_BUFFER_SIZE];
+    char* p = digits + sizeof(digits);
+    unsigned long n = value < 0 ? 0UL - (unsigned long)value : (unsigned long)value;
+    // two digits at a time
+    while(n >= 100)
+    {
+        const char* pair = &digitPairs[(n % 100) * 2];
+        n /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    if(n >= 10)
+    {
+        *--p = digitPairs[n * 2 + 1];
+        *--p = digitPairs[n * 2];
+    }
+    else
+        *--p = (char)('0' + n);
+    if(value < 0)
+        *--p = '-';
+    int length = (int)(digits + sizeof(digits) - p);
+    memcpy(buffer, p, length);
+    buffer[length] = 0;
+    return length;
+}
+
+// ----------------------------------------------------------------------------------- Grisu2
+
+/// A floating point number with a 64 bit significand, and no rounding: f * 2^e
+struct DiyFp
+{
+    uint64_t f;
+    int e;
+
+    DiyFp(uint64_t f, int e) : f(f), e(e) {}
+    /// The exact value of a (positive) double
+    explicit DiyFp(double d)
+    {
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        int biasedExponent = (int)((bits >> 52) & 0x7FF);
+        uint64_t significand = bits & 0x000FFFFFFFFFFFFFULL;
+        if(biasedExponent)
+        {
+            f = significand | HIDDEN_BIT;
+            e = biasedExponent - EXPONENT_BIAS;
+        }
+        else
+        {
+            f = significand; // denormal
+            e = 1 - EXPONENT_BIAS;
+        }
+    }
+
+    DiyFp operator-(const DiyFp& b) const { return DiyFp(f - b.f, e); }
+    /// The product, rounded to 64 bits
+    DiyFp operator*(const DiyFp& b) const
+    {
+        const uint64_t M32 = 0xFFFFFFFFULL;
+        uint64_t ac = (f >> 32) * (b.f >> 32);
+        uint64_t bc = (f & M32) * (b.f >> 32);
+        uint64_t ad = (f >> 32) * (b.f & M32);
+        uint64_t bd = (f & M32) * (b.f & M32);
+        uint64_t mid = (bd >> 32) + (ad & M32) + (bc & M32) + (1ULL << 31);
+        return DiyFp(ac + (ad >> 32) + (bc >> 32) + (mid >> 32), e + b.e + 64);
+    }
+    /// Shift so that the top bit of f is set
+    DiyFp normalize() const
+    {
+        DiyFp r = *this;
+        while(!(r.f & (1ULL << 63)))
+        {
+            r.f <<= 1;
+            r.e--;
+        }
+        return r;
+    }
+    /// The points halfway to the doubles either side, with the same exponent (that of 'plus' normalized)
+    void boundaries(DiyFp& minus, DiyFp& plus) const
+    {
+        plus = DiyFp((f << 1) + 1, e - 1).normalize();
+        // the gap below is half the size at a power of two
+        minus = f == HIDDEN_BIT ? DiyFp((f << 2) - 1, e - 2) : DiyFp((f << 1) - 1, e - 1);
+        minus.f <<= minus.e - plus.e;
+        minus.e = plus.e;
+    }
+
+    static const uint64_t HIDDEN_BIT = 0x0010000000000000ULL;
+    static const int EXPONENT_BIAS = 0x3FF + 52;
+};
+
+// 10^-348, 10^-340, ... 10^340, normalized
+static const uint64_t cachedPowersF[] =
+{
+    0xfa8fd5a0081c0288, 0xbaaee17fa23ebf76, 0x8b16fb203055ac76, 0xcf42894a5dce35ea,
+    0x9a6bb0aa55653b2d, 0xe61acf033d1a45df, 0xab70fe17c79ac6ca, 0xff77b1fcbebcdc4f,
+    0xbe5691ef416bd60c, 0x8dd01fad907ffc3c, 0xd3515c2831559a83, 0x9d71ac8fada6c9b5,
+    0xea9c227723ee8bcb, 0xaecc49914078536d, 0x823c12795db6ce57, 0xc21094364dfb5637,
+    0x9096ea6f3848984f, 0xd77485cb25823ac7, 0xa086cfcd97bf97f4, 0xef340a98172aace5,
+    0xb23867fb2a35b28e, 0x84c8d4dfd2c63f3b, 0xc5dd44271ad3cdba, 0x936b9fcebb25c996,
+    0xdbac6c247d62a584, 0xa3ab66580d5fdaf6, 0xf3e2f893dec3f126, 0xb5b5ada8aaff80b8,
+    0x87625f056c7c4a8b, 0xc9bcff6034c13053, 0x964e858c91ba2655, 0xdff9772470297ebd,
+    0xa6dfbd9fb8e5b88f, 0xf8a95fcf88747d94, 0xb94470938fa89bcf, 0x8a08f0f8bf0f156b,
+    0xcdb02555653131b6, 0x993fe2c6d07b7fac, 0xe45c10c42a2b3b06, 0xaa242499697392d3,
+    0xfd87b5f28300ca0e, 0xbce5086492111aeb, 0x8cbccc096f5088cc, 0xd1b71758e219652c,
+    0x9c40000000000000, 0xe8d4a51000000000, 0xad78ebc5ac620000, 0x813f3978f8940984,
+    0xc097ce7bc90715b3, 0x8f7e32ce7bea5c70, 0xd5d238a4abe98068, 0x9f4f2726179a2245,
+    0xed63a231d4c4fb27, 0xb0de65388cc8ada8, 0x83c7088e1aab65db, 0xc45d1df942711d9a,
+    0x924d692ca61be758, 0xda01ee641a708dea, 0xa26da3999aef774a, 0xf209787bb47d6b85,
+    0xb454e4a179dd1877, 0x865b86925b9bc5c2, 0xc83553c5c8965d3d, 0x952ab45cfa97a0b3,
+    0xde469fbd99a05fe3, 0xa59bc234db398c25, 0xf6c69a72a3989f5c, 0xb7dcbf5354e9bece,
+    0x88fcf317f22241e2, 0xcc20ce9bd35c78a5, 0x98165af37b2153df, 0xe2a0b5dc971f303a,
+    0xa8d9d1535ce3b396, 0xfb9b7cd9a4a7443c, 0xbb764c4ca7a44410, 0x8bab8eefb6409c1a,
+    0xd01fef10a657842c, 0x9b10a4e5e9913129, 0xe7109bfba19c0c9d, 0xac2820d9623bf429,
+    0x80444b5e7aa7cf85, 0xbf21e44003acdd2d, 0x8e679c2f5e44ff8f, 0xd433179d9c8cb841,
+    0x9e19db92b4e31ba9, 0xeb96bf6ebadf77d9, 0xaf87023b9bf0ee6b,
+};
+static const short cachedPowersE[] =
+{
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927,
+    -901, -874, -847, -821, -794, -768, -741, -715, -688, -661, -635, -608,
+    -582, -555, -529, -502, -475, -449, -422, -396, -369, -343, -316, -289,
+    -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30,
+    56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614, 641, 667,
+    694, 720, 747, 774, 800, 827, 853, 880, 907, 933, 960, 986,
+    1013, 1039, 1066,
+};
+
+/// A power of ten that brings a number with binary exponent 'e' into the range Grisu needs. 'K' is set to minus its decimal exponent
+static DiyFp getCachedPower(int e, int& K)
+{
+    double dk = (-61 - e) * 0.30102999566398114 + 347; // log10(2)
+    int k = (int)dk;
+    if(dk - k > 0.0)
+        k++;
+    unsigned index = (unsigned)((k >> 3) + 1);
+    K = -(-348 + (int)(index << 3));
+    return DiyFp(cachedPowersF[index], cachedPowersE[index]);
+}
+
+/// Move the last digit down while that gets closer to w and stays within the range
+static void grisuRound(char* buffer, int length, uint64_t delta, uint64_t rest, uint64_t tenKappa, uint64_t wpw)
+{
+    while(rest < wpw && delta - rest >= tenKappa && (rest + tenKappa < wpw || wpw - rest > rest + tenKappa - wpw))
+    {
+        buffer[length - 1]--;
+        rest += tenKappa;
+    }
+}
+
+static int countDigits(uint32_t n)
+{
+    int digits = 1;
+    while(n >= 10)
+    {
+        n /= 10;
+        digits++;
+    }
+    return digits;
+}
+
+/// Generate the digits of W, stopping as soon as they're within delta of Mp (the top of the range)
+static void digitGen(const DiyFp& W, const DiyFp& Mp, uint64_t delta, char* buffer, int& length, int& K)
+{
+    static const uint64_t pow10[] =
+    {
+        1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL,
+        10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL, 100000000000000ULL,
+        1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+    };
+    const DiyFp one(1ULL << -Mp.e, Mp.e);
+    const DiyFp wpw = Mp - W;
+    uint32_t p1 = (uint32_t)(Mp.f >> -one.e); // the integer part
+    uint64_t p2 = Mp.f & (one.f - 1); // the fraction
+    int kappa = countDigits(p1);
+    length = 0;
+    while(kappa > 0)
+    {
+        uint32_t d = p1 / (uint32_t)pow10[kappa - 1];
+        p1 %= (uint32_t)pow10[kappa - 1];
+        if(d || length)
+            buffer[length++] = (char)('0' + d);
+        kappa--;
+        uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+        if(rest <= delta)
+        {
+            K += kappa;
+            grisuRound(buffer, length, delta, rest, pow10[kappa] << -one.e, wpw.f);
+            return;
+        }
+    }
+    for(;;)
+    {
+        p2 *= 10;
+        delta *= 10;
+        char d = (char)(p2 >> -one.e);
+        if(d || length)
+            buffer[length++] = (char)('0' + d);
+        p2 &= one.f - 1;
+        kappa--;
+        if(p2 < delta)
+        {
+            K += kappa;
+            grisuRound(buffer, length, delta, p2, one.f, wpw.f * (-kappa < 20 ? pow10[-kappa] : 0));
+            return;
+        }
+    }
+}
+
+/// The digits of a positive 'value', which is digits * 10^K
+static void grisu2(double value, char* buffer, int& length, int& K)
+{
+    const DiyFp v(value);
+    DiyFp minus(0, 0), plus(0, 0);
+    v.boundaries(minus, plus);
+    const DiyFp cached = getCachedPower(plus.e, K);
+    const DiyFp W = v.normalize() * cached;
+    DiyFp Wp = plus * cached;
+    DiyFp Wm = minus * cached;
+    // stay strictly inside the range, as the multiplications may have been out by one
+    Wm.f++;
+    Wp.f--;
+    digitGen(W, Wp, Wp.f - Wm.f, buffer, length, K);
+}
+
+int formatDouble(double value, char* buffer)
+{
+    char* p = buffer;
+    if(value != value)
+    {
+        strcpy(buffer, "NaN");
+        return 3;
+    }
+    if(value < 0)
+    {
+        *p++ = '-';
+        value = -value;
+    }
+    if(isinf(value))
+    {
+        strcpy(p, "Infinity");
+        return (int)(p - buffer) + 8;
+    }
+    if(value == 0)
+    {
+        strcpy(buffer, "0"); // including -0
+        return 1;
+    }
+    char digits[20];
+    int length, K;
+    grisu2(value, digits, length, K);
+    int point = length + K; // where the decimal point goes, counting from the start of the digits
+    if(length <= point && point <= 21)
+    {
+        // an integer: 1234e2 -> 123400
+        memcpy(p, digits, length);
+        p += length;
+        for(int i = length; i < point; i++)
+            *p++ = '0';
+    }
+    else if(0 < point && point <= 21)
+    {
+        // 1234e-2 -> 12.34
+        memcpy(p, digits, point);
+        p += point;
+        *p++ = '.';
+        memcpy(p, digits + point, length - point);
+        p += length - point;
+    }
+    else if(-6 < point && point <= 0)
+    {
+        // 1234e-6 -> 0.001234
+        *p++ = '0';
+        *p++ = '.';
+        for(int i = point; i < 0; i++)
+            *p++ = '0';
+        memcpy(p, digits, length);
+        p += length;
+    }
+    else
+    {
+        // 1234e30 -> 1.234e+33
+        *p++ = digits[0];
+        if(length > 1)
+        {
+            *p++ = '.';
+            memcpy(p, digits + 1, length - 1);
+            p += length - 1;
+        }
+        *p++ = 'e';
+        int exponent = point - 1;
+        *p++ = exponent < 0 ? '-' : '+';
+        p += formatInt(exponent < 0 ? -exponent : exponent, p);
+    }
+    *p = 0;
+    return (int)(p - buffer);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+/// Room for any number written by the functions below, with its terminating 0
+#define TINYJS_NUMBER_BUFFER_SIZE 32
+
+/// Write 'value' in decimal, and return the number of characters written (not counting the 0)
+int formatInt(long value, char* buffer);
+
+/** Write 'value' as JavaScript's Number.prototype.toString does: the shortest digits that read back
+  * as exactly the same double, with exponent notation for very large and very small numbers. The
+  * digits come from Grisu2 (Loitsch, "Printing Floating-Point Numbers Quickly and Accurately with
+  * Integers"), which always reads back exactly and is almost always the shortest. Returns the
+  * number of characters written (not counting the 0). */
+int formatDouble(double value, char* buffer);
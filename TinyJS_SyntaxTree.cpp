@@ -3,6 +3,8 @@
 #include <algorithm>
 #include <assert.h>
 #include <sstream>
+#include <cmath>
+#include <climits>
 
 #define ASSERT(X) assert(X)
 // if this flag is enabled, the constructors of CSyntax constructs
@@ -15,11 +17,243 @@
 #define NO_LEAK_BEGIN() (std::string("(*") + FUNCTION_VECTOR_NAME + ".insert(" + FUNCTION_VECTOR_NAME + ".end(), ")
 #define NO_LEAK_END() ("))")
 
+// the code CSyntaxNode::emitNative writes when a guard fails (see CSyntaxFunction::emitSpecialized)
+#define NATIVE_DEOPT "throw __deopt_()"
+
+/// The names emitNative gives a variable's native value, and its flag
+static std::string nativeName(const std::string& id) { return "__v_" + id; }
+static std::string nativeFlag(const std::string& id) { return "__d_" + id; }
+
+void CSyntaxNativeFrame::settle()
+{
+    for(auto& variable : pending)
+    {
+        declared.insert(variable.first);
+        if(variable.second)
+            defined.insert(variable.first);
+    }
+    pending.clear();
+}
+
+/// emitNative an expression into 'code', returning its type (FAILED if it isn't an expression it can do)
+static int emitNativeValue(CSyntaxNode* expr, CSyntaxNativeFrame& frame, std::string& code)
+{
+    std::ostringstream out;
+    int type = expr->emitNative(out, frame);
+    code = out.str();
+    return type == CSyntaxNativeFrame::STATEMENT ? (int)CSyntaxNativeFrame::FAILED : type;
+}
+
+/// What CScriptVar::getBool gives for a native value
+static std::string nativeBool(const std::string& code, int type)
+{
+    return type == CSyntaxNativeFrame::DOUBLE ? "((int)(" + code + ") != 0)" : "((" + code + ") != 0)";
+}
+
+/// A native value as a new CScriptVar
+static std::string nativeBox(const std::string& code, int type)
+{
+    return type == CSyntaxNativeFrame::DOUBLE ? "new CScriptVar((double)(" + code + "))" : "CScriptConstants::newInt(" + code + ")";
+}
+
+/// emitNative a statement, with what ends it
+static bool emitNativeStatement(std::ostream& out, CSyntaxNode* statement, CSyntaxNativeFrame& frame, const std::string& indentation)
+{
+    if(dynamic_cast<CSyntaxExpression*>(statement))
+    {
+        // gcc would warn that the value isn't used
+        std::string code;
+        if(emitNativeValue(statement, frame, code) == CSyntaxNativeFrame::FAILED)
+            return false;
+        out << indentation << "(void)(" << code << ");\n";
+    }
+    else
+    {
+        if(statement->emitNative(out, frame, indentation) == CSyntaxNativeFrame::FAILED)
+            return false;
+        if(!dynamic_cast<CSyntaxSequence*>(statement))
+            out << ";\n";
+    }
+    if(!frame.depth)
+        frame.settle();
+    return true;
+}
+
+/// Run a statement, saying it's where anything it throws went wrong unless somewhere inside it already has
+static CScriptVarLink* evaluateStatement(CTinyJS* js, bool& execute, CSyntaxNode* statement)
+{
+    try
+    {
+        return statement->evaluate(js, execute);
+    }
+    catch(CScriptException* e)
+    {
+        if(!e->source && !e->position)
+            e->position = statement->getPosition();
+        throw e;
+    }
+}
+
+/// Write the body of an if, loop or else, which is a lone statement (wanting its ';') unless it was a block
+static void emitStatement(std::ostream& out, CSyntaxNode* statement, const std::string& indentation)
+{
+    statement->emit(out, indentation);
+    if(dynamic_cast<CSyntaxSequence*>(statement))
+        return;
+    if(statement->semicolonizable())
+        out << ";";
+    out << "\n";
+}
+
+/// Write a local's flag (if it has one) to say it's been declared, or given a value
+static std::string nativeSetFlag(CSyntaxNativeFrame& frame, const std::string& id, bool value)
+{
+    if(!frame.flagged.count(id))
+        return std::string();
+    std::string flag = nativeFlag(id);
+    return value ? flag + " = 2" : flag + " = " + flag + " ? " + flag + " : 1";
+}
+
+/// Store a value of type 'type' in the variable 'id', for an assignment ('check' if it might not have been declared) or a 'var'
+static void emitNativeStore(std::ostream& out, CSyntaxNativeFrame& frame, const std::string& id, const std::string& value, int type,
+    bool check)
+{
+    std::string name = nativeName(id);
+    frame.used.insert(id);
+    out << "(";
+    if(check && !frame.declared.count(id))
+    {
+        // before its 'var', it's a global that's being written to
+        frame.checked.insert(id);
+        out << "(" << nativeFlag(id) << " ? (void)0 : " NATIVE_DEOPT "), ";
+    }
+    if(type != frame.variables[id])
+        out << NATIVE_DEOPT; // the variable would change type, which the code can't
+    else
+    {
+        std::string flag = nativeSetFlag(frame, id, true);
+        out << name << " = " << value;
+        if(!flag.empty())
+            out << ", " << flag;
+    }
+    out << ", " << name << ")";
+    if(!frame.depth)
+        frame.pending[id] = true;
+}
+
+/// Write 'a <op> b' for native values of types 'ta' and 'tb' just as CScriptMaths works it out, returning its type
+static int emitNativeMaths(std::ostream& out, int op, const std::string& a, int ta, const std::string& b, int tb)
+{
+    const char* relation = 0;
+    switch(op)
+    {
+    case LEX_EQUAL: case LEX_TYPEEQUAL: relation = "=="; break;
+    case LEX_NEQUAL: case LEX_NTYPEEQUAL: relation = "!="; break;
+    case '<': relation = "<"; break;
+    case LEX_LEQUAL: relation = "<="; break;
+    case '>': relation = ">"; break;
+    case LEX_GEQUAL: relation = ">="; break;
+    }
+    if(relation)
+    {
+        if((op == LEX_TYPEEQUAL || op == LEX_NTYPEEQUAL) && ta != tb)
+            out << (op == LEX_TYPEEQUAL ? "0" : "1"); // an int is never the same as a double
+        else
+            out << "(int)((" << a << ") " << relation << " (" << b << "))";
+        return CSyntaxNativeFrame::INT;
+    }
+    if(op == LEX_LSHIFT || op == LEX_RSHIFT || op == LEX_RSHIFTUNSIGNED)
+    {
+        // shifts always work on ints, and x86 only looks at the bottom 5 bits of the count
+        std::string x = ta == CSyntaxNativeFrame::DOUBLE ? "(int)(" + a + ")" : "(" + a + ")";
+        std::string y = tb == CSyntaxNativeFrame::DOUBLE ? "((int)(" + b + ") & 31)" : "((" + b + ") & 31)";
+        if(op == LEX_RSHIFT)
+            out << "(" << x << " >> " << y << ")";
+        else
+            out << "(int)((unsigned)" << x << (op == LEX_LSHIFT ? " << " : " >> ") << y << ")";
+        return CSyntaxNativeFrame::INT;
+    }
+    if(ta == CSyntaxNativeFrame::DOUBLE || tb == CSyntaxNativeFrame::DOUBLE)
+    {
+        // the interpreter throws for anything else on a double
+        if(op != '+' && op != '-' && op != '*' && op != '/')
+            return CSyntaxNativeFrame::FAILED;
+        out << "((double)(" << a << ") " << (char)op << " (double)(" << b << "))";
+        return CSyntaxNativeFrame::DOUBLE;
+    }
+    switch(op)
+    {
+    case '+': case '-': case '*':
+        // on unsigned, so that overflow wraps as it does when interpreted, rather than being undefined
+        out << "(int)((unsigned)(" << a << ") " << (char)op << " (unsigned)(" << b << "))";
+        return CSyntaxNativeFrame::INT;
+    case '/': case '%':
+        // 0, and -1 (which traps for INT_MIN), are left to the interpreter
+        out << "[&]() -> int { int __b = " << b << "; if(__b == 0 || __b == -1) " NATIVE_DEOPT "; return (" << a << ") "
+            << (char)op << " __b; }()";
+        return CSyntaxNativeFrame::INT;
+    case '&': case '|': case '^':
+        out << "((" << a << ") " << (char)op << " (" << b << "))";
+        return CSyntaxNativeFrame::INT;
+    }
+    return CSyntaxNativeFrame::FAILED;
+}
+
+/// If 'node' is a literal, get it
+static CSyntaxFactor* getLiteral(CSyntaxNode* node)
+{
+    CSyntaxFactor* factor = dynamic_cast<CSyntaxFactor*>(node);
+    return factor && factor->isLiteral() ? factor : 0;
+}
+
+/// Work out 'a <op> b' for two literals just as it would be when run, or return 0 if it has to be left until then
+static CSyntaxFactor* fold(CSyntaxFactor* a, CSyntaxFactor* b, int op)
+{
+    bool execute = true;
+    CScriptVarLink* va = a->evaluate(0, execute);
+    CScriptVarLink* vb = b->evaluate(0, execute);
+    CSyntaxFactor* result = 0;
+    // an int divided by 0 (or the smallest int by -1) would stop us here, rather than when it's run
+    bool trap = (op == '/' || op == '%') && !va->var->isDouble() && !vb->var->isDouble() &&
+        (vb->var->getInt() == 0 || (vb->var->getInt() == -1 && va->var->getInt() == INT_MIN));
+    if(!trap)
+    {
+        try
+        {
+            CScriptVarLink* value = new CScriptVarLink(va->var->mathsOp(vb->var, op));
+            result = CSyntaxFactor::fromValue(value->var);
+            delete value;
+        }
+        catch(CScriptException* e)
+        {
+            delete e; // it'll throw again when it's run
+        }
+    }
+    CLEAN(va);
+    CLEAN(vb);
+    return result;
+}
+
+/// Whether an int is left as it is by 'op' with 'value' on the right (or the left)
+static bool isIdentity(int op, int value, bool onRight)
+{
+    switch(op)
+    {
+    case '+': case '|': case '^': return value == 0;
+    case '*': return value == 1;
+    case '&': return value == -1;
+    case '-': case LEX_LSHIFT: case LEX_RSHIFT: case LEX_RSHIFTUNSIGNED: return onRight && value == 0;
+    case '/': return onRight && value == 1;
+    default: return false;
+    }
+}
+
 CScriptSyntaxTree::CScriptSyntaxTree(CScriptLex* lexer)
 {
     this->lexer = lexer;
     lexerOwned = false;
     root = 0;
+    functionDepth = 0;
 
 }
 
@@ -28,6 +262,7 @@ CScriptSyntaxTree::CScriptSyntaxTree(const std::string& buffer)
     this->lexer = new CScriptLex(buffer);
     lexerOwned = true;
     root = 0;
+    functionDepth = 0;
 }
 
 CScriptSyntaxTree::~CScriptSyntaxTree()
@@ -42,21 +277,58 @@ void CScriptSyntaxTree::parse()
 {
     CSyntaxSequence* stmts = 0;
     while(lexer->tk)
-        stmts = new CSyntaxSequence(stmts, statement());
+        stmts = appendStatement(stmts, statement());
     lexer->match(LEX_EOF);
-    if(stmts && !stmts->first())
+    if(!stmts)
+        root = new CSyntaxEmpty();
+    else if(!stmts->first())
+    {
+        // a single statement doesn't need the sequence around it
         root = stmts->second();
+        stmts->normalize();
+        delete stmts;
+    }
     else
         root = stmts;
 }
 
-void CScriptSyntaxTree::compile(std::ostream & out)
+void CScriptSyntaxTree::optimize(int passes)
 {
-    if(!(CSyntaxFunction*)root)
+    if(root && passes)
+    {
+        int position = root->getPosition();
+        root = root->optimize(passes);
+        if(!root->getPosition())
+            root->setPosition(position);
+    }
+}
+
+void CScriptSyntaxTree::compile(std::ostream & out, const CScriptTypeFeedback* feedback)
+{
+    CSyntaxFunction* function = dynamic_cast<CSyntaxFunction*>(root);
+    if(!function)
         TRACE("Warning: the root of this syntax tree is not a function definition. Compiled code may not function correctly.\n");
+    else if(feedback && function->emitSpecialized(out, *feedback))
+        return;
     root->emit(out);
 }
 
+CScriptVarLink* CScriptSyntaxTree::evaluate(CTinyJS* js, bool& execute)
+{
+    ASSERT(root);
+    try
+    {
+        return evaluateStatement(js, execute, root);
+    }
+    catch(CScriptException* e)
+    {
+        // a statement only knows its position, and it's in our source
+        if(!e->source && e->position)
+            e->source = getSource();
+        throw e;
+    }
+}
+
 std::vector<CSyntaxExpression*> CScriptSyntaxTree::functionCall()
 {
     std::vector<CSyntaxExpression*> args;
@@ -92,18 +364,18 @@ CSyntaxExpression* CScriptSyntaxTree::factor()
     if(lexer->tk == LEX_R_NULL)
     {
         lexer->match(LEX_R_NULL);
-        return new CSyntaxFactor("null");
+        return new CSyntaxFactor("null", CSyntaxFactor::F_TYPE_NULL);
     }
     if(lexer->tk == LEX_R_UNDEFINED)
     {
         lexer->match(LEX_R_UNDEFINED);
-        return new CSyntaxFactor("undefined");
+        return new CSyntaxFactor("undefined", CSyntaxFactor::F_TYPE_UNDEFINED);
     }
-    if(lexer->tk == LEX_ID)
+    if(lexer->tk == LEX_ID || lexer->tk == LEX_R_RESERVED)
     {
         int nameStart = lexer->tokenStart;
         std::string tokenName = lexer->tkStr;
-        lexer->match(LEX_ID);
+        lexer->match(lexer->tk);
         CSyntaxExpression* a = 0;
         while(lexer->tk == '(' || lexer->tk == '.' || lexer->tk == '[')
         {
@@ -113,13 +385,13 @@ CSyntaxExpression* CScriptSyntaxTree::factor()
                 int argStart = lexer->tokenStart;
                 auto args = functionCall();
                 argString += lexer->getSubString(argStart);
-                a = new CSyntaxFunctionCall(a ? a : new CSyntaxID(tokenName), args, argString);
+                a = new CSyntaxFunctionCall(a ? a : variable(tokenName), args, argString, lexer->getSource(), lexer->tokenLastEnd);
             }
             else if(lexer->tk == '.')
             {
                 lexer->match('.');
                 const std::string &name = lexer->tkStr;
-                a = new CSyntaxBinaryOperator('.', a ? a : new CSyntaxID(tokenName), new CSyntaxID(name));
+                a = new CSyntaxBinaryOperator('.', a ? a : variable(tokenName), new CSyntaxID(name));
                 lexer->match(LEX_ID);
             }
             else if(lexer->tk == '[')
@@ -127,62 +399,68 @@ CSyntaxExpression* CScriptSyntaxTree::factor()
                 lexer->match('[');
                 CSyntaxExpression* index = base();
                 lexer->match(']');
-                a = new CSyntaxBinaryOperator('[', a ? a : new CSyntaxID(tokenName), index);
+                a = new CSyntaxBinaryOperator('[', a ? a : variable(tokenName), index);
             }
             else ASSERT(0);
         }
         // likely the lhs of an assignment (or rhs, really)
         if(!a)
-            a = new CSyntaxID(tokenName);
+            a = variable(tokenName);
         return a;
     }
     if(lexer->tk == LEX_INT || lexer->tk == LEX_FLOAT)
     {
-        CSyntaxFactor* a = new CSyntaxFactor(lexer->tkStr);
+        CSyntaxFactor* a = new CSyntaxFactor(lexer->tkStr,
+            lexer->tk == LEX_INT ? CSyntaxFactor::F_TYPE_INT : CSyntaxFactor::F_TYPE_DOUBLE);
         lexer->match(lexer->tk);
         return a;
     }
     if(lexer->tk == LEX_STR)
     {
-        CSyntaxFactor* a = new CSyntaxFactor(lexer->tkStr);
+        // tkStr has already had its quotes stripped, so we can't guess the type from it
+        CSyntaxFactor* a = new CSyntaxFactor(lexer->tkStr, CSyntaxFactor::F_TYPE_STRING);
         lexer->match(LEX_STR);
         return a;
     }
     if(lexer->tk == '{')
     {
         /* JSON-style object definition */
-        std::string arg = "{";
+        int objectStart = lexer->tokenStart;
+        std::vector<std::string> names;
+        std::vector<CSyntaxExpression*> values;
         lexer->match('{');
-        // compile string
         while(lexer->tk != '}')
         {
-            arg += lexer->tkStr.size() ? lexer->tkStr : std::string(1, (char)lexer->tk);
-            lexer->match(lexer->tk);
+            names.push_back(lexer->tkStr);
+            // we only allow strings or IDs on the left hand side of an initialisation
+            if(lexer->tk == LEX_STR) lexer->match(LEX_STR);
+            else lexer->match(LEX_ID);
+            lexer->match(':');
+            values.push_back(base());
+            if(lexer->tk != '}') lexer->match(',');
         }
-        arg += "}";
         lexer->match('}');
-        // "__object_()" is a special native function that constructs an object from a string
-        return new CSyntaxFunctionCall(new CSyntaxID(TINYJS_OBJECT_FUNCTION_NAME), std::vector<CSyntaxExpression*>(1,
-            new CSyntaxFactor(arg.c_str())), TINYJS_OBJECT_FUNCTION_NAME + ("(\"" + arg + "\")"));
+        return new CSyntaxObjectLiteral(names, values, lexer->getSubString(objectStart));
     }
     if(lexer->tk == '[')
     {
         /* JSON-style array definition */
+        int arrayStart = lexer->tokenStart;
+        std::vector<CSyntaxExpression*> values;
         lexer->match('[');
-        std::string arg = "[";
         while(lexer->tk != ']')
         {
-            arg += lexer->tkStr;
-            lexer->match(lexer->tk);
+            values.push_back(base());
+            if(lexer->tk != ']') lexer->match(',');
         }
         lexer->match(']');
-        arg += ']';
-        return new CSyntaxFunctionCall(new CSyntaxID(TINYJS_ARRAY_FUNCTION_NAME), std::vector<CSyntaxExpression*>(1,
-            new CSyntaxFactor(arg.c_str())), TINYJS_ARRAY_FUNCTION_NAME + ("(\"" + arg + "\")"));
+        return new CSyntaxArrayLiteral(values, lexer->getSubString(arrayStart));
     }
     if(lexer->tk == LEX_R_FUNCTION)
     {
-        return parseFunctionDefinition();
+        CSyntaxFunction* func = parseFunctionDefinition();
+        func->setStatement(false);
+        return func;
     }
     if(lexer->tk == LEX_R_NEW)
     {
@@ -192,18 +470,13 @@ CSyntaxExpression* CScriptSyntaxTree::factor()
         // otherwise create a new object and set its .prototype attribute
         // to the thing specified.
         lexer->match(LEX_R_NEW);
-        const std::string &className = lexer->tkStr;
+        int classStart = lexer->tokenStart;
+        CSyntaxID* className = variable(lexer->tkStr);
         lexer->match(LEX_ID);
-        std::string arg = className + "(";
-        while(lexer->tk != ')')
-        {
-            arg += lexer->tkStr;
-            lexer->match(lexer->tk);
-        }
-        lexer->match(')');
-        arg += ')';
-        return new CSyntaxFunctionCall(new CSyntaxID(TINYJS_NEW_FUNCTION_NAME), std::vector<CSyntaxExpression*>(1,
-            new CSyntaxFactor(arg.c_str())), TINYJS_NEW_FUNCTION_NAME + arg);
+        std::vector<CSyntaxExpression*> args;
+        if(lexer->tk == '(')
+            args = functionCall();
+        return new CSyntaxNew(className, args, lexer->getSubString(classStart), lexer->getSource(), lexer->tokenLastEnd);
     }
     // Nothing we can do here... just hope it's the end...
     lexer->match(LEX_EOF);
@@ -227,7 +500,7 @@ CSyntaxExpression* CScriptSyntaxTree::term()
     {
         int op = lexer->tk;
         lexer->match(lexer->tk);
-        return new CSyntaxBinaryOperator(op, a, unary());
+        a = new CSyntaxBinaryOperator(op, a, unary());
     }
     return a;
 }
@@ -253,9 +526,7 @@ CSyntaxExpression* CScriptSyntaxTree::expression()
         lexer->match(lexer->tk);
         if(op == LEX_PLUSPLUS || op == LEX_MINUSMINUS)
         {
-            // more desugaring
-            a = new CSyntaxAssign('=', a,
-                new CSyntaxBinaryOperator(op == LEX_PLUSPLUS ? '+' : '-', a, new CSyntaxFactor("1")));
+            a = new CSyntaxPostfixOperator(op, a);
         }
         else
         {
@@ -330,44 +601,36 @@ CSyntaxExpression* CScriptSyntaxTree::base()
     {
         int op = lexer->tk;
         lexer->match(lexer->tk);
-        CSyntaxExpression* rhs = base();
-        if(op == '=')
-        {
-            lhs = new CSyntaxAssign('=', lhs, rhs);
-        }
-        // hey look, syntactic desugaring
-        else if(op == LEX_PLUSEQUAL)
-        {
-            lhs = new CSyntaxAssign('=', lhs, new CSyntaxBinaryOperator('+', lhs, rhs));
-        }
-        else if(op == LEX_MINUSEQUAL)
-        {
-            lhs = new CSyntaxAssign('=', lhs, new CSyntaxBinaryOperator('-', lhs, rhs));
-        }
-        else ASSERT(0);
+        // the left hand side is only evaluated once, so += and -= are kept as they are
+        lhs = new CSyntaxAssign(op, lhs, base());
     }
     return lhs;
 }
 
+CSyntaxSequence* CScriptSyntaxTree::appendStatement(CSyntaxSequence* stmts, CSyntaxNode* stmt)
+{
+    CSyntaxSequence* seq = dynamic_cast<CSyntaxSequence*>(stmt);
+    if(seq)
+    {
+        std::vector<CSyntaxNode*> statements = seq->normalize();
+        delete seq;
+        for(auto& stmt2 : statements)
+            stmts = new CSyntaxSequence(stmts, stmt2);
+    }
+    else
+        stmts = new CSyntaxSequence(stmts, stmt);
+    return stmts;
+}
+
 CSyntaxStatement* CScriptSyntaxTree::block()
 {
     lexer->match('{');
     CSyntaxSequence* stmts = 0;
     while(lexer->tk && lexer->tk != '}')
-    {
-        CSyntaxNode* stmt = statement();
-        CSyntaxSequence* seq = dynamic_cast<CSyntaxSequence*>(stmt);
-        if(seq)
-        {
-            std::vector<CSyntaxNode*> statements = seq->normalize();
-            delete seq;
-            for(auto& stmt2 : statements)
-                stmts = new CSyntaxSequence(stmts, stmt2);
-        }
-        else
-            stmts = new CSyntaxSequence(stmts, stmt);
-    }
+        stmts = appendStatement(stmts, statement());
     lexer->match('}');
+    if(!stmts)
+        return new CSyntaxEmpty();
     return stmts;
 }
 
@@ -377,10 +640,12 @@ CSyntaxNode* CScriptSyntaxTree::statement()
         lexer->tk == LEX_INT ||
         lexer->tk == LEX_FLOAT ||
         lexer->tk == LEX_STR ||
+        lexer->tk == LEX_R_RESERVED ||
         lexer->tk == '-')
     {
         /* Execute a simple statement that only contains basic arithmetic... */
         CSyntaxNode* out = base();
+        out->setPosition(lexer->tokenLastEnd);
         lexer->match(';');
         return out;
     }
@@ -393,7 +658,7 @@ CSyntaxNode* CScriptSyntaxTree::statement()
     {
         /* Empty statement - to allow things like ;;; */
         lexer->match(';');
-        return statement();
+        return new CSyntaxEmpty();
     }
     else if(lexer->tk == LEX_R_VAR)
     {
@@ -402,7 +667,7 @@ CSyntaxNode* CScriptSyntaxTree::statement()
         CSyntaxNode* stmt = 0;
         while(lexer->tk != ';')
         {
-            CSyntaxExpression* lhs = new CSyntaxID(lexer->tkStr);
+            CSyntaxExpression* lhs = variable(lexer->tkStr);
             lexer->match(LEX_ID);
             // now do stuff defined with dots
             while(lexer->tk == '.')
@@ -419,6 +684,7 @@ CSyntaxNode* CScriptSyntaxTree::statement()
             }
             else
                 stmt = new CSyntaxDefinition(lhs, NULL);
+            stmt->setPosition(lexer->tokenLastEnd);
             if(lexer->tk != ';')
             {
                 lexer->match(',');
@@ -437,6 +703,7 @@ CSyntaxNode* CScriptSyntaxTree::statement()
         lexer->match('(');
         CSyntaxExpression* cond = base();
         lexer->match(')');
+        int head = lexer->tokenLastEnd;
         CSyntaxNode* body = statement();
         CSyntaxNode* else_ = 0;
         if(lexer->tk == LEX_R_ELSE)
@@ -444,7 +711,9 @@ CSyntaxNode* CScriptSyntaxTree::statement()
             lexer->match(LEX_R_ELSE);
             else_ = statement();
         }
-        return new CSyntaxIf(cond, body, else_);
+        CSyntaxIf* out = new CSyntaxIf(cond, body, else_);
+        out->setPosition(head);
+        return out;
     }
     else if(lexer->tk == LEX_R_WHILE)
     {
@@ -452,8 +721,11 @@ CSyntaxNode* CScriptSyntaxTree::statement()
         lexer->match('(');
         CSyntaxExpression* cond = base();
         lexer->match(')');
+        int head = lexer->tokenLastEnd;
         CSyntaxNode* body = statement();
-        return new CSyntaxWhile(cond, body);
+        CSyntaxWhile* out = new CSyntaxWhile(cond, body);
+        out->setPosition(head);
+        return out;
     }
     else if(lexer->tk == LEX_R_FOR)
     {
@@ -464,19 +736,28 @@ CSyntaxNode* CScriptSyntaxTree::statement()
         lexer->match(';');
         CSyntaxExpression* iter = base(); // iterator
         lexer->match(')');
+        int head = lexer->tokenLastEnd;
         CSyntaxNode* body = statement();
-        return new CSyntaxFor(init, cond, iter, body);
+        CSyntaxFor* out = new CSyntaxFor(init, cond, iter, body);
+        out->setPosition(head);
+        return out;
     }
     else if(lexer->tk == LEX_R_RETURN)
     {
         lexer->match(LEX_R_RETURN);
-        CSyntaxExpression* value = base();
+        CSyntaxExpression* value = 0;
+        if(lexer->tk != ';')
+            value = base();
+        CSyntaxReturn* out = new CSyntaxReturn(value);
+        out->setPosition(lexer->tokenLastEnd);
         lexer->match(';');
-        return new CSyntaxReturn(value);
+        return out;
     }
     else if(lexer->tk == LEX_R_FUNCTION)
     {
-        return parseFunctionDefinition();
+        CSyntaxFunction* func = parseFunctionDefinition();
+        func->setStatement(true);
+        return func;
     }
     else
     {
@@ -496,8 +777,25 @@ CSyntaxFunction* CScriptSyntaxTree::parseFunctionDefinition()
         lexer->match(LEX_ID);
     }
     std::vector<CSyntaxID*> args = parseFunctionArguments();
+    int funcBegin = lexer->tokenStart;
+    functionDepth++;
     CSyntaxStatement* body = block();
-    return new CSyntaxFunction(funcName == TINYJS_TEMP_NAME ? 0 : new CSyntaxID(funcName), args, body);
+    functionDepth--;
+    CSyntaxFunction* func = new CSyntaxFunction(funcName == TINYJS_TEMP_NAME ? 0 : variable(funcName), args, body);
+    func->setSource(lexer->getSubString(funcBegin));
+    return func;
+}
+
+CSyntaxID* CScriptSyntaxTree::variable(const std::string& name)
+{
+    CSyntaxID* id = new CSyntaxID(name);
+    // a nested function gets its own frame when it's parsed for calling
+    if(functionDepth == 0)
+    {
+        auto slot = slots.insert(std::make_pair(id->getAtom(), (int)slots.size())).first;
+        id->setSlot(slot->second);
+    }
+    return id;
 }
 
 std::vector<CSyntaxID*> CScriptSyntaxTree::parseFunctionArguments()
@@ -517,6 +815,7 @@ std::vector<CSyntaxID*> CScriptSyntaxTree::parseFunctionArguments()
 CSyntaxNode::CSyntaxNode()
 {
     node = 0;
+    position = 0;
 }
 
 CSyntaxNode::~CSyntaxNode()
@@ -525,6 +824,86 @@ CSyntaxNode::~CSyntaxNode()
         delete node;
 }
 
+CSyntaxNode* CSyntaxNode::optimize(int passes)
+{
+    if(node)
+        node = node->optimize(passes);
+    return this;
+}
+
+CSyntaxExpression* CSyntaxNode::optimizeExpression(CSyntaxExpression* expression, int passes)
+{
+    return expression ? (CSyntaxExpression*)expression->optimize(passes) : 0;
+}
+
+CSyntaxNode* CSyntaxNode::optimizeStatement(CSyntaxNode* statement, int passes)
+{
+    int position = statement->position;
+    statement = statement->optimize(passes);
+    // what takes its place is where it was
+    if(!statement->position)
+        statement->position = position;
+    return statement;
+}
+
+CScriptVar* CSyntaxNode::currentScope(CTinyJS* js)
+{
+    return js->scopes.back();
+}
+
+CScriptVarLink* CSyntaxNode::findInScopes(CTinyJS* js, int atom)
+{
+    return js->findInScopes(atom);
+}
+
+CScriptVarLink* CSyntaxNode::findInFrame(CTinyJS* js, CSyntaxID* id)
+{
+    if(id->getSlot() < 0)
+        return js->findInScopes(id->getAtom());
+    return js->findInFrame(id->getSlot(), id->getAtom());
+}
+
+void CSyntaxNode::setInFrame(CTinyJS* js, CSyntaxID* id, CScriptVarLink* link)
+{
+    if(id->getSlot() >= 0)
+        js->setInFrame(id->getSlot(), link);
+}
+
+CScriptVarLink* CSyntaxNode::findInParentClasses(CTinyJS* js, CScriptVar* object, int atom)
+{
+    return js->findInParentClasses(object, atom);
+}
+
+CScriptVarLink* CSyntaxNode::callFunction(CTinyJS* js, bool& execute, CScriptVarLink* function, CScriptVar* parent,
+    const std::vector<CScriptVarLink*>& arguments, CScriptTokenList* source, int position)
+{
+    return js->callFunction(execute, function, parent, arguments, source, position);
+}
+
+void CSyntaxNode::prepareCall(CTinyJS* js, CScriptVarLink* function)
+{
+    js->prepareCall(function);
+}
+
+bool CSyntaxNode::constructBuiltin(CTinyJS* js, CScriptVar* obj, CScriptVar* objClass,
+    const std::vector<CScriptVarLink*>& arguments)
+{
+    return js->constructBuiltin(obj, objClass, arguments);
+}
+
+// Once we're done with a member, the object it came from can go too. If that object
+// was only a temporary (eg. "foo().bar"), the member has to be copied out of it first.
+CScriptVarLink* releaseParent(CScriptVarLink* child, CScriptVarLink* parent)
+{
+    if(parent && !parent->owned)
+    {
+        if(child->owned)
+            child = new CScriptVarLink(child->var, child->nameAtom);
+        delete parent;
+    }
+    return child;
+}
+
 CSyntaxSequence::CSyntaxSequence(CSyntaxNode* front, CSyntaxNode* last)
 {
     node = front;
@@ -628,6 +1007,62 @@ void CSyntaxSequence::emit(std::ostream & out, const std::string indentation)
     }
 }
 
+int CSyntaxSequence::emitNative(std::ostream & out, CSyntaxNativeFrame & frame, const std::string indentation)
+{
+    for(CSyntaxNode* statement : normalize(false))
+        if(!emitNativeStatement(out, statement, frame, indentation))
+            return CSyntaxNativeFrame::FAILED;
+    return CSyntaxNativeFrame::STATEMENT;
+}
+
+CScriptVarLink* CSyntaxSequence::evaluate(CTinyJS* js, bool& execute)
+{
+    if(statements.empty())
+        statements = normalize(false);
+    for(CSyntaxNode* stmt : statements)
+    {
+        CLEAN(evaluateStatement(js, execute, stmt));
+        // a return statement has been hit
+        if(!execute)
+            break;
+    }
+    return 0;
+}
+
+CSyntaxNode* CSyntaxSequence::optimize(int passes)
+{
+    // take the statements out, and make a new sequence from what's left of them
+    std::vector<CSyntaxNode*> stmts = normalize();
+    delete this;
+    CSyntaxSequence* seq = 0;
+    bool returned = false;
+    for(CSyntaxNode* stmt : stmts)
+    {
+        if(returned)
+        {
+            delete stmt; // nothing after a return is ever run
+            continue;
+        }
+        stmt = optimizeStatement(stmt, passes);
+        if(dynamic_cast<CSyntaxEmpty*>(stmt))
+        {
+            delete stmt;
+            continue;
+        }
+        // a block that an if has been replaced with goes into this sequence, as the parser does it
+        CSyntaxSequence* inner = dynamic_cast<CSyntaxSequence*>(stmt);
+        std::vector<CSyntaxNode*> added = inner ? inner->normalize() : std::vector<CSyntaxNode*>(1, stmt);
+        if(inner)
+            delete inner;
+        for(CSyntaxNode* stmt2 : added)
+            seq = new CSyntaxSequence(seq, stmt2);
+        returned = (passes & TINYJS_OPTIMIZE_UNREACHABLE) && dynamic_cast<CSyntaxReturn*>(added.back());
+    }
+    if(!seq)
+        return new CSyntaxEmpty();
+    return seq;
+}
+
 CSyntaxIf::CSyntaxIf(CSyntaxExpression* expr, CSyntaxNode* body, CSyntaxNode* else_)
 {
     ASSERT(expr);
@@ -651,14 +1086,75 @@ void CSyntaxIf::emit(std::ostream & out, const std::string indentation)
     out << indentation << "if(";
     expr->emit(out);
     out << "->var->getBool()) {\n";
-    node->emit(out, indentation + "    ");
+    emitStatement(out, node, indentation + "    ");
     out << indentation << "} ";
     if(else_)
     {
         out << "else {\n";
-        else_->emit(out, indentation + "    ");
+        emitStatement(out, else_, indentation + "    ");
+        out << indentation << "}";
+    }
+}
+
+int CSyntaxIf::emitNative(std::ostream & out, CSyntaxNativeFrame & frame, const std::string indentation)
+{
+    std::string cond;
+    int type = emitNativeValue(expr, frame, cond);
+    if(type == CSyntaxNativeFrame::FAILED)
+        return CSyntaxNativeFrame::FAILED;
+    out << indentation << "if(" << nativeBool(cond, type) << ") {\n";
+    frame.depth++;
+    if(!emitNativeStatement(out, node, frame, indentation + "    "))
+        return CSyntaxNativeFrame::FAILED;
+    out << indentation << "}";
+    if(else_)
+    {
+        out << " else {\n";
+        if(!emitNativeStatement(out, else_, frame, indentation + "    "))
+            return CSyntaxNativeFrame::FAILED;
         out << indentation << "}";
     }
+    frame.depth--;
+    return CSyntaxNativeFrame::STATEMENT;
+}
+
+CScriptVarLink* CSyntaxIf::evaluate(CTinyJS* js, bool& execute)
+{
+    CScriptVarLink* cond = expr->evaluate(js, execute);
+    bool result = cond->var->getBool();
+    CLEAN(cond);
+    if(result)
+    {
+        CLEAN(evaluateStatement(js, execute, node));
+    }
+    else if(else_)
+    {
+        CLEAN(evaluateStatement(js, execute, else_));
+    }
+    return 0;
+}
+
+CSyntaxNode* CSyntaxIf::optimize(int passes)
+{
+    expr = optimizeExpression(expr, passes);
+    node = optimizeStatement(node, passes);
+    if(else_)
+        else_ = optimizeStatement(else_, passes);
+    CSyntaxFactor* cond = getLiteral(expr);
+    if(cond && (passes & TINYJS_OPTIMIZE_BRANCHES))
+    {
+        CSyntaxNode* taken = node;
+        if(cond->getBool())
+            node = 0;
+        else
+        {
+            taken = else_;
+            else_ = 0;
+        }
+        delete this;
+        return taken ? taken : new CSyntaxEmpty();
+    }
+    return this;
 }
 
 CSyntaxWhile::CSyntaxWhile(CSyntaxExpression* expr, CSyntaxNode* body)
@@ -679,8 +1175,50 @@ void CSyntaxWhile::emit(std::ostream & out, const std::string indentation)
     out << indentation << "while(";
     expr->emit(out);
     out << "->var->getBool()) {\n";
-    node->emit(out, indentation + "    ");
+    emitStatement(out, node, indentation + "    ");
+    out << indentation << "}";
+}
+
+int CSyntaxWhile::emitNative(std::ostream & out, CSyntaxNativeFrame & frame, const std::string indentation)
+{
+    frame.depth++;
+    std::string cond;
+    int type = emitNativeValue(expr, frame, cond);
+    if(type == CSyntaxNativeFrame::FAILED)
+        return CSyntaxNativeFrame::FAILED;
+    out << indentation << "while(" << nativeBool(cond, type) << ") {\n";
+    if(!emitNativeStatement(out, node, frame, indentation + "    "))
+        return CSyntaxNativeFrame::FAILED;
     out << indentation << "}";
+    frame.depth--;
+    return CSyntaxNativeFrame::STATEMENT;
+}
+
+CScriptVarLink* CSyntaxWhile::evaluate(CTinyJS* js, bool& execute)
+{
+    while(execute)
+    {
+        CScriptVarLink* cond = expr->evaluate(js, execute);
+        bool loopCond = cond->var->getBool();
+        CLEAN(cond);
+        if(!loopCond)
+            break;
+        CLEAN(evaluateStatement(js, execute, node));
+    }
+    return 0;
+}
+
+CSyntaxNode* CSyntaxWhile::optimize(int passes)
+{
+    expr = optimizeExpression(expr, passes);
+    node = optimizeStatement(node, passes);
+    CSyntaxFactor* cond = getLiteral(expr);
+    if(cond && (passes & TINYJS_OPTIMIZE_BRANCHES) && !cond->getBool())
+    {
+        delete this;
+        return new CSyntaxEmpty();
+    }
+    return this;
 }
 
 CSyntaxFor::CSyntaxFor(CSyntaxNode* init, CSyntaxExpression* expr, CSyntaxExpression* update, CSyntaxNode* body)
@@ -721,54 +1259,225 @@ void CSyntaxFor::emit(std::ostream & out, const std::string indentation)
         update->emit(out);
     }
     out << ") {\n";
-    node->emit(out, indentation + "    ");
+    emitStatement(out, node, indentation + "    ");
     out << indentation << "}";
 }
 
-CSyntaxFactor::CSyntaxFactor(std::string val)
+int CSyntaxFor::emitNative(std::ostream & out, CSyntaxNativeFrame & frame, const std::string indentation)
 {
-    value = val;
-    node = 0;
-
-    char f = value.front();
-    if(f == '"')
-        factorType = F_TYPE_STRING;
-    else if(isdigit(f))
+    std::string code;
+    out << indentation << "for(";
+    if(init)
     {
-        if(value.find('.') != std::string::npos)
-            factorType = F_TYPE_DOUBLE;
+        // a 'var' writes its own expression, and anything else is an expression
+        if(dynamic_cast<CSyntaxDefinition*>(init))
+        {
+            if(init->emitNative(out, frame) == CSyntaxNativeFrame::FAILED)
+                return CSyntaxNativeFrame::FAILED;
+        }
+        else if(emitNativeValue(init, frame, code) == CSyntaxNativeFrame::FAILED)
+            return CSyntaxNativeFrame::FAILED;
         else
-            factorType = F_TYPE_INT;
+            out << "(void)(" << code << ")";
+        if(!frame.depth)
+            frame.settle(); // the rest all comes after it
     }
-    else
-        factorType = F_TYPE_IDENTIFIER;
+    out << "; ";
+    frame.depth++;
+    if(cond)
+    {
+        int type = emitNativeValue(cond, frame, code);
+        if(type == CSyntaxNativeFrame::FAILED)
+            return CSyntaxNativeFrame::FAILED;
+        out << nativeBool(code, type);
+    }
+    out << "; ";
+    if(update)
+    {
+        if(emitNativeValue(update, frame, code) == CSyntaxNativeFrame::FAILED)
+            return CSyntaxNativeFrame::FAILED;
+        out << "(void)(" << code << ")";
+    }
+    out << ") {\n";
+    if(!emitNativeStatement(out, node, frame, indentation + "    "))
+        return CSyntaxNativeFrame::FAILED;
+    out << indentation << "}";
+    frame.depth--;
+    return CSyntaxNativeFrame::STATEMENT;
 }
 
-void CSyntaxFactor::emit(std::ostream & out, const std::string indentation)
+CScriptVarLink* CSyntaxFor::evaluate(CTinyJS* js, bool& execute)
 {
-    out << indentation;
-    out << NO_LEAK_BEGIN();
-    out << "new CScriptVarLink(new CScriptVar(";
-    switch(factorType)
+    if(init)
+        CLEAN(init->evaluate(js, execute));
+    while(execute)
     {
-    case F_TYPE_INT:
-        out << getInt();
-        break;
+        if(cond)
+        {
+            CScriptVarLink* condVar = cond->evaluate(js, execute);
+            bool loopCond = condVar->var->getBool();
+            CLEAN(condVar);
+            if(!loopCond)
+                break;
+        }
+        CLEAN(evaluateStatement(js, execute, node));
+        if(execute && update)
+            CLEAN(update->evaluate(js, execute));
+    }
+    return 0;
+}
+
+CSyntaxNode* CSyntaxFor::optimize(int passes)
+{
+    if(init)
+        init = optimizeStatement(init, passes);
+    cond = optimizeExpression(cond, passes);
+    update = optimizeExpression(update, passes);
+    node = optimizeStatement(node, passes);
+    CSyntaxFactor* literal = getLiteral(cond);
+    if(literal && (passes & TINYJS_OPTIMIZE_BRANCHES) && !literal->getBool())
+    {
+        // only the initialisation is ever run
+        CSyntaxNode* first = init;
+        init = 0;
+        delete this;
+        return first ? first : new CSyntaxEmpty();
+    }
+    return this;
+}
+
+CSyntaxFactor::CSyntaxFactor(std::string val, int type)
+{
+    value = val;
+    factorType = type;
+}
+
+CSyntaxFactor::CSyntaxFactor(std::string val)
+{
+    value = val;
+    node = 0;
+
+    char f = value.empty() ? 0 : value.front();
+    if(f == '"')
+        factorType = F_TYPE_STRING;
+    else if(isdigit(f))
+    {
+        if(value.find('.') != std::string::npos)
+            factorType = F_TYPE_DOUBLE;
+        else
+            factorType = F_TYPE_INT;
+    }
+    else
+        factorType = F_TYPE_IDENTIFIER;
+}
+
+void CSyntaxFactor::emit(std::ostream & out, const std::string indentation)
+{
+    out << indentation;
+    out << NO_LEAK_BEGIN();
+    out << "new CScriptVarLink(new CScriptVar(";
+    switch(factorType)
+    {
+    case F_TYPE_INT:
+        out << getInt();
+        break;
     case F_TYPE_DOUBLE:
         out << getDouble();
         break;
     case F_TYPE_STRING:
-        out << "\"" << value.c_str() << "\"";
+        out << "std::string(" << getJSString(value) << ")";
         break;
     case F_TYPE_IDENTIFIER:
         out << value.c_str();
         break;
+    case F_TYPE_NULL:
+        out << "TINYJS_BLANK_DATA, SCRIPTVAR_NULL";
+        break;
     }
     out << "))";
     out << NO_LEAK_END();
 }
 
-CSyntaxID::CSyntaxID(std::string id) : CSyntaxFactor(id) { }
+int CSyntaxFactor::emitNative(std::ostream & out, CSyntaxNativeFrame & frame, const std::string indentation)
+{
+    if(factorType == F_TYPE_INT)
+    {
+        // one too big for an int is left to whatever the interpreter makes of it
+        long value = std::strtol(this->value.c_str(), 0, 0);
+        if(value != (int)value)
+            return CSyntaxNativeFrame::FAILED;
+        out << value;
+        return CSyntaxNativeFrame::INT;
+    }
+    if(factorType == F_TYPE_DOUBLE && std::isfinite(getDouble()))
+    {
+        // exactly the double the interpreter has, and written so that gcc reads it as one
+        char literal[32];
+        snprintf(literal, sizeof(literal), "%.17g", getDouble());
+        out << literal;
+        if(!strpbrk(literal, ".e"))
+            out << ".0";
+        return CSyntaxNativeFrame::DOUBLE;
+    }
+    return CSyntaxNativeFrame::FAILED;
+}
+
+CScriptVarLink* CSyntaxFactor::evaluate(CTinyJS* js, bool& execute)
+{
+    switch(factorType)
+    {
+    case F_TYPE_INT:
+    {
+        long intValue = std::strtol(value.c_str(), 0, 0);
+        if(intValue == (int)intValue)
+            return new CScriptVarLink(CScriptConstants::newInt((int)intValue));
+        return new CScriptVarLink(new CScriptVar(value, SCRIPTVAR_INTEGER));
+    }
+    case F_TYPE_DOUBLE:
+        return new CScriptVarLink(new CScriptVar(value, SCRIPTVAR_DOUBLE));
+    case F_TYPE_STRING:
+        return new CScriptVarLink(new CScriptVar(value, SCRIPTVAR_STRING));
+    case F_TYPE_NULL:
+        return new CScriptVarLink(CScriptConstants::getNull());
+    }
+    return new CScriptVarLink(CScriptConstants::getUndefined());
+}
+
+bool CSyntaxFactor::getBool()
+{
+    bool execute = true;
+    CScriptVarLink* link = evaluate(0, execute);
+    bool result = link->var->getBool();
+    CLEAN(link);
+    return result;
+}
+
+CSyntaxFactor* CSyntaxFactor::fromValue(CScriptVar* value)
+{
+    if(value->isInt())
+        return new CSyntaxFactor(value->getString(), F_TYPE_INT);
+    if(value->isDouble())
+    {
+        // it has to read back as the same double, which rules out NaN, the infinities and -0
+        double d = value->getDouble();
+        if(!std::isfinite(d) || (d == 0 && std::signbit(d)))
+            return 0;
+        return new CSyntaxFactor(value->getString(), F_TYPE_DOUBLE);
+    }
+    if(value->isString())
+        return new CSyntaxFactor(value->getString(), F_TYPE_STRING);
+    if(value->isNull())
+        return new CSyntaxFactor("null", F_TYPE_NULL);
+    if(value->isUndefined())
+        return new CSyntaxFactor("undefined", F_TYPE_UNDEFINED);
+    return 0;
+}
+
+CSyntaxID::CSyntaxID(std::string id) : CSyntaxFactor(id)
+{
+    atom = CScriptAtoms::get(id);
+    slot = -1;
+}
 
 void CSyntaxID::emit(std::ostream & out, const std::string indentation)
 {
@@ -776,12 +1485,42 @@ void CSyntaxID::emit(std::ostream & out, const std::string indentation)
     out << indentation << value.c_str();
 }
 
+int CSyntaxID::emitNative(std::ostream & out, CSyntaxNativeFrame & frame, const std::string indentation)
+{
+    auto variable = frame.variables.find(value);
+    if(variable == frame.variables.end())
+        return CSyntaxNativeFrame::FAILED; // a global, or a local we don't know the type of
+    frame.used.insert(value);
+    if(frame.defined.count(value))
+        out << nativeName(value);
+    else
+    {
+        // before its 'var' it's a global, and after it may still be undefined
+        frame.checked.insert(value);
+        out << "((" << nativeFlag(value) << " == 2 ? (void)0 : " NATIVE_DEOPT "), " << nativeName(value) << ")";
+    }
+    return variable->second;
+}
+
+CScriptVarLink* CSyntaxID::evaluate(CTinyJS* js, bool& execute)
+{
+    CScriptVarLink* a = findInFrame(js, this);
+    if(!a)
+    {
+        /* Variable doesn't exist! JavaScript says we should create it
+         * (we won't add it here. This is done in the assignment operator) */
+        a = new CScriptVarLink(new CScriptVar(), atom);
+    }
+    return a;
+}
+
 CSyntaxFunction::CSyntaxFunction(CSyntaxID* name, std::vector<CSyntaxID*>& arguments, CSyntaxStatement* body)
 {
     ASSERT(body);
     this->name = name;
     this->arguments = arguments;
     node = body;
+    statement = false;
 }
 
 CSyntaxFunction::~CSyntaxFunction()
@@ -829,6 +1568,96 @@ void CSyntaxFunction::emit(std::ostream & out, const std::string indentation)
     out << indentation << "}\n";
 }
 
+bool CSyntaxFunction::emitSpecialized(std::ostream & out, const CScriptTypeFeedback & feedback, const std::string indentation)
+{
+    CSyntaxNativeFrame frame;
+    std::unordered_set<std::string> parameters;
+    for(CSyntaxID* arg : arguments)
+    {
+        parameters.insert(arg->getName());
+        auto seen = feedback.types.find(arg->getName());
+        int type = seen == feedback.types.end() ? 0 : seen->second;
+        if(type != SCRIPTVAR_INTEGER && type != SCRIPTVAR_DOUBLE)
+            return false;
+        frame.variables[arg->getName()] = type == SCRIPTVAR_INTEGER ? CSyntaxNativeFrame::INT : CSyntaxNativeFrame::DOUBLE;
+    }
+    for(auto& seen : feedback.types)
+    {
+        // a local only seen undefined is taken to be an int, which the guards on storing to it check
+        int type = seen.second & ~CScriptTypeFeedback::UNDEFINED;
+        if(!frame.variables.count(seen.first) && (!type || type == SCRIPTVAR_INTEGER || type == SCRIPTVAR_DOUBLE))
+            frame.variables[seen.first] = type == SCRIPTVAR_DOUBLE ? CSyntaxNativeFrame::DOUBLE : CSyntaxNativeFrame::INT;
+    }
+    // twice, as it's only at the end that we know which locals need their flags kept up to date
+    std::string realIndent = indentation + "    ";
+    std::ostringstream body;
+    for(int pass = 0; pass < 2; pass++)
+    {
+        frame.flagged = frame.checked;
+        frame.checked.clear();
+        frame.declared = parameters;
+        frame.defined = parameters;
+        body.str("");
+        if(!emitNativeStatement(body, node, frame, realIndent + "        "))
+            return false;
+    }
+
+    out << indentation << "extern \"C\" {\n";
+    out << realIndent << "void " << getName()->getName() << "(CScriptVar* root, void* userData) {\n";
+    out << realIndent + "    " << "struct __deopt_ { };\n";
+    for(CSyntaxID* arg : arguments)
+    {
+        // guard the type it's been called with so far
+        const std::string& id = arg->getName();
+        bool isInt = frame.variables[id] == CSyntaxNativeFrame::INT;
+        out << realIndent + "    " << "CScriptVar* __a_" << id << " = root->getParameter(\"" << id << "\");\n";
+        out << realIndent + "    " << "if(!__a_" << id << (isInt ? "->isInt()" : "->isDouble()") << ") {\n";
+        out << realIndent + "        " << "((CTinyJS*)userData)->deoptimize(root);\n";
+        out << realIndent + "        " << "return;\n";
+        out << realIndent + "    " << "}\n";
+        if(frame.used.count(id))
+            out << realIndent + "    " << (isInt ? "int " : "double ") << nativeName(id) << " = __a_" << id
+                << (isInt ? "->getInt();\n" : "->getDouble();\n");
+    }
+    for(auto& variable : frame.variables)
+    {
+        if(!frame.used.count(variable.first) || parameters.count(variable.first))
+            continue;
+        out << realIndent + "    " << (variable.second == CSyntaxNativeFrame::INT ? "int " : "double ") << nativeName(variable.first) << " = 0;\n";
+        if(frame.flagged.count(variable.first))
+            out << realIndent + "    " << "int " << nativeFlag(variable.first) << " = 0;\n";
+    }
+    out << realIndent + "    " << "try {\n";
+    out << body.str();
+    out << realIndent + "    " << "} catch(__deopt_&) {\n";
+    out << realIndent + "        " << "// nothing that anything else can see has been changed yet, so the interpreter can run all of it\n";
+    out << realIndent + "        " << "((CTinyJS*)userData)->deoptimize(root);\n";
+    out << realIndent + "    " << "}\n";
+    out << realIndent << "}\n";
+    out << indentation << "}\n";
+    return true;
+}
+
+CScriptVarLink* CSyntaxFunction::evaluate(CTinyJS* js, bool& execute)
+{
+    // the body tree belongs to whoever parsed us and may not outlive this call, so
+    // the function only keeps its source; CTinyJS will parse (and cache) it when called
+    CScriptVar* funcVar = new CScriptVar(source, SCRIPTVAR_FUNCTION);
+    for(CSyntaxID* arg : arguments)
+        funcVar->addChildNoDup(arg->getAtom());
+    if(statement)
+    {
+        if(!name)
+            TRACE("Functions defined at statement-level are meant to have a name\n");
+        else
+            setInFrame(js, name, currentScope(js)->addChildNoDup(name->getAtom(), funcVar));
+        return new CScriptVarLink(funcVar);
+    }
+    if(name)
+        TRACE("Functions not defined at statement-level are not meant to have a name");
+    return new CScriptVarLink(funcVar, name ? name->getName() : TINYJS_TEMP_NAME);
+}
+
 CSyntaxID* CSyntaxFunction::getName()
 {
     if(!name)
@@ -854,6 +1683,9 @@ CSyntaxAssign::CSyntaxAssign(int op, CSyntaxExpression* lvalue, CSyntaxExpressio
 {
     ASSERT(lvalue);
     ASSERT(rvalue);
+#ifdef CHECK_SYNTAX_TREE
+    ASSERT(op == '=' || op == LEX_PLUSEQUAL || op == LEX_MINUSEQUAL);
+#endif
     this->op = op;
     lval = lvalue;
     node = rvalue;
@@ -869,8 +1701,80 @@ void CSyntaxAssign::emit(std::ostream & out, const std::string indentation)
     out << indentation;
     lval->emit(out);
     out << "->replaceWith(";
-    node->emit(out);
-    out << "->var)";
+    if(op == '=')
+    {
+        node->emit(out);
+        out << "->var)";
+    }
+    else
+    {
+        lval->emit(out);
+        out << "->var->mathsOp(";
+        node->emit(out);
+        out << "->var, " << (int)(op == LEX_PLUSEQUAL ? '+' : '-') << "))";
+    }
+}
+
+int CSyntaxAssign::emitNative(std::ostream & out, CSyntaxNativeFrame & frame, const std::string indentation)
+{
+    CSyntaxID* id = dynamic_cast<CSyntaxID*>(lval);
+    if(!id || !frame.variables.count(id->getName()))
+        return CSyntaxNativeFrame::FAILED;
+    std::string value;
+    int type = emitNativeValue(node, frame, value);
+    if(type != CSyntaxNativeFrame::FAILED && op != '=')
+    {
+        std::string current;
+        std::ostringstream sum;
+        id->emitNative(sum, frame);
+        current = sum.str();
+        sum.str("");
+        type = emitNativeMaths(sum, op == LEX_PLUSEQUAL ? '+' : '-', current, frame.variables[id->getName()], value, type);
+        value = sum.str();
+    }
+    if(type == CSyntaxNativeFrame::FAILED)
+        return CSyntaxNativeFrame::FAILED;
+    emitNativeStore(out, frame, id->getName(), value, type, true);
+    return frame.variables[id->getName()];
+}
+
+CScriptVarLink* CSyntaxAssign::evaluate(CTinyJS* js, bool& execute)
+{
+    CScriptVarLink* parent = 0;
+    CSyntaxBinaryOperator* member = dynamic_cast<CSyntaxBinaryOperator*>(lval);
+    CScriptVarLink* lhs;
+    if(member && member->canBeLval())
+        lhs = member->evaluateMember(js, execute, parent);
+    else
+        lhs = lval->evaluate(js, execute);
+    /* If we're assigning to this and we don't have a parent,
+     * add it to the symbol table root as per JavaScript. */
+    if(!lhs->owned)
+    {
+        if(lhs->nameAtom != TINYJS_ATOM_TEMP_NAME)
+        {
+            CScriptVarLink* realLhs = js->root->addChildNoDup(lhs->nameAtom, lhs->var);
+            CLEAN(lhs);
+            lhs = realLhs;
+        }
+        else
+            TRACE("Trying to assign to an un-named type\n");
+    }
+
+    CScriptVarLink* rhs = node->evaluate(js, execute);
+    if(op == '=')
+        lhs->replaceWith(rhs);
+    else
+        CScriptMaths::assign(lhs, rhs->var, op == LEX_PLUSEQUAL ? '+' : '-');
+    CLEAN(rhs);
+    return releaseParent(lhs, parent);
+}
+
+CSyntaxNode* CSyntaxAssign::optimize(int passes)
+{
+    lval = optimizeExpression(lval, passes);
+    node = node->optimize(passes);
+    return this;
 }
 
 CSyntaxTernaryOperator::CSyntaxTernaryOperator(int op, CSyntaxExpression* cond, CSyntaxExpression* b1, CSyntaxExpression* b2)
@@ -904,6 +1808,61 @@ void CSyntaxTernaryOperator::emit(std::ostream & out, const std::string indentat
     b2->emit(out);
 }
 
+int CSyntaxTernaryOperator::emitNative(std::ostream & out, CSyntaxNativeFrame & frame, const std::string indentation)
+{
+    std::string cond, a, b;
+    int type = emitNativeValue(node, frame, cond);
+    frame.depth++;
+    int ta = emitNativeValue(b1, frame, a);
+    int tb = emitNativeValue(b2, frame, b);
+    frame.depth--;
+    // the result has to have the one type
+    if(type == CSyntaxNativeFrame::FAILED || ta == CSyntaxNativeFrame::FAILED || ta != tb)
+        return CSyntaxNativeFrame::FAILED;
+    out << "(" << nativeBool(cond, type) << " ? (" << a << ") : (" << b << "))";
+    return ta;
+}
+
+CScriptVarLink* CSyntaxTernaryOperator::evaluate(CTinyJS* js, bool& execute)
+{
+    CScriptVarLink* cond = node->evaluate(js, execute);
+    bool first = cond->var->getBool();
+    CLEAN(cond);
+    return first ? b1->evaluate(js, execute) : b2->evaluate(js, execute);
+}
+
+CSyntaxNode* CSyntaxTernaryOperator::optimize(int passes)
+{
+    node = node->optimize(passes);
+    b1 = optimizeExpression(b1, passes);
+    b2 = optimizeExpression(b2, passes);
+    CSyntaxFactor* cond = getLiteral(node);
+    if(cond && (passes & TINYJS_OPTIMIZE_BRANCHES))
+    {
+        CSyntaxExpression* taken = b1;
+        if(cond->getBool())
+            b1 = 0;
+        else
+        {
+            taken = b2;
+            b2 = 0;
+        }
+        delete this;
+        return taken;
+    }
+    return this;
+}
+
+bool CSyntaxTernaryOperator::isAlwaysInt()
+{
+    return b1->isAlwaysInt() && b2->isAlwaysInt();
+}
+
+bool CSyntaxTernaryOperator::isAlwaysBool()
+{
+    return b1->isAlwaysBool() && b2->isAlwaysBool();
+}
+
 CSyntaxRelation::CSyntaxRelation(int rel, CSyntaxExpression* left, CSyntaxExpression* right)
     : CSyntaxBinaryOperator(rel, left, right)
 { }
@@ -924,6 +1883,8 @@ CSyntaxBinaryOperator::CSyntaxBinaryOperator(int op, CSyntaxExpression* left, CS
     // right side has to be an ID
     ASSERT(op != '.' || dynamic_cast<CSyntaxID*>(right));
 #endif
+    if(op == '.')
+        cache.atom = ((CSyntaxID*)right)->getAtom();
 }
 
 CSyntaxBinaryOperator::~CSyntaxBinaryOperator()
@@ -951,22 +1912,130 @@ void CSyntaxBinaryOperator::emit(std::ostream & out, const std::string indentati
         // The more I work on this code, the more I begin to think that it was actually
         // fairly well designed.	  
         node->emit(out);
-        out << "->var->findChildOrCreate(";
         if(op == '.')
         {
-            out << '"';
+            out << "->getWritableVar()->findChildOrCreate(\"";
             right->emit(out);
-            out << '"';
+            out << "\")";
         }
         else
         {
+            out << "->getWritableVar()->findIndexOrCreate(";
             right->emit(out);
-            out << "->var->getString()";
+            out << "->var)";
         }
-        out << ")";
     }
 }
 
+int CSyntaxBinaryOperator::emitNative(std::ostream & out, CSyntaxNativeFrame & frame, const std::string indentation)
+{
+    if(canBeLval())
+        return CSyntaxNativeFrame::FAILED;
+    std::string a, b;
+    int ta = emitNativeValue(node, frame, a);
+    int tb = emitNativeValue(right, frame, b);
+    if(ta == CSyntaxNativeFrame::FAILED || tb == CSyntaxNativeFrame::FAILED)
+        return CSyntaxNativeFrame::FAILED;
+    return emitNativeMaths(out, op, a, ta, b, tb);
+}
+
+CScriptVarLink* CSyntaxBinaryOperator::evaluate(CTinyJS* js, bool& execute)
+{
+    if(op == '.' || op == '[')
+    {
+        CScriptVarLink* parent = 0;
+        CScriptVarLink* child = evaluateMember(js, execute, parent);
+        return releaseParent(child, parent);
+    }
+    CScriptVarLink* a = node->evaluate(js, execute);
+    CScriptVarLink* b = right->evaluate(js, execute);
+    CScriptMaths::apply(a, b->var, op);
+    CLEAN(b);
+    return a;
+}
+
+CSyntaxNode* CSyntaxBinaryOperator::optimize(int passes)
+{
+    node = node->optimize(passes);
+    right = optimizeExpression(right, passes);
+    if(op == '.' || op == '[')
+        return this;
+    CSyntaxFactor* a = getLiteral(node);
+    CSyntaxFactor* b = getLiteral(right);
+    if(a && b && (passes & TINYJS_OPTIMIZE_CONSTANTS))
+    {
+        CSyntaxFactor* value = fold(a, b, op);
+        if(value)
+        {
+            delete this;
+            return value;
+        }
+    }
+    if(passes & TINYJS_OPTIMIZE_ALGEBRA)
+    {
+        // only for ints, as anything else might be changed (or thrown about) by the operator
+        CSyntaxExpression* kept = 0;
+        if(b && b->isAlwaysInt() && isIdentity(op, b->getInt(), true) && getLeft()->isAlwaysInt())
+        {
+            kept = getLeft();
+            node = 0;
+        }
+        else if(a && a->isAlwaysInt() && isIdentity(op, a->getInt(), false) && right->isAlwaysInt())
+        {
+            kept = right;
+            right = 0;
+        }
+        if(kept)
+        {
+            delete this;
+            return kept;
+        }
+    }
+    return this;
+}
+
+bool CSyntaxBinaryOperator::isAlwaysInt()
+{
+    switch(op)
+    {
+    case LEX_LSHIFT: case LEX_RSHIFT: case LEX_RSHIFTUNSIGNED:
+        return true;
+    case '+': case '-': case '*': case '/': case '%': case '&': case '|': case '^':
+        return getLeft()->isAlwaysInt() && right->isAlwaysInt();
+    default:
+        return false;
+    }
+}
+
+bool CSyntaxBinaryOperator::isAlwaysBool()
+{
+    return (op == '&' || op == '|' || op == '^') && getLeft()->isAlwaysBool() && right->isAlwaysBool();
+}
+
+CScriptVarLink* CSyntaxBinaryOperator::evaluateMember(CTinyJS* js, bool& execute, CScriptVarLink*& parent)
+{
+    ASSERT(canBeLval());
+    CScriptVarLink* object = node->evaluate(js, execute);
+    CScriptVarLink* child;
+    if(op == '.')
+    {
+        int name = cache.atom;
+        child = cache.find(object->var);
+        if(!child)
+            child = findInParentClasses(js, object->var, name);
+        if(!child)
+            child = object->getWritableVar()->addChild(name);
+    }
+    else
+    {
+        CScriptVarLink* index = right->evaluate(js, execute);
+        child = object->getWritableVar()->findIndexOrCreate(index->var);
+        CLEAN(index);
+    }
+    parent = object;
+    return child;
+}
+
 std::string CSyntaxBinaryOperator::lvaluePath()
 {
     if(op == '.')
@@ -1015,6 +2084,95 @@ void CSyntaxUnaryOperator::emit(std::ostream & out, const std::string indentatio
     node->emit(out);
 }
 
+int CSyntaxUnaryOperator::emitNative(std::ostream & out, CSyntaxNativeFrame & frame, const std::string indentation)
+{
+    std::string code;
+    if(op != '!' || emitNativeValue(node, frame, code) == CSyntaxNativeFrame::FAILED)
+        return CSyntaxNativeFrame::FAILED;
+    out << "(int)((" << code << ") == 0)";
+    return CSyntaxNativeFrame::INT;
+}
+
+CScriptVarLink* CSyntaxUnaryOperator::evaluate(CTinyJS* js, bool& execute)
+{
+    // '!' is the only unary operator; negation is parsed as a subtraction from 0
+    CScriptVarLink* a = node->evaluate(js, execute);
+    CScriptMaths::apply(a, CScriptConstants::newInt(0), LEX_EQUAL);
+    return a;
+}
+
+CSyntaxNode* CSyntaxUnaryOperator::optimize(int passes)
+{
+    node = node->optimize(passes);
+    CSyntaxFactor* a = getLiteral(node);
+    if(a && (passes & TINYJS_OPTIMIZE_CONSTANTS))
+    {
+        CSyntaxFactor zero("0", CSyntaxFactor::F_TYPE_INT);
+        CSyntaxFactor* value = fold(a, &zero, LEX_EQUAL);
+        if(value)
+        {
+            delete this;
+            return value;
+        }
+    }
+    CSyntaxUnaryOperator* inner = dynamic_cast<CSyntaxUnaryOperator*>(node);
+    if(inner && (passes & TINYJS_OPTIMIZE_ALGEBRA) && ((CSyntaxExpression*)inner->node)->isAlwaysBool())
+    {
+        // !!x is x when x is already 0 or 1
+        CSyntaxNode* value = inner->node;
+        inner->node = 0;
+        delete this;
+        return value;
+    }
+    return this;
+}
+
+CSyntaxPostfixOperator::CSyntaxPostfixOperator(int op, CSyntaxExpression* lvalue)
+{
+    ASSERT(lvalue);
+    this->op = op;
+    node = lvalue;
+#ifdef CHECK_SYNTAX_TREE
+    ASSERT(op == LEX_PLUSPLUS || op == LEX_MINUSMINUS);
+#endif
+}
+
+void CSyntaxPostfixOperator::emit(std::ostream & out, const std::string indentation)
+{
+    // the old value has to be kept hold of, so wrap the whole thing up in a lambda
+    out << indentation << "[&]() -> CScriptVarLink* { CScriptVarLink* __l_ = ";
+    node->emit(out);
+    out << "; CScriptVarLink* __o_ = new CScriptVarLink(__l_->var); CScriptVar __one_(1); ";
+    out << "__l_->replaceWith(__l_->var->mathsOp(&__one_, " << (int)(op == LEX_PLUSPLUS ? '+' : '-') << ")); ";
+    out << FUNCTION_VECTOR_NAME << ".push_back(__o_); return __o_; }()";
+}
+
+int CSyntaxPostfixOperator::emitNative(std::ostream & out, CSyntaxNativeFrame & frame, const std::string indentation)
+{
+    CSyntaxID* id = dynamic_cast<CSyntaxID*>(node);
+    if(!id || !frame.variables.count(id->getName()))
+        return CSyntaxNativeFrame::FAILED;
+    // reading it checks it has a value (as undefined++ gives back undefined), so its flag is already right
+    std::ostringstream current;
+    id->emitNative(current, frame);
+    std::string name = nativeName(id->getName());
+    if(frame.variables[id->getName()] == CSyntaxNativeFrame::INT)
+        out << "[&]() -> int { int __o = " << current.str() << "; " << name << " = (int)((unsigned)__o "
+            << (op == LEX_PLUSPLUS ? "+" : "-") << " 1u); return __o; }()";
+    else
+        out << "[&]() -> double { double __o = " << current.str() << "; " << name << " = __o "
+            << (op == LEX_PLUSPLUS ? "+" : "-") << " 1.0; return __o; }()";
+    return frame.variables[id->getName()];
+}
+
+CScriptVarLink* CSyntaxPostfixOperator::evaluate(CTinyJS* js, bool& execute)
+{
+    CScriptVarLink* a = node->evaluate(js, execute);
+    CScriptVarLink* oldValue = CScriptMaths::postfix(a, op == LEX_PLUSPLUS ? '+' : '-');
+    CLEAN(a);
+    return oldValue;
+}
+
 CSyntaxReturn::CSyntaxReturn(CSyntaxExpression* value)
 {
     node = value;
@@ -1025,8 +2183,41 @@ void CSyntaxReturn::emit(std::ostream & out, const std::string indentation)
     out << indentation;
     out << "root->setReturnVar(";
     // todo: ensure this returns a CScriptVar or CScriptVarLink
-    node->emit(out);
-    out << "->var)";
+    if(node)
+    {
+        node->emit(out);
+        out << "->var)";
+    }
+    else
+        out << "new CScriptVar())";
+}
+
+int CSyntaxReturn::emitNative(std::ostream & out, CSyntaxNativeFrame & frame, const std::string indentation)
+{
+    std::string value = "new CScriptVar()";
+    if(node)
+    {
+        std::string code;
+        int type = emitNativeValue(node, frame, code);
+        if(type == CSyntaxNativeFrame::FAILED)
+            return CSyntaxNativeFrame::FAILED;
+        value = nativeBox(code, type);
+    }
+    out << indentation << "{ root->setReturnVar(" << value << "); return; }";
+    return CSyntaxNativeFrame::STATEMENT;
+}
+
+CScriptVarLink* CSyntaxReturn::evaluate(CTinyJS* js, bool& execute)
+{
+    CScriptVarLink* result = node ? node->evaluate(js, execute) : 0;
+    CScriptVarLink* resultVar = currentScope(js)->findChild(TINYJS_ATOM_RETURN_VAR);
+    if(resultVar)
+        resultVar->replaceWith(result);
+    else
+        TRACE("RETURN statement, but not in a function.\n");
+    execute = false;
+    CLEAN(result);
+    return 0;
 }
 
 CSyntaxCondition::CSyntaxCondition(int op, CSyntaxExpression* left, CSyntaxExpression* right)
@@ -1038,12 +2229,86 @@ void CSyntaxCondition::emit(std::ostream & out, const std::string indentation)
     CSyntaxBinaryOperator::emit(out);
 }
 
+int CSyntaxCondition::emitNative(std::ostream & out, CSyntaxNativeFrame & frame, const std::string indentation)
+{
+    std::string a, b;
+    int ta = emitNativeValue(node, frame, a);
+    frame.depth++;
+    int tb = emitNativeValue(right, frame, b);
+    frame.depth--;
+    // the result can be the left side as it is, so that has to be an int like the rest
+    if(ta != CSyntaxNativeFrame::INT || tb == CSyntaxNativeFrame::FAILED)
+        return CSyntaxNativeFrame::FAILED;
+    if(op == LEX_ANDAND)
+        out << "((" << a << ") ? (int)" << nativeBool(b, tb) << " : 0)";
+    else
+        out << "[&]() -> int { int __a = " << a << "; return __a ? __a : (int)" << nativeBool(b, tb) << "; }()";
+    return CSyntaxNativeFrame::INT;
+}
+
+CScriptVarLink* CSyntaxCondition::evaluate(CTinyJS* js, bool& execute)
+{
+    CScriptVarLink* a = node->evaluate(js, execute);
+    bool first = a->var->getBool();
+    // if we know the outcome we don't bother to evaluate the other side
+    if(op == LEX_ANDAND ? !first : first)
+        return a;
+    CScriptVarLink* b = right->evaluate(js, execute);
+    bool second = b->var->getBool();
+    CLEAN(b);
+    CScriptVar* res = new CScriptVar(op == LEX_ANDAND ? (first && second) : (first || second));
+    CREATE_LINK(a, res);
+    return a;
+}
+
+CSyntaxNode* CSyntaxCondition::optimize(int passes)
+{
+    node = node->optimize(passes);
+    right = optimizeExpression(right, passes);
+    CSyntaxFactor* a = getLiteral(node);
+    CSyntaxFactor* b = getLiteral(right);
+    if(a && ((passes & TINYJS_OPTIMIZE_BRANCHES) || (b && (passes & TINYJS_OPTIMIZE_CONSTANTS))))
+    {
+        bool first = a->getBool();
+        if(op == LEX_ANDAND ? !first : first)
+        {
+            // the right side is never run, and the result is the left side as it is
+            node = 0;
+            delete this;
+            return a;
+        }
+        if(b && (passes & TINYJS_OPTIMIZE_CONSTANTS))
+        {
+            CSyntaxFactor* value = new CSyntaxFactor(b->getBool() ? "1" : "0", CSyntaxFactor::F_TYPE_INT);
+            delete this;
+            return value;
+        }
+    }
+    return this;
+}
+
+bool CSyntaxCondition::isAlwaysInt()
+{
+    return getLeft()->isAlwaysInt(); // it's either the left side or 0 or 1
+}
+
+bool CSyntaxCondition::isAlwaysBool()
+{
+    return getLeft()->isAlwaysBool();
+}
+
 CSyntaxFunctionCall::CSyntaxFunctionCall(CSyntaxExpression* name,
-    std::vector<CSyntaxExpression*> arguments, std::string originalString)
+    std::vector<CSyntaxExpression*> arguments, std::string originalString, CScriptTokenList* source, int position)
 {
     node = name;
     actuals = arguments;
     origString = originalString;
+    this->source = source;
+    this->position = position;
+    // for method calls, we need to hang on to the object to use as 'this'
+    member = dynamic_cast<CSyntaxBinaryOperator*>(name);
+    if(member && !member->canBeLval())
+        member = 0;
 }
 
 CSyntaxFunctionCall::~CSyntaxFunctionCall()
@@ -1071,17 +2336,195 @@ void CSyntaxFunctionCall::emit(std::ostream & out, const std::string indentation
     // CSyntaxFunction::emit() doesn't set up a local CTinyJS variable because it
     // is only used here and we want to avoid accidental redeclarations of variables.
 	out << indentation << NO_LEAK_BEGIN();
-	out << "new CScriptVarLink(((CTinyJS*)userData)->evaluateComplex(\"";
-    // we need to escape quotes
-    std::string str = origString;
-    size_t pos = 0;
-    while((pos = str.find_first_of('"', pos)) != std::string::npos)
+	out << "new CScriptVarLink(((CTinyJS*)userData)->evaluateComplex(";
+    // getJSString's escaping is also valid in a C++ string literal
+    out << getJSString(origString) << ").var)";
+	out << NO_LEAK_END();
+}
+
+CScriptVarLink* CSyntaxFunctionCall::evaluate(CTinyJS* js, bool& execute)
+{
+    CScriptVarLink* parent = 0;
+    CScriptVarLink* function;
+    if(member)
+        function = member->evaluateMember(js, execute, parent);
+    else
+        function = node->evaluate(js, execute);
+    // check it's a function before we go evaluating the arguments
+    try
     {
-        str.insert(str.begin() + pos, '\\');
-        pos += 2; // make sure to skip past both the \ and the " to avoid infinite loops
+        prepareCall(js, function);
     }
-    out << str << "\").var)";
-	out << NO_LEAK_END();
+    catch(CScriptException* e)
+    {
+        e->source = source; // the call is what went wrong, as it is when callFunction does this check
+        e->position = position;
+        throw e;
+    }
+    std::vector<CScriptVarLink*> arguments;
+    arguments.reserve(actuals.size());
+    for(CSyntaxExpression* actual : actuals)
+        arguments.push_back(actual->evaluate(js, execute));
+    CScriptVarLink* returnVar = callFunction(js, execute, function, parent ? parent->var : 0, arguments, source, position);
+    for(CScriptVarLink* argument : arguments)
+        CLEAN(argument);
+    // the function may belong to the parent, so it has to go first
+    CLEAN(function);
+    CLEAN(parent);
+    return returnVar;
+}
+
+CSyntaxNode* CSyntaxFunctionCall::optimize(int passes)
+{
+    // a member being called is never replaced, so 'member' stays right
+    node = node->optimize(passes);
+    for(CSyntaxExpression*& arg : actuals)
+        arg = optimizeExpression(arg, passes);
+    return this;
+}
+
+// emits a call to one of the special native functions that evaluate source code,
+// for the object/array literals and 'new'
+static void emitSourceCall(std::ostream& out, const std::string& indentation, const std::string& call)
+{
+    out << indentation << NO_LEAK_BEGIN();
+    out << "new CScriptVarLink(((CTinyJS*)userData)->evaluateComplex(";
+    out << getJSString(call) << ").var)";
+    out << NO_LEAK_END();
+}
+
+CSyntaxObjectLiteral::CSyntaxObjectLiteral(std::vector<std::string>& names, std::vector<CSyntaxExpression*>& values,
+    const std::string& source)
+{
+    ASSERT(names.size() == values.size());
+    this->names = names;
+    this->values = values;
+    this->source = source;
+}
+
+CSyntaxObjectLiteral::~CSyntaxObjectLiteral()
+{
+    for(CSyntaxExpression* value : values)
+        delete value;
+}
+
+void CSyntaxObjectLiteral::emit(std::ostream & out, const std::string indentation)
+{
+    // "__object_()" is a special native function that constructs an object from a string
+    emitSourceCall(out, indentation, std::string(TINYJS_OBJECT_FUNCTION_NAME) + "(" + getJSString(source) + ")");
+}
+
+CScriptVarLink* CSyntaxObjectLiteral::evaluate(CTinyJS* js, bool& execute)
+{
+    CScriptVar* contents = new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_OBJECT);
+    for(size_t i = 0; i < values.size(); i++)
+    {
+        CScriptVarLink* a = values[i]->evaluate(js, execute);
+        contents->addChild(names[i], a->var);
+        CLEAN(a);
+    }
+    return new CScriptVarLink(contents);
+}
+
+CSyntaxNode* CSyntaxObjectLiteral::optimize(int passes)
+{
+    for(CSyntaxExpression*& value : values)
+        value = optimizeExpression(value, passes);
+    return this;
+}
+
+CSyntaxArrayLiteral::CSyntaxArrayLiteral(std::vector<CSyntaxExpression*>& values, const std::string& source)
+{
+    this->values = values;
+    this->source = source;
+}
+
+CSyntaxArrayLiteral::~CSyntaxArrayLiteral()
+{
+    for(CSyntaxExpression* value : values)
+        delete value;
+}
+
+void CSyntaxArrayLiteral::emit(std::ostream & out, const std::string indentation)
+{
+    emitSourceCall(out, indentation, std::string(TINYJS_ARRAY_FUNCTION_NAME) + "(" + getJSString(source) + ")");
+}
+
+CScriptVarLink* CSyntaxArrayLiteral::evaluate(CTinyJS* js, bool& execute)
+{
+    CScriptVar* contents = new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_ARRAY);
+    for(size_t i = 0; i < values.size(); i++)
+    {
+        CScriptVarLink* a = values[i]->evaluate(js, execute);
+        contents->addChild(CScriptAtoms::getIndexAtom((int)i), a->var);
+        CLEAN(a);
+    }
+    return new CScriptVarLink(contents);
+}
+
+CSyntaxNode* CSyntaxArrayLiteral::optimize(int passes)
+{
+    for(CSyntaxExpression*& value : values)
+        value = optimizeExpression(value, passes);
+    return this;
+}
+
+CSyntaxNew::CSyntaxNew(CSyntaxID* className, std::vector<CSyntaxExpression*>& arguments, const std::string& source,
+    CScriptTokenList* tokens, int position)
+{
+    ASSERT(className);
+    node = className;
+    this->arguments = arguments;
+    this->source = source;
+    this->tokens = tokens;
+    this->position = position;
+}
+
+CSyntaxNew::~CSyntaxNew()
+{
+    for(CSyntaxExpression* arg : arguments)
+        delete arg;
+}
+
+void CSyntaxNew::emit(std::ostream & out, const std::string indentation)
+{
+    emitSourceCall(out, indentation, std::string(TINYJS_NEW_FUNCTION_NAME) + "(" + getJSString(source) + ")");
+}
+
+CScriptVarLink* CSyntaxNew::evaluate(CTinyJS* js, bool& execute)
+{
+    const std::string& className = ((CSyntaxID*)node)->getName();
+    CScriptVarLink* objClassOrFunc = findInFrame(js, (CSyntaxID*)node);
+    if(!objClassOrFunc)
+    {
+        TRACE("%s is not a valid class name", className.c_str());
+        return new CScriptVarLink(new CScriptVar());
+    }
+    // keep a link to our object so it doesn't get cleaned up during the constructor
+    CScriptVarLink* objLink = new CScriptVarLink(new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_OBJECT));
+    bool isFunction = objClassOrFunc->var->isFunction();
+    if(isFunction)
+        prepareCall(js, objClassOrFunc);
+    std::vector<CScriptVarLink*> args;
+    args.reserve(arguments.size());
+    for(CSyntaxExpression* arg : arguments)
+        args.push_back(arg->evaluate(js, execute));
+    if(isFunction)
+    {
+        CLEAN(callFunction(js, execute, objClassOrFunc, objLink->var, args, tokens, position));
+    }
+    else if(!constructBuiltin(js, objLink->var, objClassOrFunc->var, args))
+        objLink->var->addChild(TINYJS_ATOM_PROTOTYPE_CLASS, objClassOrFunc->var);
+    for(CScriptVarLink* arg : args)
+        CLEAN(arg);
+    return objLink;
+}
+
+CSyntaxNode* CSyntaxNew::optimize(int passes)
+{
+    for(CSyntaxExpression*& arg : arguments)
+        arg = optimizeExpression(arg, passes);
+    return this;
 }
 
 CSyntaxDefinition::CSyntaxDefinition(CSyntaxExpression * lvalue, CSyntaxExpression * rvalue)
@@ -1112,3 +2555,60 @@ void CSyntaxDefinition::emit(std::ostream & out, const std::string indentation)
         out << ")";
     }
 }
+
+int CSyntaxDefinition::emitNative(std::ostream & out, CSyntaxNativeFrame & frame, const std::string indentation)
+{
+    CSyntaxID* id = dynamic_cast<CSyntaxID*>(lval);
+    if(!id || !frame.variables.count(id->getName()))
+        return CSyntaxNativeFrame::FAILED;
+    out << indentation << "(void)";
+    if(node)
+    {
+        std::string value;
+        int type = emitNativeValue(node, frame, value);
+        if(type == CSyntaxNativeFrame::FAILED)
+            return CSyntaxNativeFrame::FAILED;
+        emitNativeStore(out, frame, id->getName(), value, type, false);
+        return CSyntaxNativeFrame::STATEMENT;
+    }
+    // without a value, it keeps any it had
+    std::string flag = nativeSetFlag(frame, id->getName(), false);
+    out << "(" << (flag.empty() ? "0" : flag) << ")";
+    if(!frame.depth && !frame.pending.count(id->getName()))
+        frame.pending[id->getName()] = false;
+    return CSyntaxNativeFrame::STATEMENT;
+}
+
+CScriptVarLink* CSyntaxDefinition::evaluate(CTinyJS* js, bool& execute)
+{
+    CScriptVarLink* a = define(js, lval);
+    if(node)
+    {
+        CScriptVarLink* var = node->evaluate(js, execute);
+        a->replaceWith(var);
+        CLEAN(var);
+    }
+    return 0;
+}
+
+CSyntaxNode* CSyntaxDefinition::optimize(int passes)
+{
+    lval = optimizeExpression(lval, passes);
+    if(node)
+        node = node->optimize(passes);
+    return this;
+}
+
+CScriptVarLink* CSyntaxDefinition::define(CTinyJS* js, CSyntaxExpression* path)
+{
+    // "var" creates the variable in the current scope, and then any dotted children of it
+    CSyntaxBinaryOperator* member = dynamic_cast<CSyntaxBinaryOperator*>(path);
+    if(!member)
+    {
+        CScriptVarLink* var = currentScope(js)->findChildOrCreate(((CSyntaxID*)path)->getAtom());
+        setInFrame(js, (CSyntaxID*)path, var);
+        return var;
+    }
+    ASSERT(member->getOp() == '.');
+    return define(js, member->getLeft())->getWritableVar()->findChildOrCreate(((CSyntaxID*)member->getRight())->getAtom());
+}
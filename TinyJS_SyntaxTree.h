@@ -3,9 +3,37 @@
 #include <vector>
 #include <cstdlib>
 #include <assert.h>
+#include <unordered_set>
 
 #pragma once
 
+class CSyntaxBinaryOperator;
+class CSyntaxExpression;
+class CSyntaxID;
+class CScriptBytecode;
+
+/** The native types of a function's arguments and locals, for CSyntaxNode::emitNative to write
+  * code on plain ints and doubles with. Anything it can't be sure of at compile time is checked
+  * by a guard, which throws __deopt_ to give the call to the interpreter (see CTinyJS::deoptimize).
+  * A local's flag says whether its 'var' has run (1) and whether it has been given a value (2):
+  * before its 'var', TinyJS reads and writes any global of the same name instead. */
+struct CSyntaxNativeFrame
+{
+    enum Type { FAILED = -1, STATEMENT, INT, DOUBLE };
+    std::unordered_map<std::string, Type> variables; ///< By name
+    std::unordered_set<std::string> declared; ///< Variables whose 'var' has certainly run by this point in the code
+    std::unordered_set<std::string> defined; ///< ...and that certainly have a value
+    std::unordered_map<std::string, bool> pending; ///< Declared (and defined, if true) once the statement is done
+    std::unordered_set<std::string> checked; ///< Locals with a guard on their flag
+    std::unordered_set<std::string> flagged; ///< Locals whose flag has to be kept up to date (what 'checked' was last time)
+    std::unordered_set<std::string> used; ///< Variables the code uses, which need declaring
+    int depth; ///< How many branches or loops in, where what's run might not be
+
+    CSyntaxNativeFrame() : depth(0) { }
+    /// A statement at the top level of the function has finished, so what it declared and defined is now certain
+    void settle();
+};
+
 class CSyntaxNode
 {
 public:
@@ -13,14 +41,53 @@ public:
     virtual ~CSyntaxNode();
 
     virtual void emit(std::ostream& out, const std::string indentation = "") = 0;
+    /// Run this node directly against the interpreter's current scopes. Like CTinyJS::base(),
+    /// the link returned may be a temporary that the caller must clean up, and like
+    /// CTinyJS::statement(), 'execute' is set to false once a return has been hit.
+    virtual CScriptVarLink* evaluate(CTinyJS* js, bool& execute) = 0;
+    /// Add bytecode for this node, putting the value of an expression into register 'dest'
+    /// (see TinyJS_Bytecode.h). Statements are given CScriptBytecode::NO_REGISTER.
+    virtual void assemble(CScriptBytecode& code, int dest) = 0;
+    /// Make the optimizations in 'passes' (TINYJS_OPTIMIZATIONS) to this node and the ones below it.
+    /// This returns what should take the node's place: either the node itself, or a new one, in which
+    /// case this one has been deleted. An expression is only ever replaced by another expression.
+    virtual CSyntaxNode* optimize(int passes);
+    /// Write this node out as C++ on the native ints and doubles in 'frame' rather than on CScriptVars,
+    /// returning the type of an expression's value, STATEMENT for a statement, or FAILED if it can't be.
+    virtual int emitNative(std::ostream& out, CSyntaxNativeFrame& frame, const std::string indentation = "")
+    {
+        return CSyntaxNativeFrame::FAILED;
+    }
     // returns true if this node is the kind that should have a semicolon after it.
     // since returns and declarations are statement-types but require semicolons,
     // and the latter of which can appear in for statements, it cannot emit a semicolon
     // itself. plus this is a little more "OO".
     virtual bool semicolonizable() = 0;
 
+    /// Where in the source this is, if it's a call or a statement (the end of it, or of an if's or a loop's
+    /// head), so an error in it can say where it went wrong (see CScriptException). 0 if it isn't known.
+    int getPosition() { return position; }
+    void setPosition(int position) { this->position = position; }
+
 protected:
     CSyntaxNode* node;
+    int position;
+
+    // CSyntaxNode is a friend of CTinyJS, so these give evaluate() access to the interpreter
+    static CScriptVar* currentScope(CTinyJS* js);
+    static CScriptVarLink* findInScopes(CTinyJS* js, int atom);
+    static CScriptVarLink* findInFrame(CTinyJS* js, CSyntaxID* id);
+    static void setInFrame(CTinyJS* js, CSyntaxID* id, CScriptVarLink* link);
+    static CScriptVarLink* findInParentClasses(CTinyJS* js, CScriptVar* object, int atom);
+    static CScriptVarLink* callFunction(CTinyJS* js, bool& execute, CScriptVarLink* function, CScriptVar* parent,
+        const std::vector<CScriptVarLink*>& arguments, CScriptTokenList* source, int position);
+    static void prepareCall(CTinyJS* js, CScriptVarLink* function);
+    static bool constructBuiltin(CTinyJS* js, CScriptVar* obj, CScriptVar* objClass,
+        const std::vector<CScriptVarLink*>& arguments);
+    /// Optimize an expression that might be missing (see optimize)
+    static CSyntaxExpression* optimizeExpression(CSyntaxExpression* expression, int passes);
+    /// Optimize a statement, giving whatever replaces it its position (see optimize)
+    static CSyntaxNode* optimizeStatement(CSyntaxNode* statement, int passes);
 };
 
 // these two classes serve no purpose except to divide the two
@@ -35,6 +102,9 @@ class CSyntaxExpression : public CSyntaxNode
 public:
     virtual bool semicolonizable() { return true; }
     virtual std::string lvaluePath() { assert(0); return std::string(); }
+    // what the optimizer can know about the value without running it (unless it throws)
+    virtual bool isAlwaysInt() { return false; }
+    virtual bool isAlwaysBool() { return false; } ///< always the int 0 or 1
 };
 
 class CSyntaxSequence : public CSyntaxStatement
@@ -53,10 +123,28 @@ public:
     CSyntaxNode* second() { return last; }
 
     virtual void emit(std::ostream& out, const std::string indentation = "");
+    virtual CScriptVarLink* evaluate(CTinyJS* js, bool& execute);
+    virtual void assemble(CScriptBytecode& code, int dest);
+    virtual int emitNative(std::ostream& out, CSyntaxNativeFrame& frame, const std::string indentation = "");
+    virtual CSyntaxNode* optimize(int passes);
 
 private:
     CSyntaxNode* last;
     bool disowned;
+    std::vector<CSyntaxNode*> statements; ///< flattened copy of the sequence, built on first evaluate()
+};
+
+/// An empty statement, such as ";" or "{ }"
+class CSyntaxEmpty : public CSyntaxStatement
+{
+public:
+    virtual void emit(std::ostream& out, const std::string indentation = "") { }
+    virtual CScriptVarLink* evaluate(CTinyJS* js, bool& execute) { return 0; }
+    virtual void assemble(CScriptBytecode& code, int dest) { }
+    virtual int emitNative(std::ostream& out, CSyntaxNativeFrame& frame, const std::string indentation = "")
+    {
+        return CSyntaxNativeFrame::STATEMENT;
+    }
 };
 
 class CSyntaxIf : public CSyntaxStatement
@@ -67,6 +155,10 @@ public:
     ~CSyntaxIf();
 
     virtual void emit(std::ostream& out, const std::string indentation = "");
+    virtual CScriptVarLink* evaluate(CTinyJS* js, bool& execute);
+    virtual void assemble(CScriptBytecode& code, int dest);
+    virtual int emitNative(std::ostream& out, CSyntaxNativeFrame& frame, const std::string indentation = "");
+    virtual CSyntaxNode* optimize(int passes);
 
 private:
     CSyntaxExpression* expr;
@@ -80,6 +172,10 @@ public:
     ~CSyntaxWhile();
 
     virtual void emit(std::ostream& out, const std::string indentation = "");
+    virtual CScriptVarLink* evaluate(CTinyJS* js, bool& execute);
+    virtual void assemble(CScriptBytecode& code, int dest);
+    virtual int emitNative(std::ostream& out, CSyntaxNativeFrame& frame, const std::string indentation = "");
+    virtual CSyntaxNode* optimize(int passes);
 
 private:
     CSyntaxExpression* expr;
@@ -92,6 +188,10 @@ public:
     ~CSyntaxFor();
 
     virtual void emit(std::ostream& out, const std::string indentation = "");
+    virtual CScriptVarLink* evaluate(CTinyJS* js, bool& execute);
+    virtual void assemble(CScriptBytecode& code, int dest);
+    virtual int emitNative(std::ostream& out, CSyntaxNativeFrame& frame, const std::string indentation = "");
+    virtual CSyntaxNode* optimize(int passes);
 
 private:
     CSyntaxNode* init;
@@ -107,16 +207,29 @@ public:
         F_TYPE_INT = 1,
         F_TYPE_DOUBLE = 2,
         F_TYPE_STRING = 4,
-        F_TYPE_IDENTIFIER = 8
+        F_TYPE_IDENTIFIER = 8,
+        F_TYPE_NULL = 16,
+        F_TYPE_UNDEFINED = 32
     };
     CSyntaxFactor(std::string val);
+    CSyntaxFactor(std::string val, int type);
 
     bool isValueType() { return factorType & (F_TYPE_INT | F_TYPE_DOUBLE | F_TYPE_STRING); }
+    bool isLiteral() { return factorType != F_TYPE_IDENTIFIER; } ///< Anything but a name
+    /// A literal for a value, or 0 if there's no way to write it as one (objects, or doubles that aren't finite)
+    static CSyntaxFactor* fromValue(CScriptVar* value);
     std::string getRawValue() { return value; }
     double getDouble() { if(factorType != F_TYPE_DOUBLE) return getInt(); return std::strtod(value.c_str(), 0); }
     int getInt() { if(factorType != F_TYPE_INT) return 0; return std::strtol(value.c_str(), 0, 0); }
+    bool getBool(); ///< What CScriptVar::getBool gives for a literal
+
+    virtual bool isAlwaysInt() { return factorType == F_TYPE_INT; }
+    virtual bool isAlwaysBool() { return factorType == F_TYPE_INT && (getInt() == 0 || getInt() == 1); }
 
     virtual void emit(std::ostream& out, const std::string indentation = "");
+    virtual CScriptVarLink* evaluate(CTinyJS* js, bool& execute);
+    virtual void assemble(CScriptBytecode& code, int dest);
+    virtual int emitNative(std::ostream& out, CSyntaxNativeFrame& frame, const std::string indentation = "");
 
 protected:
     std::string value;
@@ -129,8 +242,18 @@ public:
     CSyntaxID(std::string id);
 
     virtual void emit(std::ostream& out, const std::string indentation = "");
-    std::string getName() { return value; }
+    virtual CScriptVarLink* evaluate(CTinyJS* js, bool& execute);
+    virtual void assemble(CScriptBytecode& code, int dest);
+    virtual int emitNative(std::ostream& out, CSyntaxNativeFrame& frame, const std::string indentation = "");
+    const std::string& getName() { return value; }
+    int getAtom() { return atom; } ///< The name, as an atom (see CScriptAtoms)
+    int getSlot() { return slot; } ///< The frame slot for the variable, or -1 if it doesn't have one
+    void setSlot(int slot) { this->slot = slot; }
     std::string lvaluePath() { return getName(); }
+
+private:
+    int atom;
+    int slot;
 };
 
 class CSyntaxFunction : public CSyntaxExpression
@@ -140,11 +263,25 @@ public:
     ~CSyntaxFunction();
 
     virtual void emit(std::ostream& out, const std::string indentation = "");
+    virtual CScriptVarLink* evaluate(CTinyJS* js, bool& execute);
+    virtual void assemble(CScriptBytecode& code, int dest);
     CSyntaxID* getName();
+    /** Write the function out as C++ on plain ints and doubles, with its arguments and locals the types
+      * in 'feedback'. Returns false (having written nothing) if the body does anything but arithmetic on
+      * them, or they haven't been seen as just one of int or double. */
+    bool emitSpecialized(std::ostream& out, const CScriptTypeFeedback& feedback, const std::string indentation = "");
+
+    /// Remember the source of the body, which is what a function variable stores
+    void setSource(const std::string& bodySource) { source = bodySource; }
+    /// Function definitions at statement level add themselves to the current scope
+    void setStatement(bool isStatement) { statement = isStatement; }
+    virtual bool semicolonizable() { return !statement; }
 
 private:
     CSyntaxID* name;
     std::vector<CSyntaxID*> arguments;
+    std::string source;
+    bool statement;
 
     void generateRandomId();
 };
@@ -152,14 +289,73 @@ private:
 class CSyntaxFunctionCall : public CSyntaxExpression
 {
 public:
-    CSyntaxFunctionCall(CSyntaxExpression* name, std::vector<CSyntaxExpression*> arguments, std::string originalArguments);
+    CSyntaxFunctionCall(CSyntaxExpression* name, std::vector<CSyntaxExpression*> arguments, std::string originalArguments,
+        CScriptTokenList* source, int position);
     ~CSyntaxFunctionCall();
 
     virtual void emit(std::ostream& out, const std::string indentation = "");
+    virtual CScriptVarLink* evaluate(CTinyJS* js, bool& execute);
+    virtual void assemble(CScriptBytecode& code, int dest);
+    virtual CSyntaxNode* optimize(int passes);
 
 protected:
     std::vector<CSyntaxExpression*> actuals;
     std::string origString;
+    CSyntaxBinaryOperator* member; ///< set if this is a method call, so we know what 'this' is
+    CScriptTokenList* source; ///< What the call's position is in, for the call stack
+};
+
+/// Object ({...}), array ([...]) and 'new' expressions. These are emitted as calls to the
+/// special native functions with the original source, but evaluated from their parsed parts.
+class CSyntaxObjectLiteral : public CSyntaxExpression
+{
+public:
+    CSyntaxObjectLiteral(std::vector<std::string>& names, std::vector<CSyntaxExpression*>& values, const std::string& source);
+    ~CSyntaxObjectLiteral();
+
+    virtual void emit(std::ostream& out, const std::string indentation = "");
+    virtual CScriptVarLink* evaluate(CTinyJS* js, bool& execute);
+    virtual void assemble(CScriptBytecode& code, int dest);
+    virtual CSyntaxNode* optimize(int passes);
+
+private:
+    std::vector<std::string> names;
+    std::vector<CSyntaxExpression*> values;
+    std::string source;
+};
+
+class CSyntaxArrayLiteral : public CSyntaxExpression
+{
+public:
+    CSyntaxArrayLiteral(std::vector<CSyntaxExpression*>& values, const std::string& source);
+    ~CSyntaxArrayLiteral();
+
+    virtual void emit(std::ostream& out, const std::string indentation = "");
+    virtual CScriptVarLink* evaluate(CTinyJS* js, bool& execute);
+    virtual void assemble(CScriptBytecode& code, int dest);
+    virtual CSyntaxNode* optimize(int passes);
+
+private:
+    std::vector<CSyntaxExpression*> values;
+    std::string source;
+};
+
+class CSyntaxNew : public CSyntaxExpression
+{
+public:
+    CSyntaxNew(CSyntaxID* className, std::vector<CSyntaxExpression*>& arguments, const std::string& source,
+        CScriptTokenList* tokens, int position);
+    ~CSyntaxNew();
+
+    virtual void emit(std::ostream& out, const std::string indentation = "");
+    virtual CScriptVarLink* evaluate(CTinyJS* js, bool& execute);
+    virtual void assemble(CScriptBytecode& code, int dest);
+    virtual CSyntaxNode* optimize(int passes);
+
+private:
+    std::vector<CSyntaxExpression*> arguments;
+    std::string source;
+    CScriptTokenList* tokens; ///< What the constructor call's position is in, for the call stack
 };
 
 class CSyntaxReturn : public CSyntaxStatement
@@ -167,6 +363,9 @@ class CSyntaxReturn : public CSyntaxStatement
 public:
     CSyntaxReturn(CSyntaxExpression* value);
     virtual void emit(std::ostream& out, const std::string indentation = "");
+    virtual CScriptVarLink* evaluate(CTinyJS* js, bool& execute);
+    virtual void assemble(CScriptBytecode& code, int dest);
+    virtual int emitNative(std::ostream& out, CSyntaxNativeFrame& frame, const std::string indentation = "");
     virtual bool semicolonizable() { return true; }
 };
 
@@ -183,6 +382,10 @@ public:
     ~CSyntaxAssign();
 
     virtual void emit(std::ostream& out, const std::string indentation = "");
+    virtual CScriptVarLink* evaluate(CTinyJS* js, bool& execute);
+    virtual void assemble(CScriptBytecode& code, int dest);
+    virtual int emitNative(std::ostream& out, CSyntaxNativeFrame& frame, const std::string indentation = "");
+    virtual CSyntaxNode* optimize(int passes);
 
 private:
     int op;
@@ -196,10 +399,17 @@ public:
     ~CSyntaxDefinition();
 
     virtual void emit(std::ostream& out, const std::string indentation = "");
+    virtual CScriptVarLink* evaluate(CTinyJS* js, bool& execute);
+    virtual void assemble(CScriptBytecode& code, int dest);
+    virtual int emitNative(std::ostream& out, CSyntaxNativeFrame& frame, const std::string indentation = "");
+    virtual CSyntaxNode* optimize(int passes);
     virtual bool semicolonizable() { return true; }
 
 private:
     CSyntaxExpression* lval;
+
+    CScriptVarLink* define(CTinyJS* js, CSyntaxExpression* path);
+    void assembleDefine(CScriptBytecode& code, CSyntaxExpression* path, int dest);
 };
 
 class CSyntaxTernaryOperator : public CSyntaxExpression
@@ -209,6 +419,12 @@ public:
     ~CSyntaxTernaryOperator();
 
     virtual void emit(std::ostream& out, const std::string indentation = "");
+    virtual CScriptVarLink* evaluate(CTinyJS* js, bool& execute);
+    virtual void assemble(CScriptBytecode& code, int dest);
+    virtual int emitNative(std::ostream& out, CSyntaxNativeFrame& frame, const std::string indentation = "");
+    virtual CSyntaxNode* optimize(int passes);
+    virtual bool isAlwaysInt();
+    virtual bool isAlwaysBool();
 
 private:
     int op;
@@ -223,13 +439,28 @@ public:
     ~CSyntaxBinaryOperator();
 
     bool canBeLval() { return op == '.' || op == '['; }
+    int getOp() { return op; }
+    CSyntaxExpression* getLeft() { return (CSyntaxExpression*)node; }
+    CSyntaxExpression* getRight() { return right; }
 
     virtual void emit(std::ostream& out, const std::string indentation = "");
+    virtual CScriptVarLink* evaluate(CTinyJS* js, bool& execute);
+    virtual void assemble(CScriptBytecode& code, int dest);
+    virtual int emitNative(std::ostream& out, CSyntaxNativeFrame& frame, const std::string indentation = "");
+    virtual CSyntaxNode* optimize(int passes);
+    virtual bool isAlwaysInt();
+    virtual bool isAlwaysBool();
     virtual std::string lvaluePath();
 
-private:
+    /// Evaluate a '.' or '[' access, also returning a link to the object the member belongs to
+    CScriptVarLink* evaluateMember(CTinyJS* js, bool& execute, CScriptVarLink*& parent);
+    /// Assemble a '.' or '[' access, putting the object in register 'object' and the member in 'child'
+    void assembleMember(CScriptBytecode& code, int object, int child);
+
+protected:
     int op;
     CSyntaxExpression* right;
+    CScriptPropertyCache cache; ///< For a '.', where to find the member
     std::string randomArrayName = "";
 
     void generateRandomID();
@@ -241,6 +472,12 @@ public:
     CSyntaxCondition(int op, CSyntaxExpression* left, CSyntaxExpression* right);
 
     virtual void emit(std::ostream& out, const std::string indentation = "");
+    virtual CScriptVarLink* evaluate(CTinyJS* js, bool& execute);
+    virtual void assemble(CScriptBytecode& code, int dest);
+    virtual int emitNative(std::ostream& out, CSyntaxNativeFrame& frame, const std::string indentation = "");
+    virtual CSyntaxNode* optimize(int passes);
+    virtual bool isAlwaysInt();
+    virtual bool isAlwaysBool();
 };
 
 class CSyntaxRelation : public CSyntaxBinaryOperator
@@ -249,6 +486,8 @@ public:
     CSyntaxRelation(int rel, CSyntaxExpression* left, CSyntaxExpression* right);
 
     virtual void emit(std::ostream& out, const std::string indentation = "");
+    virtual bool isAlwaysInt() { return true; }
+    virtual bool isAlwaysBool() { return true; }
 };
 
 class CSyntaxUnaryOperator : public CSyntaxExpression
@@ -257,6 +496,27 @@ public:
     CSyntaxUnaryOperator(int op, CSyntaxExpression* expr);
 
     virtual void emit(std::ostream& out, const std::string indentation = "");
+    virtual CScriptVarLink* evaluate(CTinyJS* js, bool& execute);
+    virtual void assemble(CScriptBytecode& code, int dest);
+    virtual int emitNative(std::ostream& out, CSyntaxNativeFrame& frame, const std::string indentation = "");
+    virtual CSyntaxNode* optimize(int passes);
+    virtual bool isAlwaysInt() { return true; }
+    virtual bool isAlwaysBool() { return true; }
+
+private:
+    int op;
+};
+
+/// Postfix ++ and --, which change the variable but give back its old value
+class CSyntaxPostfixOperator : public CSyntaxExpression
+{
+public:
+    CSyntaxPostfixOperator(int op, CSyntaxExpression* lvalue);
+
+    virtual void emit(std::ostream& out, const std::string indentation = "");
+    virtual CScriptVarLink* evaluate(CTinyJS* js, bool& execute);
+    virtual void assemble(CScriptBytecode& code, int dest);
+    virtual int emitNative(std::ostream& out, CSyntaxNativeFrame& frame, const std::string indentation = "");
 
 private:
     int op;
@@ -270,12 +530,25 @@ public:
     ~CScriptSyntaxTree();
 
     void parse();
-    void compile(std::ostream& out);
+    /// Make the optimizations in 'passes' (TINYJS_OPTIMIZATIONS) to the parsed tree
+    void optimize(int passes);
+    /// Write the function that was parsed out as C++, specialized to the types in 'feedback' if it can be
+    void compile(std::ostream& out, const CScriptTypeFeedback* feedback = 0);
+    /// Run the parsed code against the interpreter's current scopes (see CSyntaxNode::evaluate)
+    CScriptVarLink* evaluate(CTinyJS* js, bool& execute);
+    CSyntaxNode* getRoot() { return root; }
+    CScriptTokenList* getSource() { return lexer->getSource(); } ///< The tokens the tree was parsed from
+    int getSlotCount() { return (int)slots.size(); } ///< The size of the frame needed to evaluate the tree
 
 protected:
     CScriptLex* lexer;
     bool lexerOwned;
     CSyntaxNode* root;
+    std::unordered_map<int, int> slots; ///< Frame slot for each variable name (as an atom) used in the code
+    int functionDepth; ///< How many function definitions deep the parser is
+
+    /// An ID for a variable used by our code (rather than a nested function), with a frame slot for it
+    CSyntaxID* variable(const std::string& name);
 
     // taken from TinyJS.h
     // parsing - in order of precedence
@@ -289,10 +562,14 @@ protected:
     CSyntaxExpression* logic();
     CSyntaxExpression* ternary();
     CSyntaxExpression* base();
-    // can return null for blocks like "{ }" or possibly "{ ;* }"
     CSyntaxStatement* block();
     CSyntaxNode* statement();
     // parsing utility functions
     CSyntaxFunction* parseFunctionDefinition();
     std::vector<CSyntaxID*> parseFunctionArguments();
-};
\ No newline at end of file
+    /// add a statement to the end of a sequence, flattening it first if it's a sequence itself
+    CSyntaxSequence* appendStatement(CSyntaxSequence* stmts, CSyntaxNode* stmt);
+};
+
+/// Done with a member: free the object it came from if that was a temporary, copying the member out first if needed
+CScriptVarLink* releaseParent(CScriptVarLink* child, CScriptVarLink* parent);
@@ -0,0 +1,12 @@
+extern "C" {
+    void bits(CScriptVar* root, void* userData) {
+        std::vector<CScriptVarLink*> __t_;
+        CScriptVarLink* a = new CScriptVarLink(root->getParameter("a"));
+        CScriptVarLink* b = new CScriptVarLink(root->getParameter("b"));
+        root->setReturnVar((*__t_.insert(__t_.end(), new CScriptVarLink((*__t_.insert(__t_.end(), new CScriptVarLink((*__t_.insert(__t_.end(), new CScriptVarLink(a->var->mathsOp(b->var, 38))))->var->mathsOp((*__t_.insert(__t_.end(), new CScriptVarLink(a->var->mathsOp(b->var, 94))))->var, 124))))->var->mathsOp((*__t_.insert(__t_.end(), new CScriptVarLink(new CScriptVar(3))))->var, 42))))->var);
+        delete a;
+        delete b;
+        for(CScriptVarLink* __to_del_: __t_)
+            delete __to_del_;
+    }
+}
@@ -62,7 +62,12 @@ void js_print(CScriptVar *v, void *userdata)
 
 int usage(const char* name)
 {
-	printf("Usage: %s [--jit n] profile.js [NAME=VALUE...]\n", name);
+	printf("Usage: %s [--tree|--bytecode] [--disassemble] [--jit n] profile.js [NAME=VALUE...]\n", name);
+	printf("       --tree: Execute functions from their parsed syntax trees rather than\n");
+	printf("                re-reading their source on every call.\n");
+	printf("       --bytecode: Execute functions from bytecode compiled from their syntax trees.\n");
+	printf("       --disassemble: Print the bytecode of the profiled function first.\n");
+	printf("                (Implies --bytecode.)\n");
 	printf("       --jit n: Set the JIT compilation to occur after n executions. Default is 1.\n");
 	printf("                Setting n=0 will disable compilation.\n");
 	printf("                (This argument must appear here or nowhere.)\n");
@@ -114,6 +119,27 @@ int main(int argc, char **argv)
 	char* fname;
 	int jit_at = 1;
 	int i = 2;
+	int mode = TINYJS_EXECUTE_SOURCE;
+	bool disassemble = false;
+	const char* name = argv[0];
+	for(;;)
+	{
+		if(!strcmp(argv[1], "--tree"))
+			mode = TINYJS_EXECUTE_SYNTAX_TREE;
+		else if(!strcmp(argv[1], "--bytecode"))
+			mode = TINYJS_EXECUTE_BYTECODE;
+		else if(!strcmp(argv[1], "--disassemble"))
+		{
+			mode = TINYJS_EXECUTE_BYTECODE;
+			disassemble = true;
+		}
+		else
+			break;
+		argc--;
+		argv++;
+		if(argc < 2)
+			return usage(name);
+	}
 	if(!strcmp(argv[1], "--jit"))
 	{
 		if(argc < 4)
@@ -134,6 +160,7 @@ int main(int argc, char **argv)
 
 	/* Create the interpreter with the specified number of executions */
 	CTinyJS *js = new CTinyJS(jit_at);
+	js->setExecutionMode(mode);
 	/* add the functions from TinyJS_Functions.cpp */
 	registerFunctions(js);
 	registerMathFunctions(js);
@@ -193,6 +220,9 @@ int main(int argc, char **argv)
 		string fnname = js->evaluate("get_function_name();");
 		string profstring = fnname + "(" + js->evaluate("get_arg_list();") + ");";
 
+		if(disassemble && !js->disassemble(fnname, std::cout))
+			printf("'%s' has no bytecode to show.\n", fnname.c_str());
+
 		// run algorithm setup
 		js->execute("setup();");
 		
@@ -308,6 +338,19 @@ int main(int argc, char **argv)
 		}
 		else
 			cout << "(Memory profiling disabled due to error)" << endl;
+		const CScriptPool &vars = CScriptVar::getPool();
+		const CScriptPool &links = CScriptVarLink::getPool();
+		cout << "Variables allocated:\t\t\t" << vars.getAllocations() << " (" << vars.getInUse() << " of " << vars.getCapacity() << " in use)" << endl;
+		cout << "Links allocated:\t\t\t" << links.getAllocations() << " (" << links.getInUse() << " of " << links.getCapacity() << " in use)" << endl;
+#ifdef TINYJS_TRACING_GC
+		cout << "Collections:\t\t\t\t" << CScriptTracingCollector::getCollections() << " (" << CScriptTracingCollector::getFreedVars() << " variables freed, "
+			<< CScriptTracingCollector::getHeapVars() << " still in the heap)" << endl;
+		cout << "Collection pauses:\t\t\t" << CScriptTracingCollector::getTotalPause() << "ms total, " << CScriptTracingCollector::getMaxPause() << "ms max" << endl;
+		cout << "Pauses by ms (<1, <2, <4...):\t\t";
+		for(int i = 0; i < CScriptTracingCollector::PAUSE_BUCKETS; i++)
+			cout << CScriptTracingCollector::getPauses(i) << " ";
+		cout << endl;
+#endif
 
 		delete[] times;
     }
@@ -33,11 +33,17 @@
 #include "TinyJS.h"
 #include "TinyJS_Functions.h"
 #include "TinyJS_MathFunctions.h"
+#include "TinyJS_Compiler.h"
 #include <assert.h>
+#ifndef _MSC_VER
+#include <dirent.h>
+#include <unistd.h>
+#endif
 #include <sys/stat.h>
 #include <string>
 #include <sstream>
 #include <stdio.h>
+#include <string.h>
 
 #ifdef MTRACE
 #include <mcheck.h>
@@ -207,6 +213,211 @@ void memtracing_kill()
 }
 #endif // INSANE_MEMORY_DEBUG
 
+int execution_mode = TINYJS_EXECUTE_SOURCE;
+int optimizations = TINYJS_OPTIMIZE_ALL;
+int compilers = TINYJS_COMPILE_GCC;
+int compile_threads = 1;
+int compile_batching = 0;
+
+/* Natives that let tests see what the engine is doing underneath, as 'Test.whatever()' */
+
+static CScriptVar *poolStats(const CScriptPool &pool)
+{
+    CScriptPool counts = pool; // before making the variables that hold them changes them
+    CScriptVar *stats = new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_OBJECT);
+    stats->addChild("allocations", new CScriptVar((int)counts.getAllocations()));
+    stats->addChild("inUse", new CScriptVar((int)counts.getInUse()));
+    stats->addChild("capacity", new CScriptVar((int)counts.getCapacity()));
+    stats->addChild("free", new CScriptVar((int)counts.getFree()));
+    stats->addChild("chunks", new CScriptVar((int)counts.getChunks()));
+    stats->addChild("fragmentation", new CScriptVar(counts.getFragmentation()));
+    return stats;
+}
+
+void scTestPool(CScriptVar *c, void *)
+{
+    c->getReturnVar()->addChild("vars", poolStats(CScriptVar::getPool()));
+    c->getReturnVar()->addChild("links", poolStats(CScriptVarLink::getPool()));
+}
+
+void scTestCollector(CScriptVar *c, void *data)
+{
+    CScriptCycleCollector &collector = ((CTinyJS*)data)->getCycleCollector();
+    CScriptVar *stats = c->getReturnVar();
+    stats->addChild("candidates", new CScriptVar((int)collector.getCandidates()));
+    stats->addChild("collections", new CScriptVar((int)collector.getCollections()));
+    stats->addChild("freedVars", new CScriptVar((int)collector.getFreedVars()));
+    stats->addChild("freedBytes", new CScriptVar((int)collector.getFreedBytes()));
+    stats->addChild("abandoned", new CScriptVar((int)collector.getAbandoned()));
+    stats->addChild("lastPause", new CScriptVar(collector.getLastPause()));
+    stats->addChild("maxPause", new CScriptVar(collector.getMaxPause()));
+}
+
+void scTestCollect(CScriptVar *c, void *data)
+{
+    // only call this from the top level of a test, where everything is held by a link or a ref
+    CScriptCycleCollector &collector = ((CTinyJS*)data)->getCycleCollector();
+    c->getReturnVar()->setInt((int)collector.collect(c->getParameter("milliseconds")->getDouble()));
+}
+
+void scTestSetCompilers(CScriptVar *c, void *data)
+{
+    ((CTinyJS*)data)->setCompilers(c->getParameter("compilers")->getInt());
+}
+
+void scTestSetCompileThreads(CScriptVar *c, void *data)
+{
+    ((CTinyJS*)data)->setCompileThreads(c->getParameter("threads")->getInt());
+}
+
+void scTestSetCompileCache(CScriptVar *c, void *data)
+{
+    ((CTinyJS*)data)->setCompileCache(c->getParameter("directory")->getString());
+}
+
+void scTestSetCompileCacheSize(CScriptVar *c, void *data)
+{
+    ((CTinyJS*)data)->setCompileCache(c->getParameter("directory")->getString(), c->getParameter("maxBytes")->getInt());
+}
+
+void scTestFinishCompiles(CScriptVar *c, void *data)
+{
+    ((CTinyJS*)data)->finishCompiles();
+}
+
+void scTestSetCompileBatching(CScriptVar *c, void *data)
+{
+    ((CTinyJS*)data)->setCompileBatching(c->getParameter("milliseconds")->getInt());
+}
+
+void scTestCompileBuilds(CScriptVar *c, void *)
+{
+    c->getReturnVar()->setInt(CScriptCompiler::getBuildCount());
+}
+
+void scTestBuildDirectory(CScriptVar *c, void *)
+{
+    c->getReturnVar()->setString(CScriptCompiler::getDirectory());
+}
+
+void scTestFilesIn(CScriptVar *c, void *)
+{
+    int files = -1;
+#ifndef _MSC_VER
+    if(DIR *dir = opendir(c->getParameter("directory")->getString().c_str()))
+    {
+        files = 0;
+        while(struct dirent *entry = readdir(dir))
+            if(strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+                files++;
+        closedir(dir);
+    }
+#endif
+    c->getReturnVar()->setInt(files);
+}
+
+void scTestBytesIn(CScriptVar *c, void *)
+{
+    int bytes = -1;
+#ifndef _MSC_VER
+    std::string directory = c->getParameter("directory")->getString();
+    if(DIR *dir = opendir(directory.c_str()))
+    {
+        bytes = 0;
+        while(struct dirent *entry = readdir(dir))
+        {
+            struct stat info;
+            if(stat((directory + "/" + entry->d_name).c_str(), &info) == 0 && S_ISREG(info.st_mode))
+                bytes += (int)info.st_size;
+        }
+        closedir(dir);
+    }
+#endif
+    c->getReturnVar()->setInt(bytes);
+}
+
+void scTestRemoveDirectory(CScriptVar *c, void *)
+{
+#ifndef _MSC_VER
+    std::string directory = c->getParameter("directory")->getString();
+    if(DIR *dir = opendir(directory.c_str()))
+    {
+        while(struct dirent *entry = readdir(dir))
+            if(strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+                unlink((directory + "/" + entry->d_name).c_str());
+        closedir(dir);
+    }
+    rmdir(directory.c_str());
+#endif
+}
+
+void scTestCompileState(CScriptVar *c, void *data)
+{
+    c->getReturnVar()->setInt(((CTinyJS*)data)->getCompileState(c->getParameter("path")->getString()));
+}
+
+void scTestCompileFailures(CScriptVar *c, void *data)
+{
+    CScriptVar *result = c->getReturnVar();
+    result->setArray();
+    int length = 0;
+    for(const CScriptCompileFailure &failure : ((CTinyJS*)data)->getCompileFailures())
+    {
+        CScriptVar *item = new CScriptVar(TINYJS_BLANK_DATA, SCRIPTVAR_OBJECT);
+        item->addChild("name", new CScriptVar(failure.name));
+        item->addChild("compiler", new CScriptVar(failure.compiler));
+        item->addChild("attempts", new CScriptVar(failure.attempts));
+        item->addChild("retryAt", new CScriptVar(failure.retryAt));
+        item->addChild("blacklisted", new CScriptVar(failure.blacklisted));
+        result->setArrayIndex(length++, item);
+    }
+}
+
+void scTestErrorOf(CScriptVar *c, void *data)
+{
+    // in an engine of its own, as executing in this one would lose the call stack we're in
+    CTinyJS *tinyJS = (CTinyJS*)data;
+    std::string error;
+    {
+        CTinyJS s;
+        s.setExecutionMode(tinyJS->getExecutionMode());
+        s.setCompilers(TINYJS_COMPILE_NONE);
+        registerFunctions(&s);
+        try
+        {
+            s.execute(c->getParameter("code")->getString());
+        }
+        catch(CScriptException *e)
+        {
+            error = e->text;
+            delete e;
+        }
+    }
+    tinyJS->getCycleCollector().makeCurrent();
+    c->getReturnVar()->setString(error);
+}
+
+void registerTestFunctions(CTinyJS *tinyJS)
+{
+    tinyJS->addNative("function Test.pool()", scTestPool, tinyJS); // this thread's pools of variables and links
+    tinyJS->addNative("function Test.collector()", scTestCollector, tinyJS); // the engine's cycle collector's statistics
+    tinyJS->addNative("function Test.collect(milliseconds)", scTestCollect, tinyJS); // collect cycles now, returning how many variables were freed
+    tinyJS->addNative("function Test.setCompilers(compilers)", scTestSetCompilers, tinyJS); // for tests that need particular compilers, whatever the command line says
+    tinyJS->addNative("function Test.setCompileThreads(threads)", scTestSetCompileThreads, tinyJS);
+    tinyJS->addNative("function Test.setCompileBatching(milliseconds)", scTestSetCompileBatching, tinyJS);
+    tinyJS->addNative("function Test.setCompileCache(directory)", scTestSetCompileCache, tinyJS);
+    tinyJS->addNative("function Test.setCompileCacheSize(directory, maxBytes)", scTestSetCompileCacheSize, tinyJS); // evicting to keep it to maxBytes
+    tinyJS->addNative("function Test.compileBuilds()", scTestCompileBuilds, 0); // how many times gcc has built a library in this process
+    tinyJS->addNative("function Test.buildDirectory()", scTestBuildDirectory, 0); // where gcc builds, which is this process's own
+    tinyJS->addNative("function Test.filesIn(directory)", scTestFilesIn, 0); // how many files are in a directory, or -1 if it can't be read
+    tinyJS->addNative("function Test.bytesIn(directory)", scTestBytesIn, 0); // how big the files in a directory are altogether, or -1
+    tinyJS->addNative("function Test.removeDirectory(directory)", scTestRemoveDirectory, 0); // a directory of files (not directories)
+    tinyJS->addNative("function Test.finishCompiles()", scTestFinishCompiles, tinyJS);
+    tinyJS->addNative("function Test.compileState(path)", scTestCompileState, tinyJS); // a TINYJS_COMPILE_STATES
+    tinyJS->addNative("function Test.compileFailures()", scTestCompileFailures, tinyJS);
+    tinyJS->addNative("function Test.errorOf(code)", scTestErrorOf, tinyJS); // the error executing the code gives, in a new engine
+}
+
 bool run_test(const char *filename)
 {
     printf("TEST %s ", filename);
@@ -231,12 +442,19 @@ bool run_test(const char *filename)
     fclose(file);
 
     CTinyJS s;
+    s.setExecutionMode(execution_mode);
+    s.setOptimizations(optimizations);
+    s.setCompilers(compilers);
+    s.setCompileThreads(compile_threads);
+    s.setCompileBatching(compile_batching);
     registerFunctions(&s);
     registerMathFunctions(&s);
+    registerTestFunctions(&s);
     s.root->addChild("result", new CScriptVar("0", SCRIPTVAR_INTEGER));
     try
     {
         s.execute(buffer);
+        s.finishCompiles(); // so that installing what was built is tested too
     }
     catch(CScriptException *e)
     {
@@ -279,6 +497,48 @@ int main(int argc, char **argv)
     printf("USAGE:\n");
     printf("   ./run_tests test.js       : run just one test\n");
     printf("   ./run_tests               : run all tests\n");
+    printf("   ./run_tests --tree ...    : execute from parsed syntax trees\n");
+    printf("   ./run_tests --bytecode ...: execute from bytecode\n");
+    printf("   ./run_tests ... --optimize N ...: optimize syntax trees with just the TINYJS_OPTIMIZATIONS flags N\n");
+    printf("   ./run_tests ... --compilers N ...: compile hot functions with just the TINYJS_COMPILERS flags N\n");
+    printf("   ./run_tests ... --compile-threads N ...: run gcc on N background threads (0 to wait for it)\n");
+    printf("   ./run_tests ... --compile-batching N ...: build the functions that get hot within N ms with one run of gcc\n");
+    if(argc > 1 && !strcmp(argv[1], "--tree"))
+    {
+        execution_mode = TINYJS_EXECUTE_SYNTAX_TREE;
+        argc--;
+        argv++;
+    }
+    else if(argc > 1 && !strcmp(argv[1], "--bytecode"))
+    {
+        execution_mode = TINYJS_EXECUTE_BYTECODE;
+        argc--;
+        argv++;
+    }
+    if(argc > 2 && !strcmp(argv[1], "--optimize"))
+    {
+        optimizations = atoi(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+    if(argc > 2 && !strcmp(argv[1], "--compilers"))
+    {
+        compilers = atoi(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+    if(argc > 2 && !strcmp(argv[1], "--compile-threads"))
+    {
+        compile_threads = atoi(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+    if(argc > 2 && !strcmp(argv[1], "--compile-batching"))
+    {
+        compile_batching = atoi(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
     if(argc == 2)
     {
         return !run_test(argv[1]);
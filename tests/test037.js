@@ -0,0 +1,11 @@
+// things the syntax tree used to get wrong: chained terms, postfix, +=, empty blocks and bare returns
+function sum(n) { var t = 0; for (var i = 0; i < n; i++) { t += i; } return t; }
+function nothing() { }
+function early(x) { if (x) { return; } return 5; }
+var i = 3;
+var j = i++;
+var o = { a : "x\"y", b : [1, 2, 3] };
+o.a += "!";
+var k = 2*3*4;
+result = sum(5)==10 && j==3 && i==4 && k==24 && o.a=="x\"y!" && o.b[2]==3 && early(0)==5 && early(1)==undefined;
+nothing();
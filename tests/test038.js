@@ -0,0 +1,12 @@
+// nested calls, short-circuits and temporaries, which need care in the bytecode registers
+function Point(x, y) { this.x = x; this.y = y; }
+function add(a, b) { return a + b; }
+function pick(c) { return c ? "yes" : "no"; }
+function obj() { return { v : [10, 20, 30] }; }
+var p = new Point(add(1, add(2, 3)), 4);
+var calls = 0;
+function count() { calls++; return true; }
+var s = false && count();
+var t = true || count();
+var u = 0 || count();
+result = p.x==6 && p.y==4 && pick(1)=="yes" && pick(0)=="no" && obj().v[1]==20 && !s && t && u && calls==1 && add(add(1,2), add(3,4))==10;
@@ -0,0 +1,13 @@
+// variables that are looked up once per call and then remembered
+var x = 1;
+var seen = 0;
+function shadow() { seen = x; var x = 2; return x; }
+function outer() { var y = 5; return inner(); }
+function inner() { return y; }
+function fact(n) { if (n <= 1) return 1; return n * fact(n - 1); }
+function redefine() { var r = f(); function f() { return 3; } return r; }
+function f() { return 4; }
+function create() { made = 7; return made; }
+var loopTotal = 0;
+for (var i = 0; i < 5; i++) { loopTotal += i; }
+result = shadow()==2 && seen==1 && x==1 && outer()==5 && fact(5)==120 && redefine()==4 && create()==7 && made==7 && loopTotal==10;
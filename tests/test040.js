@@ -0,0 +1,22 @@
+// property access through shapes and inline caches: one '.name' used on objects of many shapes
+function sumX(list) { var t = 0; for (var i = 0; i < list.length; i++) { t += list[i].x; } return t; }
+var a = { x : 1, y : 2 };
+var b = { y : 2, x : 2 };
+var c = { x : 3 };
+var d = { w : 0, v : 0, u : 0, x : 4 };
+var e = { z : 0, x : 5 };
+var f = { x : 6, y : 0, z : 0 };
+var g = {};
+g.x = 7;
+// lots of properties, so this one lives in a map instead
+var big = {};
+for (var i = 0; i < 40; i++) big["p" + i] = i;
+big.x = 8;
+var total = 0;
+for (var n = 0; n < 3; n++) total += sumX([a, b, c, d, e, f, g, big]);
+// adding a property changes the shape of an object that's already been seen
+a.z = 10;
+c.y = 11;
+var arr = [1, 2, 3];
+arr.x = 9;
+result = total == 3*36 && sumX([a, c, arr]) == 13 && a.z == 10 && c.y == 11 && big.p39 == 39 && big.p0 == 0 && arr.length == 3;
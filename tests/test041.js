@@ -0,0 +1,24 @@
+// arrays: integer and string indices, holes, far away indices and preallocation
+var a = [];
+for (var i = 0; i < 1000; i++) a[i] = i * 2;
+var sum = 0;
+for (var i = 0; i < a.length; i++) sum += a[i];
+var b = new Array(5);
+b[1] = "x";
+var c = [1, 2];
+c[100000] = 3; // far enough past the end that it's kept apart from the others
+c[3] = 4;
+var d = new Array(1, 2, 3);
+var e = [5, 6, 7];
+e.remove(6);
+var o = {};
+o[1] = "one";
+var s = [];
+s["01"] = 1; // not the same as s[1]
+s["2"] = 2;
+result = a.length == 1000 && sum == 999000 && a["10"] == 20 &&
+         b.length == 5 && b[1] == "x" && b.join(",") == "null,x,null,null,null" &&
+         c.length == 100001 && c[100000] == 3 && c[3] == 4 && c[2] == undefined &&
+         d.length == 3 && d[2] == 3 && d.contains(2) &&
+         e.length == 2 && e[1] == 7 && !e.contains(6) &&
+         o["1"] == "one" && s.length == 3 && s[2] == 2 && s[1] == undefined && s["01"] == 1;
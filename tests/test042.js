@@ -0,0 +1,18 @@
+// numbers in expressions: ints, doubles, undefined, strict equality and variables that share a value
+var i = 0, d = 0.5, sum = 0, dsum = 0;
+for (var n = 0; n < 100; n++) {
+  sum = sum + n * 2 - 1;
+  dsum += d;
+}
+var j = i;
+i = i + 1; // mustn't change j
+var k = i;
+k++;
+var u;
+var cmp = (1 === 1) && !(1 === 1.0) && (1 == 1.0) && (1 !== "1") && (u === undefined) && (u == undefined);
+var shifts = (1 << 4) + (-16 >> 2) + (-1 >>> 28);
+var mixed = 3 / 2 + 7 % 4 + 2.5 * 2;
+var p = 5;
+var q = p++;
+result = sum == 9800 && dsum == 50 && j == 0 && i == 1 && k == 2 && cmp &&
+         shifts == 16 - 4 + 15 && mixed == 1 + 3 + 5 && p == 6 && q == 5 && !0 && !(!1.5);
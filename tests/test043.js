@@ -0,0 +1,25 @@
+// common values are shared, but giving one a property mustn't change the others
+var t = true;
+t.x = 1;
+var u = true;
+var k = 5;
+k.z = 3;
+var m = 2 + 3;
+var abc = "abc";
+var c = abc.charAt(1);
+c.y = 2;
+var d = String.fromCharCode(98);
+function f() { }
+var r = f();
+r.q = 1;
+var r2 = f();
+var n = null;
+n.a = 1;
+var n2 = null;
+var s = "";
+for (var i = 0; i < 3; i++) s = s + abc.charAt(i);
+result = t.x == 1 && u.x == undefined && u == 1 &&
+         k.z == 3 && m.z == undefined && m == 5 &&
+         c.y == 2 && d.y == undefined && c == "b" && d == "b" &&
+         r.q == 1 && r2.q == undefined &&
+         n.a == 1 && n2.a == undefined && s == "abc";
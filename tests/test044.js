@@ -0,0 +1,20 @@
+/* Loops of objects made and dropped in a loop, while others are kept */
+
+var kept = [];
+var total = 0;
+for (var i = 0; i < 2000; i++) {
+  var a = { n: i };
+  a.self = a;
+  var b = { other: a };
+  a.other = b;
+  if (i % 100 == 0) kept[kept.length] = b;
+  total = total + b.other.self.n;
+}
+
+var ok = kept.length == 20;
+for (var j = 0; j < kept.length; j++)
+  if (kept[j].other.other != kept[j] || kept[j].other.n != j * 100) ok = false;
+
+result = ok && total == 1999000;
+// drop the loops, so that nothing has to print them
+kept = 0; a = 0; b = 0;
@@ -0,0 +1,25 @@
+/* Building strings up a piece at a time */
+
+var csv = "";
+for (var i = 0; i < 500; i++) {
+  csv = csv + i + "," + (i * 2) + "\n";
+}
+var ok = csv.length == 3835 && csv.substring(0, 8) == "0,0\n1,2\n";
+
+// strings that share the start of one another stay separate
+var base = "the quick brown fox jumps over the lazy dog";
+var a = base + " and the cat";
+var b = base + " and the cow";
+var c = a;
+a += "!";
+ok = ok && a == "the quick brown fox jumps over the lazy dog and the cat!";
+ok = ok && b == "the quick brown fox jumps over the lazy dog and the cow";
+ok = ok && c == "the quick brown fox jumps over the lazy dog and the cat";
+ok = ok && a.length == c.length + 1 && c.indexOf("cat") == 52;
+
+// a string added on to itself
+var d = base + base;
+d = d + d;
+ok = ok && d.length == base.length * 4 && d.substring(base.length * 3, base.length * 4) == base;
+
+result = ok;
@@ -0,0 +1,28 @@
+/* Numbers turned into strings as JavaScript would */
+
+var big = 1.0;
+for (var i = 0; i < 21; i++) big = big * 10.0;
+var small = 1.0 / 10000000.0;
+
+var ok = "" + 0.5 == "0.5";
+ok = ok && "" + (1.0 / 4.0) == "0.25";
+ok = ok && "" + (0.1 + 0.2) == "0.30000000000000004";
+ok = ok && "" + (2.5 * 2) == "5";
+ok = ok && "" + (0 - 2.5) == "-2.5";
+ok = ok && "" + (big / 10.0) == "100000000000000000000";
+ok = ok && "" + big == "1e+21";
+ok = ok && "" + small == "1e-7";
+ok = ok && "" + (1.0 / 1000000.0) == "0.000001";
+ok = ok && "" + 1234567 == "1234567" && "" + (0 - 42) == "-42";
+
+// a number's string changes along with it
+var x = 1.5;
+var s1 = "" + x;
+x += 1;
+var s2 = "" + x;
+var n = 7;
+var s3 = "" + n;
+n++;
+ok = ok && s1 == "1.5" && s2 == "2.5" && s3 == "7" && "" + n == "8";
+
+result = ok;
@@ -0,0 +1,41 @@
+/* Maths on numbers, undefined, null and strings, and changing numbers in place */
+
+var u;
+var ok = 7 / 2 == 3 && 7 % 3 == 1 && 7.0 / 2.0 == 3.5 && 3 + 0.5 == 3.5;
+ok = ok && (6 & 3) == 2 && (6 | 3) == 7 && (6 ^ 3) == 5 && (1 << 4) == 16 && (0 - 16) >> 2 == 0 - 4;
+ok = ok && u == u && null == null && u == null && u + 1 == 1 && null + 1 == 1;
+ok = ok && u === u && null === null && !(u === null) && 1 === 1 && !(1 === 1.0) && 1 !== "1";
+ok = ok && "abc" == "abc" && "abc" != "abd" && "abc" < "abd" && "b" > "abc" && "a" <= "a" && "b" >= "a";
+ok = ok && 1 == "1" && "10" < 9 && "x" + 1 == "x1";
+
+// in place, but only when nothing else can see the variable
+var a = 5000;
+var b = a;
+b += 1;
+var c = a;
+c++;
+var d = 2.5;
+var e = d;
+d -= 1;
+e++;
+ok = ok && a == 5000 && b == 5001 && c == 5001 && d == 1.5 && e == 3.5;
+
+// temporaries reused for results mustn't be variables
+var x = 5000;
+var y = x + 1 + 2;
+var z = x * 2.0 - 1;
+ok = ok && x == 5000 && y == 5003 && z == 9999;
+
+var total = 0;
+var f = 0.0;
+for (var i = 2000; i < 3000; i++) {
+  total += i;
+  f += 0.5;
+}
+var old = i++;
+ok = ok && total == 2499500 && f == 500 && old == 3000 && i == 3001;
+
+var arr = [1, 2.5, "three", 4000];
+ok = ok && arr.contains(2.5) && arr.contains("three") && arr.contains(4000) && !arr.contains(3);
+
+result = ok;
@@ -0,0 +1,27 @@
+/* Expressions of literals, and code that is never run, give the same results however they are optimized */
+
+var u;
+var ok = 60 * 60 == 3600 && 7 / 2 == 3 && 7.0 / 2 == 3.5 && "a" + 1 + 2 == "a12" && 1 + 2 + "a" == "3a";
+ok = ok && ((1 << 4) | 1) == 17 && (0 - 7) % 3 == 0 - 1 && "abc" < "abd" && !(null == 1) && undefined == u;
+ok = ok && 1.0 / (0.0 * (0 - 1.0)) < 0 && (0.1 + 0.2) * 10 > 3;
+
+// only ints are left alone by '+ 0', '* 1' and '!(!x)'
+ok = ok && ("a" + 0) == "a0" && (u + 0) === 0 && ((1 < 2) + 0) === 1 && ((3 > 2) * 1) == 1;
+ok = ok && !(!"abc") === 1 && !(!(2 > 1)) === 1 && !(!5) === 1 && (2.5 * 1) === 2.5;
+
+// branches that are never taken, which would throw (or worse) if they were run
+var r = 1;
+if (0) { r = 1 / 0; }
+if (1 > 2) r = 2.5 % 1; else r = r + 1;
+while (false) { r = 1 / 0; }
+for (var k = 7; false; k++) { r = 1 / 0; }
+ok = ok && r == 2 && k == 7;
+ok = ok && (1 ? "y" : 1 / 0) == "y" && (0 && nothing()) == 0 && (1 || nothing()) == 1 && (1 && 5) === 1;
+
+// statements after a return
+function f(x) { return x * (60 * 60); r = 1 / 0; }
+function g() { { return 2; } return 3; }
+function h(x) { if (true) { return x + 0; } return 0; }
+ok = ok && f(2) == 7200 && g() == 2 && h("b") == "b0" && r == 2;
+
+result = ok;
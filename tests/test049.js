@@ -0,0 +1,31 @@
+/* Code that isn't run is stepped over, however it is bracketed */
+
+var calls = 0;
+function count() { calls++; return calls; }
+
+function classify(n) {
+  if (n == 0) { return "zero"; }
+  else if (n == 1) { var o = { a: [count(), "}", { b: ")" }] }; return "one"; }
+  else if (n == 2) { while (count() < 100) { count(); } return "two"; }
+  else if (n == 3) return "three";
+  for (var i = 0; i < 10; i++) { if (i == n) { return "small"; } }
+  return "big";
+  count();
+  { count(); }
+}
+
+function early(n) {
+  var r = 0;
+  while (true) {
+    r++;
+    if (r == n) { return r * 10; count(); }
+  }
+  count();
+}
+
+var skipped = [];
+if (calls) skipped[count()] = (count() + count([count()])) * count({ x: count() });
+var t = calls > 0 ? count() : 5;
+
+result = classify(0) == "zero" && classify(3) == "three" && classify(7) == "small" && classify(12) == "big" &&
+         early(3) == 30 && t == 5 && calls == 0;
@@ -0,0 +1,22 @@
+/* Arguments are passed the same way whatever a call's scope is made from */
+
+function bump(x) { x++; x += 10; return x; }
+function setFoo(o) { o.foo = 7; }
+function getThis() { return this.v; }
+function nothing(a) { }
+function depth(n) { if (n == 0) return 0; return depth(n - 1) + 1; }
+function swap(a, b) { var t = a; a = b; b = t; return a * 10 + b; }
+
+var a = 5;
+var b = bump(a);               // a variable is copied...
+var c = bump(a + 1);           // ...and so is a temporary, as far as the caller can tell
+var d = bump(bump(1));
+var big = 100000;
+var e = bump(big);
+var s = "str";
+var o = { v: 3, get: getThis };
+setFoo(o);                      // objects are passed by reference
+
+result = a == 5 && b == 16 && c == 17 && d == 23 && big == 100000 && e == 100011 &&
+         bump(s) == "str110" && s == "str" && o.foo == 7 && o.get() == 3 &&
+         nothing(1) == undefined && depth(200) == 200 && swap(1, 2) == 21 && swap(a, b) == 165;
@@ -0,0 +1,31 @@
+/* Functions give the same answers once they've run often enough to be compiled */
+
+function sum(n) { var t = 0; for (var i = 0; i < n; i++) t = t + i * 2 - 1; return t; }
+function bits(a, b) { return ((a & b) | (a ^ b)) * 3; }
+function compare(a, b) {
+  var r = 0;
+  if (a < b) r += 1;
+  if (a <= b) r += 2;
+  if (a > b) r += 4;
+  if (a >= b) r += 8;
+  if (a == b) r += 16;
+  if (a != b) r += 32;
+  if (a === b) r += 64;
+  if (a !== b) r += 128;
+  return r;
+}
+function pick(a, b) { if (a && b) return 1; if (a || !b) return 2; return 3; }
+function count(o) { var n = 0; while (o.left) { o.left--; n++; } return n; }
+
+var ok = true;
+for (var i = 0; i < 400; i++) {
+  ok = ok && sum(10) == 80 && bits(i, 6) == (i | 6) * 3 &&
+       compare(i, 200) == (i < 200 ? 163 : (i == 200 ? 90 : 172)) &&
+       compare(i + 0.5, 200) == (i < 200 ? 163 : 172) &&
+       compare("a", "b") == 163 && compare(1, "1") == 154 &&
+       pick(i + 1, 2) == 1 && pick(0, 2) == 3 && pick(1, 0) == 2 && pick(0, 0) == 2 &&
+       count({ left: 3 }) == 3;
+}
+
+Test.finishCompiles();
+result = ok && sum(1000) == 998000 && Test.compileState("compare") == 2; // COMPILED
@@ -0,0 +1,45 @@
+/* Numeric functions give the same answers once they've been compiled for the types they warmed up
+   with, and when they're then called with others (or hit a case the compiled code leaves to the interpreter) */
+
+function fib(n) { var current, last = 0, penult = 1; for (var i = 0; i < n; i++) { current = last + penult; penult = last; last = current; } return current; }
+function poly(x) { var y = 0.0; for (var i = 0; i < 10; i++) y = y * x + 0.5; return y; }
+function mean(a, b) { var t = a + b; return t / 2.0; }
+function divide(a, b) { return a / b + a % b; }
+function shifts(a, b) { return (a << b) + (a >> b) + (a >>> b); }
+function logic(a, b) { var x = a && b, y = a || b; return (x ? 10 : 20) + y * 100 + !a + (a == b) + (a === b) * 1000; }
+function steps(n) { var k = 0, s = 0; while (k < n) s += k++; return s * 10 + k; }
+function late(n) { if (n > 5) { var d = n * 2; } return d; }
+// the same body, with its parameters the other way round (and so warmed up with other types for each name)
+function scale(a, b) { return a * 2 + b; }
+function scaleBack(b, a) { return a * 2 + b; }
+
+// what the interpreter makes of them, before any are hot ('late' sees this before its 'var' has run)
+var d = 42;
+var expect = [fib(30), fib(0), fib(100), fib(10.5), poly(0.75), poly(2), mean(3, 4), mean(1.5, 2),
+              divide(17, 5), divide(17, -1), divide(-17, 4), shifts(-7, 3), shifts(-7, 40), shifts(5.9, 2),
+              logic(3, 0), logic(0, 4), logic(2.5, 1), steps(10), steps(2.5), late(9), late(1)];
+
+function answers() {
+  return [fib(30), fib(0), fib(100), fib(10.5), poly(0.75), poly(2), mean(3, 4), mean(1.5, 2),
+          divide(17, 5), divide(17, -1), divide(-17, 4), shifts(-7, 3), shifts(-7, 40), shifts(5.9, 2),
+          logic(3, 0), logic(0, 4), logic(2.5, 1), steps(10), steps(2.5), late(9), late(1)];
+}
+function same(a) {
+  for (var i = 0; i < a.length; i++)
+    if (!(a[i] === expect[i])) return false;
+  return true;
+}
+
+var ok = true;
+for (var i = 0; i < 400; i++) {
+  ok = ok && fib(30) === expect[0] && fib(100) === expect[2] && poly(0.75) === expect[4] &&
+       mean(3, 4) === expect[6] && divide(17, 5) === expect[8] && shifts(-7, 3) === expect[11] &&
+       logic(3, 0) === expect[14] && logic(0, 4) === expect[15] && steps(10) === expect[17] && late(9) === expect[19] &&
+       scale(i, 0.5) == i * 2 + 0.5 && scaleBack(i, 0.5) == i + 1;
+}
+// calls that each give up on the compiled code, often enough for it to be built again without specializing
+for (var i = 0; i < 100; i++)
+  ok = ok && steps(2.5) === expect[18];
+
+result = ok && same(answers()) && scale(3, 0.5) == 6.5 && scaleBack(3, 0.5) == 4 &&
+         scale(1.5, 2) == 5 && scaleBack(1.5, 2) == 5.5 && d == 42;
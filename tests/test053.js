@@ -0,0 +1,19 @@
+/* Array functions only visit the elements a sparse array actually has */
+
+var a = [1];
+a[20000000] = 2;
+a.remove(1);
+var ok = a.length == 20000000 && a[19999999] == 2 && a.contains(2) && !a.contains(1);
+
+var b = [1, 2, 1, 3, 1, 4];
+b[10] = 1;
+b[12] = 5;
+b.remove(1);
+ok = ok && b.length == 9 && b[0] == 2 && b[1] == 3 && b[2] == 4 && b[3] == undefined && b[8] == 5;
+
+var c = [5, 6];
+c[4] = 7;
+var json = JSON.stringify(c, 0);
+ok = ok && json.split("null").length == 3 && json.indexOf("7") > json.indexOf("null");
+
+result = ok;
@@ -0,0 +1,19 @@
+/* Objects used as dictionaries, with many different keys, still find their properties */
+
+var dicts = [];
+for (var i = 0; i < 200; i++) {
+  var d = {};
+  d["key" + i] = i;
+  d["other" + (i % 7)] = i * 2;
+  d.common = -i;
+  dicts[i] = d;
+}
+
+var ok = true;
+for (var i = 0; i < 200; i++) {
+  var d = dicts[i];
+  ok = ok && d["key" + i] == i && d["other" + (i % 7)] == i * 2 && d.common == -i;
+  ok = ok && d["key" + (i + 1)] == undefined;
+}
+
+result = ok;
@@ -0,0 +1,20 @@
+/* The pools that variables and links come from count what they hand out and get back */
+
+var before = Test.pool();
+var a = [];
+for (var i = 0; i < 5000; i++) a[i] = { n: i };
+var during = Test.pool();
+a = 0;
+var after = Test.pool();
+
+function sane(p) {
+  return p.inUse <= p.capacity && p.free == p.capacity - p.inUse && p.fragmentation >= 0 && p.fragmentation <= 1;
+}
+
+result = sane(before.vars) && sane(during.vars) && sane(after.vars) && sane(during.links) &&
+         during.vars.allocations >= before.vars.allocations + 5000 &&
+         during.vars.inUse >= before.vars.inUse + 5000 &&
+         during.links.inUse >= before.links.inUse + 5000 &&
+         after.vars.inUse < during.vars.inUse - 5000 &&
+         after.vars.capacity == during.vars.capacity &&
+         after.vars.fragmentation > during.vars.fragmentation;
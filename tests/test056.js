@@ -0,0 +1,23 @@
+/* The cycle collector frees loops of objects, and with a time limit it frees them a part at a time */
+
+function makeLoops(n) {
+  for (var i = 0; i < n; i++) {
+    var a = { n: i };
+    var b = { a: a };
+    a.b = b;
+  }
+}
+makeLoops(5000);
+
+var before = Test.collector();
+var some = Test.collect(0.000001); // much less time than they all take
+var part = Test.collector();
+var rest = Test.collect(0);
+var after = Test.collector();
+
+result = before.candidates >= 5000 &&
+         some > 0 && part.candidates > 0 && part.abandoned == before.abandoned + 1 &&
+         rest > some && after.candidates < 10 && after.abandoned == part.abandoned &&
+         some + rest >= 10000 && after.freedVars >= before.freedVars + 10000 &&
+         after.freedBytes > part.freedBytes && after.collections == before.collections + 2 &&
+         after.lastPause > 0 && after.maxPause >= after.lastPause;
@@ -0,0 +1,42 @@
+/* A function gcc can't build is tried again less and less often as it runs, and then given up on */
+
+var COLD = 0, QUEUED = 1, COMPILED = 2, FAILED = 3, BLACKLISTED = 4;
+Test.setCompilers(1); // just gcc, on one background thread, whatever the tests were run with
+Test.setCompileThreads(1);
+Test.setCompileCache("/nonexistent/tinyjs-cache"); // there's nowhere to build into, so every build fails
+
+function f(x) { return x + 1; }
+var calls = 0;
+function runTo(n) { for (; calls < n; calls++) f(calls); }
+function failure() {
+  var failures = Test.compileFailures();
+  for (var i = 0; i < failures.length; i++)
+    if (failures[i].name == "f") return failures[i];
+  return { attempts : 0, blacklisted : false };
+}
+
+var states = Test.compileState("f") == COLD;
+runTo(31); // hot, so it goes to the background compiler
+states = states && Test.compileState("f") == QUEUED;
+Test.finishCompiles();
+states = states && Test.compileState("f") == FAILED && failure().attempts == 1;
+
+// it's only tried again once it has run four times as often as when it failed
+runTo(120);
+var backoff = Test.compileState("f") == FAILED && failure().attempts == 1;
+runTo(300);
+Test.finishCompiles();
+backoff = backoff && Test.compileState("f") == FAILED && failure().attempts == 2 && !failure().blacklisted;
+
+// and after the third failure, it's never tried again
+runTo(2100);
+Test.finishCompiles();
+var given = Test.compileState("f") == BLACKLISTED && failure().attempts == 3 && failure().blacklisted;
+runTo(10000);
+Test.finishCompiles();
+given = given && Test.compileState("f") == BLACKLISTED && failure().attempts == 3;
+
+// the failed builds' sources aren't left behind (unless TINYJS_KEEP_BUILDS asks for them)
+var tidy = Test.filesIn(Test.buildDirectory()) == 0;
+
+result = states && backoff && given && tidy && f(1) == 2;
@@ -0,0 +1,47 @@
+/* More functions get hot at once than the compile queue holds, and every one is still built and used */
+
+var COLD = 0, QUEUED = 1, COMPILED = 2;
+Test.setCompilers(1); // just gcc, on one background thread, whatever the tests were run with
+Test.setCompileThreads(1);
+
+function f0(x) { return x * 2 + 0; }
+function f1(x) { return x * 3 + 1; }
+function f2(x) { return x * 4 + 2; }
+function f3(x) { return x * 5 + 3; }
+function f4(x) { return x * 6 + 4; }
+function f5(x) { return x * 7 + 5; }
+function f6(x) { return x * 8 + 6; }
+function f7(x) { return x * 9 + 7; }
+function f8(x) { return x * 10 + 8; }
+function f9(x) { return x * 11 + 9; }
+function f10(x) { return x * 12 + 10; }
+function f11(x) { return x * 13 + 11; }
+function f12(x) { return x * 14 + 12; }
+function f13(x) { return x * 15 + 13; }
+function f14(x) { return x * 16 + 14; }
+function f15(x) { return x * 17 + 15; }
+function f16(x) { return x * 18 + 16; }
+function f17(x) { return x * 19 + 17; }
+function f18(x) { return x * 20 + 18; }
+function f19(x) { return x * 21 + 19; }
+var names = ["f0", "f1", "f2", "f3", "f4", "f5", "f6", "f7", "f8", "f9", "f10", "f11", "f12", "f13", "f14", "f15", "f16", "f17", "f18", "f19"];
+function count(state) {
+  var n = 0;
+  for (var i = 0; i < names.length; i++) if (Test.compileState(names[i]) == state) n++;
+  return n;
+}
+
+// they all get hot at once, faster than gcc builds them, so the queue fills and the coldest are pushed out
+var ok = count(COLD) == 20, n = 0, sum;
+for (n = 0; n < 40; n++) {
+  sum = f0(n) + f1(n) + f2(n) + f3(n) + f4(n) + f5(n) + f6(n) + f7(n) + f8(n) + f9(n) + f10(n) + f11(n) + f12(n) + f13(n) + f14(n) + f15(n) + f16(n) + f17(n) + f18(n) + f19(n);
+  ok = ok && sum == n * 230 + 190;
+}
+var queued = count(QUEUED) + count(COMPILED) == 20 && count(QUEUED) > 17; // more than one thread building and a full queue
+
+// draining builds everything, including what was pushed out, and the calls after it use what was built
+Test.finishCompiles();
+var compiled = count(COMPILED) == 20;
+sum = f0(3) + f1(3) + f2(3) + f3(3) + f4(3) + f5(3) + f6(3) + f7(3) + f8(3) + f9(3) + f10(3) + f11(3) + f12(3) + f13(3) + f14(3) + f15(3) + f16(3) + f17(3) + f18(3) + f19(3);
+
+result = ok && queued && compiled && sum == 880;
@@ -0,0 +1,22 @@
+/* Errors list the calls that led to them at the places the calls were made, however the code is run */
+
+var code = "function inner(x) {\n  return x + nothing(x);\n}\n" +
+           "function outer(x) {\n  var y = 1;\n  return inner(x) + y;\n}\n" +
+           "function Thing(x) {\n  this.value = outer(x);\n}\n" +
+           "var o = { method : function(x) {\n  return new Thing(x);\n} };\n" +
+           "result = o.method(1);";
+var error = Test.errorOf(code);
+
+// errors that aren't in a call are where their statement is, even in a loop or a block
+var operator = Test.errorOf("var a = 1;\nif (a == 1) {\n  a = 2;\n  a = [1] * [2];\n  a = 4;\n}\n");
+var loop = Test.errorOf("var a = [1];\nfor (var i = 0; i < 3; i++)\n  if (i == 2) a = a * a;\n");
+
+// each position is in the source the call was made from: the script, or the body of the function making it,
+// and the error is at the call it came out of in the script (not the end, where a tree or bytecode was parsed to)
+result = error == "Error Expecting 'nothing' to be a function\n" +
+                  "3: inner from (line: 3, col: 16)\n" +
+                  "2: outer from (line: 2, col: 22)\n" +
+                  "1: Thing from (line: 2, col: 20)\n" +
+                  "0: method from (line: 14, col: 19) at (line: 14, col: 19)" &&
+         operator == "Error Operation '*' not supported on the Array datatype at (line: 4, col: 14)" &&
+         loop == "Error Operation '*' not supported on the Array datatype at (line: 3, col: 22)";
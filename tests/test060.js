@@ -0,0 +1,28 @@
+/* Loops give the same tokens each time round as the first, including strings, numbers and the source of functions */
+
+var words = "";
+var n = 0;
+for (var i = 0; i < 5; i++) {
+  // the same string twice, escapes, and numbers in every form
+  words += "a\nb" + 'a\nb' + "\"" + 0x10 + 1.5 + 07;
+  var j = 0;
+  while (j < 3) { j++; if (j != 2) n += j; }
+  n--;
+  for (var k = 0; k < 10; k++) if (k > 2) n -= 1; else n += k;
+}
+var oneRound = "a\nba\nb\"161.57";
+var sameWords = words == oneRound + oneRound + oneRound + oneRound + oneRound;
+var sameCounts = n == 5 * (1 + 3 - 1 + 0 + 1 + 2 - 7);
+
+// functions made in a loop take their source from the replayed tokens
+var made = [];
+for (var i = 0; i < 3; i++) {
+  made[i] = function(x) { return x * 2 + "!"; };
+}
+var sameFunctions = made[0](1) == "2!" && made[2](2) == "4!";
+
+// and an error on a later time round is at the same place as it would be the first
+var error = Test.errorOf("function check(i) { if (i == 3) missing(i); }\nvar i = 0;\nwhile (i < 3) {\n  i++;\n  check(i);\n}");
+var samePosition = error.indexOf("\n0: check from (line: 5, col: 9)") > 0;
+
+result = sameWords && sameCounts && sameFunctions && samePosition;
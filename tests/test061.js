@@ -0,0 +1,30 @@
+/* Errors' call stacks read just as they did when each frame was formatted as the call was made */
+
+// the error and the frames, without the " at" position of the top level
+function stackOf(code) {
+  var error = Test.errorOf(code);
+  var end = error.length;
+  while (end > 0 && error.substring(end - 4, end) != " at ") end--;
+  return error.substring(0, end - 4);
+}
+
+var recursion = stackOf("function fail(x) { return x + missing(x); }\n" +
+                        "function twice(x) { return x * 2; }\n" +
+                        "function recurse(n) {\n  if (n == 0) return fail(n);\n  return recurse(n - 1);\n}\n" +
+                        "var o = { run : function(n) { return twice(twice(n)) + recurse(n); } };\n" +
+                        "o.run(2);\n");
+var constructor = stackOf("function Maker(n) {\n  this.n = n;\n  this.bad = broken(n);\n}\nvar m = new Maker(3);\n");
+var finished = stackOf("function first() { return 1; }\n" +
+                       "function second(x) {\n  return first() + x.y.z + lost(x);\n}\n" +
+                       "var v = first() + second({ y : 1 });\n");
+var topLevel = stackOf("var a = 1;\nnowhere(a);\n");
+
+result = recursion == "Error Expecting 'missing' to be a function\n" +
+                      "4: fail from (line: 2, col: 27)\n" +
+                      "3: recurse from (line: 3, col: 22)\n" +
+                      "2: recurse from (line: 3, col: 22)\n" +
+                      "1: recurse from (line: 1, col: 37)\n" +
+                      "0: run from (line: 8, col: 7)" &&
+         constructor == "Error Expecting 'broken' to be a function\n0: Maker from (line: 5, col: 19)" &&
+         finished == "Error Expecting 'lost' to be a function\n0: second from (line: 5, col: 34)" &&
+         topLevel == "Error Expecting 'nowhere' to be a function";
@@ -0,0 +1,31 @@
+/* Functions that get hot together are built by one run of gcc when builds are batched, in a directory of the process's own */
+
+var COMPILED = 2;
+Test.setCompilers(1); // just gcc, on one background thread, whatever the tests were run with
+Test.setCompileThreads(1);
+Test.setCompileBatching(500);
+
+function a(x) { return x + 1; }
+function b(x) { return x * 3; }
+function c(x) { return x - 7; }
+function d(x) { return (x & 12) | 1; }
+function e(x) { return x % 5; }
+function f(x) { return x * x; }
+
+var directory = Test.buildDirectory();
+var files = Test.filesIn(directory); // other tests may have left the sources of builds that failed
+var builds = Test.compileBuilds();
+var ok = true;
+for (var n = 0; n < 40; n++)
+  ok = ok && a(n) + b(n) + c(n) + d(n) + e(n) + f(n) == (n + 1) + n * 3 + (n - 7) + ((n & 12) | 1) + n % 5 + n * n;
+Test.finishCompiles();
+builds = Test.compileBuilds() - builds;
+
+var compiled = Test.compileState("a") == COMPILED && Test.compileState("b") == COMPILED &&
+               Test.compileState("c") == COMPILED && Test.compileState("d") == COMPILED &&
+               Test.compileState("e") == COMPILED && Test.compileState("f") == COMPILED;
+var same = a(3) + b(3) + c(3) + d(3) + e(3) + f(3) == 4 + 9 - 4 + 1 + 3 + 9;
+// somewhere of its own (not the working directory), which it leaves as it found it once the builds have worked
+var own = directory.indexOf("/tinyjs-") >= 0 && Test.filesIn(directory) == files;
+
+result = ok && compiled && same && builds == 1 && own;
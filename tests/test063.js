@@ -0,0 +1,46 @@
+/* Libraries gcc has built are kept in the compile cache, loaded from there by functions built the same way again, and the least recently used are evicted to keep it to its size */
+
+var COMPILED = 2;
+Test.setCompilers(1); // just gcc, on one background thread, whatever the tests were run with
+Test.setCompileThreads(1);
+var cache = Test.buildDirectory() + "cache test"; // a path with a space in it, which mustn't be split
+Test.setCompileCache(cache);
+
+var builds = Test.compileBuilds();
+var ok = true;
+function f(x) { return x + 1; }
+for (var n = 0; n < 40; n++) ok = ok && f(n) == n + 1;
+Test.finishCompiles();
+function g(x) { return x * 3; }
+for (var n = 0; n < 40; n++) ok = ok && g(n) == n * 3;
+Test.finishCompiles();
+var built = Test.compileState("f") == COMPILED && Test.compileState("g") == COMPILED &&
+            Test.compileBuilds() - builds == 2 && Test.filesIn(cache) == 2;
+
+// the same function again is loaded from the cache rather than built (which makes it the most recently used)
+builds = Test.compileBuilds();
+function f(x) { return x + 1; }
+for (var n = 0; n < 40; n++) ok = ok && f(n) == n + 1;
+Test.finishCompiles();
+var hit = Test.compileState("f") == COMPILED && Test.compileBuilds() == builds && Test.filesIn(cache) == 2;
+
+// with room for two libraries, a third pushes out the least recently used: g's, not f's
+Test.setCompileCacheSize(cache, Test.bytesIn(cache) * 5 / 4);
+function h(x) { return x - 7; }
+for (var n = 0; n < 40; n++) ok = ok && h(n) == n - 7;
+Test.finishCompiles();
+var evicted = Test.compileState("h") == COMPILED && Test.compileBuilds() - builds == 1 && Test.filesIn(cache) == 2;
+builds = Test.compileBuilds();
+function f(x) { return x + 1; }
+for (var n = 0; n < 40; n++) ok = ok && f(n) == n + 1;
+Test.finishCompiles();
+evicted = evicted && Test.compileState("f") == COMPILED && Test.compileBuilds() == builds;
+function g(x) { return x * 3; }
+for (var n = 0; n < 40; n++) ok = ok && g(n) == n * 3;
+Test.finishCompiles();
+evicted = evicted && Test.compileState("g") == COMPILED && Test.compileBuilds() - builds == 1 && Test.filesIn(cache) == 2;
+
+Test.setCompileCache("");
+Test.removeDirectory(cache);
+
+result = ok && built && hit && evicted && Test.filesIn(cache) == -1;